@@ -1,65 +1,26 @@
 #include "vector.h"
 #include "map.h"
+#include "arena.h"
+#include "intern.h"
+#include "type.h"
+#include "cache.h"
+#include "trace.h"
+#include "asm.h"
+#include "peephole.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
+#include <stdint.h>
+#include <setjmp.h>
 
-// MINマクロ
-#define MIN(a, b) ((a) < (b) ? (a) : (b))
-
-// 型
-typedef struct Type {
-    enum TypeKind { INT, PTR, ARRAY } type; // 型の種別
-    struct Type *ptr_to;    // typeがPTRの時だけ有効
-    int num_elements;       // 配列の要素数
-} Type;
-
-static inline const char* type_description(Type *type) {
-    static const char* description[] = {
-        "INT", "PTR", "ARRAY"
-    };
-    static char buffer[1024];
-
-    if (!type) {
-        return "null.";
-    }
+// コンパイラのバージョン。関数キャッシュのキーに入るので、同じソースから出力す
+// るアセンブリが変わる変更をしたら上げること
+#define VERSION "1.6.0"
 
-    sprintf(buffer, "%-5s %-14p %d",
-            description[type->type],
-            type->ptr_to,
-            type->num_elements);
-    return buffer;
-}
-
-static inline bool type_equal(Type *lhs, Type *rhs) {
-    if (lhs == rhs) return true;
-    if (!(lhs && rhs)) return false;
-    return lhs->type == rhs->type &&
-           lhs->num_elements == rhs->num_elements &&
-           type_equal(lhs->ptr_to, rhs->ptr_to);
-}
-
-static inline Type* new_type(enum TypeKind tk) {
-    Type* type = calloc(1, sizeof(Type));
-    type->type = tk;
-    return type;
-}
-
-static inline Type* new_ptr_type(Type* original_type) {
-    Type* type = calloc(1, sizeof(Type));
-    type->type = PTR;
-    type->ptr_to = original_type;
-    return type;
-}
-
-static inline Type* new_array_type(int n, Type* original_type) {
-    Type* type = calloc(1, sizeof(Type));
-    type->type = ARRAY;
-    type->ptr_to = original_type;
-    type->num_elements = n;
-    return type;
-}
+// MIN, MAXマクロ
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
 
 // 抽象構文木のノードの種類
 typedef enum {
@@ -115,78 +76,67 @@ static inline const char* node_kind_descripion(NodeKind kind) {
     return description[kind];
 }
 
+// 抽象構文木のノードの番号。0番はどのノードも表さない(「なし」を表すのに使う)
+typedef uint32_t NodeId;
+
+// 子ノードの並びの番号。ast.listsの中の[要素数, 要素...]の先頭を指す。0番は空の並び
+typedef uint32_t ListId;
+
+/*
+ * 抽象構文木のノード
+ * ノードはast.nodesに連続して並べ、番号(NodeId)で指す。種別ごとに使うフィール
+ * ドだけを共用体に重ねて持つ。
+ *   二項演算子, ND_ASSIGN: lhs, rhs
+ *   ND_RETURN: lhs
+ *   ND_ADDR, ND_DEREF: rhs
+ *   ND_IF: condition, lhs(then), rhs(else、なければ0)
+ *   ND_WHILE: condition(0なら無限ループ), lhs(本体)
+ *   ND_FOR: block(初期化・条件・更新の3つ。それぞれ0ならなし), body
+ *   ND_NUM: val
+ *   ND_LVAR: offset, ident, type
+ *   ND_GLOBAL_VAR: ident, type
+ *   ND_BLOCK: block(文の並び)
+ *   ND_FUN: block(実引数の並び), ident
+ *   ND_FUN_IMPL: block(仮引数の並び), ident, frame_size, body
+ */
 typedef struct Node {
-    NodeKind kind;      // 種別
-    struct Node *lhs;   // 左辺
-    struct Node *rhs;   // 右辺
-    struct Node *condition; // 条件(ifの場合のみ)
-    Vector *block;      // ブロック
-    int val;            // kindがND_NUMの場合はその値、kindがND_FUNの場合、関数呼び出し確定済かどうかを示すフラグ値
-    char *ident;        // kindがND_FUNの場合のみ使う(関数名)
-    int identLength;    // 上記の長さ   
-    int offset;         // kindがND_LVARの場合のみ使う
-    Type *type;         // 型情報
+    NodeKind kind;                          // 種別
+    union {
+        struct {
+            NodeId lhs;                     // 左辺
+            NodeId rhs;                     // 右辺
+            NodeId condition;               // 条件
+        };
+        int val;                            // 整数の値
+        struct {
+            union {
+                ListId block;               // 子ノードの並び
+                int offset;                 // ローカル変数のRBPからのオフセット
+            };
+            Symbol ident;                   // 名前
+            union {
+                Type *type;                 // 変数の型情報
+                struct {
+                    int frame_size;         // ローカル変数の領域の大きさ
+                    NodeId body;            // 本体
+                };
+            };
+        };
+    };
 } Node;
 
-static inline const char* node_description(Node *node) {
-    static char buffer[1024];
-    static char tmp[1024];
-
-    if (!node) {
-        return "null.";
-    }
-
-    tmp[0] = '\0';
-    if (node->kind == ND_FUN || node->kind == ND_FUN_IMPL || node->kind == ND_LVAR) {
-        const int n = MIN(sizeof(tmp) - 1, node->identLength);
-        memcpy(tmp, node->ident, n);
-        tmp[n] = '\0';
-    } else if (node->kind == ND_NUM) {
-        const int n = sprintf(tmp, "num:%d", node->val);
-        tmp[n] = '\0';
-    }
-
-    sprintf(buffer, "%-8s '%-6s' {%-s} %3d %14p/%14p/%14p",
-            node_kind_descripion(node->kind),
-            tmp,
-            type_description(node->type),
-            node->offset,
-            node->lhs,
-            node->rhs,
-            node->condition);
-    return buffer;
-}
-
-static inline int node_num_pointers(Node *node) {
-    int n = 0;
-    if (node->kind == ND_LVAR && node->type->type == PTR) {
-        for (Type *t = node->type->ptr_to; t; t = t->ptr_to) {
-            n++;
-        }
-    }
-    return n;
-}
-
-// ポインタとして扱うかどうか
-static inline bool node_is_treat_pointer(Node *node) {
-    if (node->kind == ND_LVAR) {
-        Type *ti = node->type;
-        return ti->type == PTR || ti->type == ARRAY;
-    }
-    return false;
-}
-
-static inline bool node_hands_is_treat_pointer(Node *node) {
-    return node_is_treat_pointer(node->lhs) || node_is_treat_pointer(node->rhs);
-}
-
-static inline bool node_is_pointer_variable_many(Node *node) {
-    return node_num_pointers(node) > 1;
-}
-
-static inline bool node_hands_is_pointer_variable_many(Node *node) {
-    return node_is_pointer_variable_many(node->lhs) || node_is_pointer_variable_many(node->rhs);
-}
+/*
+ * 抽象構文木
+ * ノードの配列と、子ノードの並びを詰めて格納する配列からなる。
+ */
+typedef struct {
+    Node *nodes;            // ノードの配列(0番は使わない)
+    uint32_t count;         // 0番を含むノード数
+    uint32_t capacity;      // nodesの大きさ
+    NodeId *lists;          // 子ノードの並びの配列
+    uint32_t lists_len;     // listsの使用済の要素数
+    uint32_t lists_capacity;// listsの大きさ
+} Ast;
 
 // トークンの種類
 typedef enum {
@@ -231,69 +181,233 @@ static inline const char *token_kind_description(TokenKind kind) {
     return "*Unrecoginzed*";
 }
 
-// トークンの型
-typedef struct Token {
-    TokenKind kind;     // トークン種別
-    struct Token *next; // 次のトークン
-    int val;            // tyがTK_NUMの場合、その数値
-    char *str;          // トークン文字列
-    int len;            // トークン文字列の長さ
-    char *input;        // トークン文字列（エラーメッセージ用）
-} Token;
-
-static inline const char *token_description(Token *token) {
-    static char buffer[1024];
-    static char tmp[1024];
-
-    if (!token) {
-        return "null";
+/*
+ * トークン列
+ * 種別・位置・長さ・値をそれぞれ連続した配列に持ち(struct-of-arrays)、トークンは
+ * 配列の添字で表す。0番はどのトークンも表さない(「見つからない」を表すのに使う)。
+ * 末尾は必ずTK_EOFになる。
+ */
+typedef struct {
+    char *source;           // 入力文字列(トークンの位置の基準)
+    unsigned char *kind;    // トークン種別(TokenKind)
+    unsigned int *offset;   // トークン文字列のsourceからの位置
+    unsigned int *len;      // トークン文字列の長さ
+    int *val;               // kindがTK_NUMの場合はその数値、TK_IDENTの場合はシンボル
+    int count;              // 0番と末尾のTK_EOFを含むトークン数
+    int capacity;           // 各配列の大きさ
+} Tokens;
+
+// 関数定義ノードとそのキャッシュのキー
+typedef struct {
+    NodeId node;
+    uint64_t key;
+} FunctionKey;
+
+/*
+ * コンパイル1回分の状態(コンパイラコンテキスト)
+ * 入力ごとに1つ用意し、compiler_enter()でそのスレッドの現在のコンテキストにす
+ * る。コンテキストが別なら複数のスレッドで同時にコンパイルできる。
+ */
+typedef struct Compiler {
+    char *input;                // 入力(ファイル名, "-" またはソースそのもの)
+    char *source;               // 入力文字列
+    size_t source_mapped;       // sourceをメモリマップした長さ(マップしていなければ0)
+    jmp_buf *on_error;          // エラー時の戻り先(NULLならプロセスを終了する)
+
+    // コンパイルのフェーズごとのアリーナ
+    Arena *token_arena;         // トークナイズ: トークン列
+    Arena *parse_arena;         // パース: スコープ, ローカル変数など
+    Arena *codegen_arena;       // コード生成
+    Arena *ir_arena;            // 中間表現: 関数ごとに作って捨てる
+
+    // トークナイズ
+    Tokens tokens;              // トークン列
+    int token;                  // 現在着目しているトークン
+
+    // パース
+    Ast ast;                    // 抽象構文木
+    ListId code;                // トップレベルの文の並び
+    int nest_level;             // 現在のパース位置がトップレベルかどうか
+    struct Scope *scope;        // 現在のスコープ
+    int frame_offset;           // 現在使用中のスタック領域の大きさ
+    int frame_size;             // 関数内で使用したスタック領域の最大値
+    struct GlobalVar **global_variables;    // グローバル変数の表(シンボルで引く)
+    int global_variables_capacity;
+    NodeId *list_stack;         // 子ノードの並びを組み立てるための作業領域
+    int list_stack_len;
+    int list_stack_capacity;
+    long local_count;           // 定義したローカル変数の数(--time-report, --mem-report用)
+    long lookup_count;          // 変数の名前を引いた回数(同上)
+
+    // コード生成
+    Object *object;             // -cのとき機械語を溜めるオブジェクト(NULLならアセンブリを出力する)
+    const char *symbol_prefix;  // このプログラムで定義した関数の名前の前に付ける文字列(バッチ用)
+    bool *defined_functions;    // symbol_prefixが空でないとき、シンボルごとに関数定義があるか
+    int nested;                 // gen_expr, gen_stmtの再帰の深さ
+    unsigned int used_registers;    // 式の評価に使用中のレジスタ(ビットの集合)
+    int stack_depth;            // 関数の中でスタックに退避している値の数
+    unsigned char *register_need;   // ノードごとに求めた必要なレジスタの数(0なら未計算)
+    long label_sequence_no;     // ラベルの通し番号
+    bool peephole;              // 関数ごとに覗き穴最適化をする
+    bool ir;                    // 中間表現(SSA形式)を経由してコード生成する(--ir)
+    bool dump_ir;               // アセンブリの代わりに中間表現を出力する(--dump-ir)
+    PeepholeStats peephole_stats;
+
+    // 関数キャッシュ(cache_dirがNULLなら使わない)
+    const char *cache_dir;      // キャッシュのディレクトリ
+    uint64_t cache_salt;        // キーに混ぜるバージョンとオプションのハッシュ値
+    uint64_t function_deps;     // パース中の関数が参照したグローバル変数の型のハッシュ値
+    FunctionKey *function_keys; // 関数定義ごとのキー(ノードの番号順)
+    int function_keys_len;
+    int function_keys_capacity;
+    CacheStats cache_stats;
+} Compiler;
+
+// このスレッドの現在のコンテキスト
+extern _Thread_local Compiler *ctx;
+
+extern void compiler_enter(Compiler *compiler, char *input);
+extern void compiler_leave(void);
+
+static inline Node *node_at(NodeId id) {
+    return &ctx->ast.nodes[id];
+}
+
+static inline int list_len(ListId list) {
+    return ctx->ast.lists[list];
+}
+
+static inline NodeId list_at(ListId list, int i) {
+    return ctx->ast.lists[list + 1 + i];
+}
+
+// 二項演算子(lhsとrhsを持つ)かどうか
+static inline bool node_is_binary(NodeKind kind) {
+    return kind <= ND_ASSIGN;
+}
+
+static inline const char* node_description(NodeId id) {
+    static _Thread_local char buffer[1024];
+    static _Thread_local char tmp[1024];
+
+    if (!id) {
+        return "null.";
     }
 
-    const int n = MIN(sizeof(tmp) - 1, token->len);
-    memcpy(tmp, token->str, n);
-    tmp[n] = '\0';
-    
-    sprintf(buffer, "Token: %s, `%s` %p",
-            token_kind_description(token->kind),
+    Node *node = node_at(id);
+    Type *type = NULL;
+    tmp[0] = '\0';
+    if (node->kind == ND_FUN || node->kind == ND_FUN_IMPL || node->kind == ND_LVAR || node->kind == ND_GLOBAL_VAR) {
+        const int n = MIN(sizeof(tmp) - 1, symbol_length(node->ident));
+        memcpy(tmp, symbol_name(node->ident), n);
+        tmp[n] = '\0';
+        if (node->kind == ND_LVAR || node->kind == ND_GLOBAL_VAR) {
+            type = node->type;
+        }
+    } else if (node->kind == ND_NUM) {
+        const int n = sprintf(tmp, "num:%d", node->val);
+        tmp[n] = '\0';
+    }
+
+    sprintf(buffer, "#%-6u %-8s '%-6s' {%-s} %6u/%6u/%6u",
+            id,
+            node_kind_descripion(node->kind),
             tmp,
-            token->next);
+            type_description(type),
+            node->lhs,
+            node->rhs,
+            node->condition);
     return buffer;
 }
 
-static inline char *token_name_copy(Token *token) {
-    char *name = NULL;
-    if (token) {
-        // 変数名を確保する
-        name = calloc(1, token->len + 1);
-        memcpy(name, token->str, token->len);
+static inline int node_num_pointers(NodeId id) {
+    Node *node = node_at(id);
+    if (node->kind == ND_LVAR && node->type->type == PTR) {
+        return node->type->depth;
     }
-    return name;
+    return 0;
 }
 
-typedef enum {
-    GEN_PUSHED_RESULT,
-    GEN_DONT_PUSHED_RESULT,
-} GenResult;
+// ポインタとして扱うかどうか
+static inline bool node_is_treat_pointer(NodeId id) {
+    Node *node = node_at(id);
+    if (node->kind == ND_LVAR) {
+        Type *ti = node->type;
+        return ti->type == PTR || ti->type == ARRAY;
+    }
+    return false;
+}
 
-extern Token *token;
+static inline bool node_hands_is_treat_pointer(NodeId id) {
+    Node *node = node_at(id);
+    return node_is_treat_pointer(node->lhs) || node_is_treat_pointer(node->rhs);
+}
 
-extern Token *tokenize(char *p);
-extern void error_exit(char *fmt, ...);
-extern void program();
-extern GenResult gen(Node *node);
-extern Node *code[];
+static inline bool node_is_pointer_variable_many(NodeId id) {
+    return node_num_pointers(id) > 1;
+}
+
+static inline bool node_hands_is_pointer_variable_many(NodeId id) {
+    Node *node = node_at(id);
+    return node_is_pointer_variable_many(node->lhs) || node_is_pointer_variable_many(node->rhs);
+}
+
+// ポインタの加減算で整数の側を何倍するか(int *なら4, int **以上なら8, それ以外は1)
+static inline int node_pointer_scale(NodeId id) {
+    if (!node_hands_is_treat_pointer(id)) {
+        return 1;
+    }
+    return node_hands_is_pointer_variable_many(id) ? 8 : 4;
+}
+
+static inline TokenKind token_kind(int t) {
+    return (TokenKind)ctx->tokens.kind[t];
+}
+
+static inline char *token_str(int t) {
+    return ctx->tokens.source + ctx->tokens.offset[t];
+}
+
+static inline int token_len(int t) {
+    return ctx->tokens.len[t];
+}
 
-#define D(fmt, ...) \
-    fprintf(stderr, ("🐝 %s[%s#%d] " fmt "\n"), __PRETTY_FUNCTION__, __FILE__, __LINE__, ##__VA_ARGS__)
+static inline int token_val(int t) {
+    return ctx->tokens.val[t];
+}
 
-#define D_INT(v) \
-    do { D(#v "=%d", (v)); fflush(stderr); } while (0)
+static inline Symbol token_sym(int t) {
+    return (Symbol)ctx->tokens.val[t];
+}
 
-#define D_NODE(n) \
-    do { D(#n "=%s", node_description(n)); fflush(stderr); } while (0)
+static inline const char *token_description(int t) {
+    static _Thread_local char buffer[1024];
+    static _Thread_local char tmp[1024];
 
-#define D_TOKEN(t) \
-    do { D(#t "=%s", token_description(t)); fflush(stderr); } while (0)
+    if (t <= 0 || ctx->tokens.count <= t) {
+        return "null";
+    }
 
-#define D_TYPE(t) \
-    do { D(#t "=%s", type_description(t)); fflush(stderr); } while (0)
+    const int n = MIN(sizeof(tmp) - 1, token_len(t));
+    memcpy(tmp, token_str(t), n);
+    tmp[n] = '\0';
+    
+    sprintf(buffer, "Token: %s, `%s` #%d",
+            token_kind_description(token_kind(t)),
+            tmp,
+            t);
+    return buffer;
+}
+
+extern void load_source(void);
+extern void release_source(void);
+extern int tokenize(char *p);
+extern void error_exit(char *fmt, ...);
+extern void program();
+extern void release_ast();
+extern void fold_program(void);
+extern void gen(NodeId node);
+extern void gen_program(void);
+extern const char *function_prefix(Symbol sym);
+extern void gen_multiply_constant(const char *reg, long value);
+extern void gen_divide_constant(const char *reg, long value);
@@ -0,0 +1,60 @@
+#include "arena.h"
+#include "9cc.h"
+#include <stdlib.h>
+#include <string.h>
+
+// 1ブロックの標準サイズ
+static const size_t ARENA_BLOCK_SIZE = 256 * 1024;
+
+Arena *new_arena(const char *name) {
+    Arena *arena = calloc(1, sizeof(Arena));
+    arena->name = name;
+    return arena;
+}
+
+// 現在のブロックに収まらない場合に新しいブロックを確保して払い出す
+// ブロックはcallocで確保するので払い出すメモリは常にゼロクリアされている
+void *arena_alloc_slow(Arena *arena, size_t size) {
+    const size_t header = (sizeof(ArenaBlock) + ARENA_ALIGNMENT - 1) & ~(size_t)(ARENA_ALIGNMENT - 1);
+    size_t block_size = ARENA_BLOCK_SIZE;
+    if (header + size > block_size) {
+        block_size = header + size; // 巨大な要求は専用のブロックにする
+    }
+
+    ArenaBlock *block = calloc(1, block_size);
+    if (!block) {
+        error_exit("アリーナ%sのメモリを確保できません(%zuバイト)", arena->name, size);
+    }
+    block->next = arena->blocks;
+    block->size = block_size;
+    arena->blocks = block;
+    arena->reserved += block_size;
+
+    char *p = (char *)block + header;
+    arena->cursor = p + size;
+    arena->limit = (char *)block + block_size;
+    arena->used += size;
+    arena->count++;
+    return p;
+}
+
+// アリーナから払い出したメモリをまとめて解放する
+// アリーナ自体は空の状態に戻り再利用できる
+void arena_release(Arena *arena) {
+    ArenaBlock *block = arena->blocks;
+    while (block) {
+        ArenaBlock *next = block->next;
+        free(block);
+        block = next;
+    }
+    arena->blocks = NULL;
+    arena->cursor = arena->limit = NULL;
+    arena->used = arena->reserved = arena->count = 0;
+}
+
+// NULL終端した文字列のコピーをアリーナ上に作る
+char *arena_strndup(Arena *arena, const char *s, size_t len) {
+    char *p = arena_alloc(arena, len + 1);
+    memcpy(p, s, len);
+    return p;
+}
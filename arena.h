@@ -0,0 +1,51 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// アリーナから払い出すメモリのアライメント
+#define ARENA_ALIGNMENT 16
+
+// アリーナを構成するメモリブロック
+typedef struct ArenaBlock {
+    struct ArenaBlock *next;    // 前に確保したブロック
+    size_t size;                // ブロックのバイト数(ヘッダ込み)
+} ArenaBlock;
+
+// バンプポインタ方式のアリーナ
+// 個別の解放はできず、arena_release()でまとめて解放する
+typedef struct {
+    const char *name;   // 統計表示用の名前
+    ArenaBlock *blocks; // 確保済ブロックのリスト(先頭が現在のブロック)
+    char *cursor;       // 次に払い出す位置
+    char *limit;        // 現在のブロックの終端
+    size_t used;        // 払い出したバイト数
+    size_t reserved;    // mallocで確保したバイト数
+    size_t count;       // 払い出した回数
+} Arena;
+
+extern Arena *new_arena(const char *name);
+extern void *arena_alloc_slow(Arena *arena, size_t size);
+extern void arena_release(Arena *arena);
+extern char *arena_strndup(Arena *arena, const char *s, size_t len);
+
+// ゼロクリア済のメモリをsizeバイト払い出す
+static inline void *arena_alloc(Arena *arena, size_t size) {
+    size = (size + ARENA_ALIGNMENT - 1) & ~(size_t)(ARENA_ALIGNMENT - 1);
+    if ((size_t)(arena->limit - arena->cursor) < size) {
+        return arena_alloc_slow(arena, size);
+    }
+    void *p = arena->cursor;
+    arena->cursor += size;
+    arena->used += size;
+    arena->count++;
+    return p;
+}
+
+static inline size_t arena_bytes_used(Arena *arena) {
+    return arena->used;
+}
+
+static inline size_t arena_bytes_reserved(Arena *arena) {
+    return arena->reserved;
+}
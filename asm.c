@@ -0,0 +1,901 @@
+#include "9cc.h"
+#include "asm.h"
+
+// 命令の名前(Opcodeの順)
+static const char *OPCODE_NAMES[] = {
+    "mov", "add", "sub", "cmp", "and", "or", "xor", "test",
+    "imul", "idiv", "neg", "cqo", "shl", "sar", "shr", "lea", "movzx",
+    "push", "pop",
+    "sete", "setne", "setl", "setle", "setg", "setge",
+    "jmp", "je", "jne", "jl", "jle", "jg", "jge",
+    "call", "ret",
+};
+
+const char *opcode_name(Opcode op) {
+    return OPCODE_NAMES[op];
+}
+
+// レジスタの名前(番号順に64・32・8ビット)
+static const char *REG64[] = {
+    "rax", "rcx", "rdx", "rbx", "rsp", "rbp", "rsi", "rdi",
+    "r8", "r9", "r10", "r11", "r12", "r13", "r14", "r15",
+};
+static const char *REG32[] = {
+    "eax", "ecx", "edx", "ebx", "esp", "ebp", "esi", "edi",
+    "r8d", "r9d", "r10d", "r11d", "r12d", "r13d", "r14d", "r15d",
+};
+static const char *REG8[] = {
+    "al", "cl", "dl", "bl", "spl", "bpl", "sil", "dil",
+    "r8b", "r9b", "r10b", "r11b", "r12b", "r13b", "r14b", "r15b",
+};
+
+static bool word_equal(const char *s, int n, const char *word) {
+    // 先頭の文字で大半を振り落とす
+    return n > 0 && *s == *word && (int)strlen(word) == n && memcmp(s, word, n) == 0;
+}
+
+// レジスタ名ならその番号を返し、*sizeにバイト数を入れる。そうでなければ-1
+static int find_register(const char *s, int n, unsigned char *size) {
+    if (n < 2 || n > 4) {
+        return -1;
+    }
+    if (s[0] == 'r' && '0' <= s[1] && s[1] <= '9') {
+        // r8からr15と、その32ビット(d)・8ビット(b)の名前
+        int reg = s[1] - '0';
+        int i = 2;
+        if (reg == 1 && i < n && '0' <= s[i] && s[i] <= '5') {
+            reg = 10 + s[i++] - '0';
+        }
+        if (reg < 8) {
+            return -1;
+        }
+        if (i == n) {
+            *size = 8;
+            return reg;
+        }
+        if (i + 1 == n && (s[i] == 'd' || s[i] == 'b')) {
+            *size = s[i] == 'd' ? 4 : 1;
+            return reg;
+        }
+        return -1;
+    }
+    for (int i = 0; i < 8; i++) {
+        if (n == 3 && s[1] == REG64[i][1] && s[2] == REG64[i][2]) {
+            if (s[0] == 'r') {
+                *size = 8;
+                return i;
+            }
+            if (s[0] == 'e') {
+                *size = 4;
+                return i;
+            }
+        }
+        if (s[0] == REG8[i][0] && word_equal(s, n, REG8[i])) {
+            *size = 1;
+            return i;
+        }
+    }
+    return -1;
+}
+
+// 名前・数に使える文字の表(英数字と'_', '.', '$')
+static const bool word_chars[256] = {
+    ['0'] = true, ['1'] = true, ['2'] = true, ['3'] = true, ['4'] = true,
+    ['5'] = true, ['6'] = true, ['7'] = true, ['8'] = true, ['9'] = true,
+
+    ['a'] = true, ['b'] = true, ['c'] = true, ['d'] = true, ['e'] = true,
+    ['f'] = true, ['g'] = true, ['h'] = true, ['i'] = true, ['j'] = true,
+    ['k'] = true, ['l'] = true, ['m'] = true, ['n'] = true, ['o'] = true,
+    ['p'] = true, ['q'] = true, ['r'] = true, ['s'] = true, ['t'] = true,
+    ['u'] = true, ['v'] = true, ['w'] = true, ['x'] = true, ['y'] = true,
+    ['z'] = true,
+    ['A'] = true, ['B'] = true, ['C'] = true, ['D'] = true, ['E'] = true,
+    ['F'] = true, ['G'] = true, ['H'] = true, ['I'] = true, ['J'] = true,
+    ['K'] = true, ['L'] = true, ['M'] = true, ['N'] = true, ['O'] = true,
+    ['P'] = true, ['Q'] = true, ['R'] = true, ['S'] = true, ['T'] = true,
+    ['U'] = true, ['V'] = true, ['W'] = true, ['X'] = true, ['Y'] = true,
+    ['Z'] = true,
+    ['_'] = true, ['.'] = true, ['$'] = true,
+};
+
+static const char *skip_spaces(const char *p, const char *end) {
+    while (p < end && (*p == ' ' || *p == '\t')) {
+        p++;
+    }
+    return p;
+}
+
+static const char *skip_word(const char *p, const char *end) {
+    // 行ごとに何回も呼ばれるので、関数を呼ばずに表を引く
+    while (p < end && word_chars[(unsigned char)*p]) {
+        p++;
+    }
+    return p;
+}
+
+static void syntax_error(const char *s, size_t n) {
+    error_exit("アセンブルできません: %.*s", (int)n, s);
+}
+
+// 符号付きの10進数を読む
+static const char *parse_number(const char *p, const char *end, long *val) {
+    bool negative = false;
+    if (p < end && (*p == '-' || *p == '+')) {
+        negative = *p == '-';
+        p = skip_spaces(p + 1, end);
+    }
+    unsigned long u = 0;
+    while (p < end && '0' <= *p && *p <= '9') {
+        u = u * 10 + (*p++ - '0');
+    }
+    *val = negative ? (long)(0 - u) : (long)u;
+    return p;
+}
+
+// メモリオペランド"[base + index * scale +/- disp]"の中身を読む
+static bool parse_memory(const char *p, const char *end, Operand *opr) {
+    opr->kind = OPR_MEM;
+    opr->reg = -1;
+    opr->index = -1;
+    opr->scale = 1;
+    opr->imm = 0;
+    bool negative = false;
+    for (;;) {
+        p = skip_spaces(p, end);
+        if (p < end && '0' <= *p && *p <= '9') {
+            long val;
+            p = parse_number(p, end, &val);
+            opr->imm += negative ? -val : val;
+        } else {
+            const char *w = skip_word(p, end);
+            unsigned char size;
+            const int reg = find_register(p, w - p, &size);
+            if (reg < 0 || size != 8 || negative) {
+                return false;
+            }
+            p = skip_spaces(w, end);
+            if (p < end && *p == '*') {
+                long scale;
+                p = parse_number(skip_spaces(p + 1, end), end, &scale);
+                if (opr->index >= 0 || (scale != 1 && scale != 2 && scale != 4 && scale != 8)) {
+                    return false;
+                }
+                opr->index = reg;
+                opr->scale = scale;
+            } else if (opr->reg < 0) {
+                opr->reg = reg;
+            } else if (opr->index < 0) {
+                opr->index = reg;
+            } else {
+                return false;
+            }
+        }
+        p = skip_spaces(p, end);
+        if (p == end) {
+            break;
+        }
+        if (*p != '+' && *p != '-') {
+            return false;
+        }
+        negative = *p++ == '-';
+    }
+    return opr->reg >= 0 && opr->index != REG_RSP;
+}
+
+// オペランドを1つ読む。pからendまでがオペランドの文字列
+static bool parse_operand(const char *p, const char *end, Operand *opr) {
+    *opr = (Operand){.kind = OPR_NONE};
+    p = skip_spaces(p, end);
+    while (end > p && (end[-1] == ' ' || end[-1] == '\t')) {
+        end--;
+    }
+    if (p == end) {
+        return false;
+    }
+
+    // "qword ptr [...]"のような大きさの指定
+    unsigned char size = 0;
+    const char *w = skip_word(p, end);
+    if ((*p == 'q' || *p == 'd' || *p == 'b') &&
+        (word_equal(p, w - p, "qword") || word_equal(p, w - p, "dword") || word_equal(p, w - p, "byte"))) {
+        size = *p == 'q' ? 8 : *p == 'd' ? 4 : 1;
+        p = skip_spaces(w, end);
+        w = skip_word(p, end);
+        if (!word_equal(p, w - p, "ptr")) {
+            return false;
+        }
+        p = skip_spaces(w, end);
+    }
+
+    if (*p == '[') {
+        if (end[-1] != ']' || !parse_memory(p + 1, end - 1, opr)) {
+            return false;
+        }
+        opr->size = size;
+        return true;
+    }
+    if (size) {
+        return false;
+    }
+    if (*p == '-' || ('0' <= *p && *p <= '9')) {
+        opr->kind = OPR_IMM;
+        return parse_number(p, end, &opr->imm) == end;
+    }
+    w = skip_word(p, end);
+    if (w != end) {
+        return false;
+    }
+    const int reg = find_register(p, w - p, &opr->size);
+    if (reg >= 0) {
+        opr->kind = OPR_REG;
+        opr->reg = reg;
+        return true;
+    }
+    opr->kind = OPR_LABEL;
+    opr->name = p;
+    opr->name_len = w - p;
+    return true;
+}
+
+/**
+ * アセンブリの1行(改行を含まない)を読む
+ * 読めない行はエラーにする
+ */
+void asm_parse_line(const char *s, size_t n, AsmLine *line) {
+    const char *end = s + n;
+    // コメントを除く
+    const char *comment = memchr(s, '#', n);
+    if (comment) {
+        end = comment;
+    }
+    const char *p = skip_spaces(s, end);
+    while (end > p && (end[-1] == ' ' || end[-1] == '\t' || end[-1] == '\r')) {
+        end--;
+    }
+    *line = (AsmLine){.kind = ASM_EMPTY};
+    if (p == end) {
+        return;
+    }
+
+    const char *w = skip_word(p, end);
+    if (w < end && *w == ':' && skip_spaces(w + 1, end) == end) {
+        line->kind = ASM_LABEL;
+        line->name = p;
+        line->name_len = w - p;
+        return;
+    }
+    if (*p == '.') {
+        line->kind = ASM_DIRECTIVE;
+        line->name = p;
+        line->name_len = end - p;
+        return;
+    }
+
+    line->kind = ASM_INST;
+    Inst *inst = &line->inst;
+    int op = 0;
+    while (op < OP_COUNT && (*p != OPCODE_NAMES[op][0] || !word_equal(p, w - p, OPCODE_NAMES[op]))) {
+        op++;
+    }
+    if (op == OP_COUNT) {
+        syntax_error(s, n);
+    }
+    inst->op = op;
+    inst->count = 0;
+
+    p = skip_spaces(w, end);
+    while (p < end) {
+        const char *comma = memchr(p, ',', end - p);
+        const char *next = comma ? comma : end;
+        if (inst->count == 2 || !parse_operand(p, next, &inst->operands[inst->count])) {
+            syntax_error(s, n);
+        }
+        inst->count++;
+        p = comma ? comma + 1 : end;
+    }
+}
+
+// 命令の書き出し
+
+static const char *register_name(int reg, int size) {
+    return size == 1 ? REG8[reg] : size == 4 ? REG32[reg] : REG64[reg];
+}
+
+// 書き出し先のバッファ。入りきらない分は捨て、常にNUL終端する
+typedef struct {
+    char *buf;
+    size_t size;
+    size_t len;
+} Writer;
+
+// 覗き穴最適化が書き換えた行ごとに呼ばれるので、snprintfを使わずに書く
+static void put_text(Writer *w, const char *s, size_t n) {
+    n = MIN(n, w->size - 1 - w->len);
+    memcpy(w->buf + w->len, s, n);
+    w->len += n;
+    w->buf[w->len] = '\0';
+}
+
+static void put_string(Writer *w, const char *s) {
+    put_text(w, s, strlen(s));
+}
+
+static void put_unsigned(Writer *w, unsigned long u) {
+    char tmp[24];
+    char *p = tmp + sizeof(tmp);
+    do {
+        *--p = '0' + u % 10;
+        u /= 10;
+    } while (u);
+    put_text(w, p, tmp + sizeof(tmp) - p);
+}
+
+static unsigned long magnitude(long v) {
+    return v < 0 ? 0UL - (unsigned long)v : (unsigned long)v;
+}
+
+// オペランドを1つ書く。with_sizeならメモリに大きさを付ける
+static void format_operand(const Operand *opr, bool with_size, Writer *w) {
+    switch (opr->kind) {
+    case OPR_REG:
+        put_string(w, register_name(opr->reg, opr->size));
+        break;
+    case OPR_IMM:
+        if (opr->imm < 0) {
+            put_text(w, "-", 1);
+        }
+        put_unsigned(w, magnitude(opr->imm));
+        break;
+    case OPR_LABEL:
+        put_text(w, opr->name, opr->name_len);
+        break;
+    case OPR_MEM:
+        if (with_size || opr->size) {
+            put_string(w, opr->size == 1 ? "byte ptr " : opr->size == 4 ? "dword ptr " : "qword ptr ");
+        }
+        put_text(w, "[", 1);
+        put_string(w, REG64[opr->reg]);
+        if (opr->index >= 0) {
+            put_text(w, " + ", 3);
+            put_string(w, REG64[opr->index]);
+            put_text(w, "*", 1);
+            put_unsigned(w, opr->scale);
+        }
+        if (opr->imm != 0) {
+            put_text(w, opr->imm < 0 ? " - " : " + ", 3);
+            put_unsigned(w, magnitude(opr->imm));
+        }
+        put_text(w, "]", 1);
+        break;
+    default:
+        put_text(w, "?", 1);
+        break;
+    }
+}
+
+/**
+ * 命令をasm_parse_line()で読める1行(字下げ付き、改行なし)にしてbufに書く
+ * 書いた文字数を返す。レジスタのオペランドがなければメモリに大きさを付ける
+ */
+int asm_format_inst(const Inst *inst, char *buf, size_t size) {
+    if (size == 0) {
+        return 0;
+    }
+    bool has_register = false;
+    for (int i = 0; i < inst->count; i++) {
+        has_register |= inst->operands[i].kind == OPR_REG;
+    }
+    Writer w = {buf, size, 0};
+    put_text(&w, "  ", 2);
+    put_string(&w, OPCODE_NAMES[inst->op]);
+    for (int i = 0; i < inst->count; i++) {
+        put_text(&w, i == 0 ? " " : ", ", i == 0 ? 1 : 2);
+        format_operand(&inst->operands[i], !has_register, &w);
+    }
+    return w.len;
+}
+
+// 機械語の出力
+
+static void put_byte(Object *obj, int b) {
+    if (obj->code_len == obj->code_capacity) {
+        obj->code_capacity = obj->code_capacity ? obj->code_capacity * 2 : 4096;
+        obj->code = realloc(obj->code, obj->code_capacity);
+        if (!obj->code) {
+            error_exit("機械語のメモリを確保できません");
+        }
+    }
+    obj->code[obj->code_len++] = b;
+}
+
+static void put_u32(Object *obj, uint32_t v) {
+    for (int i = 0; i < 4; i++) {
+        put_byte(obj, (v >> (i * 8)) & 0xff);
+    }
+}
+
+static void put_u64(Object *obj, uint64_t v) {
+    put_u32(obj, (uint32_t)v);
+    put_u32(obj, (uint32_t)(v >> 32));
+}
+
+static bool fits_int8(long v) {
+    return -128 <= v && v <= 127;
+}
+
+static bool fits_int32(long v) {
+    return INT32_MIN <= v && v <= INT32_MAX;
+}
+
+/**
+ * REXプレフィックス・オペコード・ModRM(とSIB・変位)を出力する
+ * regはModRMのregフィールド(レジスタまたは/digitの値)、rmはレジスタかメモリ
+ * wideならREX.Wを付ける。rmが8ビットのレジスタならbyte_regsを真にする(spl, bpl,
+ * sil, dilはREXがないとah, ch, dh, bhになるため)
+ */
+static void put_modrm(Object *obj, bool wide, const unsigned char *opcode, int opcode_len,
+                      int reg, const Operand *rm, bool byte_regs) {
+    int rex = wide ? 0x48 : 0;
+    if (reg & 8) {
+        rex |= 0x44;
+    }
+    if (rm->kind == OPR_REG) {
+        if (rm->reg & 8) {
+            rex |= 0x41;
+        }
+        if (byte_regs && rm->reg >= 4) {
+            rex |= 0x40;
+        }
+    } else {
+        if (rm->reg & 8) {
+            rex |= 0x41;
+        }
+        if (rm->index >= 0 && (rm->index & 8)) {
+            rex |= 0x42;
+        }
+    }
+    if (rex) {
+        put_byte(obj, rex);
+    }
+    for (int i = 0; i < opcode_len; i++) {
+        put_byte(obj, opcode[i]);
+    }
+
+    if (rm->kind == OPR_REG) {
+        put_byte(obj, 0xc0 | (reg & 7) << 3 | (rm->reg & 7));
+        return;
+    }
+
+    // [rbp], [r13]は変位なしで表せないので変位0を付ける
+    const long disp = rm->imm;
+    int mod;
+    if (disp == 0 && (rm->reg & 7) != REG_RBP) {
+        mod = 0;
+    } else if (fits_int8(disp)) {
+        mod = 1;
+    } else {
+        mod = 2;
+    }
+    if (rm->index < 0 && (rm->reg & 7) != REG_RSP) {
+        put_byte(obj, mod << 6 | (reg & 7) << 3 | (rm->reg & 7));
+    } else {
+        // SIBバイトを使う(rsp, r12がベースの場合はインデックスなしのSIB)
+        const int scale = rm->scale == 8 ? 3 : rm->scale == 4 ? 2 : rm->scale == 2 ? 1 : 0;
+        const int index = rm->index < 0 ? REG_RSP : rm->index;
+        put_byte(obj, mod << 6 | (reg & 7) << 3 | 4);
+        put_byte(obj, scale << 6 | (index & 7) << 3 | (rm->reg & 7));
+    }
+    if (mod == 1) {
+        put_byte(obj, disp & 0xff);
+    } else if (mod == 2) {
+        put_u32(obj, (uint32_t)disp);
+    }
+}
+
+// 1バイトのオペコードでput_modrm()する
+static void put_op_modrm(Object *obj, bool wide, int opcode, int reg, const Operand *rm) {
+    const unsigned char op = opcode;
+    put_modrm(obj, wide, &op, 1, reg, rm, false);
+}
+
+// 0F xxの2バイトのオペコードでput_modrm()する
+static void put_op2_modrm(Object *obj, bool wide, int opcode, int reg, const Operand *rm, bool byte_regs) {
+    const unsigned char op[] = {0x0f, opcode};
+    put_modrm(obj, wide, op, 2, reg, rm, byte_regs);
+}
+
+// 名前のシンボルを探し、なければ未定義のシンボルとして追加してその添字を返す
+static int intern_symbol(Object *obj, const char *name, int len) {
+    char key[256];
+    if (len >= (int)sizeof(key)) {
+        error_exit("シンボルの名前が長すぎます: %.*s", len, name);
+    }
+    memcpy(key, name, len);
+    key[len] = '\0';
+    const int index = (int)(intptr_t)kv_value(map_lookup(obj->symbol_index, key)) - 1;
+    if (index >= 0) {
+        return index;
+    }
+
+    if (obj->symbols_len == obj->symbols_capacity) {
+        obj->symbols_capacity = obj->symbols_capacity ? obj->symbols_capacity * 2 : 256;
+        obj->symbols = realloc(obj->symbols, sizeof(ObjectSymbol) * obj->symbols_capacity);
+    }
+    const int i = obj->symbols_len++;
+    char *stored = arena_strndup(obj->names, name, len);
+    obj->symbols[i] = (ObjectSymbol){.name = stored};
+    map_insert(obj->symbol_index, stored, (void *)(intptr_t)(i + 1));
+    return i;
+}
+
+// rel32でシンボルを参照する(位置は後でasm_finish()が埋める)
+static void put_rel32(Object *obj, const Operand *target, RelocKind kind) {
+    if (obj->relocs_len == obj->relocs_capacity) {
+        obj->relocs_capacity = obj->relocs_capacity ? obj->relocs_capacity * 2 : 256;
+        obj->relocs = realloc(obj->relocs, sizeof(ObjectReloc) * obj->relocs_capacity);
+    }
+    obj->relocs[obj->relocs_len++] = (ObjectReloc){
+        .offset = obj->code_len,
+        .symbol = intern_symbol(obj, target->name, target->name_len),
+        .kind = kind,
+    };
+    put_u32(obj, 0);
+}
+
+// 条件コード(Jcc, SETccのオペコードの下位4ビット)
+static int condition_code(Opcode op) {
+    switch (op) {
+    case OP_JE: case OP_SETE: return 0x4;
+    case OP_JNE: case OP_SETNE: return 0x5;
+    case OP_JL: case OP_SETL: return 0xc;
+    case OP_JGE: case OP_SETGE: return 0xd;
+    case OP_JLE: case OP_SETLE: return 0xe;
+    default: return 0xf; // OP_JG, OP_SETG
+    }
+}
+
+// ALU命令(add, or, and, sub, xor, cmp)のModRMの/digit
+static int alu_digit(Opcode op) {
+    switch (op) {
+    case OP_ADD: return 0;
+    case OP_OR: return 1;
+    case OP_AND: return 4;
+    case OP_SUB: return 5;
+    case OP_XOR: return 6;
+    default: return 7; // OP_CMP
+    }
+}
+
+static bool is_reg(const Operand *opr) {
+    return opr->kind == OPR_REG;
+}
+
+static bool is_rm(const Operand *opr) {
+    return opr->kind == OPR_REG || opr->kind == OPR_MEM;
+}
+
+// オペランドの大きさ(レジスタ優先。メモリだけで指定がなければ8バイト)
+static int operand_size(const Inst *inst) {
+    for (int i = 0; i < inst->count; i++) {
+        if (inst->operands[i].kind == OPR_REG) {
+            return inst->operands[i].size;
+        }
+    }
+    for (int i = 0; i < inst->count; i++) {
+        if (inst->operands[i].kind == OPR_MEM && inst->operands[i].size) {
+            return inst->operands[i].size;
+        }
+    }
+    return 8;
+}
+
+/**
+ * 命令を1つ符号化する。符号化できない組み合わせなら偽を返す
+ */
+static bool encode(Object *obj, const Inst *inst) {
+    const Operand *a = &inst->operands[0];
+    const Operand *b = &inst->operands[1];
+    const int size = operand_size(inst);
+    const bool wide = size == 8;
+    if (size == 1 && inst->op != OP_MOVZX && !(OP_SETE <= inst->op && inst->op <= OP_SETGE)) {
+        return false;
+    }
+
+    switch (inst->op) {
+    case OP_MOV:
+        if (inst->count != 2) return false;
+        if (is_rm(a) && is_reg(b)) {
+            put_op_modrm(obj, wide, 0x89, b->reg, a);
+        } else if (is_reg(a) && b->kind == OPR_MEM) {
+            put_op_modrm(obj, wide, 0x8b, a->reg, b);
+        } else if (is_rm(a) && b->kind == OPR_IMM && (fits_int32(b->imm) || !wide)) {
+            put_op_modrm(obj, wide, 0xc7, 0, a);
+            put_u32(obj, (uint32_t)b->imm);
+        } else if (is_reg(a) && b->kind == OPR_IMM) {
+            // movabs
+            put_byte(obj, 0x48 | (a->reg & 8 ? 1 : 0));
+            put_byte(obj, 0xb8 + (a->reg & 7));
+            put_u64(obj, (uint64_t)b->imm);
+        } else {
+            return false;
+        }
+        return true;
+
+    case OP_ADD:
+    case OP_OR:
+    case OP_AND:
+    case OP_SUB:
+    case OP_XOR:
+    case OP_CMP: {
+        if (inst->count != 2) return false;
+        const int digit = alu_digit(inst->op);
+        if (is_rm(a) && is_reg(b)) {
+            put_op_modrm(obj, wide, digit << 3 | 0x01, b->reg, a);
+        } else if (is_reg(a) && b->kind == OPR_MEM) {
+            put_op_modrm(obj, wide, digit << 3 | 0x03, a->reg, b);
+        } else if (is_rm(a) && b->kind == OPR_IMM && fits_int8(b->imm)) {
+            put_op_modrm(obj, wide, 0x83, digit, a);
+            put_byte(obj, b->imm & 0xff);
+        } else if (is_rm(a) && b->kind == OPR_IMM && fits_int32(b->imm)) {
+            put_op_modrm(obj, wide, 0x81, digit, a);
+            put_u32(obj, (uint32_t)b->imm);
+        } else {
+            return false;
+        }
+        return true;
+    }
+
+    case OP_TEST:
+        if (inst->count != 2 || !is_rm(a) || !is_reg(b)) return false;
+        put_op_modrm(obj, wide, 0x85, b->reg, a);
+        return true;
+
+    case OP_IMUL:
+        if (inst->count == 1 && is_rm(a)) {
+            put_op_modrm(obj, wide, 0xf7, 5, a);
+        } else if (inst->count == 2 && is_reg(a) && is_rm(b)) {
+            put_op2_modrm(obj, wide, 0xaf, a->reg, b, false);
+        } else if (inst->count == 2 && is_reg(a) && b->kind == OPR_IMM && fits_int8(b->imm)) {
+            // imul r, r, imm8 の略記
+            put_op_modrm(obj, wide, 0x6b, a->reg, a);
+            put_byte(obj, b->imm & 0xff);
+        } else if (inst->count == 2 && is_reg(a) && b->kind == OPR_IMM && fits_int32(b->imm)) {
+            put_op_modrm(obj, wide, 0x69, a->reg, a);
+            put_u32(obj, (uint32_t)b->imm);
+        } else {
+            return false;
+        }
+        return true;
+
+    case OP_IDIV:
+    case OP_NEG:
+        if (inst->count != 1 || !is_rm(a)) return false;
+        put_op_modrm(obj, wide, 0xf7, inst->op == OP_IDIV ? 7 : 3, a);
+        return true;
+
+    case OP_CQO:
+        if (inst->count != 0) return false;
+        put_byte(obj, 0x48);
+        put_byte(obj, 0x99);
+        return true;
+
+    case OP_SHL:
+    case OP_SAR:
+    case OP_SHR: {
+        if (inst->count != 2 || !is_rm(a)) return false;
+        const int digit = inst->op == OP_SHL ? 4 : inst->op == OP_SAR ? 7 : 5;
+        if (b->kind == OPR_IMM && 0 <= b->imm && b->imm < 64) {
+            put_op_modrm(obj, wide, 0xc1, digit, a);
+            put_byte(obj, b->imm);
+        } else if (is_reg(b) && b->reg == REG_RCX && b->size == 1) {
+            put_op_modrm(obj, wide, 0xd3, digit, a);
+        } else {
+            return false;
+        }
+        return true;
+    }
+
+    case OP_LEA:
+        if (inst->count != 2 || !is_reg(a) || b->kind != OPR_MEM) return false;
+        put_op_modrm(obj, wide, 0x8d, a->reg, b);
+        return true;
+
+    case OP_MOVZX:
+        if (inst->count != 2 || !is_reg(a) || !is_rm(b) || a->size == 1) return false;
+        if (b->size != 1) return false;
+        put_op2_modrm(obj, a->size == 8, 0xb6, a->reg, b, true);
+        return true;
+
+    case OP_PUSH:
+    case OP_POP:
+        if (inst->count != 1) return false;
+        if (is_reg(a) && a->size == 8) {
+            if (a->reg & 8) {
+                put_byte(obj, 0x41);
+            }
+            put_byte(obj, (inst->op == OP_PUSH ? 0x50 : 0x58) + (a->reg & 7));
+        } else if (inst->op == OP_PUSH && a->kind == OPR_IMM && fits_int8(a->imm)) {
+            put_byte(obj, 0x6a);
+            put_byte(obj, a->imm & 0xff);
+        } else if (inst->op == OP_PUSH && a->kind == OPR_IMM && fits_int32(a->imm)) {
+            put_byte(obj, 0x68);
+            put_u32(obj, (uint32_t)a->imm);
+        } else if (a->kind == OPR_MEM) {
+            if (inst->op == OP_PUSH) {
+                put_op_modrm(obj, false, 0xff, 6, a);
+            } else {
+                put_op_modrm(obj, false, 0x8f, 0, a);
+            }
+        } else {
+            return false;
+        }
+        return true;
+
+    case OP_SETE:
+    case OP_SETNE:
+    case OP_SETL:
+    case OP_SETLE:
+    case OP_SETG:
+    case OP_SETGE:
+        if (inst->count != 1 || !is_rm(a) || (is_reg(a) && a->size != 1)) return false;
+        put_op2_modrm(obj, false, 0x90 | condition_code(inst->op), 0, a, true);
+        return true;
+
+    case OP_JMP:
+    case OP_CALL:
+        if (inst->count != 1 || a->kind != OPR_LABEL) return false;
+        put_byte(obj, inst->op == OP_JMP ? 0xe9 : 0xe8);
+        put_rel32(obj, a, inst->op == OP_JMP ? RELOC_PC32 : RELOC_PLT32);
+        return true;
+
+    case OP_JE:
+    case OP_JNE:
+    case OP_JL:
+    case OP_JLE:
+    case OP_JG:
+    case OP_JGE:
+        if (inst->count != 1 || a->kind != OPR_LABEL) return false;
+        put_byte(obj, 0x0f);
+        put_byte(obj, 0x80 | condition_code(inst->op));
+        put_rel32(obj, a, RELOC_PC32);
+        return true;
+
+    case OP_RET:
+        if (inst->count != 0) return false;
+        put_byte(obj, 0xc3);
+        return true;
+
+    default:
+        return false;
+    }
+}
+
+// 疑似命令を処理する。シンボルを公開する.globalのほかは読み飛ばせるものだけ受け付ける
+static void directive(Object *obj, const char *s, size_t n, const AsmLine *line) {
+    const char *end = line->name + line->name_len;
+    const char *w = skip_word(line->name, end);
+    const int len = w - line->name;
+    if (word_equal(line->name, len, ".global") || word_equal(line->name, len, ".globl")) {
+        const char *name = skip_spaces(w, end);
+        const char *name_end = skip_word(name, end);
+        if (name == name_end || name_end != end) {
+            syntax_error(s, n);
+        }
+        const int sym = intern_symbol(obj, name, name_end - name); // symbolsが伸びて動くことがある
+        obj->symbols[sym].global = true;
+    } else if (!word_equal(line->name, len, ".intel_syntax") && !word_equal(line->name, len, ".text")) {
+        syntax_error(s, n);
+    }
+}
+
+// 1行をアセンブルする
+static void assemble_line(Object *obj, const char *s, size_t n) {
+    AsmLine line;
+    asm_parse_line(s, n, &line);
+    switch (line.kind) {
+    case ASM_EMPTY:
+        break;
+    case ASM_LABEL: {
+        const int index = intern_symbol(obj, line.name, line.name_len);
+        ObjectSymbol *sym = &obj->symbols[index];
+        if (sym->defined) {
+            error_exit("ラベルが重複しています: %.*s", line.name_len, line.name);
+        }
+        sym->defined = true;
+        sym->offset = obj->code_len;
+        break;
+    }
+    case ASM_DIRECTIVE:
+        directive(obj, s, n, &line);
+        break;
+    case ASM_INST:
+        if (!encode(obj, &line.inst)) {
+            syntax_error(s, n);
+        }
+        break;
+    }
+}
+
+void asm_begin(Object *obj) {
+    *obj = (Object){0};
+    obj->symbol_index = new_map();
+    obj->names = new_arena("asm");
+}
+
+/**
+ * アセンブリの断片を受け取って、行が揃った分をアセンブルする
+ * 断片は行の途中で切れていてもよい(emitの出力先として使う)
+ */
+void asm_feed(void *arg, const char *s, size_t n) {
+    Object *obj = arg;
+    const char *end = s + n;
+    while (s < end) {
+        const char *newline = memchr(s, '\n', end - s);
+        if (!newline) {
+            // 行の残りは次の断片と合わせる
+            const size_t rest = end - s;
+            if (obj->pending_len + rest > obj->pending_capacity) {
+                obj->pending_capacity = (obj->pending_len + rest) * 2;
+                obj->pending = realloc(obj->pending, obj->pending_capacity);
+            }
+            memcpy(obj->pending + obj->pending_len, s, rest);
+            obj->pending_len += rest;
+            return;
+        }
+        if (obj->pending_len > 0) {
+            const size_t head = newline - s;
+            if (obj->pending_len + head > obj->pending_capacity) {
+                obj->pending_capacity = (obj->pending_len + head) * 2;
+                obj->pending = realloc(obj->pending, obj->pending_capacity);
+            }
+            memcpy(obj->pending + obj->pending_len, s, head);
+            assemble_line(obj, obj->pending, obj->pending_len + head);
+            obj->pending_len = 0;
+        } else {
+            assemble_line(obj, s, newline - s);
+        }
+        s = newline + 1;
+    }
+}
+
+/**
+ * 残りの行をアセンブルし、このオブジェクトで定義したラベルへの参照を解決する
+ * 未定義のシンボルへの参照は再配置としてrelocsに残す
+ */
+void asm_finish(Object *obj) {
+    if (obj->pending_len > 0) {
+        assemble_line(obj, obj->pending, obj->pending_len);
+        obj->pending_len = 0;
+    }
+    int kept = 0;
+    for (int i = 0; i < obj->relocs_len; i++) {
+        const ObjectReloc *reloc = &obj->relocs[i];
+        const ObjectSymbol *sym = &obj->symbols[reloc->symbol];
+        if (sym->defined) {
+            const int64_t rel = (int64_t)sym->offset - (int64_t)(reloc->offset + 4);
+            const uint32_t v = (uint32_t)rel;
+            for (int k = 0; k < 4; k++) {
+                obj->code[reloc->offset + k] = (v >> (k * 8)) & 0xff;
+            }
+        } else if (sym->name[0] == '.') {
+            error_exit("ラベルが定義されていません: %s", sym->name);
+        } else {
+            obj->symbols[reloc->symbol].global = true;
+            obj->relocs[kept++] = *reloc;
+        }
+    }
+    obj->relocs_len = kept;
+}
+
+void release_object(Object *obj) {
+    free(obj->code);
+    free(obj->symbols);
+    free(obj->relocs);
+    free(obj->pending);
+    map_free(obj->symbol_index);
+    if (obj->names) {
+        arena_release(obj->names);
+        free(obj->names);
+    }
+    *obj = (Object){0};
+}
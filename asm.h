@@ -0,0 +1,153 @@
+#pragma once
+
+#include "map.h"
+#include "arena.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * 組み込みのアセンブラ
+ * コード生成が出力するIntel記法のアセンブリ(命令の部分集合)を1行ずつ構造化した
+ * 命令(Inst)に読み、x86-64の機械語に符号化してObjectに溜める。ラベルへの参照は
+ * 最後にasm_finish()で解決し、このオブジェクトで定義していないシンボルへの参照
+ * は再配置として残す。Objectはwrite_elf_object()でELF64の再配置可能オブジェクト
+ * として書き出せる。
+ */
+
+// 命令の種類
+typedef enum {
+    OP_MOV,
+    OP_ADD,
+    OP_SUB,
+    OP_CMP,
+    OP_AND,
+    OP_OR,
+    OP_XOR,
+    OP_TEST,
+    OP_IMUL,
+    OP_IDIV,
+    OP_NEG,
+    OP_CQO,
+    OP_SHL,
+    OP_SAR,
+    OP_SHR,
+    OP_LEA,
+    OP_MOVZX,
+    OP_PUSH,
+    OP_POP,
+    OP_SETE,
+    OP_SETNE,
+    OP_SETL,
+    OP_SETLE,
+    OP_SETG,
+    OP_SETGE,
+    OP_JMP,
+    OP_JE,
+    OP_JNE,
+    OP_JL,
+    OP_JLE,
+    OP_JG,
+    OP_JGE,
+    OP_CALL,
+    OP_RET,
+    OP_COUNT,
+} Opcode;
+
+// レジスタの番号(機械語での番号)
+enum {
+    REG_RAX, REG_RCX, REG_RDX, REG_RBX, REG_RSP, REG_RBP, REG_RSI, REG_RDI,
+    REG_R8, REG_R9, REG_R10, REG_R11, REG_R12, REG_R13, REG_R14, REG_R15,
+};
+
+// オペランドの種類
+typedef enum {
+    OPR_NONE,
+    OPR_REG,    // レジスタ
+    OPR_IMM,    // 即値
+    OPR_MEM,    // メモリ([base + index * scale + disp])
+    OPR_LABEL,  // ラベル・シンボル
+} OperandKind;
+
+typedef struct {
+    OperandKind kind;
+    unsigned char size;     // OPR_REG, OPR_MEM: バイト数(1, 4, 8。メモリで不明なら0)
+    signed char reg;        // OPR_REG: レジスタ / OPR_MEM: ベースレジスタ
+    signed char index;      // OPR_MEM: インデックスレジスタ(なければ-1)
+    unsigned char scale;    // OPR_MEM: インデックスの倍率
+    long imm;               // OPR_IMM: 値 / OPR_MEM: 変位
+    const char *name;       // OPR_LABEL: 名前(行の中を指す。NUL終端ではない)
+    int name_len;
+} Operand;
+
+// 構造化した命令
+typedef struct {
+    Opcode op;
+    int count;              // オペランドの数
+    Operand operands[2];
+} Inst;
+
+// アセンブリの1行の種類
+typedef enum {
+    ASM_EMPTY,              // 空行・コメントだけの行
+    ASM_LABEL,              // ラベルの定義
+    ASM_DIRECTIVE,          // 疑似命令
+    ASM_INST,               // 命令
+} AsmLineKind;
+
+typedef struct {
+    AsmLineKind kind;
+    const char *name;       // ASM_LABEL: ラベル名 / ASM_DIRECTIVE: 疑似命令の行(どちらもNUL終端ではない)
+    int name_len;
+    Inst inst;              // ASM_INST: 命令
+} AsmLine;
+
+// オブジェクトのシンボル
+typedef struct {
+    const char *name;       // 名前(NUL終端)
+    size_t offset;          // 定義した位置(.textの先頭から)
+    bool defined;
+    bool global;
+} ObjectSymbol;
+
+// 再配置の種類
+typedef enum {
+    RELOC_PC32,             // ジャンプ先
+    RELOC_PLT32,            // 呼び出し先
+} RelocKind;
+
+// ラベル・シンボルへの参照(rel32)
+typedef struct {
+    size_t offset;          // rel32を書く位置
+    int symbol;             // 参照先のシンボル(symbolsの添字)
+    RelocKind kind;
+} ObjectReloc;
+
+// アセンブルした結果
+typedef struct {
+    unsigned char *code;    // .textの機械語
+    size_t code_len;
+    size_t code_capacity;
+    ObjectSymbol *symbols;
+    int symbols_len;
+    int symbols_capacity;
+    ObjectReloc *relocs;    // asm_finish()の後は未定義のシンボルへの参照だけが残る
+    int relocs_len;
+    int relocs_capacity;
+    Map *symbol_index;      // 名前からsymbolsの添字+1を引く
+    Arena *names;           // シンボル名の置き場
+    char *pending;          // asm_feed()で行の途中まで受け取った分
+    size_t pending_len;
+    size_t pending_capacity;
+} Object;
+
+extern void asm_parse_line(const char *s, size_t n, AsmLine *line);
+extern const char *opcode_name(Opcode op);
+extern int asm_format_inst(const Inst *inst, char *buf, size_t size);
+
+extern void asm_begin(Object *obj);
+extern void asm_feed(void *obj, const char *s, size_t n);
+extern void asm_finish(Object *obj);
+extern void release_object(Object *obj);
+
+extern void write_elf_object(int fd, const Object *obj);
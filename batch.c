@@ -0,0 +1,343 @@
+#define _POSIX_C_SOURCE 200809L // getline
+#include "9cc.h"
+#include "batch.h"
+#include "emit.h"
+#include "jit.h"
+#include <stdio.h>
+#include <stdarg.h>
+#include <fcntl.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+/*
+ * バッチモードの実装
+ * プログラムごとに新しいコンパイラのコンテキストでコンパイルし、アセンブリを
+ * いったんプログラムごとのバッファに受ける。コンパイルに成功したプログラムの分
+ * だけを共通の出力(.sのファイルか、-cなら1つのオブジェクト)に足すので、エラー
+ * になったプログラムは出力に何も残さない。
+ * プログラムが定義した関数には"p<番号>_"を付け(_mainは_p<番号>_mainになる)、
+ * ラベルの番号もプログラムをまたいで通し番号にするので、全部を1つにリンクできる。
+ * 最後に各プログラムの_mainを順に呼び、期待値と違った数を返す_mainを足す。
+ * --runなら出力せず、プログラムごとにJITで読み込んで子プロセスで実行する。
+ */
+
+// マニフェストの1プログラム
+typedef struct {
+    char *source;           // ソース(エスケープを戻したもの)
+    int line;               // マニフェストの行番号
+    bool has_expected;
+    int expected;
+} BatchProgram;
+
+// プログラムごとのアセンブリを受けるバッファ
+typedef struct {
+    char *data;
+    size_t len;
+    size_t capacity;
+} Text;
+
+static void text_append(void *arg, const char *s, size_t n) {
+    Text *text = arg;
+    if (text->len + n > text->capacity) {
+        text->capacity = (text->len + n) * 2;
+        text->data = realloc(text->data, text->capacity);
+        if (!text->data) {
+            error_exit("バッチの出力のメモリを確保できません");
+        }
+    }
+    memcpy(text->data + text->len, s, n);
+    text->len += n;
+}
+
+static void text_printf(Text *text, const char *fmt, ...) {
+    char line[128];
+    va_list ap;
+    va_start(ap, fmt);
+    const int n = vsnprintf(line, sizeof(line), fmt, ap);
+    va_end(ap);
+    text_append(text, line, n);
+}
+
+static void write_all(int fd, const char *s, size_t n) {
+    while (n > 0) {
+        const ssize_t written = write(fd, s, n);
+        if (written <= 0) {
+            error_exit("出力を書き込めません");
+        }
+        s += written;
+        n -= written;
+    }
+}
+
+// ソースの中のエスケープを戻す(その場で書き換える)
+static void unescape(char *s) {
+    char *out = s;
+    while (*s) {
+        if (s[0] == '\\' && (s[1] == 'n' || s[1] == 't' || s[1] == '\\')) {
+            *out++ = s[1] == 'n' ? '\n' : s[1] == 't' ? '\t' : '\\';
+            s += 2;
+        } else {
+            *out++ = *s++;
+        }
+    }
+    *out = '\0';
+}
+
+// マニフェストを読んでプログラムの配列を返す
+static BatchProgram *read_manifest(const char *path, int *out_count) {
+    FILE *fp = strcmp(path, "-") == 0 ? stdin : fopen(path, "r");
+    if (!fp) {
+        error_exit("マニフェストを開けません: %s", path);
+    }
+
+    BatchProgram *programs = NULL;
+    int count = 0, capacity = 0;
+    char *line = NULL;
+    size_t line_capacity = 0;
+    ssize_t len;
+    for (int line_no = 1; (len = getline(&line, &line_capacity, fp)) >= 0; line_no++) {
+        while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r')) {
+            line[--len] = '\0';
+        }
+        if (len == 0 || line[0] == '#') {
+            continue;
+        }
+
+        BatchProgram program = {.line = line_no};
+        char *source = line;
+        char *tab = strchr(line, '\t');
+        if (tab) {
+            char *end;
+            program.expected = strtol(line, &end, 10);
+            if (end == line || end != tab) {
+                error_exit("%s:%d: 期待値が数ではありません", path, line_no);
+            }
+            program.has_expected = true;
+            source = tab + 1;
+        }
+        program.source = strdup(source);
+        unescape(program.source);
+
+        if (count == capacity) {
+            capacity = capacity ? capacity * 2 : 64;
+            programs = realloc(programs, sizeof(BatchProgram) * capacity);
+        }
+        programs[count++] = program;
+    }
+    free(line);
+    if (fp != stdin) {
+        fclose(fp);
+    }
+    *out_count = count;
+    return programs;
+}
+
+// バッチ全体の状態
+typedef struct {
+    const BatchOptions *options;
+    Text text;              // プログラムごとのアセンブリ
+    long label_sequence_no; // ラベルの通し番号
+    Object object;          // -cのとき全プログラムの機械語を溜める
+    JitCode jit;            // --runのとき読み込んだプログラム
+} Batch;
+
+/**
+ * 1つのプログラムをコンパイルする。エラーがあれば偽を返す
+ * --runならbatch->jitに読み込み、そうでなければ共通の出力に足す
+ */
+static bool compile_program(Batch *batch, const BatchProgram *entry, int index, int out_fd) {
+    Compiler compiler;
+    jmp_buf on_error;
+    Object object;
+    char prefix[32] = "";
+    const bool run = batch->options->run;
+
+    compiler_enter(&compiler, entry->source);
+    if (setjmp(on_error)) {
+        jit_unload(&batch->jit);
+        emit_close();
+        compiler_leave();
+        trace_dump(stderr, NULL);
+        return false;
+    }
+    ctx->on_error = &on_error;
+    // ソースは読み込み済みなのでload_source()は呼ばない(compiler_leave()でも解放しない)
+    ctx->source = ctx->input;
+    ctx->peephole = !batch->options->no_peephole;
+    ctx->ir = batch->options->ir;
+    if (!run) {
+        // --runならプログラムごとに別のオブジェクトにするので接頭辞は要らない
+        snprintf(prefix, sizeof(prefix), "p%d_", index);
+        ctx->symbol_prefix = prefix;
+        ctx->label_sequence_no = batch->label_sequence_no;
+    }
+
+    batch->text.len = 0;
+    emit_open_sink(text_append, &batch->text, batch->options->compact);
+    ctx->token = tokenize(ctx->source);
+    program();
+    gen_program();
+    emit_flush();
+
+    if (run) {
+        asm_begin(&object);
+        ctx->object = &object;
+        asm_feed(&object, batch->text.data, batch->text.len);
+        asm_finish(&object);
+        jit_load(&batch->jit, &object);
+    } else if (batch->options->object) {
+        // 組み込みのアセンブラが失敗するのはコード生成の誤りなので、途中まで
+        // 足した分を取り消すことは考えない
+        asm_feed(&batch->object, batch->text.data, batch->text.len);
+    } else {
+        write_all(out_fd, batch->text.data, batch->text.len);
+    }
+    batch->label_sequence_no = ctx->label_sequence_no;
+
+    emit_close();
+    compiler_leave();
+    trace_dump(stderr, NULL);
+    return true;
+}
+
+/**
+ * 読み込んだプログラムの_mainを子プロセスで実行する
+ * プログラムが異常終了してもバッチは続けられる。終了コードを返し、シグナルで
+ * 終了した場合は-(シグナル番号)を返す
+ */
+static int run_isolated(const JitCode *jit) {
+    fflush(stdout);
+    fflush(stderr);
+    const pid_t pid = fork();
+    if (pid < 0) {
+        error_exit("プロセスを作成できません");
+    }
+    if (pid == 0) {
+        const int status = jit->main();
+        fflush(NULL);
+        _exit(status & 0xff);
+    }
+    int status;
+    if (waitpid(pid, &status, 0) < 0) {
+        error_exit("プロセスを待てません");
+    }
+    return WIFSIGNALED(status) ? -WTERMSIG(status) : WEXITSTATUS(status);
+}
+
+/**
+ * 全プログラムの_mainを順に呼ぶ_mainを作る
+ * 期待値のあるプログラムは戻り値の下位8ビット(終了コード)を比べ、違った数を返す
+ * 生成したコードはrbxを保存しないので、数は自分のスタックフレームに置く
+ */
+static void driver(Text *text, const BatchProgram *programs, const bool *compiled, int count) {
+    text_printf(text, ".intel_syntax noprefix\n");
+    text_printf(text, ".global _main\n");
+    text_printf(text, "_main:\n");
+    text_printf(text, "  push rbp\n");
+    text_printf(text, "  mov rbp, rsp\n");
+    text_printf(text, "  sub rsp, 16\n");
+    text_printf(text, "  mov qword ptr [rbp-8], 0\n");
+    for (int i = 0; i < count; i++) {
+        if (!compiled[i]) {
+            continue;
+        }
+        text_printf(text, "  call _p%d_main\n", i + 1);
+        if (programs[i].has_expected) {
+            text_printf(text, "  and rax, 255\n");
+            text_printf(text, "  cmp rax, %d\n", programs[i].expected & 0xff);
+            text_printf(text, "  setne al\n");
+            text_printf(text, "  movzx rax, al\n");
+            text_printf(text, "  add [rbp-8], rax\n");
+        }
+    }
+    text_printf(text, "  mov rax, [rbp-8]\n");
+    text_printf(text, "  mov rsp, rbp\n");
+    text_printf(text, "  pop rbp\n");
+    text_printf(text, "  ret\n");
+}
+
+/**
+ * マニフェストのプログラムをまとめてコンパイルし、プログラムごとの結果と集計
+ * を標準エラー出力に書く。全て成功すれば0、1つでも失敗すれば1を返す
+ * 出力する場合の成否はコンパイルできたかどうかで、期待値は出力した実行ファイル
+ * の_mainが確かめる(--runならここで実行して確かめる)
+ */
+int run_batch(const BatchOptions *options) {
+    int count;
+    BatchProgram *programs = read_manifest(options->manifest, &count);
+    bool *compiled = calloc(count + 1, sizeof(bool));
+
+    int out_fd = STDOUT_FILENO;
+    if (!options->run && options->output) {
+        out_fd = open(options->output, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (out_fd < 0) {
+            error_exit("出力ファイルを開けません: %s", options->output);
+        }
+    }
+
+    Batch batch = {.options = options};
+    if (options->object && !options->run) {
+        asm_begin(&batch.object);
+    }
+
+    int passed = 0, failed = 0, errors = 0, compiled_count = 0;
+    for (int i = 0; i < count; i++) {
+        const BatchProgram *program = &programs[i];
+        if (!compile_program(&batch, program, i + 1, out_fd)) {
+            fprintf(stderr, "batch: ERROR %d (line %d)\n", i + 1, program->line);
+            errors++;
+            continue;
+        }
+        compiled[i] = true;
+        if (!options->run) {
+            // 期待値はここでは確かめていないので、コンパイルできたことだけを書く
+            fprintf(stderr, "batch: compiled %d\n", i + 1);
+            compiled_count++;
+            continue;
+        }
+
+        const int status = run_isolated(&batch.jit);
+        jit_unload(&batch.jit);
+        if (status < 0) {
+            fprintf(stderr, "batch: FAIL %d (line %d): killed by signal %d\n", i + 1, program->line, -status);
+            failed++;
+        } else if (program->has_expected && status != (program->expected & 0xff)) {
+            fprintf(stderr, "batch: FAIL %d (line %d): expected %d, got %d\n",
+                    i + 1, program->line, program->expected, status);
+            failed++;
+        } else {
+            fprintf(stderr, "batch: ok %d\n", i + 1);
+            passed++;
+        }
+    }
+
+    if (!options->run) {
+        batch.text.len = 0;
+        driver(&batch.text, programs, compiled, count);
+        if (options->object) {
+            asm_feed(&batch.object, batch.text.data, batch.text.len);
+            asm_finish(&batch.object);
+            write_elf_object(out_fd, &batch.object);
+            release_object(&batch.object);
+        } else {
+            write_all(out_fd, batch.text.data, batch.text.len);
+        }
+        if (options->output) {
+            close(out_fd);
+        }
+    }
+    if (options->run) {
+        fprintf(stderr, "batch: %d programs, %d passed, %d failed, %d errors\n", count, passed, failed, errors);
+    } else {
+        fprintf(stderr, "batch: %d programs, %d compiled, %d errors (results are checked by the output's _main)\n",
+                count, compiled_count, errors);
+    }
+
+    free(batch.text.data);
+    free(compiled);
+    for (int i = 0; i < count; i++) {
+        free(programs[i].source);
+    }
+    free(programs);
+    return failed + errors > 0;
+}
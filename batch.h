@@ -0,0 +1,25 @@
+#pragma once
+
+#include <stdbool.h>
+
+/*
+ * バッチモード(--batch)
+ * マニフェストに並べた多数の小さなプログラムを1回の起動でコンパイルする。
+ * マニフェストは1行に1プログラムで、空行と'#'で始まる行は読み飛ばす。
+ *   期待値<TAB>ソース   終了コードの期待値つき
+ *   ソース              期待値なし
+ * ソースの中の"\n", "\t", "\\"はそれぞれ改行・タブ・'\'に戻す。
+ */
+
+// バッチの設定
+typedef struct {
+    const char *manifest;   // マニフェストのファイル("-"なら標準入力)
+    const char *output;     // 出力ファイル(NULLなら標準出力)
+    bool object;            // アセンブリの代わりにELFのオブジェクトファイルを出力する
+    bool run;               // 出力せずに各プログラムをJITで実行して期待値と比べる
+    bool compact;           // コメントを出力しない
+    bool ir;                // 中間表現を経由してコード生成する
+    bool no_peephole;       // 覗き穴最適化をしない
+} BatchOptions;
+
+extern int run_batch(const BatchOptions *options);
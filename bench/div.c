@@ -0,0 +1,95 @@
+/*
+ * 定数での除算のマイクロベンチマーク
+ *
+ * 使い方: bench/div [ループの回数]
+ * 定数で割る(と掛ける)ループと、同じ値を変数に入れて割るループを生成し、それぞ
+ * れ9cc --runで実行した時間を表示する。前者は強度低減で上位の乗算とシフトになり、
+ * 後者はidivのままになる。両者の結果(_mainの戻り値)が違えば失敗する。
+ */
+#define _DEFAULT_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+static const char *INPUT = "tmp_div.c";
+
+// 割る数。負の数も含める
+static const char *DIVISORS[] = {"3", "7", "10", "16", "641", "(0 - 5)", "256"};
+#define DIVISOR_COUNT (sizeof(DIVISORS) / sizeof(DIVISORS[0]))
+
+// 割る数を定数で書くか変数d0, d1, ...で書くかだけが違う入力を生成する
+static void generate(long iterations, bool constant) {
+    FILE *fp = fopen(INPUT, "w");
+    if (!fp) {
+        perror(INPUT);
+        exit(1);
+    }
+    char divisors[DIVISOR_COUNT][16];
+    fprintf(fp, "int main() {\n\tint i;\n\tint n;\n\tint s;\n");
+    for (size_t k = 0; k < DIVISOR_COUNT; k++) {
+        if (constant) {
+            snprintf(divisors[k], sizeof(divisors[k]), "%s", DIVISORS[k]);
+        } else {
+            snprintf(divisors[k], sizeof(divisors[k]), "d%zu", k);
+            fprintf(fp, "\tint d%zu;\n\td%zu = %s;\n", k, k, DIVISORS[k]);
+        }
+    }
+    fprintf(fp, "\ts = 0;\n\tfor (i = 0; i < %ld; i = i + 1) {\n\t\tn = 0 - i * 3;\n\t\ts = s", iterations);
+    // 正と負の被除数を交互に割る
+    for (size_t k = 0; k + 1 < DIVISOR_COUNT; k++) {
+        fprintf(fp, " + %s / %s", k % 2 ? "n" : "i", divisors[k]);
+    }
+    fprintf(fp, ";\n\t}\n");
+    const char *last = divisors[DIVISOR_COUNT - 1];
+    fprintf(fp, "\treturn s - s / %s * %s;\n}\n", last, last);
+    fclose(fp);
+}
+
+// 9cc --runで実行して経過時間を求め、_mainの戻り値を返す
+static int run(double *seconds) {
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        execl("./9cc", "9cc", "--run", INPUT, (char *)NULL);
+        _exit(127);
+    }
+
+    int status;
+    if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) == 127) {
+        fprintf(stderr, "div: 9cc failed\n");
+        exit(1);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    *seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) * 1e-9;
+    return WEXITSTATUS(status);
+}
+
+int main(int argc, char **argv) {
+    const long iterations = argc > 1 ? atol(argv[1]) : 20000000;
+
+    double seconds[2];
+    int results[2];
+    printf("%-10s %12s %10s %8s\n", "divisor", "iterations", "seconds", "result");
+    for (int constant = 1; constant >= 0; constant--) {
+        generate(iterations, constant);
+        results[constant] = run(&seconds[constant]);
+        printf("%-10s %12ld %10.3f %8d\n", constant ? "constant" : "variable",
+               iterations, seconds[constant], results[constant]);
+        fflush(stdout);
+    }
+    unlink(INPUT);
+
+    if (results[0] != results[1]) {
+        printf("div: results differ between constant and variable divisors\n");
+        return 1;
+    }
+    printf("speedup: %.2fx\n", seconds[0] / seconds[1]);
+    return 0;
+}
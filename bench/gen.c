@@ -0,0 +1,122 @@
+/*
+ * ベンチマーク用の合成プログラムの生成器
+ *
+ * 使い方: bench/gen 形 大きさ [シード]
+ * 指定した形のプログラムを標準出力に書く。同じ引数なら常に同じプログラムになる。
+ *   deep-expr     入れ子の深さが「大きさ」の式
+ *   long-func     「大きさ」個の文からなる1つの関数
+ *   many-locals   「大きさ」個のローカル変数を使う1つの関数
+ *   many-globals  「大きさ」個のグローバル変数
+ *   many-funcs    「大きさ」個の関数
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// 再現性のため乱数は自前の線形合同法で作る
+static unsigned long seed = 1;
+
+static int next_random(int n) {
+    seed = seed * 6364136223846793005ul + 1442695040888963407ul;
+    return (int)((seed >> 33) % n);
+}
+
+static const char *OPERATORS[] = {"+", "-", "*"};
+
+// 入れ子の深さがdepthの式: (a + (b * (c - ... 1)))。行数で比べられるよう1段ごとに改行する
+static void deep_expr(long depth) {
+    printf("int main() {\n\tint a;\n\tint b;\n\tint c;\n\ta = 1;\n\tb = 2;\n\tc = 3;\n\treturn ");
+    const char vars[] = "abc";
+    for (long i = 0; i < depth; i++) {
+        printf("(%c %s\n\t\t", vars[next_random(3)], OPERATORS[next_random(3)]);
+    }
+    printf("%d", next_random(100));
+    for (long i = 0; i < depth; i++) {
+        putchar(')');
+    }
+    printf(";\n}\n");
+}
+
+// n個の文からなる関数
+static void long_func(long n) {
+    printf("int main() {\n\tint a;\n\tint b;\n\tint c;\n\tint i;\n\ta = 0;\n\tb = 1;\n\tc = 2;\n");
+    for (long i = 0; i < n; i++) {
+        const int k = next_random(100);
+        switch (next_random(4)) {
+        case 0:
+            printf("\ta = b %s c + %d;\n", OPERATORS[next_random(3)], k);
+            break;
+        case 1:
+            printf("\tif (a > %d) b = b - 1; else c = c + a;\n", k);
+            break;
+        case 2:
+            printf("\twhile (b < %d) b = b + c;\n", k);
+            break;
+        default:
+            printf("\tfor (i = 0; i < %d; i = i + 1) { a = a + i; c = a / 2; }\n", k);
+            break;
+        }
+    }
+    printf("\treturn a;\n}\n");
+}
+
+// n個のローカル変数を定義し、それぞれ1つ前の変数から計算する関数
+static void many_locals(long n) {
+    printf("int main() {\n\tint x0;\n\tx0 = 1;\n");
+    for (long i = 1; i < n; i++) {
+        printf("\tint x%ld;\n\tx%ld = x%ld %s %d;\n",
+               i, i, i - 1 - next_random(i < 8 ? i : 8), OPERATORS[next_random(3)], next_random(100));
+    }
+    printf("\treturn x%ld;\n}\n", n - 1);
+}
+
+// n個のグローバル変数
+static void many_globals(long n) {
+    for (long i = 0; i < n; i++) {
+        if (next_random(4)) {
+            printf("int g%ld;\n", i);
+        } else {
+            printf("int g%ld[%d];\n", i, 1 + next_random(16));
+        }
+    }
+    printf("int main() {\n\treturn 0;\n}\n");
+}
+
+// n個の関数。それぞれ前に定義した関数を呼ぶ
+static void many_funcs(long n) {
+    printf("int f0(int a, int b) {\n\treturn a + b;\n}\n");
+    for (long i = 1; i < n; i++) {
+        printf("int f%ld(int a, int b) {\n\tint x;\n\tx = a %s %d;\n\tif (x > b) return f%ld(x, b);\n\treturn x - b;\n}\n",
+               i, OPERATORS[next_random(3)], next_random(100), i - 1 - next_random(i < 16 ? i : 16));
+    }
+    printf("int main() {\n\treturn f%ld(1, 2);\n}\n", n - 1);
+}
+
+static const struct {
+    const char *name;
+    void (*generate)(long n);
+} SHAPES[] = {
+    {"deep-expr", deep_expr},
+    {"long-func", long_func},
+    {"many-locals", many_locals},
+    {"many-globals", many_globals},
+    {"many-funcs", many_funcs},
+};
+
+int main(int argc, char **argv) {
+    if (argc < 3 || atol(argv[2]) <= 0) {
+        fprintf(stderr, "使い方: bench/gen 形 大きさ [シード]\n");
+        return 1;
+    }
+    if (argc > 3) {
+        seed = strtoul(argv[3], NULL, 10);
+    }
+    for (size_t i = 0; i < sizeof(SHAPES) / sizeof(SHAPES[0]); i++) {
+        if (strcmp(argv[1], SHAPES[i].name) == 0) {
+            SHAPES[i].generate(atol(argv[2]));
+            return 0;
+        }
+    }
+    fprintf(stderr, "gen: 不明な形です: %s\n", argv[1]);
+    return 1;
+}
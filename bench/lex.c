@@ -0,0 +1,127 @@
+/*
+ * トークナイザのマイクロベンチマーク
+ *
+ * 使い方: bench/lex [ソースファイル]
+ * ファイルを省略した場合は合成したソース(約16MB)をトークナイズしてMB/sを表示する
+ * 走査の実装ごとに計測し、トークン列がスカラ実装と一致することも確認する
+ */
+#define _POSIX_C_SOURCE 200809L
+#include "../9cc.h"
+#include "../scan.h"
+#include <stdarg.h>
+#include <time.h>
+
+void error_exit(char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    vfprintf(stderr, fmt, ap);
+    fprintf(stderr, "\n");
+    exit(1);
+}
+
+static const char *SNIPPET =
+    "int func%d(int a, int *b) {\n"
+    "    int x;\n"
+    "    int values[16];\n"
+    "    x = a * 3 + 17 - (a / 2);\n"
+    "    if (x >= 100) {\n"
+    "        return x - 1;\n"
+    "    } else {\n"
+    "        while (x < 1000) x = x + a;\n"
+    "    }\n"
+    "    for (x = 0; x <= 10; x = x + 1) {\n"
+    "        *b = *b + sizeof(x) + values[x];\n"
+    "    }\n"
+    "    return x == 42 != 0;\n"
+    "}\n";
+
+// 合成ソースをsizeバイト程度生成する
+static char *synthesize(size_t size) {
+    char *buffer = malloc(size + 1024);
+    size_t len = 0;
+    for (int i = 0; len < size; i++) {
+        len += sprintf(buffer + len, SNIPPET, i);
+    }
+    return buffer;
+}
+
+static char *read_file(const char *path) {
+    FILE *fp = fopen(path, "rb");
+    if (!fp) {
+        error_exit("ファイルを開けません: %s", path);
+    }
+    fseek(fp, 0, SEEK_END);
+    long size = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+    char *buffer = calloc(1, size + 1);
+    if (fread(buffer, 1, size, fp) != (size_t)size) {
+        error_exit("ファイルを読めません: %s", path);
+    }
+    fclose(fp);
+    return buffer;
+}
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// トークン列のチェックサム(実装間の比較用)
+static unsigned long checksum(int t, size_t *count) {
+    unsigned long sum = 0;
+    *count = 0;
+    for (; t < ctx->tokens.count; t++) {
+        sum = sum * 31 + token_kind(t);
+        sum = sum * 31 + ctx->tokens.offset[t];
+        sum = sum * 31 + (unsigned long)token_len(t);
+        sum = sum * 31 + (unsigned long)token_val(t);
+        (*count)++;
+    }
+    return sum;
+}
+
+int main(int argc, char **argv) {
+    char *source = argc > 1 ? read_file(argv[1]) : synthesize(16 * 1024 * 1024);
+    const size_t size = strlen(source);
+    const int runs = 5;
+    static const char *implementations[] = {"scalar", "sse2"};
+
+    Compiler compiler;
+    compiler_enter(&compiler, NULL);
+
+    unsigned long expected = 0;
+    for (int k = 0; k < sizeof(implementations) / sizeof(implementations[0]); k++) {
+        if (!scan_select(implementations[k])) {
+            continue;
+        }
+
+        double best = 0;
+        size_t count = 0;
+        unsigned long sum = 0;
+        for (int i = 0; i < runs; i++) {
+            const double start = now();
+            int t = tokenize(source);
+            const double elapsed = now() - start;
+
+            sum = checksum(t, &count);
+            if (i == 0 || elapsed < best) {
+                best = elapsed;
+            }
+            arena_release(ctx->token_arena);
+        }
+        if (k == 0) {
+            expected = sum;
+        }
+
+        printf("lex[%-6s]: %zu bytes, %zu tokens, best of %d: %.3f ms, %.1f MB/s%s\n",
+               implementations[k], size, count, runs, best * 1e3,
+               size / best / (1024 * 1024),
+               sum == expected ? "" : "  *** MISMATCH ***");
+        if (sum != expected) {
+            return 1;
+        }
+    }
+    compiler_leave();
+    return 0;
+}
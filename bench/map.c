@@ -0,0 +1,74 @@
+/*
+ * Mapのマイクロベンチマーク
+ *
+ * 使い方: bench/map
+ * キー数を10から100万まで増やしながら1回あたりのlookupの時間を表示する。
+ * 挿入・削除・イテレーションの結果も確認する。
+ */
+#define _POSIX_C_SOURCE 200809L
+#include "../map.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void check(int ok, const char *what) {
+    if (!ok) {
+        fprintf(stderr, "map: %s failed\n", what);
+        exit(1);
+    }
+}
+
+int main() {
+    const int max_keys = 1000000;
+    const int lookups = 2000000;
+
+    char **keys = malloc(sizeof(char *) * max_keys);
+    for (int i = 0; i < max_keys; i++) {
+        char buffer[32];
+        sprintf(buffer, "global_var_%d", i);
+        keys[i] = strdup(buffer);
+    }
+
+    for (int n = 10; n <= max_keys; n *= 10) {
+        Map *map = new_map();
+        for (int i = 0; i < n; i++) {
+            map_insert(map, keys[i], keys[i]);
+        }
+        check(map_size(map) == n, "insert");
+
+        // 同じ順序でキーを引くとキャッシュに乗りやすいので擬似乱数で選ぶ
+        unsigned x = 12345;
+        int found = 0;
+        const double start = now();
+        for (int i = 0; i < lookups; i++) {
+            x = x * 1103515245 + 12345;
+            found += map_lookup(map, keys[(x >> 8) % n]) != NULL;
+        }
+        const double elapsed = now() - start;
+        check(found == lookups, "lookup");
+        check(map_lookup(map, "not_found") == NULL, "lookup missing key");
+
+        // 偶数番目を削除して残りが引けること、イテレーションで全て辿れることを確認する
+        for (int i = 0; i < n; i += 2) {
+            check(map_remove(map, keys[i]), "remove");
+        }
+        for (int i = 0; i < n; i++) {
+            check((map_lookup(map, keys[i]) != NULL) == (i % 2 == 1), "lookup after remove");
+        }
+        int cursor = 0, visited = 0;
+        while (map_iterate(map, &cursor)) {
+            visited++;
+        }
+        check(visited == map_size(map) && visited == n / 2, "iterate");
+
+        printf("map: %7d keys, %.1f ns/lookup\n", n, elapsed / lookups * 1e9);
+    }
+    return 0;
+}
@@ -0,0 +1,95 @@
+/*
+ * 大きな翻訳単位でのスケーリングテスト
+ *
+ * 使い方: bench/scale [最大の宣言数]
+ * トップレベルの宣言(関数とグローバル変数)を10^3個から10^6個まで10倍ずつ
+ * 増やした入力を生成して9ccでコンパイルし、時間とピークRSSを表示する。
+ * 宣言1つあたりの時間またはRSSが、宣言数を10倍にしたときに2倍を超えて
+ * 増えた場合(線形より悪い場合)は失敗する。
+ */
+#define _DEFAULT_SOURCE // wait4
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+static const char *INPUT = "tmp_scale.c";
+
+// n個のトップレベル宣言を持つ入力を生成する
+static void generate(long n) {
+    FILE *fp = fopen(INPUT, "w");
+    if (!fp) {
+        perror(INPUT);
+        exit(1);
+    }
+    for (long i = 0; i < n - 1; i++) {
+        if (i % 2) {
+            fprintf(fp, "int g%ld;\n", i);
+        } else {
+            fprintf(fp, "int f%ld(int a) {\n\tint x;\n\tx = a + %ld;\n\tif (x > 3) x = 3;\n\treturn x;\n}\n", i, i % 100);
+        }
+    }
+    fprintf(fp, "int main() {\n\treturn 0;\n}\n");
+    fclose(fp);
+}
+
+// 9ccを実行して経過時間とピークRSS(KB)を求める
+static void compile(double *seconds, long *max_rss_kb) {
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        int devnull = open("/dev/null", O_WRONLY);
+        dup2(devnull, STDERR_FILENO);
+        execl("./9cc", "9cc", "--compact-asm", "-o", "/dev/null", INPUT, (char *)NULL);
+        _exit(127);
+    }
+
+    int status;
+    struct rusage usage;
+    if (wait4(pid, &status, 0, &usage) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        fprintf(stderr, "scale: 9cc failed\n");
+        exit(1);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    *seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) * 1e-9;
+#ifdef __APPLE__
+    *max_rss_kb = usage.ru_maxrss / 1024; // macOSはバイト単位
+#else
+    *max_rss_kb = usage.ru_maxrss;
+#endif
+}
+
+int main(int argc, char **argv) {
+    const long max_decls = argc > 1 ? atol(argv[1]) : 1000000;
+    const double limit = 2.0; // 1宣言あたりのコストの許容増加率
+
+    double prev_time = 0, prev_rss = 0;
+    int failed = 0;
+    printf("%10s %10s %10s %12s %12s\n", "decls", "seconds", "rss(KB)", "us/decl", "bytes/decl");
+    for (long n = 1000; n <= max_decls; n *= 10) {
+        generate(n);
+        double seconds;
+        long rss;
+        compile(&seconds, &rss);
+
+        const double time_per_decl = seconds / n;
+        const double rss_per_decl = (double)rss / n;
+        printf("%10ld %10.3f %10ld %12.3f %12.1f\n",
+               n, seconds, rss, time_per_decl * 1e6, rss_per_decl * 1024);
+        if (prev_time > 0 && (time_per_decl > prev_time * limit || rss_per_decl > prev_rss * limit)) {
+            printf("scale: not linear between %ld and %ld declarations\n", n / 10, n);
+            failed = 1;
+        }
+        fflush(stdout);
+        prev_time = time_per_decl;
+        prev_rss = rss_per_decl;
+    }
+    unlink(INPUT);
+    return failed;
+}
@@ -0,0 +1,202 @@
+/*
+ * コンパイル速度のベンチマーク(make bench)
+ *
+ * 使い方: bench/suite [--threshold 割合] [--update] [--baseline ファイル]
+ * bench/genで形ごとの合成プログラムを生成して9ccでコンパイルし、1秒あたりの
+ * 行数とピークRSSを表示する。時間は3回のうち最短を使う。
+ * 基準値のファイル(既定はbench/baseline.txt)と比べ、行数/秒が基準値より
+ * 割合(既定は0.25)を超えて下がるか、ピークRSSが割合を超えて増えたら失敗する。
+ * --updateなら比較せずに今回の値で基準値のファイルを書き直す。
+ */
+#define _DEFAULT_SOURCE // wait4
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+static const char *INPUT = "tmp_bench.c";
+static const int RUNS = 3;
+
+// 計測する形と大きさ
+static const struct {
+    const char *shape;
+    const char *size;
+} CASES[] = {
+    {"deep-expr", "5000"},
+    {"long-func", "50000"},
+    {"many-locals", "50000"},
+    {"many-globals", "200000"},
+    {"many-funcs", "50000"},
+};
+#define CASE_COUNT (sizeof(CASES) / sizeof(CASES[0]))
+
+typedef struct {
+    double lines_per_sec;
+    long peak_rss_kb;
+} Result;
+
+// コマンドを実行して経過時間とピークRSS(KB)を求める
+// outがNULLでなければ標準出力をそのファイルに向ける。標準エラー出力は捨てる
+static double run(char *const argv[], const char *out, long *max_rss_kb) {
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        int devnull = open("/dev/null", O_WRONLY);
+        dup2(devnull, STDERR_FILENO);
+        if (out) {
+            int fd = open(out, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+            dup2(fd, STDOUT_FILENO);
+        }
+        execv(argv[0], argv);
+        _exit(127);
+    }
+
+    int status;
+    struct rusage usage;
+    if (wait4(pid, &status, 0, &usage) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        fprintf(stderr, "bench: %s failed\n", argv[0]);
+        exit(1);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+#ifdef __APPLE__
+    *max_rss_kb = usage.ru_maxrss / 1024; // macOSはバイト単位
+#else
+    *max_rss_kb = usage.ru_maxrss;
+#endif
+    return (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) * 1e-9;
+}
+
+static long count_lines(const char *path) {
+    FILE *fp = fopen(path, "r");
+    if (!fp) {
+        perror(path);
+        exit(1);
+    }
+    long lines = 0;
+    int c;
+    while ((c = getc(fp)) != EOF) {
+        lines += c == '\n';
+    }
+    fclose(fp);
+    return lines;
+}
+
+static Result measure(int i) {
+    long rss;
+    char *gen[] = {"./bench/gen", (char *)CASES[i].shape, (char *)CASES[i].size, NULL};
+    run(gen, INPUT, &rss);
+    const long lines = count_lines(INPUT);
+
+    char *cc[] = {"./9cc", "--compact-asm", "-o", "/dev/null", (char *)INPUT, NULL};
+    Result result = {0};
+    double best = 0;
+    for (int r = 0; r < RUNS; r++) {
+        const double seconds = run(cc, NULL, &rss);
+        if (r == 0 || seconds < best) {
+            best = seconds;
+        }
+        if (rss > result.peak_rss_kb) {
+            result.peak_rss_kb = rss;
+        }
+    }
+    result.lines_per_sec = lines / best;
+    return result;
+}
+
+// 基準値を読む。ファイルにない形は0のままにする
+static void load_baseline(const char *path, Result *baseline) {
+    FILE *fp = fopen(path, "r");
+    if (!fp) {
+        return;
+    }
+    char shape[64];
+    double lines_per_sec;
+    long rss;
+    while (fscanf(fp, "%63s %lf %ld", shape, &lines_per_sec, &rss) == 3) {
+        for (size_t i = 0; i < CASE_COUNT; i++) {
+            if (strcmp(shape, CASES[i].shape) == 0) {
+                baseline[i] = (Result){lines_per_sec, rss};
+            }
+        }
+    }
+    fclose(fp);
+}
+
+static void save_baseline(const char *path, const Result *results) {
+    FILE *fp = fopen(path, "w");
+    if (!fp) {
+        perror(path);
+        exit(1);
+    }
+    for (size_t i = 0; i < CASE_COUNT; i++) {
+        fprintf(fp, "%s %.0f %ld\n", CASES[i].shape, results[i].lines_per_sec, results[i].peak_rss_kb);
+    }
+    fclose(fp);
+}
+
+int main(int argc, char **argv) {
+    double threshold = 0.25;
+    const char *baseline_path = "bench/baseline.txt";
+    int update = 0;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--threshold") == 0 && i + 1 < argc) {
+            threshold = atof(argv[++i]);
+        } else if (strcmp(argv[i], "--baseline") == 0 && i + 1 < argc) {
+            baseline_path = argv[++i];
+        } else if (strcmp(argv[i], "--update") == 0) {
+            update = 1;
+        } else {
+            fprintf(stderr, "使い方: bench/suite [--threshold 割合] [--update] [--baseline ファイル]\n");
+            return 1;
+        }
+    }
+
+    Result baseline[CASE_COUNT] = {0};
+    Result results[CASE_COUNT];
+    load_baseline(baseline_path, baseline);
+
+    int failed = 0;
+    printf("%-14s %8s %12s %10s %10s %10s\n", "shape", "size", "lines/s", "vs base", "rss(KB)", "vs base");
+    for (size_t i = 0; i < CASE_COUNT; i++) {
+        results[i] = measure(i);
+        const Result *r = &results[i];
+        const Result *b = &baseline[i];
+        printf("%-14s %8s %12.0f", CASES[i].shape, CASES[i].size, r->lines_per_sec);
+        if (b->lines_per_sec > 0) {
+            printf(" %+9.1f%%", (r->lines_per_sec / b->lines_per_sec - 1) * 100);
+        } else {
+            printf(" %10s", "-");
+        }
+        printf(" %10ld", r->peak_rss_kb);
+        if (b->peak_rss_kb > 0) {
+            printf(" %+9.1f%%", ((double)r->peak_rss_kb / b->peak_rss_kb - 1) * 100);
+        } else {
+            printf(" %10s", "-");
+        }
+
+        if (!update && b->lines_per_sec > 0 &&
+            (r->lines_per_sec < b->lines_per_sec * (1 - threshold) ||
+             r->peak_rss_kb > b->peak_rss_kb * (1 + threshold))) {
+            printf("  REGRESSION");
+            failed = 1;
+        }
+        printf("\n");
+        fflush(stdout);
+    }
+    unlink(INPUT);
+
+    if (update) {
+        save_baseline(baseline_path, results);
+        printf("bench: baseline written to %s\n", baseline_path);
+    } else if (failed) {
+        printf("bench: regression beyond %.0f%% of %s\n", threshold * 100, baseline_path);
+    }
+    return failed;
+}
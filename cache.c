@@ -0,0 +1,217 @@
+#define _POSIX_C_SOURCE 200809L // mkstemp, futimens
+#include "cache.h"
+#include "emit.h"
+#include "trace.h"
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// エントリのファイル名の長さ(キーの16進数表記)
+#define KEY_DIGITS 16
+
+// ラベル番号の桁数(codegen.cの"%08ld")
+#define LABEL_DIGITS 8
+
+// FNV-1a(64ビット)でhにnバイトを混ぜる
+uint64_t cache_hash(uint64_t h, const void *p, size_t n) {
+    const unsigned char *s = p;
+    for (size_t i = 0; i < n; i++) {
+        h ^= s[i];
+        h *= 1099511628211u;
+    }
+    return h;
+}
+
+static void entry_path(char *path, size_t size, const char *dir, uint64_t key) {
+    snprintf(path, size, "%s/%016llx", dir, (unsigned long long)key);
+}
+
+static bool is_digit(char c) {
+    return '0' <= c && c <= '9';
+}
+
+/**
+ * アセンブリ中のラベル(".L<英字><8桁の番号>")の番号をold_base起点からnew_base
+ * 起点に付け替える。桁数が変わってしまう場合は偽を返す
+ */
+static bool relabel(char *text, size_t n, long old_base, long new_base) {
+    for (size_t i = 0; i + 2 < n; i++) {
+        if (text[i] != '.' || text[i + 1] != 'L') {
+            continue;
+        }
+        size_t j = i + 2;
+        while (j < n && (('a' <= text[j] && text[j] <= 'z') || ('A' <= text[j] && text[j] <= 'Z'))) {
+            j++;
+        }
+        if (j + LABEL_DIGITS > n || (j + LABEL_DIGITS < n && is_digit(text[j + LABEL_DIGITS]))) {
+            continue;
+        }
+        long number = 0;
+        size_t k = 0;
+        for (; k < LABEL_DIGITS && is_digit(text[j + k]); k++) {
+            number = number * 10 + (text[j + k] - '0');
+        }
+        if (k < LABEL_DIGITS) {
+            continue;
+        }
+        number = number - old_base + new_base;
+        if (number < 0 || number > 99999999) {
+            return false;
+        }
+        for (k = LABEL_DIGITS; k > 0; k--) {
+            text[j + k - 1] = '0' + number % 10;
+            number /= 10;
+        }
+        i = j + LABEL_DIGITS - 1;
+    }
+    return true;
+}
+
+/**
+ * keyのエントリがあれば、そのアセンブリのラベル番号を*label_sequence_noから
+ * に付け替えて出力し、*label_sequence_noを使った分だけ進めて真を返す
+ */
+bool cache_emit(const char *dir, uint64_t key, long *label_sequence_no, CacheStats *stats) {
+    char path[4096];
+    entry_path(path, sizeof(path), dir, key);
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        TRACE(TRACE_CACHE, 1, "miss %016llx", (unsigned long long)key);
+        stats->misses++;
+        return false;
+    }
+
+    // ヘッダ行("<ラベルの開始番号> <ラベル数>")と本体を読む
+    struct stat st;
+    char *data = NULL;
+    bool ok = fstat(fd, &st) == 0 && (data = malloc(st.st_size + 1)) != NULL &&
+              read(fd, data, st.st_size) == st.st_size;
+    long label_base = 0, label_count = 0;
+    char *text = NULL;
+    if (ok) {
+        data[st.st_size] = '\0';
+        text = strchr(data, '\n');
+        ok = text && sscanf(data, "%ld %ld", &label_base, &label_count) == 2;
+    }
+    if (ok) {
+        text++;
+        ok = relabel(text, data + st.st_size - text, label_base, *label_sequence_no);
+    }
+    if (ok) {
+        emit_raw(text, data + st.st_size - text);
+        *label_sequence_no += label_count;
+        futimens(fd, NULL); // 最後に使った時刻として更新日時を使う
+        TRACE(TRACE_CACHE, 1, "hit %016llx labels=%ld", (unsigned long long)key, label_count);
+        stats->hits++;
+    } else {
+        TRACE(TRACE_CACHE, 1, "broken entry %016llx", (unsigned long long)key);
+        stats->misses++;
+    }
+    free(data);
+    close(fd);
+    return ok;
+}
+
+/**
+ * 関数のアセンブリをkeyのエントリとして保存する
+ * ラベル番号はlabel_baseからlabel_count個使っているものとして記録する
+ * 並行して同じキャッシュを使うコンパイルがあってもよいよう、一時ファイルに書い
+ * てから置き換える
+ */
+void cache_store(const char *dir, uint64_t key, const char *text, size_t len,
+                 long label_base, long label_count, CacheStats *stats) {
+    char path[4096];
+    char tmp[4096 + 16];
+    entry_path(path, sizeof(path), dir, key);
+    snprintf(tmp, sizeof(tmp), "%s.XXXXXX", path);
+
+    int fd = mkstemp(tmp);
+    if (fd < 0) {
+        return; // 保存できなくてもコンパイルは続ける
+    }
+    char header[64];
+    const int n = snprintf(header, sizeof(header), "%ld %ld\n", label_base, label_count);
+    const bool ok = write(fd, header, n) == n && write(fd, text, len) == (ssize_t)len;
+    close(fd);
+    if (ok && rename(tmp, path) == 0) {
+        TRACE(TRACE_CACHE, 1, "store %016llx bytes=%zu", (unsigned long long)key, len);
+        stats->stores++;
+    } else {
+        unlink(tmp);
+    }
+}
+
+// エントリの情報
+typedef struct {
+    char name[KEY_DIGITS + 1];
+    off_t size;
+    time_t mtime;
+} Entry;
+
+static int compare_mtime(const void *a, const void *b) {
+    const Entry *x = a, *y = b;
+    return (x->mtime > y->mtime) - (x->mtime < y->mtime);
+}
+
+static bool is_entry_name(const char *name) {
+    for (int i = 0; i < KEY_DIGITS; i++) {
+        const char c = name[i];
+        if (!(is_digit(c) || ('a' <= c && c <= 'f'))) {
+            return false;
+        }
+    }
+    return name[KEY_DIGITS] == '\0';
+}
+
+/**
+ * エントリの合計サイズがmax_sizeを超えていれば、最後に使われたのが古いものから
+ * 消してmax_sizeの3/4以下にする
+ */
+void cache_evict(const char *dir, size_t max_size, CacheStats *stats) {
+    DIR *d = opendir(dir);
+    if (!d) {
+        return;
+    }
+
+    Entry *entries = NULL;
+    size_t count = 0, capacity = 0;
+    size_t total = 0;
+    char path[4096];
+    for (struct dirent *e; (e = readdir(d)) != NULL;) {
+        struct stat st;
+        if (!is_entry_name(e->d_name)) {
+            continue;
+        }
+        snprintf(path, sizeof(path), "%s/%s", dir, e->d_name);
+        if (stat(path, &st) != 0) {
+            continue;
+        }
+        if (count == capacity) {
+            capacity = capacity ? capacity * 2 : 256;
+            entries = realloc(entries, sizeof(Entry) * capacity);
+        }
+        memcpy(entries[count].name, e->d_name, KEY_DIGITS + 1);
+        entries[count].size = st.st_size;
+        entries[count].mtime = st.st_mtime;
+        count++;
+        total += st.st_size;
+    }
+    closedir(d);
+
+    if (total > max_size) {
+        qsort(entries, count, sizeof(Entry), compare_mtime);
+        for (size_t i = 0; i < count && total > max_size / 4 * 3; i++) {
+            snprintf(path, sizeof(path), "%s/%s", dir, entries[i].name);
+            if (unlink(path) == 0) {
+                stats->evictions++;
+            }
+            total -= entries[i].size;
+        }
+    }
+    free(entries);
+}
@@ -0,0 +1,30 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * 関数単位のコンパイルキャッシュ
+ * 関数定義(ND_FUN_IMPL)のトークン列・コンパイラのバージョン・オプションから作っ
+ * たキーごとに、gen_fun_impl()が出力したアセンブリをディレクトリに保存しておく。
+ * 同じキーの関数はコード生成をせずに保存済のアセンブリをそのまま出力する。
+ * エントリは1つのファイルで、容量を超えたら最後に使われたのが古いものから消す。
+ */
+
+// キャッシュの統計
+typedef struct {
+    long hits;          // キャッシュから出力した関数の数
+    long misses;        // コード生成した関数の数
+    long stores;        // 保存したエントリの数
+    long evictions;     // 容量超過で消したエントリの数
+} CacheStats;
+
+// ハッシュ値の初期値
+#define CACHE_HASH_INIT 14695981039346656037u
+
+extern uint64_t cache_hash(uint64_t h, const void *p, size_t n);
+extern bool cache_emit(const char *dir, uint64_t key, long *label_sequence_no, CacheStats *stats);
+extern void cache_store(const char *dir, uint64_t key, const char *text, size_t len,
+                        long label_base, long label_count, CacheStats *stats);
+extern void cache_evict(const char *dir, size_t max_size, CacheStats *stats);
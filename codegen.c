@@ -1,354 +1,810 @@
 #include "9cc.h"
+#include "emit.h"
+#include "ir.h"
 #include <stdio.h>
 #include <assert.h>
 #include <string.h>
 
-static GenResult gen_impl(Node *);
+/*
+ * 式の一時的な値はレジスタに置く
+ * 呼び出し元保存のレジスタのうち、除算と戻り値に使うrax, rdxを除いた7つを割り
+ * 当てる。式の木のノードごとに必要なレジスタの数(Sethi-Ullman数)を求め、多く
+ * 必要な方の子から先に評価する。残りのレジスタで足りないときだけ評価済みの値を
+ * スタックに退避する。関数呼び出しは全てのレジスタを壊すので、必要数を最大とみ
+ * なして先に評価させる。
+ */
+#define TEMP_REGISTER_COUNT 7
+static const char *TempRegisters[TEMP_REGISTER_COUNT] = {"r10", "r11", "r8", "r9", "rcx", "rsi", "rdi"};
+
+static const char *ArgRegsiters[] = {"rdi", "rsi", "rdx", "rcx", "r8", "r9"};
+#define ARG_REGISTER_COUNT (sizeof(ArgRegsiters) / sizeof(ArgRegsiters[0]))
+
+static int gen_expr(NodeId id);
+static void gen_stmt(NodeId id);
+
+static int alloc_register(void) {
+    for (int i = 0; i < TEMP_REGISTER_COUNT; i++) {
+        if (!(ctx->used_registers & 1u << i)) {
+            ctx->used_registers |= 1u << i;
+            return i;
+        }
+    }
+    error_exit("式の評価に使うレジスタが足りません");
+    return -1;
+}
+
+static void free_register(int r) {
+    ctx->used_registers &= ~(1u << r);
+}
+
+static int free_register_count(void) {
+    int count = 0;
+    for (int i = 0; i < TEMP_REGISTER_COUNT; i++) {
+        count += !(ctx->used_registers & 1u << i);
+    }
+    return count;
+}
+
+// スタックへの退避。関数呼び出しの前にスタックを16バイト境界に揃えるため数えておく
+static void push_register(int r) {
+    emit("  push %s\n", TempRegisters[r]);
+    ctx->stack_depth++;
+}
+
+static void pop_register(int r) {
+    emit("  pop %s\n", TempRegisters[r]);
+    ctx->stack_depth--;
+}
 
 /*
- * 与えられたノードが変数を指しているときに、その変数のアドレスを計算して、それ
- * をスタックにプッシュします。
+ * 与えられたノードがローカル変数であることを確かめます。
  * それ以外の場合にはエラーを表示します。これにより`(a+1)=2`のような式が排除さ
  * れることになります。
  */
-void gen_address_to_local_variable(Node *node) {
+static Node *local_variable(NodeId id) {
+    Node *node = node_at(id);
     if (node->kind != ND_LVAR) {
-        error_exit("代入の左辺値が変数ではありません(var)。%s", node_description(node));
+        error_exit("代入の左辺値が変数ではありません(var)。%s", node_description(id));
     }
+    return node;
+}
 
-    // 1. RBPからオフセット分減算する
-    printf("  mov rax, rbp   # var\n");
-    printf("  sub rax, %-4d  # var\n", node->offset);
+/*
+ * 二項演算子の被演算数
+ * rightはポインタの演算のためにscale倍する。(1 + p)のように左手に定数がくる
+ * 場合は左右の役割を入れ替える
+ */
+static void binary_operands(NodeId id, NodeId *left, NodeId *right, int *scale) {
+    Node *node = node_at(id);
+    *scale = node_pointer_scale(id);
+    *left = node->lhs;
+    *right = node->rhs;
+    if (*scale != 1 && node_at(node->lhs)->kind == ND_NUM) {
+        *left = node->rhs;
+        *right = node->lhs;
+    }
+}
 
-    // 2. 結果（変数のアドレス）をスタックに積む
-    printf("  push rax       # var\n");
+// 右手を即値にできるか(定数で、倍した値が32ビットに収まる)
+// 定数での除算もidivを使わずに計算するので即値として扱う
+static bool immediate_operand(NodeId right, int scale, long *value) {
+    if (node_at(right)->kind != ND_NUM) {
+        return false;
+    }
+    *value = (long)node_at(right)->val * scale;
+    return INT32_MIN <= *value && *value <= INT32_MAX;
 }
 
-static const char *ArgRegsiters[] = {"rdi", "rsi", "rdx", "rcx", "r8", "r9"};
+static int combine_need(int a, int b) {
+    const int need = a == b ? a + 1 : MAX(a, b);
+    return MIN(need, TEMP_REGISTER_COUNT);
+}
+
+// 式の評価に必要なレジスタの数(Sethi-Ullman数)
+static int register_need(NodeId id) {
+    if (ctx->register_need[id]) {
+        return ctx->register_need[id];
+    }
+
+    Node *node = node_at(id);
+    int need = 1;
+    switch (node->kind) {
+    case ND_FUN:
+        need = TEMP_REGISTER_COUNT;
+        break;
+    case ND_DEREF:
+        need = register_need(node->rhs);
+        break;
+    case ND_ASSIGN:
+        if (node_at(node->lhs)->kind == ND_DEREF) {
+            need = combine_need(register_need(node_at(node->lhs)->rhs), register_need(node->rhs));
+        } else {
+            need = register_need(node->rhs);
+        }
+        break;
+    default:
+        if (node_is_binary(node->kind)) {
+            NodeId left, right;
+            int scale;
+            long value;
+            binary_operands(id, &left, &right, &scale);
+            if (immediate_operand(right, scale, &value)) {
+                need = register_need(left);
+            } else {
+                need = combine_need(register_need(left), register_need(right));
+            }
+        }
+        break;
+    }
+    ctx->register_need[id] = need;
+    return need;
+}
+
+/*
+ * 2つの式を必要なレジスタの多い方から評価し、それぞれの値のレジスタを返す
+ * 先に評価した値を持ったままでは後の式に足りなければ、その間だけ退避する
+ */
+static void gen_operands(NodeId a, NodeId b, int *out_a, int *out_b) {
+    const bool b_first = register_need(b) > register_need(a);
+    const NodeId first = b_first ? b : a;
+    const NodeId second = b_first ? a : b;
+
+    int r1 = gen_expr(first);
+    int r2;
+    if (free_register_count() < register_need(second)) {
+        push_register(r1);
+        free_register(r1);
+        r2 = gen_expr(second);
+        r1 = alloc_register();
+        pop_register(r1);
+    } else {
+        r2 = gen_expr(second);
+    }
+    *out_a = b_first ? r2 : r1;
+    *out_b = b_first ? r1 : r2;
+}
+
+// 関数の名前に付ける接頭辞。このプログラムで定義していない関数(外部の関数)には付けない
+const char *function_prefix(Symbol sym) {
+    if (ctx->defined_functions && ctx->defined_functions[sym]) {
+        return ctx->symbol_prefix;
+    }
+    return "";
+}
+
+/*
+ * レジスタにある引数を引数レジスタへ移す
+ * 移動先が他の引数の移動元ならその移動を後回しにし、循環していればraxを経由する
+ */
+static void move_arguments(const char **src, int from, int to) {
+    bool done[ARG_REGISTER_COUNT] = {false};
+    int remaining = to - from;
+    while (remaining > 0) {
+        bool progress = false;
+        for (int i = from; i < to; i++) {
+            if (done[i]) {
+                continue;
+            }
+            bool blocked = false;
+            for (int j = from; j < to; j++) {
+                if (j != i && !done[j] && strcmp(src[j], ArgRegsiters[i]) == 0) {
+                    blocked = true;
+                }
+            }
+            if (blocked) {
+                continue;
+            }
+            if (strcmp(src[i], ArgRegsiters[i]) != 0) {
+                emit("  mov %s, %s\n", ArgRegsiters[i], src[i]);
+            }
+            done[i] = true;
+            remaining--;
+            progress = true;
+        }
+        if (!progress) {
+            for (int i = from; i < to; i++) {
+                if (!done[i]) {
+                    emit("  mov rax, %s\n", src[i]);
+                    src[i] = "rax";
+                    break;
+                }
+            }
+        }
+    }
+}
 
-void gen_fun(Node *node) {
-    static char buffer[1024];
+static int gen_fun(Node *node) {
+    const int n = list_len(node->block);
+    if (n > (int)ARG_REGISTER_COUNT) {
+        error_exit("引数が多すぎます: %s", symbol_name(node->ident));
+    }
+
+    // 評価中の値は呼び出しで壊れるので退避する
+    const unsigned int saved = ctx->used_registers;
+    for (int i = 0; i < TEMP_REGISTER_COUNT; i++) {
+        if (saved & 1u << i) {
+            push_register(i);
+        }
+    }
+    ctx->used_registers = 0;
 
-    for (int i = 0; i < node->block->len; ++i) {
-        GenResult result = gen_impl((Node *)node->block->data[i]);
-        assert(result == GEN_PUSHED_RESULT);
-        printf("  pop rax\n");
-        printf("  mov %s, rax\n", ArgRegsiters[i]);
+    // 引数を順に評価してレジスタに置く。次の引数にレジスタが足りなければ、
+    // それまでの引数をスタックに退避する(退避するのは常に先頭からの連続した引数)
+    int args[ARG_REGISTER_COUNT];
+    int spilled = 0;
+    for (int i = 0; i < n; i++) {
+        const NodeId arg = list_at(node->block, i);
+        if (free_register_count() < register_need(arg)) {
+            for (; spilled < i; spilled++) {
+                push_register(args[spilled]);
+                free_register(args[spilled]);
+            }
+        }
+        args[i] = gen_expr(arg);
+    }
+    const char *src[ARG_REGISTER_COUNT];
+    for (int i = spilled; i < n; i++) {
+        src[i] = TempRegisters[args[i]];
     }
+    move_arguments(src, spilled, n);
+    for (int i = spilled - 1; i >= 0; i--) {
+        emit("  pop %s\n", ArgRegsiters[i]);
+        ctx->stack_depth--;
+    }
+    ctx->used_registers = 0;
 
-    size_t len = MIN(node->identLength,
-                  sizeof(buffer) / sizeof(buffer[0]) - 1);
-    memcpy(buffer, node->ident, len);
-    buffer[len] = '\0';
-    printf("  call _%s\n", buffer); // RIPをスタックに置いてlabelにジャンプ
+    // 呼び出し先にはスタックを16バイト境界に揃えて渡す
+    const bool align = ctx->stack_depth % 2 != 0;
+    if (align) {
+        emit("  sub rsp, 8\n");
+    }
+    emit("  call _%s%s\n", function_prefix(node->ident), symbol_name(node->ident)); // RIPをスタックに置いてlabelにジャンプ
+    if (align) {
+        emit("  add rsp, 8\n");
+    }
+
+    ctx->used_registers = saved;
+    const int r = alloc_register();
+    emit("  mov %s, rax\n", TempRegisters[r]);
+    for (int i = TEMP_REGISTER_COUNT - 1; i >= 0; i--) {
+        if (saved & 1u << i) {
+            pop_register(i);
+        }
+    }
+    return r;
 }
 
 void gen_fun_impl(Node *node) {
-    static char name[1024];
-    size_t len = MIN(node->identLength,
-                  sizeof(name) / sizeof(name[0]) - 1);
-    memcpy(name, node->ident, len);
-    name[len] = '\0';
+    const char *name = symbol_name(node->ident);
 
     // 関数ラベル
-    printf("_%s:\n", name);
+    emit("_%s%s:\n", ctx->symbol_prefix, name);
 
-    const bool is_main = (strcmp(name, "main") == 0);
-    const int slots = node->block->len + 1; // +1はベースポインタ格納分
 
     // プロローグ
-    printf("  push rbp      # prologue\n");
-    printf("  mov rbp, rsp  # prologue\n");
-    printf("  xor eax, eax  # prologue\n"); // mov eax, 0 と同じ
+    emit("  push rbp      # prologue\n");
+    emit("  mov rbp, rsp  # prologue\n");
+    emit("  xor eax, eax  # prologue\n"); // mov eax, 0 と同じ
 
-    const int stack_size = is_main ? 256 : (slots * 8);
-    printf("  sub rsp, %-4d # prologue\n", stack_size); // スタックサイズ
+    const int stack_size = (node->frame_size + 15) / 16 * 16; // 16バイト境界に揃える
+    emit("  sub rsp, %-4d # prologue\n", stack_size); // スタックサイズ
+    ctx->used_registers = 0;
+    ctx->stack_depth = 0;
 
     // 仮引数部分
-    for (int i = 0; i < node->block->len; ++i) {
-        Node *arg = (Node *)node->block->data[i];
+    for (int i = 0; i < list_len(node->block); ++i) {
+        Node *arg = node_at(list_at(node->block, i));
         if (arg->kind != ND_LVAR)
-            error_exit("代入の左辺値が変数ではありません(args)。%s", node_description(arg));
-        printf("  mov qword ptr [rbp - %d], %s  # argument %d\n", arg->offset, ArgRegsiters[i], i);
+            error_exit("代入の左辺値が変数ではありません(args)。%s", node_description(list_at(node->block, i)));
+        emit("  mov qword ptr [rbp - %d], %s  # argument %d\n", arg->offset, ArgRegsiters[i], i);
     }
 
-    // ブロック部分: node->lhsにはND_BLOCKが格納されている
-    for (int i = 0; i < node->lhs->block->len; ++i) {
-        GenResult resutl = gen_impl(node->lhs->block->data[i]);
+    // ブロック部分: node->bodyにはND_BLOCKが格納されている
+    const ListId body = node_at(node->body)->block;
+    for (int i = 0; i < list_len(body); ++i) {
+        gen_stmt(list_at(body, i));
     }
 
     // エピローグ
-    printf("  pop rbp  # epilogue\n");
-    printf("  ret      # epilogue\n");
+    emit("  mov rsp, rbp  # epilogue\n");
+    emit("  pop rbp       # epilogue\n");
+    emit("  ret           # epilogue\n");
+}
+
+// 関数定義ノードのキャッシュのキーを探す。なければ偽を返す
+static bool find_function_key(NodeId id, uint64_t *out_key) {
+    int lo = 0, hi = ctx->function_keys_len;
+    while (lo < hi) {
+        const int mid = (lo + hi) / 2;
+        if (ctx->function_keys[mid].node < id) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    if (lo < ctx->function_keys_len && ctx->function_keys[lo].node == id) {
+        *out_key = ctx->function_keys[lo].key;
+        return true;
+    }
+    return false;
+}
+
+// 関数の出力を覗き穴最適化するフィルタ
+static const char *peephole_filter(void *arg, const char *text, size_t *len) {
+    return peephole(text, len, arg);
+}
+
+/*
+ * キャッシュと覗き穴最適化を通した関数実装
+ * キャッシュにあればその出力を使う。なければコード生成して、覗き穴最適化をした
+ * 出力をキャッシュに保存する
+ */
+static void gen_fun_impl_cached(NodeId id) {
+    uint64_t key;
+    const bool cached = ctx->cache_dir && find_function_key(id, &key);
+    if (cached && cache_emit(ctx->cache_dir, key, &ctx->label_sequence_no, &ctx->cache_stats)) {
+        return;
+    }
+
+    const long label_base = ctx->label_sequence_no;
+    if (cached) {
+        emit_capture_begin();
+    }
+    if (ctx->peephole) {
+        emit_filter_begin(peephole_filter, &ctx->peephole_stats);
+    }
+    if (ctx->ir) {
+        gen_fun_impl_ir(id);
+    } else {
+        gen_fun_impl(node_at(id));
+    }
+    if (ctx->peephole) {
+        emit_filter_end();
+    }
+    if (cached) {
+        size_t len;
+        const char *text = emit_capture_end(&len);
+        cache_store(ctx->cache_dir, key, text, len,
+                    label_base, ctx->label_sequence_no - label_base, &ctx->cache_stats);
+    }
+}
+
+/*
+ * 強度低減
+ * 定数倍と定数での除算を、imulやidivより速いシフト・lea・上位の乗算にする
+ */
+
+// 2のべき乗ならその指数を、そうでなければ-1を返す
+static int exact_log2(long value) {
+    if (value <= 0 || (value & (value - 1))) {
+        return -1;
+    }
+    return __builtin_ctzl(value);
+}
+
+// ポインタの演算のために右手のレジスタをscale(4か8)倍する
+static void gen_scale(int r, int scale) {
+    emit("  shl %s, %d  # Compute pointer\n", TempRegisters[r], exact_log2(scale));
+}
+
+/*
+ * regをvalue倍する
+ * 2のべき乗はshl、3, 5, 9倍はlea、それらの2のべき乗倍はleaとshlにし、負の数は
+ * 最後に符号を反転する。それ以外はimulのままにする
+ */
+void gen_multiply_constant(const char *reg, long value) {
+    const long magnitude = value < 0 ? -value : value;
+    const int shift = magnitude ? __builtin_ctzl(magnitude) : 0; // 0倍(f() * 0)はimulのまま
+    const long odd = magnitude >> shift;
+    if (odd == 3 || odd == 5 || odd == 9) {
+        emit("  lea %s, [%s + %s*%ld]\n", reg, reg, reg, odd - 1);
+    } else if (odd != 1) {
+        emit("  imul %s, %ld\n", reg, value);
+        return;
+    }
+    if (shift) {
+        emit("  shl %s, %d\n", reg, shift);
+    }
+    if (value < 0) {
+        emit("  neg %s\n", reg);
+    }
+}
+
+/*
+ * 2のべき乗でない2以上の除数dで割るための魔法数(2^(64+shift) / dを切り上げた
+ * 値の下位64ビット)を求める(Hacker's Delight 10-1の64ビット版)
+ * 魔法数が2^63以上のときは符号付きでは負になるので、積に被除数を足して補う
+ */
+static void signed_magic(uint64_t d, int64_t *magic, int *shift) {
+    const uint64_t two63 = 1ull << 63;
+    const uint64_t anc = two63 - 1 - two63 % d; // |nc|: 割った余りがd-1になる最大の被除数
+    int p = 63;
+    uint64_t q1 = two63 / anc, r1 = two63 - q1 * anc;
+    uint64_t q2 = two63 / d, r2 = two63 - q2 * d;
+    uint64_t delta;
+    do {
+        p++;
+        q1 *= 2;
+        r1 *= 2;
+        if (r1 >= anc) {
+            q1++;
+            r1 -= anc;
+        }
+        q2 *= 2;
+        r2 *= 2;
+        if (r2 >= d) {
+            q2++;
+            r2 -= d;
+        }
+        delta = d - r2;
+    } while (q1 < delta || (q1 == delta && r1 == 0));
+    *magic = (int64_t)(q2 + 1);
+    *shift = p - 64;
+}
+
+/*
+ * regを定数valueで割る(0方向に切り捨てる)
+ * - 2^kなら負の数のときだけ2^k-1を足してから算術シフトする
+ * - それ以外は魔法数との積の上位64ビット(rdx)をシフトし、負の数なら1を足す
+ * 除数が負なら|value|で割ってから符号を反転する。rax, rdxを壊す
+ */
+void gen_divide_constant(const char *reg, long value) {
+    const unsigned long magnitude = value < 0 ? 0 - (unsigned long)value : (unsigned long)value;
+    const int k = exact_log2(magnitude);
+    if (k == 0) {
+        // 1で割る
+    } else if (k > 0) {
+        emit("  mov rax, %s  # Division by 2^%d\n", reg, k);
+        if (k > 1) {
+            emit("  sar rax, 63\n");
+        }
+        emit("  shr rax, %d\n", 64 - k);
+        emit("  add %s, rax\n", reg);
+        emit("  sar %s, %d\n", reg, k);
+    } else {
+        int64_t magic;
+        int shift;
+        signed_magic(magnitude, &magic, &shift);
+        emit("  mov rax, %ld  # Division by %ld\n", (long)magic, (long)magnitude);
+        emit("  imul %s\n", reg);
+        if (magic < 0) {
+            emit("  add rdx, %s\n", reg);
+        }
+        if (shift) {
+            emit("  sar rdx, %d\n", shift);
+        }
+        emit("  mov rax, %s\n", reg);
+        emit("  shr rax, 63\n");
+        emit("  add rdx, rax\n");
+        emit("  mov %s, rdx\n", reg);
+    }
+    if (value < 0) {
+        emit("  neg %s\n", reg);
+    }
 }
 
-static int nested = 0;
+/*
+ * 二項演算子
+ * 左手の値のレジスタに結果を入れて返す。右手が定数なら即値にする
+ */
+static int gen_binary(NodeId id) {
+    Node *node = node_at(id);
+    NodeId left, right;
+    int scale;
+    long value;
+    binary_operands(id, &left, &right, &scale);
+
+    int rl, rr = -1;
+    char rhs[32];
+    if (immediate_operand(right, scale, &value)) {
+        rl = gen_expr(left);
+        snprintf(rhs, sizeof(rhs), "%ld", value);
+    } else {
+        gen_operands(left, right, &rl, &rr);
+        // ポインタの演算のために右手をデータサイズ倍する。加算ならleaで倍しながら足す
+        if (scale != 1 && node->kind != ND_ADD) {
+            gen_scale(rr, scale);
+        }
+        snprintf(rhs, sizeof(rhs), "%s", TempRegisters[rr]);
+    }
+    const char *lhs = TempRegisters[rl];
+
+    switch (node->kind) {
+    case ND_ADD:
+        if (rr >= 0 && scale != 1) {
+            emit("  lea %s, [%s + %s*%d]  # Compute pointer\n", lhs, lhs, rhs, scale);
+        } else {
+            emit("  add %s, %s\n", lhs, rhs);
+        }
+        break;
+    case ND_SUB:
+        emit("  sub %s, %s\n", lhs, rhs);
+        break;
+    case ND_MUL:
+        if (rr < 0) {
+            gen_multiply_constant(lhs, value);
+        } else {
+            emit("  imul %s, %s\n", lhs, rhs);
+        }
+        break;
+    case ND_DIV:
+        if (rr < 0) {
+            gen_divide_constant(lhs, value);
+            break;
+        }
+        emit("  mov rax, %s  # Division\n", lhs);
+        emit("  cqo\n");
+        emit("  idiv %s\n", rhs);
+        emit("  mov %s, rax\n", lhs);
+        break;
+    case ND_GREATER:
+        emit("  cmp %s, %s\n", lhs, rhs);
+        emit("  setl al\n");
+        emit("  movzx %s, al\n", lhs);
+        break;
+    case ND_GREATER_EQUAL:
+        emit("  cmp %s, %s\n", lhs, rhs);
+        emit("  setle al\n");
+        emit("  movzx %s, al\n", lhs);
+        break;
+    case ND_EQUAL:
+        emit("  cmp %s, %s\n", lhs, rhs);
+        emit("  sete al\n");
+        emit("  movzx %s, al\n", lhs);
+        break;
+    case ND_NOT_EQUAL:
+        emit("  cmp %s, %s\n", lhs, rhs);
+        emit("  setne al\n");
+        emit("  movzx %s, al\n", lhs);
+        break;
+    default:
+        break;
+        // through
+    }
+
+    if (rr >= 0) {
+        free_register(rr);
+    }
+    return rl;
+}
 
-GenResult gen_impl(Node *node) {
-    static int label_sequence_no = 0;
-    GenResult result;
+/*
+ * 式の値をレジスタに求め、そのレジスタ(TempRegistersの添字)を返す
+ * 返したレジスタは使い終わったらfree_register()で返す
+ */
+static int gen_expr(NodeId id) {
+    Node *node = node_at(id);
+    int r, ra;
 
-    D("%s, nested=%d", node_description(node), nested);
-    nested++;
+    TRACE(TRACE_CODEGEN, 2, "%s nested=%d", node_description(id), ctx->nested);
+    ctx->nested++;
 
     switch (node->kind) {
     case ND_NUM:
-        printf("  push %-4d      # constant\n", node->val);
-        nested--;
-        return GEN_PUSHED_RESULT;
+        r = alloc_register();
+        emit("  mov %s, %d\n", TempRegisters[r], node->val);
+        break;
     case ND_LVAR:
-        printf("  # variable {{{ type=%s\n", type_description(node->type));
-        /*
-         * 変数の参照
-         * - 左辺の変数のアドレスをスタックに置く ~ gen_address_to_local_variable()
-         * - 配列ではない場合に限り...
-         *  * スタックをポップする
-         *  * その値をアドレスとみなし参照先の値を取得する)
-         *  - 配列は"初期化済のポインタ変数"なので特別扱いする
-         */
-        gen_address_to_local_variable(node);
-        if (node->type->type != ARRAY) {
-            printf("  pop rax        # var(outside)\n");
-            printf("  mov rax, [rax] # var(outside)\n");
-            printf("  push rax       # var(outside)\n");
+        // 配列は"初期化済のポインタ変数"なので先頭のアドレスを値とする
+        r = alloc_register();
+        if (node->type->type == ARRAY) {
+            emit("  lea %s, [rbp - %d]  # variable %s\n", TempRegisters[r], node->offset, type_description(node->type));
+        } else {
+            emit("  mov %s, [rbp - %d]  # variable %s\n", TempRegisters[r], node->offset, type_description(node->type));
         }
-        printf("  # }}} variable\n");
-        nested--;
-        return GEN_PUSHED_RESULT;
-
+        break;
     case ND_GLOBAL_VAR: // TODO
-        return GEN_DONT_PUSHED_RESULT;
-
+        error_exit("グローバル変数の参照は未対応です。%s", node_description(id));
+        r = -1;
+        break;
     case ND_ASSIGN:
-        printf("  # Assign {{{\n");
         /*
          * 変数への代入
-         * - 左辺の変数のアドレスをスタックに置く ~ gen_address_to_local_variable()
-         * - 右辺を評価し結果をスタックに置く ~ gen_impl()
-         * - スタックをポップし右辺値をrbxへ
-         * - スタックをポップし変数アドレスをraxへ
-         * - raxアドレスにrbx値を書く
-         * - rbx値をスタックに置く
+         * - 右辺を評価して左辺の変数(またはデリファレンスしたアドレス)に書く
+         * - 右辺の値を式の値とする
          */
-        switch (node->lhs->kind) {
+        switch (node_at(node->lhs)->kind) {
         case ND_DEREF:
-            // 直接rhsをコード生成するのがミソ
-            gen_impl(node->lhs->rhs);
+            // デリファレンスの中の式をアドレスとして評価するのがミソ
+            gen_operands(node_at(node->lhs)->rhs, node->rhs, &ra, &r);
+            emit("  mov [%s], %s  # assign\n", TempRegisters[ra], TempRegisters[r]);
+            free_register(ra);
             break;
         case ND_LVAR:
-            // スタックにLHSのアドレスを入れたままにしておく
-            gen_address_to_local_variable(node->lhs);
+            r = gen_expr(node->rhs);
+            emit("  mov [rbp - %d], %s  # assign\n", node_at(node->lhs)->offset, TempRegisters[r]);
             break;
         default:
             error_exit("代入の左辺値は変数またはデリファレンス演算子でなければなりません。%s", node_description(node->lhs));
+            r = -1;
             break;
         }
-        result = gen_impl(node->rhs); // スタックに右辺の評価結果が積まれている
-        assert(result == GEN_PUSHED_RESULT); // ここでのgen_implは必ずスタックに結果をプッシュしなければならない
-        printf("  pop rbx        # assign\n"); // 右辺(の結果)
-        printf("  pop rax        # assign\n"); // 左辺(のアドレス)
-        printf("  mov [rax], rbx # assign\n"); // 左辺(のアドレス)に右辺の値をいれる
-        printf("  push rbx       # assign\n"); // 右辺の値をスタックに積む
-        printf("  # }}} Assign\n");
-        nested--;
-        return GEN_PUSHED_RESULT;
-
-    case ND_RETURN:
-        printf("  # return {{{\n");
-        /*
-         * return文
-         * - gen_impl()の結果はスタックに置かれる
-         * - スタックポップしてraxに
-         * - 関数からリターンする
-         */
-        result = gen_impl(node->lhs);
-        assert(result == GEN_PUSHED_RESULT); // ここでのgen_implは必ずスタックに結果をプッシュしなければならない
-        printf("  pop rax      # epilogue\n"); // 戻り値をRAXにいれる
-        printf("  mov rsp, rbp # epilogue\n"); // スタックポインタを復帰
-        printf("  pop rbp      # epilogue\n"); // ベースポインタを復帰する
-        printf("  ret          # epilogue\n"); // スタックをポップしてそのアドレスにジャンプ
-        nested--;
-        printf("  # }}} return\n");
-        return GEN_DONT_PUSHED_RESULT;
-
-    case ND_IF:
-        printf("  # If {{{\n");
-        gen_impl(node->condition);
-        printf("  pop rax    # condition\n");
-        printf("  cmp rax, 0 # condition\n");
-        if (node->rhs) {
-            // elseがある場合
-            printf("  je .Lelse%08d\n", label_sequence_no);
-            gen_impl(node->lhs);
-            printf("  jmp .Lend%08d\n", label_sequence_no);
-            printf(".Lelse%08d:\n", label_sequence_no);
-            gen_impl(node->rhs);
-            printf(".Lend%08d:\n", label_sequence_no);
-        } else {
-            // elseがない場合
-            printf("  je .Lend%08d\n", label_sequence_no);
-            gen_impl(node->lhs);
-            printf(".Lend%08d:\n", label_sequence_no);
-        }
-        label_sequence_no++;
-        nested--;
-        printf("  # }}} If\n");
-        return GEN_PUSHED_RESULT;
-    case ND_WHILE:
-        printf(".Lbegin%08d:\n", label_sequence_no);
-        gen_impl(node->condition);
-        printf("  pop rax\n");
-        printf("  cmp rax, 0\n");
-        printf("  je .Lend%08d\n", label_sequence_no);
-        gen_impl(node->lhs);
-        printf("  jmp .Lbegin%08d\n", label_sequence_no);
-        printf(".Lend%08d:\n", label_sequence_no);
-        label_sequence_no++;
-        nested--;
-        return GEN_PUSHED_RESULT;
-    case ND_FOR:
-        if (node->block->data[0]) {
-            gen_impl(node->block->data[0]);
-        }
-        printf(".Lbegin%08d:\n", label_sequence_no);
-        if (node->block->data[1]) {
-            gen_impl(node->block->data[1]);
-        }
-        printf("  pop rax\n");
-        printf("  cmp rax, 0\n");
-        printf("  je .Lend%08d\n", label_sequence_no);
-        gen_impl(node->lhs);
-        if (node->block->data[2]) {
-            gen_impl(node->block->data[2]);
-        }
-        printf("  jmp .Lbegin%08d\n", label_sequence_no);
-        printf(".Lend%08d:\n", label_sequence_no);
-        label_sequence_no++;
-        nested--;
-        return GEN_PUSHED_RESULT;
-    case ND_BLOCK:
-        for (int i = 0; i < node->block->len; ++i) {
-            gen_impl(node->block->data[i]);
-        }
-        nested--;
-        return GEN_PUSHED_RESULT;
+        break;
     case ND_FUN:
-        printf("  # Function Calling {{{\n");
-        /*
-         * 関数呼び出し
-         * - 関数へのジャンプを生成する
-         * - 戻り値が格納されているRAXをスタックに積む
-         */
-        gen_fun(node);
-        printf("  push rax # Return value\n");
-        nested--;
-        printf("  # }}} Function Calling\n");
-        return GEN_PUSHED_RESULT;
-    case ND_FUN_IMPL:
-        printf("  # Function Implementation {{{\n");
-        /*
-         * 関数実装
-         * - 関数の本体コードを生成する
-         * - 評価結果はない
-         */
-        gen_fun_impl(node);
-        nested--;
-        printf("  # }}} Function Implementation\n");
-        return GEN_DONT_PUSHED_RESULT;
+        r = gen_fun(node);
+        break;
     case ND_ADDR:
-        printf("  # Address {{{\n");
-        gen_address_to_local_variable(node->rhs);
-        nested--;
-        printf("  # }}} Address\n");
-        return GEN_PUSHED_RESULT;
+        r = alloc_register();
+        emit("  lea %s, [rbp - %d]  # address\n", TempRegisters[r], local_variable(node->rhs)->offset);
+        break;
     case ND_DEREF:
-        printf("  # Dereference {{{\n");
-        gen_impl(node->rhs); // 右辺値としてコンパイルする
-        printf("  pop rax         # dereference(outside)\n");
-        printf("  mov rax, [rax]  # dereference(outside)\n");
-        printf("  push rax        # dereference(outside)\n");
-        printf("  # }}} Dereference\n");
-        nested--;
-        return GEN_PUSHED_RESULT;
+        r = gen_expr(node->rhs); // 右辺値としてコンパイルする
+        emit("  mov %s, [%s]  # dereference\n", TempRegisters[r], TempRegisters[r]);
+        break;
     default:
+        if (!node_is_binary(node->kind)) {
+            error_exit("式ではありません。%s", node_description(id));
+        }
+        r = gen_binary(id);
         break;
-        // through
     }
 
-    /*
-     * 二項演算子系
-     */ 
-    int ptr_offset = 1;
-    if (node_hands_is_treat_pointer(node)) {
-        ptr_offset = 4; // int* のとき
-        if (node_hands_is_pointer_variable_many(node)) {
-            ptr_offset = 8; // int **以上の時
-        }
+    ctx->nested--;
+    return r;
+}
+
+/*
+ * 条件式が偽のとき".L<label><no>"へ分岐する
+ * 比較演算子なら値を作らずにcmpと条件分岐にする
+ */
+static void gen_jump_if_false(NodeId cond, const char *label, long no) {
+    const char *jump = NULL;
+    switch (node_at(cond)->kind) {
+    case ND_GREATER: jump = "jge"; break;
+    case ND_GREATER_EQUAL: jump = "jg"; break;
+    case ND_EQUAL: jump = "jne"; break;
+    case ND_NOT_EQUAL: jump = "je"; break;
+    default: break;
+    }
+    if (!jump) {
+        const int r = gen_expr(cond);
+        emit("  cmp %s, 0  # condition\n", TempRegisters[r]);
+        emit("  je .L%s%08ld\n", label, no);
+        free_register(r);
+        return;
     }
 
-    // (1 + p)のように左手に定数がくる場合は処理順を逆にする
-    // 後続のptr_offset計算のため
-    if (ptr_offset != 1 && node->lhs->kind == ND_NUM) {
-        gen_impl(node->rhs);
-        gen_impl(node->lhs);
+    NodeId left, right;
+    int scale;
+    long value;
+    binary_operands(cond, &left, &right, &scale);
+    if (immediate_operand(right, scale, &value)) {
+        const int rl = gen_expr(left);
+        emit("  cmp %s, %ld  # condition\n", TempRegisters[rl], value);
+        free_register(rl);
     } else {
-        gen_impl(node->lhs);
-        gen_impl(node->rhs);
+        int rl, rr;
+        gen_operands(left, right, &rl, &rr);
+        if (scale != 1) {
+            gen_scale(rr, scale);
+        }
+        emit("  cmp %s, %s  # condition\n", TempRegisters[rl], TempRegisters[rr]);
+        free_register(rl);
+        free_register(rr);
     }
+    emit("  %s .L%s%08ld\n", jump, label, no);
+}
 
-    // スタックに積まれている非演算数を取り出す
-    printf("  pop rdi       # binary operator\n"); // 右手
-    printf("  pop rax       # binary operator\n"); // 左手
+// 文を生成する。式文の値は捨てる
+static void gen_stmt(NodeId id) {
+    Node *node = node_at(id);
+    long no;
 
-    // ポインタの演算のために右手(rdi)をデータサイズ倍する
-    printf("  mov rbx, %-4d # Compute pointer\n", ptr_offset);
-    printf("  imul rdi, rbx # Compute pointer\n"); // rdi = rdi * rbx
+    TRACE(TRACE_CODEGEN, 2, "%s nested=%d", node_description(id), ctx->nested);
+    ctx->nested++;
 
+    // 制御文のラベルの番号は入れ子の文と重ならないよう、本体より先に取る
     switch (node->kind) {
-    case ND_ADD:
-        printf("  add rax, rdi  # Addition\n");
+    case ND_RETURN: {
+        emit("  # return {{{\n");
+        const int r = gen_expr(node->lhs);
+        emit("  mov rax, %s  # epilogue\n", TempRegisters[r]); // 戻り値をRAXにいれる
+        emit("  mov rsp, rbp # epilogue\n"); // スタックポインタを復帰
+        emit("  pop rbp      # epilogue\n"); // ベースポインタを復帰する
+        emit("  ret          # epilogue\n"); // スタックをポップしてそのアドレスにジャンプ
+        free_register(r);
+        emit("  # }}} return\n");
         break;
-    case ND_SUB:
-        printf("  sub rax, rdi  # Subtraction\n");
-        break;
-    case ND_MUL:
-        printf("  imul rdi      # Multiplication\n");
+    }
+    case ND_IF:
+        emit("  # If {{{\n");
+        no = ctx->label_sequence_no++;
+        if (node->rhs) {
+            // elseがある場合
+            gen_jump_if_false(node->condition, "else", no);
+            gen_stmt(node->lhs);
+            emit("  jmp .Lend%08ld\n", no);
+            emit(".Lelse%08ld:\n", no);
+            gen_stmt(node->rhs);
+            emit(".Lend%08ld:\n", no);
+        } else {
+            // elseがない場合
+            gen_jump_if_false(node->condition, "end", no);
+            gen_stmt(node->lhs);
+            emit(".Lend%08ld:\n", no);
+        }
+        emit("  # }}} If\n");
         break;
-    case ND_DIV:
-        printf("  cqo           # Division\n");
-        printf("  idiv rdi      # Division\n");
+    case ND_WHILE:
+        no = ctx->label_sequence_no++;
+        emit(".Lbegin%08ld:\n", no);
+        if (node->condition) {
+            gen_jump_if_false(node->condition, "end", no);
+        }
+        gen_stmt(node->lhs);
+        emit("  jmp .Lbegin%08ld\n", no);
+        emit(".Lend%08ld:\n", no);
         break;
-    case ND_GREATER:
-        printf("  cmp rax, rdi  # Greator\n");
-        printf("  setl al       # Greator\n");
-        printf("  movzx rax, al # Greator\n");
+    case ND_FOR:
+        no = ctx->label_sequence_no++;
+        if (list_at(node->block, 0)) {
+            gen_stmt(list_at(node->block, 0));
+        }
+        emit(".Lbegin%08ld:\n", no);
+        if (list_at(node->block, 1)) {
+            gen_jump_if_false(list_at(node->block, 1), "end", no);
+        }
+        gen_stmt(node->body);
+        if (list_at(node->block, 2)) {
+            gen_stmt(list_at(node->block, 2));
+        }
+        emit("  jmp .Lbegin%08ld\n", no);
+        emit(".Lend%08ld:\n", no);
         break;
-    case ND_GREATER_EQUAL:
-        printf("  cmp rax, rdi  # Greator Equal\n");
-        printf("  setle al      # Greator Equal\n");
-        printf("  movzx rax, al # Greator Equal\n");
+    case ND_BLOCK:
+        for (int i = 0; i < list_len(node->block); ++i) {
+            gen_stmt(list_at(node->block, i));
+        }
         break;
-    case ND_EQUAL:
-        printf("  cmp rax, rdi  # Equal\n");
-        printf("  sete al       # Equal\n");
-        printf("  movzx rax, al # Equal\n");
+    case ND_GLOBAL_VAR: // TODO: グローバル変数の宣言は領域をまだ確保しない
         break;
-    case ND_NOT_EQUAL:
-        printf("  cmp rax, rdi  # Not equal\n");
-        printf("  setne al      # Not equal\n");
-        printf("  movzx rax, al # Not equal\n");
+    case ND_FUN_IMPL:
+        emit("  # Function Implementation {{{\n");
+        gen_fun_impl_cached(id);
+        emit("  # }}} Function Implementation\n");
         break;
     default:
+        free_register(gen_expr(id));
         break;
-        // through
     }
 
-    printf("  push rax  # gen_impl's LAST\n");
-    nested--;
-    return GEN_PUSHED_RESULT;
+    ctx->nested--;
+}
+
+void gen(NodeId node) {
+    ctx->nested = 0;
+    gen_stmt(node);
 }
 
-GenResult gen(Node *node) {
-    nested = 0;
-    return gen_impl(node);
+/**
+ * プログラム全体(トップレベルの文の並び)のアセンブリを出力する
+ * ctx->symbol_prefixが空でなければ、このプログラムで定義した関数の名前に付ける
+ */
+void gen_program(void) {
+    if (ctx->symbol_prefix[0]) {
+        ctx->defined_functions = arena_alloc(ctx->codegen_arena, sizeof(bool) * (symbol_count() + 1));
+        for (int i = 0; i < list_len(ctx->code); i++) {
+            Node *node = node_at(list_at(ctx->code, i));
+            if (node->kind == ND_FUN_IMPL) {
+                ctx->defined_functions[node->ident] = true;
+            }
+        }
+    }
+    if (ctx->dump_ir) {
+        dump_ir_program();
+        return;
+    }
+    ctx->register_need = arena_alloc(ctx->codegen_arena, ctx->ast.count + 1);
+    memset(ctx->register_need, 0, ctx->ast.count + 1);
+
+    // アセンブリの前半部分を出力
+    emit(".intel_syntax noprefix\n");
+    emit(".global _%smain\n", ctx->symbol_prefix);
+
+    // 先頭の式から順にコード生成
+    for (int i = 0; i < list_len(ctx->code); i++) {
+        NodeId node = list_at(ctx->code, i);
+        TRACE(TRACE_CODEGEN, 1, "%s", node_description(node));
+        gen(node);
+    }
 }
@@ -0,0 +1,46 @@
+#include "9cc.h"
+
+// このスレッドの現在のコンテキスト
+_Thread_local Compiler *ctx;
+
+/**
+ * コンテキストを初期化してこのスレッドの現在のコンテキストにする
+ * 入力はまだ読み込まない(load_source()で読む)
+ */
+void compiler_enter(Compiler *compiler, char *input) {
+    *compiler = (Compiler){0};
+    compiler->input = input;
+    compiler->symbol_prefix = "";
+    compiler->peephole = true;
+    compiler->token_arena = new_arena("token");
+    compiler->parse_arena = new_arena("parse");
+    compiler->codegen_arena = new_arena("codegen");
+    compiler->ir_arena = new_arena("ir");
+    ctx = compiler;
+}
+
+/**
+ * 現在のコンテキストが持つ資源をすべて解放する
+ * シンボルと型もこのスレッドのコンパイルが終わった時点で不要になるので解放する
+ */
+void compiler_leave(void) {
+    release_source();
+    release_ast();
+    if (ctx->object) {
+        release_object(ctx->object);
+    }
+    free(ctx->global_variables);
+    free(ctx->function_keys);
+    arena_release(ctx->token_arena);
+    arena_release(ctx->parse_arena);
+    arena_release(ctx->codegen_arena);
+    arena_release(ctx->ir_arena);
+    free(ctx->token_arena);
+    free(ctx->parse_arena);
+    free(ctx->codegen_arena);
+    free(ctx->ir_arena);
+    release_symbols();
+    release_types();
+    release_peephole();
+    ctx = NULL;
+}
@@ -0,0 +1,251 @@
+#include "9cc.h"
+#include "asm.h"
+#include <unistd.h>
+
+/*
+ * ELF64の再配置可能オブジェクト(.o)の書き出し
+ * macOSでもビルドできるように<elf.h>は使わず、必要な構造体だけ定義する。
+ * セクションは次の7つで、ファイル上もこの順に並べる。
+ *   0: なし, 1: .text, 2: .rela.text, 3: .symtab, 4: .strtab, 5: .shstrtab,
+ *   6: .note.GNU-stack(スタックを実行可能にしないという印)
+ */
+
+typedef struct {
+    unsigned char e_ident[16];
+    uint16_t e_type;
+    uint16_t e_machine;
+    uint32_t e_version;
+    uint64_t e_entry;
+    uint64_t e_phoff;
+    uint64_t e_shoff;
+    uint32_t e_flags;
+    uint16_t e_ehsize;
+    uint16_t e_phentsize;
+    uint16_t e_phnum;
+    uint16_t e_shentsize;
+    uint16_t e_shnum;
+    uint16_t e_shstrndx;
+} ElfHeader;
+
+typedef struct {
+    uint32_t sh_name;
+    uint32_t sh_type;
+    uint64_t sh_flags;
+    uint64_t sh_addr;
+    uint64_t sh_offset;
+    uint64_t sh_size;
+    uint32_t sh_link;
+    uint32_t sh_info;
+    uint64_t sh_addralign;
+    uint64_t sh_entsize;
+} ElfSection;
+
+typedef struct {
+    uint32_t st_name;
+    unsigned char st_info;
+    unsigned char st_other;
+    uint16_t st_shndx;
+    uint64_t st_value;
+    uint64_t st_size;
+} ElfSymbol;
+
+typedef struct {
+    uint64_t r_offset;
+    uint64_t r_info;
+    int64_t r_addend;
+} ElfRela;
+
+enum {
+    SECTION_TEXT = 1,
+    SECTION_RELA,
+    SECTION_SYMTAB,
+    SECTION_STRTAB,
+    SECTION_SHSTRTAB,
+    SECTION_NOTE,
+    SECTION_COUNT,
+};
+
+#define SHT_PROGBITS 1
+#define SHT_SYMTAB 2
+#define SHT_STRTAB 3
+#define SHT_RELA 4
+#define SHF_ALLOC 0x2
+#define SHF_EXECINSTR 0x4
+#define SHF_INFO_LINK 0x40
+#define STB_LOCAL 0
+#define STB_GLOBAL 1
+#define STT_NOTYPE 0
+#define R_X86_64_PC32 2
+#define R_X86_64_PLT32 4
+
+// 書き出すデータを溜めるバッファ
+typedef struct {
+    char *data;
+    size_t len;
+    size_t capacity;
+} Buffer;
+
+static size_t buffer_put(Buffer *buf, const void *p, size_t n) {
+    if (buf->len + n > buf->capacity) {
+        buf->capacity = (buf->len + n) * 2;
+        buf->data = realloc(buf->data, buf->capacity);
+        if (!buf->data) {
+            error_exit("オブジェクトファイルのメモリを確保できません");
+        }
+    }
+    const size_t offset = buf->len;
+    memcpy(buf->data + offset, p, n);
+    buf->len += n;
+    return offset;
+}
+
+// 文字列表に名前を追加してその位置を返す
+static uint32_t put_string(Buffer *strtab, const char *s) {
+    return buffer_put(strtab, s, strlen(s) + 1);
+}
+
+static void put_align(Buffer *buf, size_t align) {
+    static const char zeros[16];
+    buffer_put(buf, zeros, (align - buf->len % align) % align);
+}
+
+static void write_all(int fd, const void *p, size_t n) {
+    const char *s = p;
+    while (n > 0) {
+        const ssize_t written = write(fd, s, n);
+        if (written <= 0) {
+            error_exit("オブジェクトファイルを書き込めません");
+        }
+        s += written;
+        n -= written;
+    }
+}
+
+/**
+ * asm_finish()済のオブジェクトをELF64の再配置可能オブジェクトとしてfdに書く
+ * ".L"で始まるローカルラベルはシンボル表に入れない
+ */
+void write_elf_object(int fd, const Object *obj) {
+    // シンボル表: ローカルのシンボルを先に、グローバルのシンボルを後に並べる
+    Buffer symtab = {0}, strtab = {0};
+    int *elf_index = calloc(obj->symbols_len + 1, sizeof(int));
+    put_string(&strtab, "");
+    ElfSymbol null_symbol = {0};
+    buffer_put(&symtab, &null_symbol, sizeof(null_symbol));
+    int count = 1, first_global = 0;
+    for (int pass = 0; pass < 2; pass++) {
+        if (pass == 1) {
+            first_global = count;
+        }
+        for (int i = 0; i < obj->symbols_len; i++) {
+            const ObjectSymbol *sym = &obj->symbols[i];
+            if (sym->global != (pass == 1) || sym->name[0] == '.') {
+                continue;
+            }
+            ElfSymbol entry = {
+                .st_name = put_string(&strtab, sym->name),
+                .st_info = (sym->global ? STB_GLOBAL : STB_LOCAL) << 4 | STT_NOTYPE,
+                .st_shndx = sym->defined ? SECTION_TEXT : 0,
+                .st_value = sym->defined ? sym->offset : 0,
+            };
+            buffer_put(&symtab, &entry, sizeof(entry));
+            elf_index[i] = count++;
+        }
+    }
+
+    Buffer rela = {0};
+    for (int i = 0; i < obj->relocs_len; i++) {
+        const ObjectReloc *reloc = &obj->relocs[i];
+        const uint64_t type = reloc->kind == RELOC_PLT32 ? R_X86_64_PLT32 : R_X86_64_PC32;
+        ElfRela entry = {
+            .r_offset = reloc->offset,
+            .r_info = (uint64_t)elf_index[reloc->symbol] << 32 | type,
+            .r_addend = -4,
+        };
+        buffer_put(&rela, &entry, sizeof(entry));
+    }
+    free(elf_index);
+
+    Buffer shstrtab = {0};
+    put_string(&shstrtab, "");
+    const uint32_t names[SECTION_COUNT] = {
+        0,
+        put_string(&shstrtab, ".text"),
+        put_string(&shstrtab, ".rela.text"),
+        put_string(&shstrtab, ".symtab"),
+        put_string(&shstrtab, ".strtab"),
+        put_string(&shstrtab, ".shstrtab"),
+        put_string(&shstrtab, ".note.GNU-stack"),
+    };
+
+    // ファイルの中身: ヘッダ, .text, .rela.text, .symtab, .strtab, .shstrtab, セクションヘッダ
+    Buffer file = {0};
+    ElfHeader header = {0};
+    buffer_put(&file, &header, sizeof(header));
+    ElfSection sections[SECTION_COUNT] = {{0}};
+
+    put_align(&file, 16);
+    sections[SECTION_TEXT] = (ElfSection){
+        .sh_type = SHT_PROGBITS, .sh_flags = SHF_ALLOC | SHF_EXECINSTR,
+        .sh_offset = file.len, .sh_size = obj->code_len, .sh_addralign = 16,
+    };
+    buffer_put(&file, obj->code, obj->code_len);
+
+    put_align(&file, 8);
+    sections[SECTION_RELA] = (ElfSection){
+        .sh_type = SHT_RELA, .sh_flags = SHF_INFO_LINK,
+        .sh_offset = file.len, .sh_size = rela.len,
+        .sh_link = SECTION_SYMTAB, .sh_info = SECTION_TEXT,
+        .sh_addralign = 8, .sh_entsize = sizeof(ElfRela),
+    };
+    buffer_put(&file, rela.data, rela.len);
+
+    sections[SECTION_SYMTAB] = (ElfSection){
+        .sh_type = SHT_SYMTAB,
+        .sh_offset = file.len, .sh_size = symtab.len,
+        .sh_link = SECTION_STRTAB, .sh_info = first_global,
+        .sh_addralign = 8, .sh_entsize = sizeof(ElfSymbol),
+    };
+    buffer_put(&file, symtab.data, symtab.len);
+
+    sections[SECTION_STRTAB] = (ElfSection){
+        .sh_type = SHT_STRTAB, .sh_offset = file.len, .sh_size = strtab.len, .sh_addralign = 1,
+    };
+    buffer_put(&file, strtab.data, strtab.len);
+
+    sections[SECTION_SHSTRTAB] = (ElfSection){
+        .sh_type = SHT_STRTAB, .sh_offset = file.len, .sh_size = shstrtab.len, .sh_addralign = 1,
+    };
+    buffer_put(&file, shstrtab.data, shstrtab.len);
+
+    sections[SECTION_NOTE] = (ElfSection){
+        .sh_type = SHT_PROGBITS, .sh_offset = file.len, .sh_addralign = 1,
+    };
+
+    put_align(&file, 8);
+    const size_t section_offset = file.len;
+    for (int i = 0; i < SECTION_COUNT; i++) {
+        sections[i].sh_name = names[i];
+        buffer_put(&file, &sections[i], sizeof(sections[i]));
+    }
+
+    header = (ElfHeader){
+        .e_ident = {0x7f, 'E', 'L', 'F', 2 /* 64ビット */, 1 /* リトルエンディアン */, 1 /* バージョン */},
+        .e_type = 1,        // 再配置可能
+        .e_machine = 62,    // x86-64
+        .e_version = 1,
+        .e_shoff = section_offset,
+        .e_ehsize = sizeof(ElfHeader),
+        .e_shentsize = sizeof(ElfSection),
+        .e_shnum = SECTION_COUNT,
+        .e_shstrndx = SECTION_SHSTRTAB,
+    };
+    memcpy(file.data, &header, sizeof(header));
+
+    write_all(fd, file.data, file.len);
+    free(file.data);
+    free(symtab.data);
+    free(strtab.data);
+    free(rela.data);
+    free(shstrtab.data);
+}
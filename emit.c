@@ -0,0 +1,424 @@
+#include "9cc.h"
+#include "emit.h"
+#include <errno.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// 出力バッファのサイズ
+#define EMIT_BUFFER_SIZE (1024 * 1024)
+
+// 1行の書式化に確保しておく余裕。これより長い行は途中でフラッシュすることがある
+#define EMIT_LINE_RESERVE 4096
+
+// 出力先の状態はスレッドごとに持つ(スレッドごとに別のファイルへ出力できる)
+static _Thread_local int out_fd = 1;
+static _Thread_local EmitSink out_sink;     // NULLでなければout_fdの代わりに渡す
+static _Thread_local void *out_sink_arg;
+static _Thread_local bool compact_mode = false;
+
+static _Thread_local char *buffer;
+static _Thread_local size_t len;          // バッファに溜まっているバイト数
+static _Thread_local size_t line_start;   // 書式化中の行の先頭(バッファ内のオフセット)
+static _Thread_local bool in_comment;     // コメント部分を書式化中か(compactモードのみ)
+static _Thread_local size_t comment_start;// コメントの開始位置(バッファ内のオフセット)
+
+static _Thread_local size_t total_bytes;  // これまでに書き出したバイト数
+static _Thread_local size_t total_lines;  // これまでに出力した行数
+static _Thread_local size_t total_instructions; // これまでに出力した命令の行数
+
+// 出力の写し取り(emit_capture_begin()からemit_capture_end()まで)
+static _Thread_local bool capturing;
+static _Thread_local size_t capture_from;  // バッファ内の写し取り開始位置
+static _Thread_local char *captured;       // 写し取った内容
+static _Thread_local size_t captured_len;
+static _Thread_local size_t captured_capacity;
+
+// 出力のフィルタ(emit_filter_begin()からemit_filter_end()まで)
+static _Thread_local EmitFilter filter;
+static _Thread_local void *filter_arg;
+static _Thread_local size_t filter_from;   // バッファ内のまだフィルタに通していない部分の開始位置
+
+/**
+ * 出力先を設定する
+ * compactが真のとき、書式文字列中の'#'以降(コメント)を出力しない
+ */
+void emit_open(int fd, bool compact) {
+    out_fd = fd;
+    out_sink = NULL;
+    compact_mode = compact;
+    if (!buffer) {
+        buffer = malloc(EMIT_BUFFER_SIZE);
+    }
+    len = line_start = comment_start = 0;
+    in_comment = false;
+    total_bytes = total_lines = total_instructions = 0;
+}
+
+// 出力をsinkに渡すように設定する
+void emit_open_sink(EmitSink sink, void *arg, bool compact) {
+    emit_open(-1, compact);
+    out_sink = sink;
+    out_sink_arg = arg;
+}
+
+// バッファを解放する。書き出していない分は捨てる(エラー時)。fdは閉じない
+void emit_close(void) {
+    len = line_start = comment_start = 0;
+    out_sink = NULL;
+    free(buffer);
+    buffer = NULL;
+    free(captured);
+    captured = NULL;
+    captured_len = captured_capacity = 0;
+    capturing = false;
+    filter = NULL;
+}
+
+static void append_captured(const char *s, size_t n) {
+    if (captured_len + n > captured_capacity) {
+        captured_capacity = (captured_len + n) * 2;
+        captured = realloc(captured, captured_capacity);
+    }
+    memcpy(captured + captured_len, s, n);
+    captured_len += n;
+}
+
+// バッファのcapture_fromからendまでを写し取り先に追加する
+static void capture_pending(size_t end) {
+    if (end > capture_from) {
+        append_captured(buffer + capture_from, end - capture_from);
+    }
+    capture_from = end;
+}
+
+// n文字を出力先に書き出す
+static void write_out(const char *s, size_t n) {
+    size_t done = out_sink ? n : 0;
+    if (out_sink && n > 0) {
+        out_sink(out_sink_arg, s, n);
+    }
+    while (done < n) {
+        ssize_t written = write(out_fd, s + done, n - done);
+        if (written < 0 && errno == EINTR) {
+            continue; // シグナルで中断されただけなので書き直す
+        }
+        if (written < 0) {
+            error_exit("出力を書き込めません: %s", strerror(errno));
+        }
+        if (written == 0) {
+            error_exit("出力を書き込めません");
+        }
+        done += written;
+    }
+    total_bytes += n;
+}
+
+// バッファの先頭からendまでを書き出し、残りを先頭に詰める
+static void flush_until(size_t end) {
+    if (capturing) {
+        capture_pending(end);
+        capture_from = 0;
+    }
+    write_out(buffer, end);
+    memmove(buffer, buffer + end, len - end);
+    len -= end;
+    line_start = line_start > end ? line_start - end : 0;
+    comment_start = comment_start > end ? comment_start - end : 0;
+    filter_from = 0;
+}
+
+// 命令の行かどうか。命令は字下げされている(ラベルと疑似命令は行頭から始まる)
+static bool is_instruction(const char *s, size_t n) {
+    if (n == 0 || s[0] != ' ') {
+        return false;
+    }
+    size_t i = 0;
+    while (i < n && s[i] == ' ') {
+        i++;
+    }
+    return i < n && s[i] != '#';
+}
+
+// 行数と命令の行数を数える
+static void count_lines(const char *s, size_t n) {
+    const char *end = s + n;
+    for (const char *eol; (eol = memchr(s, '\n', end - s)); s = eol + 1) {
+        if (is_instruction(s, eol - s)) {
+            total_instructions++;
+        }
+        total_lines++;
+    }
+}
+
+/*
+ * バッファのfilter_from以降の完結した行をフィルタに通し、結果で置き換える
+ * 書きかけの行はそのまま残す。結果が収まらなければ、その前までを先に書き出す
+ */
+static void filter_pending(void) {
+    size_t end = len;
+    while (end > filter_from && buffer[end - 1] != '\n') {
+        end--;
+    }
+    size_t n = end - filter_from;
+    if (n == 0) {
+        return;
+    }
+    // フィルタに通す行はend_line()で数えていないので、結果だけを数える
+    const char *text = filter(filter_arg, buffer + filter_from, &n);
+    count_lines(text, n);
+
+    if (filter_from + n + (len - end) > EMIT_BUFFER_SIZE) {
+        // フィルタに通す前の部分と結果を書き出す
+        const size_t from = filter_from;
+        const size_t tail = len - end;
+        len = from;
+        flush_until(from);
+        if (capturing) {
+            append_captured(text, n);
+        }
+        write_out(text, n);
+        memmove(buffer, buffer + end, tail);
+        len = tail;
+        line_start = comment_start = 0;
+        return;
+    }
+    const size_t moved = filter_from + n;
+    memmove(buffer + moved, buffer + end, len - end);
+    memcpy(buffer + filter_from, text, n);
+    line_start = line_start >= end ? line_start - end + moved : line_start;
+    comment_start = comment_start >= end ? comment_start - end + moved : comment_start;
+    len = moved + (len - end);
+    filter_from = moved;
+}
+
+void emit_flush(void) {
+    if (filter) {
+        filter_pending();
+        // フィルタに通していない書きかけの行は残す
+        flush_until(filter_from);
+        return;
+    }
+    flush_until(len);
+}
+
+static inline void put_char(char c) {
+    if (len == EMIT_BUFFER_SIZE) {
+        emit_flush();
+    }
+    buffer[len++] = c;
+}
+
+static void put_chars(const char *s, size_t n) {
+    while (n > 0) {
+        if (len == EMIT_BUFFER_SIZE) {
+            emit_flush();
+        }
+        size_t m = EMIT_BUFFER_SIZE - len;
+        if (m > n) m = n;
+        memcpy(buffer + len, s, m);
+        len += m;
+        s += m;
+        n -= m;
+    }
+}
+
+// 幅指定に合わせて文字列を出力する
+static void put_padded(const char *s, size_t n, int width, bool left, char pad) {
+    int fill = width > (int)n ? width - (int)n : 0;
+    if (!left) {
+        // ゼロ埋めは符号の後ろに入れる
+        if (pad == '0' && n > 0 && *s == '-') {
+            put_char(*s++);
+            n--;
+        }
+        while (fill-- > 0) put_char(pad);
+    }
+    put_chars(s, n);
+    if (left) {
+        while (fill-- > 0) put_char(' ');
+    }
+}
+
+// 整数を10進数の文字列にする。戻り値は文字列の先頭
+static char *format_long(long val, char *end) {
+    unsigned long u = val < 0 ? 0UL - (unsigned long)val : (unsigned long)val;
+    char *p = end;
+    do {
+        *--p = '0' + (u % 10);
+        u /= 10;
+    } while (u);
+    if (val < 0) {
+        *--p = '-';
+    }
+    return p;
+}
+
+// 行を終える。compactモードでコメントを書式化していた場合はコメントと行末の
+// 空白を取り除き、行が空になった場合は行ごと捨てる
+static void end_line(bool newline) {
+    if (in_comment) {
+        len = comment_start;
+        while (len > line_start && buffer[len - 1] == ' ') {
+            len--;
+        }
+        in_comment = false;
+        if (len == line_start) {
+            return;
+        }
+    }
+    if (newline) {
+        // フィルタを通す行は通した結果をfilter_pending()で数える
+        if (!filter) {
+            if (is_instruction(buffer + line_start, len - line_start)) {
+                total_instructions++;
+            }
+            total_lines++;
+        }
+        put_char('\n');
+        line_start = len;
+    }
+}
+
+/**
+ * printf風の書式で出力する
+ * 使える変換は%s, %d, %ld, %c, %%と、'-'/'0'フラグおよび幅指定のみ
+ */
+void emit(const char *fmt, ...) {
+    if (EMIT_BUFFER_SIZE - len < EMIT_LINE_RESERVE) {
+        emit_flush();
+    }
+
+    va_list ap;
+    va_start(ap, fmt);
+    for (const char *f = fmt; *f; f++) {
+        if (*f == '\n') {
+            end_line(true);
+            continue;
+        }
+        if (*f == '#' && compact_mode && !in_comment) {
+            // コメントも書式化はするが行末で捨てる(引数の対応を崩さないため)
+            in_comment = true;
+            comment_start = len;
+            continue;
+        }
+        if (*f != '%') {
+            // 次の変換・改行・コメントの手前までをまとめて写す
+            const size_t n = strcspn(f, compact_mode && !in_comment ? "%\n#" : "%\n");
+            put_chars(f, n);
+            f += n - 1;
+            continue;
+        }
+
+        f++;
+        bool left = false;
+        char pad = ' ';
+        for (; *f == '-' || *f == '0'; f++) {
+            if (*f == '-') left = true;
+            else pad = '0';
+        }
+        int width = 0;
+        for (; '0' <= *f && *f <= '9'; f++) {
+            width = width * 10 + (*f - '0');
+        }
+        bool is_long = false;
+        if (*f == 'l') {
+            is_long = true;
+            f++;
+        }
+
+        char tmp[32];
+        switch (*f) {
+        case 'd': {
+            long val = is_long ? va_arg(ap, long) : va_arg(ap, int);
+            char *end = tmp + sizeof(tmp);
+            char *s = format_long(val, end);
+            put_padded(s, end - s, width, left, pad);
+            break;
+        }
+        case 's': {
+            const char *s = va_arg(ap, const char *);
+            put_padded(s, strlen(s), width, left, ' ');
+            break;
+        }
+        case 'c':
+            tmp[0] = (char)va_arg(ap, int);
+            put_padded(tmp, 1, width, left, ' ');
+            break;
+        case '%':
+            put_char('%');
+            break;
+        default:
+            abort(); // 未対応の変換
+        }
+    }
+    va_end(ap);
+
+    if (in_comment) {
+        end_line(false);
+    }
+}
+
+/**
+ * 書式化せずにn文字をそのまま出力する(完成したアセンブリの断片用)
+ * compactモードでもコメントは取り除かない
+ */
+void emit_raw(const char *s, size_t n) {
+    put_chars(s, n);
+    if (!filter) {
+        count_lines(s, n);
+    }
+    line_start = len;
+}
+
+// これ以降の出力の写し取りを始める
+void emit_capture_begin(void) {
+    capturing = true;
+    capture_from = len;
+    captured_len = 0;
+}
+
+// 写し取りを終えて、写し取った内容とその長さを返す
+// 内容は次のemit_capture_begin()まで有効
+const char *emit_capture_end(size_t *out_len) {
+    capture_pending(len);
+    capturing = false;
+    *out_len = captured_len;
+    return captured;
+}
+
+/**
+ * これ以降の出力を、書き出す前に行単位でfilterに通す
+ * filterは完結した行だけからなる断片を受け取り、置き換える内容を返す。1回の出
+ * 力を何回かに分けて渡すことがある
+ */
+void emit_filter_begin(EmitFilter f, void *arg) {
+    filter = f;
+    filter_arg = arg;
+    filter_from = len;
+}
+
+// 残りの出力をフィルタに通してフィルタを外す
+void emit_filter_end(void) {
+    filter_pending();
+    filter = NULL;
+}
+
+// これまでに出力したバイト数(バッファに溜まっている分を含む)
+size_t emit_bytes(void) {
+    return total_bytes + len;
+}
+
+size_t emit_lines(void) {
+    return total_lines;
+}
+
+size_t emit_instructions(void) {
+    return total_instructions;
+}
+
+// 出力バッファの大きさ(確保していなければ0)
+size_t emit_buffer_bytes(void) {
+    return buffer ? EMIT_BUFFER_SIZE : 0;
+}
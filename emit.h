@@ -0,0 +1,35 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// アセンブリの出力先
+// 大きなバッファに書式化して溜め、満杯になるか終了時にwriteでまとめて書き出す
+// 出力先とバッファはスレッドごとに持つ
+
+// 出力をファイルの代わりに受け取る関数(組み込みのアセンブラ用)
+// 行の途中で区切られた断片で呼ばれることがある
+typedef void (*EmitSink)(void *arg, const char *s, size_t n);
+
+extern void emit_open(int fd, bool compact);
+extern void emit_open_sink(EmitSink sink, void *arg, bool compact);
+extern void emit(const char *fmt, ...);
+extern void emit_flush(void);
+extern void emit_close(void);
+extern void emit_raw(const char *s, size_t n);
+
+// 出力を書き出す前に通す関数(関数単位の覗き穴最適化用)
+// 完結した行だけからなるtext(長さ*len)を受け取り、置き換える内容を返して*lenをその長さにする
+typedef const char *(*EmitFilter)(void *arg, const char *text, size_t *len);
+
+extern void emit_filter_begin(EmitFilter filter, void *arg);
+extern void emit_filter_end(void);
+
+// 出力を写し取る(関数単位のキャッシュ用)
+extern void emit_capture_begin(void);
+extern const char *emit_capture_end(size_t *out_len);
+
+extern size_t emit_bytes(void);
+extern size_t emit_lines(void);
+extern size_t emit_instructions(void);
+extern size_t emit_buffer_bytes(void);
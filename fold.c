@@ -0,0 +1,256 @@
+#include "9cc.h"
+
+/*
+ * 定数畳み込みと代数的な簡約
+ * パースした構文木をコード生成の前にその場で書き換える。
+ * - 両辺が定数の演算は計算して定数にする(実行時と同じく64ビットで計算し、
+ *   intに収まらない結果はそのまま残す)。定数で0除算していればエラーにする
+ * - x+0, x-0, x*1, x/1はxに、x*0と副作用のないx-xは0にする
+ * - 条件が定数のif, while, forは分岐やループを取り除く
+ * ポインタを含む演算は倍率がかかるので書き換えない。新しいノードは作らず、
+ * ノードの中身を子ノードや定数で上書きする。
+ */
+
+static void fold_expr(NodeId id);
+static void fold_stmt(NodeId id);
+
+static bool is_num(NodeId id, int val) {
+    return node_at(id)->kind == ND_NUM && node_at(id)->val == val;
+}
+
+// idのノードを別のノードの中身で置き換える
+static void replace(NodeId id, NodeId with) {
+    *node_at(id) = *node_at(with);
+}
+
+static void replace_num(NodeId id, int val) {
+    *node_at(id) = (Node){.kind = ND_NUM};
+    node_at(id)->val = val;
+}
+
+// 何もしない文(空のブロック)にする
+static void replace_empty(NodeId id) {
+    *node_at(id) = (Node){.kind = ND_BLOCK};
+    node_at(id)->block = 0;
+}
+
+// 式の評価に副作用(代入・関数呼び出し)があるかどうか
+static bool has_side_effect(NodeId id) {
+    Node *node = node_at(id);
+    switch (node->kind) {
+    case ND_NUM:
+    case ND_LVAR:
+    case ND_ADDR:
+        return false;
+    case ND_DEREF:
+        return has_side_effect(node->rhs);
+    case ND_ASSIGN:
+    case ND_FUN:
+        return true;
+    default:
+        if (node_is_binary(node->kind)) {
+            return has_side_effect(node->lhs) || has_side_effect(node->rhs);
+        }
+        return true;
+    }
+}
+
+// 副作用のない2つの式が同じ値になることが明らかかどうか(同じ形をしているか)
+static bool same_expr(NodeId a, NodeId b) {
+    Node *x = node_at(a);
+    Node *y = node_at(b);
+    if (x->kind != y->kind) {
+        return false;
+    }
+    switch (x->kind) {
+    case ND_NUM:
+        return x->val == y->val;
+    case ND_LVAR:
+        return x->offset == y->offset;
+    case ND_DEREF:
+        return same_expr(x->rhs, y->rhs);
+    default:
+        if (node_is_binary(x->kind) && x->kind != ND_ASSIGN) {
+            return same_expr(x->lhs, y->lhs) && same_expr(x->rhs, y->rhs);
+        }
+        return false;
+    }
+}
+
+// 定数どうしの演算を計算する。計算できなければ偽を返す
+static bool evaluate(NodeKind kind, long l, long r, long *out) {
+    switch (kind) {
+    case ND_ADD: *out = l + r; return true;
+    case ND_SUB: *out = l - r; return true;
+    case ND_MUL: *out = l * r; return true;
+    case ND_DIV: *out = l / r; return true;   // Cと同じく0方向に切り捨てる
+    case ND_GREATER: *out = l < r; return true;
+    case ND_GREATER_EQUAL: *out = l <= r; return true;
+    case ND_EQUAL: *out = l == r; return true;
+    case ND_NOT_EQUAL: *out = l != r; return true;
+    default: return false;
+    }
+}
+
+static void fold_binary(NodeId id) {
+    Node *node = node_at(id);
+    fold_expr(node->lhs);
+    fold_expr(node->rhs);
+    if (node->kind == ND_ASSIGN || node_hands_is_treat_pointer(id)) {
+        return;
+    }
+
+    const NodeId lhs = node->lhs, rhs = node->rhs;
+    if (node->kind == ND_DIV && is_num(rhs, 0)) {
+        error_exit("0で割っています。%s", node_description(id));
+    }
+
+    long value;
+    if (node_at(lhs)->kind == ND_NUM && node_at(rhs)->kind == ND_NUM &&
+        evaluate(node->kind, node_at(lhs)->val, node_at(rhs)->val, &value) &&
+        INT32_MIN <= value && value <= INT32_MAX) {
+        replace_num(id, (int)value);
+        return;
+    }
+
+    switch (node->kind) {
+    case ND_ADD:
+        if (is_num(rhs, 0)) {
+            replace(id, lhs);
+        } else if (is_num(lhs, 0)) {
+            replace(id, rhs);
+        }
+        break;
+    case ND_SUB:
+        if (is_num(rhs, 0)) {
+            replace(id, lhs);
+        } else if (!has_side_effect(lhs) && same_expr(lhs, rhs)) {
+            replace_num(id, 0);
+        }
+        break;
+    case ND_MUL:
+        if (is_num(rhs, 1)) {
+            replace(id, lhs);
+        } else if (is_num(lhs, 1)) {
+            replace(id, rhs);
+        } else if ((is_num(rhs, 0) && !has_side_effect(lhs)) ||
+                   (is_num(lhs, 0) && !has_side_effect(rhs))) {
+            replace_num(id, 0);
+        }
+        break;
+    case ND_DIV:
+        if (is_num(rhs, 1)) {
+            replace(id, lhs);
+        }
+        break;
+    default:
+        break;
+    }
+}
+
+static void fold_expr(NodeId id) {
+    Node *node = node_at(id);
+    switch (node->kind) {
+    case ND_FUN:
+        for (int i = 0; i < list_len(node->block); i++) {
+            fold_expr(list_at(node->block, i));
+        }
+        break;
+    case ND_DEREF:
+        fold_expr(node->rhs);
+        break;
+    default:
+        if (node_is_binary(node->kind)) {
+            fold_binary(id);
+        }
+        break;
+    }
+}
+
+static void fold_stmt(NodeId id) {
+    Node *node = node_at(id);
+    switch (node->kind) {
+    case ND_RETURN:
+        fold_expr(node->lhs);
+        break;
+    case ND_IF:
+        fold_expr(node->condition);
+        if (node_at(node->condition)->kind == ND_NUM) {
+            // 実行されない方の文は畳み込まずに捨てる
+            const NodeId taken = node_at(node->condition)->val ? node->lhs : node->rhs;
+            if (taken) {
+                fold_stmt(taken);
+                replace(id, taken);
+            } else {
+                replace_empty(id);
+            }
+            break;
+        }
+        fold_stmt(node->lhs);
+        if (node->rhs) {
+            fold_stmt(node->rhs);
+        }
+        break;
+    case ND_WHILE:
+        fold_expr(node->condition);
+        if (is_num(node->condition, 0)) {
+            replace_empty(id);
+            break;
+        }
+        if (node_at(node->condition)->kind == ND_NUM) {
+            node->condition = 0; // 条件なし(無限ループ)
+        }
+        fold_stmt(node->lhs);
+        break;
+    case ND_FOR: {
+        const NodeId init = list_at(node->block, 0);
+        const NodeId cond = list_at(node->block, 1);
+        const NodeId update = list_at(node->block, 2);
+        if (init) {
+            fold_expr(init);
+        }
+        if (cond) {
+            fold_expr(cond);
+            if (is_num(cond, 0)) {
+                // 初期化だけが実行される
+                if (init) {
+                    replace(id, init);
+                } else {
+                    replace_empty(id);
+                }
+                break;
+            }
+            if (node_at(cond)->kind == ND_NUM) {
+                ctx->ast.lists[node->block + 1 + 1] = 0; // 条件なし(無限ループ)
+            }
+        }
+        if (update) {
+            fold_expr(update);
+        }
+        fold_stmt(node->body);
+        break;
+    }
+    case ND_BLOCK:
+        for (int i = 0; i < list_len(node->block); i++) {
+            fold_stmt(list_at(node->block, i));
+        }
+        break;
+    case ND_FUN_IMPL:
+        fold_stmt(node->body);
+        break;
+    case ND_GLOBAL_VAR:
+        break;
+    default:
+        fold_expr(id);
+        break;
+    }
+}
+
+/**
+ * プログラム全体(ctx->code)を畳み込む
+ */
+void fold_program(void) {
+    for (int i = 0; i < list_len(ctx->code); i++) {
+        fold_stmt(list_at(ctx->code, i));
+    }
+}
@@ -0,0 +1,123 @@
+#include "intern.h"
+#include "arena.h"
+#include <stdlib.h>
+#include <string.h>
+
+// シンボルの情報
+typedef struct {
+    const char *name;   // 名前(NULL終端)
+    int len;            // 名前の長さ
+    uint32_t hash;      // 名前のハッシュ値
+} SymbolEntry;
+
+// シンボルの表はスレッドごとに持つ。添字がシンボル(0番は使わない)
+static _Thread_local SymbolEntry *entries;
+static _Thread_local int entries_len;
+static _Thread_local int entries_capacity;
+
+// 名前からシンボルを引くハッシュテーブル(オープンアドレス法、0は空き)
+static _Thread_local Symbol *table;
+static _Thread_local int table_capacity;
+
+// 名前の格納先。シンボルはrelease_symbols()まで有効
+static _Thread_local Arena *names;
+
+static uint32_t hash_bytes(const char *s, int len) {
+    uint32_t h = 2166136261u;
+    for (int i = 0; i < len; i++) {
+        h ^= (unsigned char)s[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static void rehash(int capacity) {
+    free(table);
+    table = calloc(capacity, sizeof(Symbol));
+    table_capacity = capacity;
+    for (Symbol sym = 1; sym < (Symbol)entries_len; sym++) {
+        int i = entries[sym].hash & (capacity - 1);
+        while (table[i]) {
+            i = (i + 1) & (capacity - 1);
+        }
+        table[i] = sym;
+    }
+}
+
+/**
+ * 長さlenの名前sに対応するシンボルを返す。初めての名前なら新しく割り当てる
+ */
+Symbol intern(const char *s, int len) {
+    if (!table) {
+        names = new_arena("symbol");
+        entries_capacity = 256;
+        entries = malloc(sizeof(SymbolEntry) * entries_capacity);
+        entries[0] = (SymbolEntry){"", 0, 0}; // 0番は欠番
+        entries_len = 1;
+        rehash(256);
+    }
+
+    const uint32_t hash = hash_bytes(s, len);
+    const int mask = table_capacity - 1;
+    int i = hash & mask;
+    for (; table[i]; i = (i + 1) & mask) {
+        SymbolEntry *e = &entries[table[i]];
+        if (e->hash == hash && e->len == len && memcmp(e->name, s, len) == 0) {
+            return table[i];
+        }
+    }
+
+    // 新しいシンボルを割り当てる
+    if (entries_len == entries_capacity) {
+        entries_capacity *= 2;
+        entries = realloc(entries, sizeof(SymbolEntry) * entries_capacity);
+    }
+    const Symbol sym = entries_len++;
+    entries[sym].name = arena_strndup(names, s, len);
+    entries[sym].len = len;
+    entries[sym].hash = hash;
+    table[i] = sym;
+
+    if (entries_len * 4 > table_capacity * 3) {
+        rehash(table_capacity * 2);
+    }
+    return sym;
+}
+
+const char *symbol_name(Symbol sym) {
+    return entries[sym].name;
+}
+
+int symbol_length(Symbol sym) {
+    return entries[sym].len;
+}
+
+// 割り当て済のシンボルの数(+1)。シンボルで引く表の大きさに使う
+int symbol_count(void) {
+    return entries_len;
+}
+
+// このスレッドのシンボルをすべて解放する。以降のintern()は1番から割り当て直す
+void release_symbols(void) {
+    if (!table) {
+        return;
+    }
+    arena_release(names);
+    free(names);
+    free(entries);
+    free(table);
+    names = NULL;
+    entries = NULL;
+    table = NULL;
+    entries_len = entries_capacity = table_capacity = 0;
+}
+
+// このスレッドのシンボルの表が使っているメモリ
+void symbol_memory(size_t *used, size_t *reserved) {
+    *used = *reserved = 0;
+    if (!table) {
+        return;
+    }
+    *used = arena_bytes_used(names) + sizeof(SymbolEntry) * entries_len + sizeof(Symbol) * table_capacity;
+    *reserved = arena_bytes_reserved(names) + sizeof(SymbolEntry) * entries_capacity + sizeof(Symbol) * table_capacity;
+}
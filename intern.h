@@ -0,0 +1,17 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// 識別子を一意な整数(シンボル)に対応づける
+// 同じ綴りの識別子は常に同じシンボルになるので、名前の比較は整数の比較で済む
+// 0はどの識別子にも対応しない
+// シンボルの表はスレッドごとにあり、シンボルは同じスレッドの中でだけ意味を持つ
+typedef uint32_t Symbol;
+
+extern Symbol intern(const char *s, int len);
+extern const char *symbol_name(Symbol sym);
+extern int symbol_length(Symbol sym);
+extern int symbol_count(void);
+extern void release_symbols(void);
+extern void symbol_memory(size_t *used, size_t *reserved);
@@ -0,0 +1,675 @@
+#include "9cc.h"
+#include "emit.h"
+#include "ir.h"
+
+/*
+ * 中間表現の組み立て
+ * - 命令・ブロックを作って並べる関数
+ * - 制御フローグラフ(到達可能性・前のブロック・逆後順)
+ * - 構文木からの変換(lowering)
+ * - テキストでの出力(--dump-ir)
+ */
+
+static const char *OP_NAMES[IR_OP_COUNT] = {
+    [IR_NOP] = "nop",
+    [IR_CONST] = "const",
+    [IR_COPY] = "copy",
+    [IR_PARAM] = "param",
+    [IR_ADD] = "add",
+    [IR_SUB] = "sub",
+    [IR_MUL] = "mul",
+    [IR_DIV] = "div",
+    [IR_LT] = "lt",
+    [IR_LE] = "le",
+    [IR_EQ] = "eq",
+    [IR_NE] = "ne",
+    [IR_SLOT_ADDR] = "slot_addr",
+    [IR_LOAD_SLOT] = "load_slot",
+    [IR_STORE_SLOT] = "store_slot",
+    [IR_LOAD] = "load",
+    [IR_STORE] = "store",
+    [IR_CALL] = "call",
+    [IR_PHI] = "phi",
+    [IR_JMP] = "jmp",
+    [IR_BR] = "br",
+    [IR_RET] = "ret",
+};
+
+const char *ir_op_name(IrOp op) {
+    return OP_NAMES[op];
+}
+
+/*
+ * アリーナ上の配列を少なくともneed要素に広げる
+ * アリーナは個別に解放できないので、古い配列は関数のIRを捨てるまで残る
+ */
+static void *grow(void *array, size_t elem_size, int *capacity, int need) {
+    if (need <= *capacity) {
+        return array;
+    }
+    int n = *capacity ? *capacity : 16;
+    while (n < need) {
+        n *= 2;
+    }
+    void *p = arena_alloc(ctx->ir_arena, elem_size * n);
+    if (*capacity) {
+        memcpy(p, array, elem_size * *capacity);
+    }
+    *capacity = n;
+    return p;
+}
+
+IrValue ir_new_value(IrFunction *fn) {
+    return fn->value_count++;
+}
+
+int ir_new_block(IrFunction *fn) {
+    fn->blocks = grow(fn->blocks, sizeof(IrBlock), &fn->block_capacity, fn->block_count + 1);
+    fn->blocks[fn->block_count] = (IrBlock){0};
+    return fn->block_count++;
+}
+
+// どのブロックにも属さない命令を作る
+int ir_new_inst(IrFunction *fn, IrOp op) {
+    fn->insts = grow(fn->insts, sizeof(IrInst), &fn->inst_capacity, fn->inst_count + 1);
+    fn->insts[fn->inst_count] = (IrInst){.op = op, .block = -1};
+    return fn->inst_count++;
+}
+
+// 0で埋めたcount個のオペランドを確保し、その先頭を返す
+int ir_new_operands(IrFunction *fn, int count) {
+    fn->operands = grow(fn->operands, sizeof(IrValue), &fn->operand_capacity, fn->operand_count + count);
+    memset(fn->operands + fn->operand_count, 0, sizeof(IrValue) * count);
+    fn->operand_count += count;
+    return fn->operand_count - count;
+}
+
+void ir_append(IrFunction *fn, int block, int inst) {
+    IrBlock *b = &fn->blocks[block];
+    IrInst *in = ir_inst(fn, inst);
+    in->block = block;
+    in->prev = b->last;
+    in->next = 0;
+    if (b->last) {
+        ir_inst(fn, b->last)->next = inst;
+    } else {
+        b->first = inst;
+    }
+    b->last = inst;
+}
+
+void ir_insert_before(IrFunction *fn, int before, int inst) {
+    IrInst *at = ir_inst(fn, before);
+    IrInst *in = ir_inst(fn, inst);
+    in->block = at->block;
+    in->prev = at->prev;
+    in->next = before;
+    if (at->prev) {
+        ir_inst(fn, at->prev)->next = inst;
+    } else {
+        fn->blocks[at->block].first = inst;
+    }
+    at->prev = inst;
+}
+
+void ir_prepend(IrFunction *fn, int block, int inst) {
+    if (fn->blocks[block].first) {
+        ir_insert_before(fn, fn->blocks[block].first, inst);
+    } else {
+        ir_append(fn, block, inst);
+    }
+}
+
+// 命令をブロックから外す(命令の番号はそのまま残る)
+void ir_remove(IrFunction *fn, int inst) {
+    IrInst *in = ir_inst(fn, inst);
+    IrBlock *b = &fn->blocks[in->block];
+    if (in->prev) {
+        ir_inst(fn, in->prev)->next = in->next;
+    } else {
+        b->first = in->next;
+    }
+    if (in->next) {
+        ir_inst(fn, in->next)->prev = in->prev;
+    } else {
+        b->last = in->prev;
+    }
+    in->op = IR_NOP;
+    in->block = -1;
+    in->prev = in->next = 0;
+}
+
+// ブロックの後続(終端命令の飛び先。同じブロックは1つに数える)の数を返す
+int ir_successors(IrFunction *fn, int block, int succ[2]) {
+    const int last = fn->blocks[block].last;
+    if (!last) {
+        return 0;
+    }
+    const IrInst *in = ir_inst(fn, last);
+    switch (in->op) {
+    case IR_JMP:
+        succ[0] = in->target[0];
+        return 1;
+    case IR_BR:
+        succ[0] = in->target[0];
+        succ[1] = in->target[1];
+        return succ[0] == succ[1] ? 1 : 2;
+    default:
+        return 0;
+    }
+}
+
+/**
+ * 入口から到達できるブロック、各ブロックの前のブロック(到達できるものだけ)と
+ * 逆後順を求める
+ */
+void ir_compute_cfg(IrFunction *fn) {
+    const int n = fn->block_count;
+    int *stack = arena_alloc(ctx->ir_arena, sizeof(int) * n);
+    int *next_succ = arena_alloc(ctx->ir_arena, sizeof(int) * n);
+    int *postorder = arena_alloc(ctx->ir_arena, sizeof(int) * n);
+    int *counts = arena_alloc(ctx->ir_arena, sizeof(int) * n);
+    int post_len = 0;
+    for (int b = 0; b < n; b++) {
+        fn->blocks[b].reachable = false;
+        fn->blocks[b].pred_count = 0;
+    }
+
+    // 深さ優先で後順を求める(入れ子が深くなりうるので再帰しない)
+    int depth = 0;
+    stack[depth++] = 0;
+    fn->blocks[0].reachable = true;
+    while (depth > 0) {
+        const int b = stack[depth - 1];
+        int succ[2];
+        const int count = ir_successors(fn, b, succ);
+        if (next_succ[b] < count) {
+            const int s = succ[next_succ[b]++];
+            if (!fn->blocks[s].reachable) {
+                fn->blocks[s].reachable = true;
+                stack[depth++] = s;
+            }
+        } else {
+            postorder[post_len++] = b;
+            depth--;
+        }
+    }
+
+    fn->order = arena_alloc(ctx->ir_arena, sizeof(int) * post_len);
+    fn->order_len = post_len;
+    for (int i = 0; i < post_len; i++) {
+        fn->order[i] = postorder[post_len - 1 - i];
+    }
+
+    for (int i = 0; i < post_len; i++) {
+        int succ[2];
+        const int count = ir_successors(fn, fn->order[i], succ);
+        for (int k = 0; k < count; k++) {
+            counts[succ[k]]++;
+        }
+    }
+    for (int b = 0; b < n; b++) {
+        fn->blocks[b].preds = counts[b] ? arena_alloc(ctx->ir_arena, sizeof(int) * counts[b]) : NULL;
+    }
+    for (int i = 0; i < post_len; i++) {
+        const int b = fn->order[i];
+        int succ[2];
+        const int count = ir_successors(fn, b, succ);
+        for (int k = 0; k < count; k++) {
+            IrBlock *s = &fn->blocks[succ[k]];
+            s->preds[s->pred_count++] = b;
+        }
+    }
+}
+
+/*
+ * 構文木からの変換
+ * 式の評価順と値はcodegen.cのコード生成と同じにする(ポインタの演算の倍率も同
+ * じくnode_pointer_scale()で決める)。returnの後のように到達しない文は、前のブロ
+ * ックとつながらない新しいブロックに置く(ir_compute_cfg()で到達しないとわかる)。
+ */
+
+typedef struct {
+    IrFunction *fn;
+    int block;          // 命令を追加しているブロック
+    int *slot_table;    // オフセットからスロットを引くハッシュ表(スロットの番号+1、0なら空き)
+    int slot_table_size;
+} Lowering;
+
+static IrValue lower_expr(Lowering *l, NodeId id);
+static void lower_stmt(Lowering *l, NodeId id);
+
+static unsigned int hash_offset(int offset, int size) {
+    return ((unsigned int)offset * 2654435761u) & (size - 1);
+}
+
+// ローカル変数のノードのスロットを返す。初めて見るオフセットならスロットを作る
+static int slot_of(Lowering *l, Node *var) {
+    IrFunction *fn = l->fn;
+    if (fn->slot_count * 2 >= l->slot_table_size) {
+        const int size = l->slot_table_size ? l->slot_table_size * 2 : 64;
+        int *table = arena_alloc(ctx->ir_arena, sizeof(int) * size);
+        for (int s = 0; s < fn->slot_count; s++) {
+            unsigned int h = hash_offset(fn->slots[s].offset, size);
+            while (table[h]) {
+                h = (h + 1) & (size - 1);
+            }
+            table[h] = s + 1;
+        }
+        l->slot_table = table;
+        l->slot_table_size = size;
+    }
+
+    unsigned int h = hash_offset(var->offset, l->slot_table_size);
+    while (l->slot_table[h]) {
+        const int s = l->slot_table[h] - 1;
+        if (fn->slots[s].offset == var->offset) {
+            fn->slots[s].array |= var->type->type == ARRAY;
+            return s;
+        }
+        h = (h + 1) & (l->slot_table_size - 1);
+    }
+    fn->slots = grow(fn->slots, sizeof(IrSlot), &fn->slot_capacity, fn->slot_count + 1);
+    fn->slots[fn->slot_count] = (IrSlot){
+        .offset = var->offset,
+        .ident = var->ident,
+        .array = var->type->type == ARRAY,
+    };
+    l->slot_table[h] = fn->slot_count + 1;
+    return fn->slot_count++;
+}
+
+// 現在のブロックの末尾に命令を足す
+static int add(Lowering *l, IrOp op) {
+    const int inst = ir_new_inst(l->fn, op);
+    ir_append(l->fn, l->block, inst);
+    return inst;
+}
+
+// 新しい値を作る命令を足す(返すポインタは次に命令を足すまで有効)
+static IrInst *add_def(Lowering *l, IrOp op) {
+    IrInst *in = ir_inst(l->fn, add(l, op));
+    in->dst = ir_new_value(l->fn);
+    return in;
+}
+
+static IrValue add_value(Lowering *l, IrOp op, IrValue a, IrValue b) {
+    IrInst *in = add_def(l, op);
+    in->a = a;
+    in->b = b;
+    return in->dst;
+}
+
+static IrValue add_const(Lowering *l, long value) {
+    IrInst *in = add_def(l, IR_CONST);
+    in->imm = value;
+    return in->dst;
+}
+
+static IrValue add_slot_value(Lowering *l, IrOp op, int slot) {
+    IrInst *in = add_def(l, op);
+    in->slot = slot;
+    return in->dst;
+}
+
+static void add_store_slot(Lowering *l, int slot, IrValue value) {
+    IrInst *in = ir_inst(l->fn, add(l, IR_STORE_SLOT));
+    in->slot = slot;
+    in->a = value;
+}
+
+static void add_jump(Lowering *l, int target) {
+    ir_inst(l->fn, add(l, IR_JMP))->target[0] = target;
+}
+
+static void add_branch(Lowering *l, IrValue cond, int then, int otherwise) {
+    IrInst *in = ir_inst(l->fn, add(l, IR_BR));
+    in->a = cond;
+    in->target[0] = then;
+    in->target[1] = otherwise;
+}
+
+static void start_block(Lowering *l, int block) {
+    l->block = block;
+}
+
+static IrValue lower_binary(Lowering *l, NodeId id) {
+    Node *node = node_at(id);
+    NodeId left = node->lhs, right = node->rhs;
+    const int scale = node_pointer_scale(id);
+    if (scale != 1 && node_at(left)->kind == ND_NUM) {
+        left = node->rhs;
+        right = node->lhs;
+    }
+
+    const IrValue a = lower_expr(l, left);
+    IrValue b;
+    if (node_at(right)->kind == ND_NUM) {
+        b = add_const(l, (long)node_at(right)->val * scale);
+    } else {
+        b = lower_expr(l, right);
+        if (scale != 1) {
+            b = add_value(l, IR_MUL, b, add_const(l, scale));
+        }
+    }
+
+    switch (node->kind) {
+    case ND_ADD: return add_value(l, IR_ADD, a, b);
+    case ND_SUB: return add_value(l, IR_SUB, a, b);
+    case ND_MUL: return add_value(l, IR_MUL, a, b);
+    case ND_DIV: return add_value(l, IR_DIV, a, b);
+    case ND_GREATER: return add_value(l, IR_LT, a, b);
+    case ND_GREATER_EQUAL: return add_value(l, IR_LE, a, b);
+    case ND_EQUAL: return add_value(l, IR_EQ, a, b);
+    case ND_NOT_EQUAL: return add_value(l, IR_NE, a, b);
+    default:
+        error_exit("式ではありません。%s", node_description(id));
+        return 0;
+    }
+}
+
+static IrValue lower_call(Lowering *l, Node *node) {
+    const int n = list_len(node->block);
+    if (n > 6) {
+        error_exit("引数が多すぎます: %s", symbol_name(node->ident));
+    }
+    IrValue args[6];
+    for (int i = 0; i < n; i++) {
+        args[i] = lower_expr(l, list_at(node->block, i));
+    }
+    const int operands = ir_new_operands(l->fn, n);
+    IrInst *in = add_def(l, IR_CALL);
+    in->sym = node->ident;
+    in->operands = operands;
+    in->operand_count = n;
+    memcpy(l->fn->operands + operands, args, sizeof(IrValue) * n);
+    return in->dst;
+}
+
+static IrValue lower_expr(Lowering *l, NodeId id) {
+    Node *node = node_at(id);
+    switch (node->kind) {
+    case ND_NUM:
+        return add_const(l, node->val);
+    case ND_LVAR: {
+        // 配列は"初期化済のポインタ変数"なので先頭のアドレスを値とする
+        return add_slot_value(l, node->type->type == ARRAY ? IR_SLOT_ADDR : IR_LOAD_SLOT, slot_of(l, node));
+    }
+    case ND_GLOBAL_VAR:
+        error_exit("グローバル変数の参照は未対応です。%s", node_description(id));
+        return 0;
+    case ND_ASSIGN: {
+        Node *lhs = node_at(node->lhs);
+        switch (lhs->kind) {
+        case ND_DEREF: {
+            const IrValue address = lower_expr(l, lhs->rhs);
+            const IrValue value = lower_expr(l, node->rhs);
+            IrInst *in = ir_inst(l->fn, add(l, IR_STORE));
+            in->a = address;
+            in->b = value;
+            return value;
+        }
+        case ND_LVAR: {
+            const IrValue value = lower_expr(l, node->rhs);
+            add_store_slot(l, slot_of(l, lhs), value);
+            return value;
+        }
+        default:
+            error_exit("代入の左辺値は変数またはデリファレンス演算子でなければなりません。%s", node_description(node->lhs));
+            return 0;
+        }
+    }
+    case ND_FUN:
+        return lower_call(l, node);
+    case ND_ADDR: {
+        Node *var = node_at(node->rhs);
+        if (var->kind != ND_LVAR) {
+            error_exit("代入の左辺値が変数ではありません(var)。%s", node_description(node->rhs));
+        }
+        const int slot = slot_of(l, var);
+        l->fn->slots[slot].address_taken = true;
+        return add_slot_value(l, IR_SLOT_ADDR, slot);
+    }
+    case ND_DEREF:
+        return add_value(l, IR_LOAD, lower_expr(l, node->rhs), 0);
+    default:
+        if (!node_is_binary(node->kind)) {
+            error_exit("式ではありません。%s", node_description(id));
+        }
+        return lower_binary(l, id);
+    }
+}
+
+// 条件が偽ならotherwiseへ、真ならthenへ分岐する
+static void lower_condition(Lowering *l, NodeId cond, int then, int otherwise) {
+    add_branch(l, lower_expr(l, cond), then, otherwise);
+}
+
+static void lower_stmt(Lowering *l, NodeId id) {
+    Node *node = node_at(id);
+    IrFunction *fn = l->fn;
+    switch (node->kind) {
+    case ND_RETURN: {
+        const IrValue value = lower_expr(l, node->lhs);
+        ir_inst(fn, add(l, IR_RET))->a = value;
+        start_block(l, ir_new_block(fn));
+        break;
+    }
+    case ND_IF: {
+        const int then = ir_new_block(fn);
+        const int end = ir_new_block(fn);
+        const int otherwise = node->rhs ? ir_new_block(fn) : end;
+        lower_condition(l, node->condition, then, otherwise);
+        start_block(l, then);
+        lower_stmt(l, node->lhs);
+        add_jump(l, end);
+        if (node->rhs) {
+            start_block(l, otherwise);
+            lower_stmt(l, node->rhs);
+            add_jump(l, end);
+        }
+        start_block(l, end);
+        break;
+    }
+    case ND_WHILE: {
+        const int begin = ir_new_block(fn);
+        const int body = ir_new_block(fn);
+        const int end = ir_new_block(fn);
+        add_jump(l, begin);
+        start_block(l, begin);
+        if (node->condition) {
+            lower_condition(l, node->condition, body, end);
+        } else {
+            add_jump(l, body);
+        }
+        start_block(l, body);
+        lower_stmt(l, node->lhs);
+        add_jump(l, begin);
+        start_block(l, end);
+        break;
+    }
+    case ND_FOR: {
+        const NodeId init = list_at(node->block, 0);
+        const NodeId cond = list_at(node->block, 1);
+        const NodeId update = list_at(node->block, 2);
+        if (init) {
+            lower_stmt(l, init);
+        }
+        const int begin = ir_new_block(fn);
+        const int body = ir_new_block(fn);
+        const int end = ir_new_block(fn);
+        add_jump(l, begin);
+        start_block(l, begin);
+        if (cond) {
+            lower_condition(l, cond, body, end);
+        } else {
+            add_jump(l, body);
+        }
+        start_block(l, body);
+        lower_stmt(l, node->body);
+        if (update) {
+            lower_stmt(l, update);
+        }
+        add_jump(l, begin);
+        start_block(l, end);
+        break;
+    }
+    case ND_BLOCK:
+        for (int i = 0; i < list_len(node->block); i++) {
+            lower_stmt(l, list_at(node->block, i));
+        }
+        break;
+    case ND_GLOBAL_VAR:
+        break;
+    default:
+        lower_expr(l, id);
+        break;
+    }
+}
+
+/**
+ * 関数定義(ND_FUN_IMPL)のノードをIRにする
+ * 入口のブロックで引数をスロットに書き、本体の最後まで来たら0を返す
+ */
+IrFunction *ir_lower_function(NodeId id) {
+    Node *node = node_at(id);
+    IrFunction *fn = arena_alloc(ctx->ir_arena, sizeof(IrFunction));
+    fn->ident = node->ident;
+    fn->frame_size = node->frame_size;
+    fn->param_count = list_len(node->block);
+    fn->value_count = 1;
+    ir_new_inst(fn, IR_NOP); // 0番は使わない
+
+    Lowering l = {.fn = fn};
+    start_block(&l, ir_new_block(fn));
+    if (fn->param_count > 6) {
+        error_exit("引数が多すぎます: %s", symbol_name(node->ident));
+    }
+    for (int i = 0; i < fn->param_count; i++) {
+        Node *arg = node_at(list_at(node->block, i));
+        if (arg->kind != ND_LVAR) {
+            error_exit("代入の左辺値が変数ではありません(args)。%s", node_description(list_at(node->block, i)));
+        }
+        IrInst *param = add_def(&l, IR_PARAM);
+        param->imm = i;
+        add_store_slot(&l, slot_of(&l, arg), param->dst);
+    }
+
+    lower_stmt(&l, node->body);
+    const IrValue zero = add_const(&l, 0);
+    ir_inst(fn, add(&l, IR_RET))->a = zero;
+    return fn;
+}
+
+/*
+ * テキストでの出力
+ *   function 名前(引数の数) frame=大きさ
+ *     slot s0 名前 [rbp - オフセット] (array, address-taken, promoted)
+ *   b0: (preds b1 b2)
+ *     v3 = add v1, v2
+ *     v4 = phi [b1 v2] [b2 v3]
+ *     store_slot s0, v4
+ *     br v5, b1, b2
+ */
+
+static void dump_value(IrValue v) {
+    if (v) {
+        emit("v%d", v);
+    } else {
+        emit("undef");
+    }
+}
+
+static void dump_inst(IrFunction *fn, IrInst *in) {
+    emit("  ");
+    if (in->dst) {
+        dump_value(in->dst);
+        emit(" = ");
+    }
+    emit("%s", ir_op_name(in->op));
+    switch (in->op) {
+    case IR_CONST:
+    case IR_PARAM:
+        emit(" %ld", in->imm);
+        break;
+    case IR_SLOT_ADDR:
+    case IR_LOAD_SLOT:
+        emit(" s%d", in->slot);
+        break;
+    case IR_STORE_SLOT:
+        emit(" s%d, ", in->slot);
+        dump_value(in->a);
+        break;
+    case IR_CALL:
+        emit(" %s(", symbol_name(in->sym));
+        for (int i = 0; i < in->operand_count; i++) {
+            if (i > 0) {
+                emit(", ");
+            }
+            dump_value(fn->operands[in->operands + i]);
+        }
+        emit(")");
+        break;
+    case IR_PHI: {
+        const IrBlock *b = &fn->blocks[in->block];
+        for (int i = 0; i < in->operand_count; i++) {
+            emit(" [b%d ", b->preds[i]);
+            dump_value(fn->operands[in->operands + i]);
+            emit("]");
+        }
+        emit("  ; s%d", in->slot);
+        break;
+    }
+    case IR_JMP:
+        emit(" b%d", in->target[0]);
+        break;
+    case IR_BR:
+        emit(" ");
+        dump_value(in->a);
+        emit(", b%d, b%d", in->target[0], in->target[1]);
+        break;
+    case IR_NOP:
+        break;
+    default:
+        if (in->a) {
+            emit(" ");
+            dump_value(in->a);
+        }
+        if (in->b) {
+            emit(", ");
+            dump_value(in->b);
+        }
+        break;
+    }
+    emit("\n");
+}
+
+/**
+ * 関数のIRをテキストで出力する(到達できるブロックを逆後順に並べる)
+ * ir_compute_cfg()の後に呼ぶ
+ */
+void ir_dump_function(IrFunction *fn) {
+    emit("function %s(%d) frame=%d\n", symbol_name(fn->ident), fn->param_count, fn->frame_size);
+    for (int s = 0; s < fn->slot_count; s++) {
+        const IrSlot *slot = &fn->slots[s];
+        emit("  slot s%d %s [rbp - %d]%s%s%s\n", s, symbol_name(slot->ident), slot->offset,
+             slot->array ? " array" : "",
+             slot->address_taken ? " address-taken" : "",
+             slot->promoted ? " promoted" : "");
+    }
+    for (int i = 0; i < fn->order_len; i++) {
+        const int b = fn->order[i];
+        const IrBlock *block = &fn->blocks[b];
+        emit("b%d:", b);
+        if (block->pred_count > 0) {
+            emit("  ; preds");
+            for (int k = 0; k < block->pred_count; k++) {
+                emit(" b%d", block->preds[k]);
+            }
+        }
+        emit("\n");
+        for (int inst = block->first; inst; inst = ir_inst(fn, inst)->next) {
+            dump_inst(fn, ir_inst(fn, inst));
+        }
+    }
+}
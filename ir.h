@@ -0,0 +1,132 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * 中間表現(IR)
+ * 構文木とアセンブリの間に置く三番地コード。関数ごとに作る。
+ * - 値は仮想レジスタ(v1, v2, ...)で、0番は「なし」を表す
+ * - 命令は基本ブロックに並べ、ブロックの末尾は必ずjmp, br, retのどれかにする
+ *   (制御の流れはこの終端命令の飛び先で表す)
+ * - ローカル変数はフレームのスロット(s0, s1, ...)に置き、load_slot/store_slot
+ *   で読み書きする
+ * ir_construct_ssa()でアドレスを取らないスロットを値にしてSSA形式(phiを持つ)に
+ * し、ir_deconstruct_ssa()でphiをコピーに戻してからコード生成する。
+ * 命令・ブロックなどの配列は関数ごとにctx->ir_arenaから確保する。
+ */
+
+// 値(仮想レジスタ)の番号
+typedef int IrValue;
+
+typedef enum {
+    IR_NOP,         // 何もしない(取り除いた命令)
+    IR_CONST,       // dst = imm
+    IR_COPY,        // dst = a
+    IR_PARAM,       // dst = imm番目の引数
+    IR_ADD,         // dst = a + b
+    IR_SUB,         // dst = a - b
+    IR_MUL,         // dst = a * b
+    IR_DIV,         // dst = a / b
+    IR_LT,          // dst = a < b
+    IR_LE,          // dst = a <= b
+    IR_EQ,          // dst = a == b
+    IR_NE,          // dst = a != b
+    IR_SLOT_ADDR,   // dst = スロットslotのアドレス
+    IR_LOAD_SLOT,   // dst = スロットslotの値
+    IR_STORE_SLOT,  // スロットslotにaを書く
+    IR_LOAD,        // dst = アドレスaの値
+    IR_STORE,       // アドレスaにbを書く
+    IR_CALL,        // dst = sym(引数...)
+    IR_PHI,         // dst = 前のブロックごとの値(スロットslotの値として置いた)
+    IR_JMP,         // target[0]へ飛ぶ
+    IR_BR,          // aが0でなければtarget[0]へ、0ならtarget[1]へ飛ぶ
+    IR_RET,         // aを返す
+    IR_OP_COUNT,
+} IrOp;
+
+// 命令。insts[0]は使わない(命令の番号0は「なし」を表す)
+typedef struct {
+    IrOp op;
+    IrValue dst;
+    IrValue a, b;
+    long imm;           // IR_CONST: 値, IR_PARAM: 何番目の引数か
+    int slot;           // IR_SLOT_ADDR, IR_LOAD_SLOT, IR_STORE_SLOT, IR_PHI
+    Symbol sym;         // IR_CALL: 呼ぶ関数
+    int target[2];      // IR_JMP, IR_BR: 飛び先のブロック
+    int operands;       // IR_CALL: 引数の値, IR_PHI: 前のブロックの順の値(operandsの中の先頭)
+    int operand_count;
+    int block;          // 属するブロック
+    int prev, next;     // 同じブロックの前後の命令(0ならなし)
+} IrInst;
+
+// 基本ブロック。blocks[0]が入口
+typedef struct {
+    int first, last;    // 先頭と末尾の命令(空なら0)
+    int *preds;         // 前のブロック(ir_compute_cfg()で求める)
+    int pred_count;
+    bool reachable;     // 入口から到達できるか(ir_compute_cfg()で求める)
+    int idom;           // 直接の支配ブロック(入口は自分自身)
+} IrBlock;
+
+// フレーム上のローカル変数
+typedef struct {
+    int offset;         // RBPからのオフセット
+    Symbol ident;
+    bool array;         // 配列(アドレスとしてだけ使う)
+    bool address_taken; // &でアドレスを取っている
+    bool promoted;      // SSAの値にした(もう読み書きしない)
+} IrSlot;
+
+typedef struct {
+    Symbol ident;
+    int param_count;
+    int frame_size;             // ローカル変数の領域の大きさ
+    IrInst *insts;              // 命令(0番は使わない)
+    int inst_count;
+    int inst_capacity;
+    IrBlock *blocks;
+    int block_count;
+    int block_capacity;
+    IrSlot *slots;
+    int slot_count;
+    int slot_capacity;
+    IrValue *operands;          // IR_CALL, IR_PHIの可変長のオペランド
+    int operand_count;
+    int operand_capacity;
+    int value_count;            // 0番を含む値の数
+    int *order;                 // 到達できるブロックの逆後順(ir_compute_cfg()で求める)
+    int order_len;
+} IrFunction;
+
+static inline IrInst *ir_inst(IrFunction *fn, int i) {
+    return &fn->insts[i];
+}
+
+static inline bool ir_is_terminator(IrOp op) {
+    return op == IR_JMP || op == IR_BR || op == IR_RET;
+}
+
+// ir.c
+extern const char *ir_op_name(IrOp op);
+extern IrValue ir_new_value(IrFunction *fn);
+extern int ir_new_block(IrFunction *fn);
+extern int ir_new_inst(IrFunction *fn, IrOp op);
+extern int ir_new_operands(IrFunction *fn, int count);
+extern void ir_append(IrFunction *fn, int block, int inst);
+extern void ir_insert_before(IrFunction *fn, int before, int inst);
+extern void ir_prepend(IrFunction *fn, int block, int inst);
+extern void ir_remove(IrFunction *fn, int inst);
+extern int ir_successors(IrFunction *fn, int block, int succ[2]);
+extern void ir_compute_cfg(IrFunction *fn);
+extern IrFunction *ir_lower_function(NodeId id);
+extern void ir_dump_function(IrFunction *fn);
+
+// ssa.c
+extern void ir_construct_ssa(IrFunction *fn);
+extern void ir_deconstruct_ssa(IrFunction *fn);
+
+// irgen.c
+extern void ir_gen_function(IrFunction *fn);
+extern void gen_fun_impl_ir(NodeId id);
+extern void dump_ir_program(void);
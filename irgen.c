@@ -0,0 +1,733 @@
+#include "9cc.h"
+#include "emit.h"
+#include "ir.h"
+#include <limits.h>
+
+/*
+ * IRからのコード生成(--ir)
+ * SSA形式を解体したIRを次の順に処理する
+ *   1. ブロックを並べ(逆後順、分けた辺のブロックは末尾)、命令に位置を付ける
+ *   2. 一度だけ定義する32ビットに収まる定数は即値にし、直後のbrだけが使う比較
+ *      はbrと合わせてcmpとjccにする(どちらもレジスタを割り当てない)
+ *   3. 値ごとに使用から定義まで遡って生きているブロックを求め、1つの区間にまとめる
+ *   4. 線形走査でレジスタを割り当てる。callをまたぐ値はcallee-savedのレジスタに
+ *      置き、足りなければ終わりが最も遠い区間をスタックに置く(spill)
+ *   5. 命令ごとにアセンブリを出力する
+ * rax, rdx, r11は命令の中だけで使う作業用のレジスタで、値には割り当てない。
+ */
+
+static const char *ArgRegisters[] = {"rdi", "rsi", "rdx", "rcx", "r8", "r9"};
+#define ARG_REGISTER_COUNT (int)(sizeof(ArgRegisters) / sizeof(ArgRegisters[0]))
+
+// 割り当てるレジスタ。先頭のCALLER_SAVED_COUNT個はcallで壊れる
+static const char *Registers[] = {"r10", "r8", "r9", "rcx", "rsi", "rdi", "rbx", "r12", "r13", "r14", "r15"};
+#define REGISTER_COUNT (int)(sizeof(Registers) / sizeof(Registers[0]))
+#define CALLER_SAVED_COUNT 6
+#define ALL_REGISTERS ((1u << REGISTER_COUNT) - 1)
+#define CALLEE_SAVED_REGISTERS (ALL_REGISTERS & ~((1u << CALLER_SAVED_COUNT) - 1))
+
+// 値の置き場所
+typedef enum {
+    LOC_NONE,       // 使わない(比較をbrと合わせた値など)
+    LOC_REGISTER,
+    LOC_STACK,      // spillした値。[rbp - offset]
+    LOC_IMMEDIATE,  // 即値にした定数
+} LocationKind;
+
+typedef struct {
+    LocationKind kind;
+    int reg;        // LOC_REGISTER: Registersの番号
+    int offset;     // LOC_STACK: RBPからのオフセット
+    long imm;       // LOC_IMMEDIATE: 値
+} Location;
+
+typedef struct {
+    IrFunction *fn;
+    int *layout;            // 出力するブロックの並び
+    int layout_len;
+    int *next_block;        // ブロック -> 並びで次のブロック(なければ-1)
+    int *pos;               // 命令 -> 位置
+    int *block_start;       // ブロック -> 先頭の位置
+    int *block_end;         // ブロック -> 終端命令の位置
+    int *calls;             // callの位置(昇順)
+    int call_count;
+    int *def_count;         // 値 -> 定義する命令の数
+    int *use_count;         // 値 -> 読む命令の数
+    bool *fused;            // 比較の命令 -> 直後のbrと合わせて出力する
+    int *start, *end;       // 値 -> 生存区間 [start, end]
+    Location *loc;
+    int spill_size;         // spillした値の領域の大きさ
+    unsigned int used_callee_saved;
+    int callee_saved_offset[REGISTER_COUNT];
+    long label_base;
+} IrGen;
+
+// 命令が読む値のそれぞれについて、useをその値にしてbodyを実行する
+#define FOR_EACH_OPERAND(fn, in, use, body) do {                              \
+        IrValue use;                                                        \
+        if ((in)->a) { use = (in)->a; body; }                               \
+        if ((in)->b) { use = (in)->b; body; }                               \
+        if ((in)->op == IR_CALL) {                                          \
+            for (int k_ = 0; k_ < (in)->operand_count; k_++) {              \
+                use = (fn)->operands[(in)->operands + k_];                  \
+                body;                                                       \
+            }                                                               \
+        }                                                                   \
+    } while (0)
+
+static bool is_compare(IrOp op) {
+    return op == IR_LT || op == IR_LE || op == IR_EQ || op == IR_NE;
+}
+
+// ブロックを並べて命令に位置を付け、定義と使用の数を数える
+static void number_instructions(IrGen *g) {
+    IrFunction *fn = g->fn;
+    g->layout = fn->order;
+    g->layout_len = fn->order_len;
+    g->next_block = arena_alloc(ctx->ir_arena, sizeof(int) * fn->block_count);
+    g->block_start = arena_alloc(ctx->ir_arena, sizeof(int) * fn->block_count);
+    g->block_end = arena_alloc(ctx->ir_arena, sizeof(int) * fn->block_count);
+    g->pos = arena_alloc(ctx->ir_arena, sizeof(int) * fn->inst_count);
+    g->calls = arena_alloc(ctx->ir_arena, sizeof(int) * fn->inst_count);
+    g->def_count = arena_alloc(ctx->ir_arena, sizeof(int) * fn->value_count);
+    g->use_count = arena_alloc(ctx->ir_arena, sizeof(int) * fn->value_count);
+    g->fused = arena_alloc(ctx->ir_arena, sizeof(bool) * fn->inst_count);
+
+    int pos = 0;
+    for (int i = 0; i < g->layout_len; i++) {
+        const int b = g->layout[i];
+        g->next_block[b] = i + 1 < g->layout_len ? g->layout[i + 1] : -1;
+        g->block_start[b] = pos;
+        pos += 2;
+        for (int inst = fn->blocks[b].first; inst; inst = ir_inst(fn, inst)->next) {
+            const IrInst *in = ir_inst(fn, inst);
+            g->pos[inst] = pos;
+            g->block_end[b] = pos;
+            pos += 2;
+            if (in->op == IR_CALL) {
+                g->calls[g->call_count++] = g->pos[inst];
+            }
+            if (in->dst) {
+                g->def_count[in->dst]++;
+            }
+            FOR_EACH_OPERAND(fn, in, v, g->use_count[v]++);
+        }
+    }
+}
+
+// 即値にする定数と、brと合わせる比較を決める
+static void choose_locations(IrGen *g) {
+    IrFunction *fn = g->fn;
+    g->loc = arena_alloc(ctx->ir_arena, sizeof(Location) * fn->value_count);
+    for (int i = 0; i < g->layout_len; i++) {
+        for (int inst = fn->blocks[g->layout[i]].first; inst; inst = ir_inst(fn, inst)->next) {
+            const IrInst *in = ir_inst(fn, inst);
+            if (in->op == IR_CONST && g->def_count[in->dst] == 1 &&
+                INT32_MIN <= in->imm && in->imm <= INT32_MAX) {
+                g->loc[in->dst].kind = LOC_IMMEDIATE;
+                g->loc[in->dst].imm = in->imm;
+            }
+            if (is_compare(in->op) && in->next && g->def_count[in->dst] == 1 && g->use_count[in->dst] == 1) {
+                const IrInst *br = ir_inst(fn, in->next);
+                if (br->op == IR_BR && br->a == in->dst) {
+                    g->fused[inst] = true;
+                }
+            }
+        }
+    }
+}
+
+// 値にレジスタかスタックの置き場所が必要か
+static bool needs_location(IrGen *g, IrValue v) {
+    return g->loc[v].kind == LOC_NONE;
+}
+
+/*
+ * 生存区間
+ * 値ごとに、ブロックの中で先に定義せずに読むブロックから前のブロックへ遡り、
+ * 値を定義するブロックに着くまでのブロックの入口と出口で生きているとする。
+ * 遡るのは値が生きているブロックだけなので、手間は生存区間の長さの合計に比例す
+ * る。値ごとに生きている位置をすべて含む1つの区間にまとめる
+ */
+static void compute_intervals(IrGen *g) {
+    IrFunction *fn = g->fn;
+    g->start = arena_alloc(ctx->ir_arena, sizeof(int) * fn->value_count);
+    g->end = arena_alloc(ctx->ir_arena, sizeof(int) * fn->value_count);
+    for (IrValue v = 0; v < fn->value_count; v++) {
+        g->start[v] = INT_MAX;
+        g->end[v] = -1;
+    }
+#define EXTEND(v, p) do {                               \
+        g->start[v] = MIN(g->start[v], (p));            \
+        g->end[v] = MAX(g->end[v], (p));                \
+    } while (0)
+
+    // 値ごとに、定義するブロックと入口で生きているブロックを値の順に詰めて並べる
+    int *def_first = arena_alloc(ctx->ir_arena, sizeof(int) * (fn->value_count + 1));
+    int *use_first = arena_alloc(ctx->ir_arena, sizeof(int) * (fn->value_count + 1));
+    for (IrValue v = 0; v < fn->value_count; v++) {
+        def_first[v + 1] = def_first[v] + g->def_count[v];
+        use_first[v + 1] = use_first[v] + g->use_count[v];
+    }
+    int *def_blocks = arena_alloc(ctx->ir_arena, sizeof(int) * (def_first[fn->value_count] + 1));
+    int *use_blocks = arena_alloc(ctx->ir_arena, sizeof(int) * (use_first[fn->value_count] + 1));
+    int *def_len = arena_alloc(ctx->ir_arena, sizeof(int) * fn->value_count);
+    int *use_len = arena_alloc(ctx->ir_arena, sizeof(int) * fn->value_count);
+    int *defined_in = arena_alloc(ctx->ir_arena, sizeof(int) * fn->value_count); // 値 -> 定義したブロック+1
+
+    for (int i = 0; i < g->layout_len; i++) {
+        const int b = g->layout[i];
+        for (int inst = fn->blocks[b].first; inst; inst = ir_inst(fn, inst)->next) {
+            const IrInst *in = ir_inst(fn, inst);
+            FOR_EACH_OPERAND(fn, in, v, {
+                EXTEND(v, g->pos[inst]);
+                if (defined_in[v] != b + 1) {
+                    use_blocks[use_first[v] + use_len[v]++] = b;
+                }
+            });
+            if (in->dst) {
+                // 引数は入口でまとめて引数レジスタから移すので、関数の先頭から生きている
+                EXTEND(in->dst, in->op == IR_PARAM ? 0 : g->pos[inst]);
+                defined_in[in->dst] = b + 1;
+                def_blocks[def_first[in->dst] + def_len[in->dst]++] = b;
+            }
+        }
+    }
+
+    // ブロック -> 入口・出口で生きているとした値、定義する値(いまたどっている値の印)
+    int *live_in = arena_alloc(ctx->ir_arena, sizeof(int) * fn->block_count);
+    int *live_out = arena_alloc(ctx->ir_arena, sizeof(int) * fn->block_count);
+    int *defines = arena_alloc(ctx->ir_arena, sizeof(int) * fn->block_count);
+    int *stack = arena_alloc(ctx->ir_arena, sizeof(int) * fn->block_count);
+    for (IrValue v = 1; v < fn->value_count; v++) {
+        for (int k = def_first[v]; k < def_first[v] + def_len[v]; k++) {
+            defines[def_blocks[k]] = v;
+        }
+        int depth = 0;
+        for (int k = use_first[v]; k < use_first[v] + use_len[v]; k++) {
+            const int b = use_blocks[k];
+            if (live_in[b] != v) {
+                live_in[b] = v;
+                EXTEND(v, g->block_start[b]);
+                stack[depth++] = b;
+            }
+        }
+        while (depth > 0) {
+            const IrBlock *block = &fn->blocks[stack[--depth]];
+            for (int k = 0; k < block->pred_count; k++) {
+                const int p = block->preds[k];
+                if (live_out[p] == v) {
+                    continue;
+                }
+                live_out[p] = v;
+                EXTEND(v, g->block_end[p]);
+                if (defines[p] != v && live_in[p] != v) {
+                    live_in[p] = v;
+                    EXTEND(v, g->block_start[p]);
+                    stack[depth++] = p;
+                }
+            }
+        }
+    }
+#undef EXTEND
+}
+
+// 区間(start, end)の間にcallがあるか
+static bool crosses_call(IrGen *g, IrValue v) {
+    int lo = 0, hi = g->call_count;
+    while (lo < hi) {
+        const int mid = (lo + hi) / 2;
+        if (g->calls[mid] <= g->start[v]) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo < g->call_count && g->calls[lo] < g->end[v];
+}
+
+static void spill(IrGen *g, IrValue v) {
+    g->spill_size += 8;
+    g->loc[v].kind = LOC_STACK;
+    g->loc[v].offset = g->fn->frame_size + g->spill_size;
+}
+
+static _Thread_local IrGen *sort_target; // qsortの比較関数から区間を見る
+
+static int compare_start(const void *a, const void *b) {
+    const IrValue x = *(const IrValue *)a, y = *(const IrValue *)b;
+    if (sort_target->start[x] != sort_target->start[y]) {
+        return sort_target->start[x] < sort_target->start[y] ? -1 : 1;
+    }
+    return x - y;
+}
+
+// 線形走査でレジスタを割り当てる
+static void allocate_registers(IrGen *g) {
+    IrFunction *fn = g->fn;
+    IrValue *values = arena_alloc(ctx->ir_arena, sizeof(IrValue) * fn->value_count);
+    int count = 0;
+    for (IrValue v = 1; v < fn->value_count; v++) {
+        if (g->end[v] >= 0 && needs_location(g, v)) {
+            values[count++] = v;
+        }
+    }
+    sort_target = g;
+    qsort(values, count, sizeof(IrValue), compare_start);
+
+    IrValue active[REGISTER_COUNT];
+    int active_len = 0;
+    unsigned int free_registers = ALL_REGISTERS;
+    for (int i = 0; i < count; i++) {
+        const IrValue v = values[i];
+        for (int k = 0; k < active_len;) {
+            const IrValue w = active[k];
+            if (g->end[w] <= g->start[v]) {
+                free_registers |= 1u << g->loc[w].reg;
+                active[k] = active[--active_len];
+            } else {
+                k++;
+            }
+        }
+
+        const unsigned int allowed = crosses_call(g, v) ? CALLEE_SAVED_REGISTERS : ALL_REGISTERS;
+        if (free_registers & allowed) {
+            const int r = __builtin_ctz(free_registers & allowed);
+            free_registers &= ~(1u << r);
+            g->loc[v].kind = LOC_REGISTER;
+            g->loc[v].reg = r;
+            active[active_len++] = v;
+            continue;
+        }
+
+        // 使えるレジスタを持つ区間のうち終わりが最も遠いものと比べ、遠い方をspillする
+        int victim = -1;
+        for (int k = 0; k < active_len; k++) {
+            if (allowed & 1u << g->loc[active[k]].reg &&
+                (victim < 0 || g->end[active[k]] > g->end[active[victim]])) {
+                victim = k;
+            }
+        }
+        if (victim >= 0 && g->end[active[victim]] > g->end[v]) {
+            const IrValue w = active[victim];
+            g->loc[v] = g->loc[w];
+            spill(g, w);
+            active[victim] = v;
+        } else {
+            spill(g, v);
+        }
+    }
+
+    for (IrValue v = 1; v < fn->value_count; v++) {
+        if (g->loc[v].kind == LOC_REGISTER && g->loc[v].reg >= CALLER_SAVED_COUNT) {
+            g->used_callee_saved |= 1u << g->loc[v].reg;
+        }
+    }
+}
+
+/*
+ * アセンブリの出力
+ */
+
+// 値のオペランドとしての表記
+typedef struct {
+    char text[40];
+} OperandText;
+
+static OperandText operand(IrGen *g, IrValue v) {
+    OperandText op;
+    const Location *loc = &g->loc[v];
+    switch (loc->kind) {
+    case LOC_REGISTER:
+        snprintf(op.text, sizeof(op.text), "%s", Registers[loc->reg]);
+        break;
+    case LOC_STACK:
+        snprintf(op.text, sizeof(op.text), "qword ptr [rbp - %d]", loc->offset);
+        break;
+    case LOC_IMMEDIATE:
+        snprintf(op.text, sizeof(op.text), "%ld", loc->imm);
+        break;
+    default:
+        error_exit("値v%dに置き場所がありません", v);
+    }
+    return op;
+}
+
+static bool in_register(IrGen *g, IrValue v) {
+    return g->loc[v].kind == LOC_REGISTER;
+}
+
+static bool in_memory(IrGen *g, IrValue v) {
+    return g->loc[v].kind == LOC_STACK;
+}
+
+// 値をレジスタで読む。レジスタになければscratchに読み込む
+static OperandText load(IrGen *g, IrValue v, const char *scratch) {
+    if (in_register(g, v)) {
+        return operand(g, v);
+    }
+    emit("  mov %s, %s\n", scratch, operand(g, v).text);
+    OperandText op;
+    snprintf(op.text, sizeof(op.text), "%s", scratch);
+    return op;
+}
+
+// 結果を書くレジスタ。dstがレジスタならそれを、そうでなければscratchを使う
+static const char *result_register(IrGen *g, IrValue dst, const char *scratch) {
+    return in_register(g, dst) ? Registers[g->loc[dst].reg] : scratch;
+}
+
+// regに計算した結果をdstの置き場所に書く
+static void store_result(IrGen *g, IrValue dst, const char *reg) {
+    const OperandText d = operand(g, dst);
+    if (strcmp(d.text, reg) != 0) {
+        emit("  mov %s, %s\n", d.text, reg);
+    }
+}
+
+// dst = src。メモリ同士はr11を経由する
+static void move(const char *dst, const char *src, bool both_memory) {
+    if (strcmp(dst, src) == 0) {
+        return;
+    }
+    if (both_memory) {
+        emit("  mov r11, %s\n", src);
+        src = "r11";
+    }
+    emit("  mov %s, %s\n", dst, src);
+}
+
+/*
+ * 並列の移動 dst[i] = src[i] (i < n)
+ * 他の移動が読む場所に書く移動は後回しにし、循環していればraxに退避して切る
+ * memory[i]はdst[i]とsrc[i]がどちらもメモリか
+ */
+static void parallel_move(const char **dst, const char **src, bool *memory, int n) {
+    while (n > 0) {
+        int ready = -1;
+        for (int i = 0; i < n && ready < 0; i++) {
+            bool blocked = false;
+            for (int j = 0; j < n && !blocked; j++) {
+                blocked = j != i && strcmp(src[j], dst[i]) == 0;
+            }
+            if (!blocked) {
+                ready = i;
+            }
+        }
+        if (ready < 0) {
+            emit("  mov rax, %s\n", dst[0]);
+            for (int j = 0; j < n; j++) {
+                if (strcmp(src[j], dst[0]) == 0) {
+                    src[j] = "rax";
+                    memory[j] = false;
+                }
+            }
+            continue;
+        }
+        move(dst[ready], src[ready], memory[ready]);
+        dst[ready] = dst[n - 1];
+        src[ready] = src[n - 1];
+        memory[ready] = memory[n - 1];
+        n--;
+    }
+}
+
+static void emit_label(IrGen *g, int block) {
+    emit(".Lir%08ld:\n", g->label_base + block);
+}
+
+static void emit_jump(IrGen *g, const char *jump, int from, int to) {
+    if (strcmp(jump, "jmp") == 0 && g->next_block[from] == to) {
+        return; // 次のブロックなら落ちるだけ
+    }
+    emit("  %s .Lir%08ld\n", jump, g->label_base + to);
+}
+
+static void gen_prologue(IrGen *g) {
+    IrFunction *fn = g->fn;
+    emit("_%s%s:\n", ctx->symbol_prefix, symbol_name(fn->ident));
+    emit("  push rbp      # prologue\n");
+    emit("  mov rbp, rsp  # prologue\n");
+    emit("  xor eax, eax  # prologue\n"); // mov eax, 0 と同じ
+
+    int size = fn->frame_size + g->spill_size;
+    for (int r = CALLER_SAVED_COUNT; r < REGISTER_COUNT; r++) {
+        if (g->used_callee_saved & 1u << r) {
+            size += 8;
+            g->callee_saved_offset[r] = size;
+        }
+    }
+    const int stack_size = (size + 15) / 16 * 16; // 16バイト境界に揃える
+    emit("  sub rsp, %-4d # prologue\n", stack_size);
+    for (int r = CALLER_SAVED_COUNT; r < REGISTER_COUNT; r++) {
+        if (g->used_callee_saved & 1u << r) {
+            emit("  mov qword ptr [rbp - %d], %s  # prologue\n", g->callee_saved_offset[r], Registers[r]);
+        }
+    }
+
+    // 使う引数を引数レジスタから置き場所へ移す
+    const char *dst[ARG_REGISTER_COUNT], *src[ARG_REGISTER_COUNT];
+    bool memory[ARG_REGISTER_COUNT] = {false};
+    OperandText ops[ARG_REGISTER_COUNT];
+    int n = 0;
+    for (int inst = fn->blocks[0].first; inst; inst = ir_inst(fn, inst)->next) {
+        const IrInst *in = ir_inst(fn, inst);
+        if (in->op == IR_PARAM && g->use_count[in->dst] > 0) {
+            ops[n] = operand(g, in->dst);
+            dst[n] = ops[n].text;
+            src[n] = ArgRegisters[in->imm];
+            n++;
+        }
+    }
+    parallel_move(dst, src, memory, n);
+}
+
+static void gen_epilogue(IrGen *g) {
+    for (int r = CALLER_SAVED_COUNT; r < REGISTER_COUNT; r++) {
+        if (g->used_callee_saved & 1u << r) {
+            emit("  mov %s, qword ptr [rbp - %d]  # epilogue\n", Registers[r], g->callee_saved_offset[r]);
+        }
+    }
+    emit("  mov rsp, rbp  # epilogue\n");
+    emit("  pop rbp       # epilogue\n");
+    emit("  ret           # epilogue\n");
+}
+
+// 比較の命令に対応する条件(setcc, jccの接尾辞)。negateなら否定した条件
+static const char *condition(IrOp op, bool negate) {
+    switch (op) {
+    case IR_LT:
+        return negate ? "ge" : "l";
+    case IR_LE:
+        return negate ? "g" : "le";
+    case IR_EQ:
+        return negate ? "ne" : "e";
+    default:
+        return negate ? "e" : "ne";
+    }
+}
+
+// aとbを比べる(cmp)。aが即値かメモリならraxに読む
+static void gen_compare(IrGen *g, const IrInst *in) {
+    const OperandText a = load(g, in->a, "rax");
+    OperandText b = operand(g, in->b);
+    if (!in_register(g, in->a) && in_memory(g, in->b)) {
+        b = load(g, in->b, "r11");
+    }
+    emit("  cmp %s, %s\n", a.text, b.text);
+}
+
+// dst = a op b (add, sub, mul, div)
+static void gen_arithmetic(IrGen *g, const IrInst *in) {
+    const bool constant = g->loc[in->b].kind == LOC_IMMEDIATE;
+    if (in->op == IR_DIV && !(constant && g->loc[in->b].imm != 0)) {
+        emit("  mov rax, %s\n", operand(g, in->a).text);
+        emit("  cqo\n");
+        emit("  idiv %s\n", in_memory(g, in->b) ? operand(g, in->b).text : load(g, in->b, "r11").text);
+        store_result(g, in->dst, "rax");
+        return;
+    }
+
+    // 結果のレジスタがbと同じなら先にaを書くとbが壊れるのでr11で計算する
+    const char *reg = result_register(g, in->dst, "r11");
+    if (!constant && strcmp(reg, operand(g, in->b).text) == 0) {
+        reg = "r11";
+    }
+    if (strcmp(reg, operand(g, in->a).text) != 0) {
+        emit("  mov %s, %s\n", reg, operand(g, in->a).text);
+    }
+    if (in->op == IR_MUL && constant) {
+        gen_multiply_constant(reg, g->loc[in->b].imm);
+    } else if (in->op == IR_DIV) {
+        gen_divide_constant(reg, g->loc[in->b].imm);
+    } else {
+        const char *mnemonic = in->op == IR_ADD ? "add" : in->op == IR_SUB ? "sub" : "imul";
+        emit("  %s %s, %s\n", mnemonic, reg, operand(g, in->b).text);
+    }
+    store_result(g, in->dst, reg);
+}
+
+static void gen_call(IrGen *g, const IrInst *in) {
+    IrFunction *fn = g->fn;
+    const char *dst[ARG_REGISTER_COUNT], *src[ARG_REGISTER_COUNT];
+    bool memory[ARG_REGISTER_COUNT] = {false};
+    OperandText ops[ARG_REGISTER_COUNT];
+    for (int i = 0; i < in->operand_count; i++) {
+        ops[i] = operand(g, fn->operands[in->operands + i]);
+        dst[i] = ArgRegisters[i];
+        src[i] = ops[i].text;
+    }
+    parallel_move(dst, src, memory, in->operand_count);
+    emit("  call _%s%s\n", function_prefix(in->sym), symbol_name(in->sym));
+    if (g->use_count[in->dst] > 0) {
+        store_result(g, in->dst, "rax");
+    }
+}
+
+static void gen_inst(IrGen *g, int b, int inst) {
+    const IrInst *in = ir_inst(g->fn, inst);
+    if (in->dst && in->op != IR_CALL && g->use_count[in->dst] == 0 && in->op != IR_PARAM) {
+        return; // 使わない値は計算しない(どの命令も副作用はcallとstoreだけ)
+    }
+    switch (in->op) {
+    case IR_NOP:
+    case IR_PARAM: // プロローグで移した
+    case IR_PHI:   // 解体した後には残らない
+        break;
+    case IR_CONST:
+        if (g->loc[in->dst].kind != LOC_IMMEDIATE) {
+            const OperandText d = operand(g, in->dst);
+            if (in_memory(g, in->dst)) {
+                emit("  mov r11, %ld\n", in->imm);
+                emit("  mov %s, r11\n", d.text);
+            } else {
+                emit("  mov %s, %ld\n", d.text, in->imm);
+            }
+        }
+        break;
+    case IR_COPY:
+        move(operand(g, in->dst).text, operand(g, in->a).text, in_memory(g, in->dst) && in_memory(g, in->a));
+        break;
+    case IR_ADD:
+    case IR_SUB:
+    case IR_MUL:
+    case IR_DIV:
+        gen_arithmetic(g, in);
+        break;
+    case IR_LT:
+    case IR_LE:
+    case IR_EQ:
+    case IR_NE: {
+        gen_compare(g, in);
+        if (g->fused[inst]) {
+            break; // 直後のbrが条件ジャンプする
+        }
+        const char *reg = result_register(g, in->dst, "rax");
+        emit("  set%s al\n", condition(in->op, false));
+        emit("  movzx %s, al\n", reg);
+        store_result(g, in->dst, reg);
+        break;
+    }
+    case IR_SLOT_ADDR: {
+        const char *reg = result_register(g, in->dst, "r11");
+        emit("  lea %s, [rbp - %d]\n", reg, g->fn->slots[in->slot].offset);
+        store_result(g, in->dst, reg);
+        break;
+    }
+    case IR_LOAD_SLOT: {
+        const char *reg = result_register(g, in->dst, "r11");
+        emit("  mov %s, qword ptr [rbp - %d]\n", reg, g->fn->slots[in->slot].offset);
+        store_result(g, in->dst, reg);
+        break;
+    }
+    case IR_STORE_SLOT:
+        emit("  mov qword ptr [rbp - %d], %s\n", g->fn->slots[in->slot].offset,
+             in_memory(g, in->a) ? load(g, in->a, "r11").text : operand(g, in->a).text);
+        break;
+    case IR_LOAD: {
+        const OperandText address = load(g, in->a, "r11");
+        const char *reg = result_register(g, in->dst, "rax");
+        emit("  mov %s, qword ptr [%s]\n", reg, address.text);
+        store_result(g, in->dst, reg);
+        break;
+    }
+    case IR_STORE: {
+        const OperandText address = load(g, in->a, "r11");
+        const OperandText value = in_memory(g, in->b) ? load(g, in->b, "rax") : operand(g, in->b);
+        emit("  mov qword ptr [%s], %s\n", address.text, value.text);
+        break;
+    }
+    case IR_CALL:
+        gen_call(g, in);
+        break;
+    case IR_JMP:
+        emit_jump(g, "jmp", b, in->target[0]);
+        break;
+    case IR_BR: {
+        const IrInst *prev = in->prev ? ir_inst(g->fn, in->prev) : NULL;
+        if (g->loc[in->a].kind == LOC_IMMEDIATE) {
+            emit_jump(g, "jmp", b, in->target[g->loc[in->a].imm ? 0 : 1]);
+            break;
+        }
+        const bool fused = prev && g->fused[in->prev];
+        if (!fused) {
+            emit("  cmp %s, 0\n", operand(g, in->a).text);
+        }
+        const IrOp op = fused ? prev->op : IR_NE;
+        // 偽の飛び先が次のブロックなら、真のときだけ飛ぶ
+        const bool fall_to_else = g->next_block[b] == in->target[1];
+        char jump[8];
+        snprintf(jump, sizeof(jump), "j%s", condition(op, !fall_to_else));
+        emit_jump(g, jump, b, in->target[fall_to_else ? 0 : 1]);
+        if (!fall_to_else) {
+            emit_jump(g, "jmp", b, in->target[0]);
+        }
+        break;
+    }
+    case IR_RET: {
+        const OperandText value = operand(g, in->a);
+        if (strcmp(value.text, "rax") != 0) {
+            emit("  mov rax, %s\n", value.text);
+        }
+        gen_epilogue(g);
+        break;
+    }
+    default:
+        error_exit("IRのコード生成ができません: %s", ir_op_name(in->op));
+    }
+}
+
+/**
+ * SSA形式を解体した関数のIRからアセンブリを出力する
+ * ブロックのラベルには関数ごとにctx->label_sequence_noから番号を割り当てる
+ */
+void ir_gen_function(IrFunction *fn) {
+    IrGen g = {.fn = fn, .label_base = ctx->label_sequence_no};
+    ctx->label_sequence_no += fn->block_count;
+
+    number_instructions(&g);
+    choose_locations(&g);
+    compute_intervals(&g);
+    allocate_registers(&g);
+
+    gen_prologue(&g);
+    for (int i = 0; i < g.layout_len; i++) {
+        const int b = g.layout[i];
+        if (i > 0) {
+            emit_label(&g, b);
+        }
+        for (int inst = fn->blocks[b].first; inst; inst = ir_inst(fn, inst)->next) {
+            gen_inst(&g, b, inst);
+        }
+    }
+}
+
+/**
+ * 関数定義のノードをIRを経由してコード生成する(--ir)
+ */
+void gen_fun_impl_ir(NodeId id) {
+    IrFunction *fn = ir_lower_function(id);
+    ir_construct_ssa(fn);
+    ir_deconstruct_ssa(fn);
+    ir_gen_function(fn);
+    arena_release(ctx->ir_arena);
+}
+
+/**
+ * プログラムの関数定義をSSA形式のIRにしてテキストで出力する(--dump-ir)
+ */
+void dump_ir_program(void) {
+    for (int i = 0; i < list_len(ctx->code); i++) {
+        const NodeId id = list_at(ctx->code, i);
+        if (node_at(id)->kind != ND_FUN_IMPL) {
+            continue;
+        }
+        IrFunction *fn = ir_lower_function(id);
+        ir_construct_ssa(fn);
+        if (i > 0) {
+            emit("\n");
+        }
+        ir_dump_function(fn);
+        arena_release(ctx->ir_arena);
+    }
+}
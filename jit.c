@@ -0,0 +1,102 @@
+#define _DEFAULT_SOURCE // MAP_ANONYMOUS
+#include "9cc.h"
+#include "jit.h"
+#include <dlfcn.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+// 外部のシンボルへのジャンプ台: jmp [rip + 0] の直後に飛び先のアドレスを置く
+#define STUB_SIZE 16
+static const unsigned char STUB_JMP[] = {0xff, 0x25, 0x00, 0x00, 0x00, 0x00};
+
+/**
+ * 外部のシンボルを探すライブラリを読み込む(--load)
+ * 読み込んだライブラリはプロセスの終了まで開いたままにする
+ */
+void jit_load_library(const char *path) {
+    if (!dlopen(path, RTLD_NOW | RTLD_GLOBAL)) {
+        error_exit("ライブラリを読み込めません: %s", dlerror());
+    }
+}
+
+// シンボルのアドレスを探す。アセンブリの名前は先頭に'_'が付いているので外して探す
+static void *find_host_symbol(const char *name) {
+    void *p = NULL;
+    if (name[0] == '_') {
+        p = dlsym(RTLD_DEFAULT, name + 1);
+    }
+    if (!p) {
+        p = dlsym(RTLD_DEFAULT, name);
+    }
+    if (!p) {
+        error_exit("シンボルが見つかりません: %s", name);
+    }
+    return p;
+}
+
+/**
+ * オブジェクトを実行可能なメモリに置く
+ * 未定義のシンボルごとにジャンプ台を機械語の後ろに作り、rel32の参照はジャンプ
+ * 台に向ける(ホストの関数はrel32で届かない所にあることがあるため)
+ */
+void jit_load(JitCode *code, const Object *obj) {
+    *code = (JitCode){0};
+
+    // 未定義のシンボルにジャンプ台の番号を振る
+    int *stub_of = malloc(sizeof(int) * (obj->symbols_len + 1));
+    int stubs = 0;
+    for (int i = 0; i < obj->symbols_len; i++) {
+        stub_of[i] = obj->symbols[i].defined ? -1 : stubs++;
+    }
+
+    const size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    const size_t stub_base = (obj->code_len + STUB_SIZE - 1) / STUB_SIZE * STUB_SIZE;
+    const size_t size = ((stub_base + STUB_SIZE * stubs) + page - 1) / page * page;
+    unsigned char *memory = mmap(NULL, size ? size : page, PROT_READ | PROT_WRITE,
+                                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED) {
+        free(stub_of);
+        error_exit("JITのメモリを確保できません");
+    }
+    code->memory = memory;
+    code->size = size ? size : page;
+    memcpy(memory, obj->code, obj->code_len);
+
+    for (int i = 0; i < obj->symbols_len; i++) {
+        if (stub_of[i] >= 0) {
+            unsigned char *stub = memory + stub_base + STUB_SIZE * stub_of[i];
+            void *target = find_host_symbol(obj->symbols[i].name);
+            memcpy(stub, STUB_JMP, sizeof(STUB_JMP));
+            memcpy(stub + sizeof(STUB_JMP), &target, sizeof(target));
+        }
+    }
+    for (int i = 0; i < obj->relocs_len; i++) {
+        const ObjectReloc *reloc = &obj->relocs[i];
+        const size_t stub = stub_base + STUB_SIZE * stub_of[reloc->symbol];
+        const int32_t rel = (int32_t)((int64_t)stub - (int64_t)(reloc->offset + 4));
+        memcpy(memory + reloc->offset, &rel, sizeof(rel));
+    }
+    free(stub_of);
+
+    for (int i = 0; i < obj->symbols_len; i++) {
+        const ObjectSymbol *sym = &obj->symbols[i];
+        if (sym->defined && strcmp(sym->name, "_main") == 0) {
+            code->main = (int (*)(void))(memory + sym->offset);
+        }
+    }
+    if (!code->main) {
+        error_exit("_mainが定義されていません");
+    }
+
+    // 書き込みを禁止してから実行を許す
+    if (mprotect(memory, code->size, PROT_READ | PROT_EXEC) != 0) {
+        error_exit("JITのメモリを実行可能にできません");
+    }
+}
+
+void jit_unload(JitCode *code) {
+    if (code->memory) {
+        munmap(code->memory, code->size);
+    }
+    *code = (JitCode){0};
+}
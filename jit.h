@@ -0,0 +1,21 @@
+#pragma once
+
+#include "asm.h"
+
+/*
+ * JIT実行(--run)
+ * asm_finish()済のオブジェクトを実行可能なメモリに置き、未定義のシンボルを
+ * このプロセスのシンボル(dlsym)に結び付けて_mainを直接呼び出す。
+ * メモリは書き込み可能な状態で機械語を置き、実行前に読み取り・実行のみに切り替
+ * える(書き込みと実行を同時には許さない)。
+ */
+
+typedef struct {
+    void *memory;       // 機械語を置いたメモリ
+    size_t size;
+    int (*main)(void);  // _mainの入口
+} JitCode;
+
+extern void jit_load_library(const char *path);
+extern void jit_load(JitCode *code, const Object *obj);
+extern void jit_unload(JitCode *code);
@@ -1,44 +1,445 @@
+#define _POSIX_C_SOURCE 200809L // clock_gettime
 #include "9cc.h"
+#include "scan.h"
+#include "emit.h"
+#include "report.h"
+#include "jit.h"
+#include "batch.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdarg.h>
+#include <stdatomic.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
 
-int main(int argc, char **argv) {
-    //D("~~~ENTER~~~");
+// コンパイルの設定(全ての入力で共通)
+typedef struct {
+    bool arena_stats;
+    bool asm_stats;
+    bool compact_asm;
+    const char *cache_dir;      // 関数キャッシュのディレクトリ(NULLなら使わない)
+    size_t cache_max_size;      // 関数キャッシュの容量(バイト)
+    bool cache_stats;
+    bool no_peephole;           // 覗き穴最適化をしない
+    bool peephole_stats;        // 覗き穴最適化の規則ごとの件数を表示する
+    bool ir;                    // 中間表現を経由してコード生成する
+    bool dump_ir;               // アセンブリの代わりに中間表現を出力する
+    bool time_report;           // フェーズごとの時間と件数を表示する
+    bool mem_report;            // サブシステムごとのメモリ使用量を表示する
+    bool report_json;           // レポートをJSON Linesで書く
+    bool object;                // アセンブリの代わりにELFのオブジェクトファイルを出力する(-c)
+    bool run;                   // 出力せずにJITで_mainを実行する(--run)
+} Options;
 
-    if (argc != 2) {
-        error_exit("引数の個数が正しくありません");
+// エラーメッセージに入力の名前を付けるかどうか(入力が複数の場合)
+static bool show_input_name = false;
+
+// アリーナの使用量を表示する
+static void print_arena_stats(Arena *arena) {
+    fprintf(stderr, "arena %-8s used=%zu reserved=%zu allocations=%zu\n",
+            arena->name,
+            arena_bytes_used(arena),
+            arena_bytes_reserved(arena),
+            arena->count);
+}
+
+/**
+ * 入力を1つコンパイルしてアセンブリをoutput(NULLなら標準出力)に書く
+ * 成功すれば0、エラーがあれば1を返す。エラーの場合は書きかけの出力を消す
+ * --runなら何も書かずに_mainを実行し、その戻り値を返す
+ */
+static int compile(const Options *options, char *input, char *output) {
+    Compiler compiler;
+    jmp_buf on_error;
+    volatile int out_fd = STDOUT_FILENO;
+
+    // レポートを取らないなら時刻も取らない
+    const bool reporting = options->time_report || options->mem_report;
+    Report report = {.input = input};
+    const double begin = reporting ? report_clock() : 0;
+
+    Object object;
+    JitCode jit = {0};
+    compiler_enter(&compiler, input);
+    if (setjmp(on_error)) {
+        jit_unload(&jit);
+        if (output && out_fd >= 0) {
+            close(out_fd);
+            unlink(output);
+        }
+        emit_close();
+        compiler_leave();
+        trace_dump(stderr, show_input_name ? input : NULL);
         return 1;
     }
+    ctx->on_error = &on_error;
+    ctx->peephole = !options->no_peephole;
+    ctx->ir = options->ir;
+    ctx->dump_ir = options->dump_ir;
+
+    // オブジェクトファイルを出力する場合はコメントを読み飛ばすだけなので出力しない
+    const bool compact = options->compact_asm || options->object;
+    if (options->cache_dir) {
+        // 出力に影響するバージョンとオプションはキーに混ぜる
+        char salt[64];
+        const int n = snprintf(salt, sizeof(salt), "%s compact=%d peephole=%d ir=%d",
+                               VERSION, compact, !options->no_peephole, options->ir);
+        ctx->cache_dir = options->cache_dir;
+        ctx->cache_salt = cache_hash(CACHE_HASH_INIT, salt, n);
+    }
+
+    load_source();
+    if (output) {
+        out_fd = open(output, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (out_fd < 0) {
+            error_exit("出力ファイルを開けません: %s", output);
+        }
+    }
+    if (options->object) {
+        // アセンブリは組み込みのアセンブラに直接流し込む
+        asm_begin(&object);
+        ctx->object = &object;
+        emit_open_sink(asm_feed, &object, compact);
+    } else {
+        emit_open(out_fd, compact);
+    }
 
     // トークナイズしてパースする
-    token = tokenize(argv[1]);
+    double lap = reporting ? report_clock() : 0;
+    ctx->token = tokenize(ctx->source);
+    if (reporting) {
+        const double now = report_clock();
+        report.tokenize_time = now - lap;
+        lap = now;
+    }
     program();
+    if (reporting) {
+        const double now = report_clock();
+        report.parse_time = now - lap;
+        lap = now;
+    }
+
+    // パースが終わればトークンは不要なのでまとめて解放する
+    if (options->arena_stats) {
+        print_arena_stats(ctx->token_arena);
+    }
+    if (reporting) {
+        // トークン列はこの後解放するので、ここで数えておく
+        report.tokens = ctx->tokens.count;
+        report_memory(&report, "tokens", arena_bytes_used(ctx->token_arena),
+                      arena_bytes_reserved(ctx->token_arena));
+    }
+    ctx->token = 0;
+    ctx->tokens = (Tokens){0};
+    arena_release(ctx->token_arena);
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    gen_program();
+    emit_flush();
+    if (options->object) {
+        asm_finish(ctx->object);
+        if (options->run) {
+            jit_load(&jit, ctx->object);
+        } else {
+            write_elf_object(out_fd, ctx->object);
+        }
+    }
+    if (reporting) {
+        report.codegen_time = report_clock() - lap;
+    }
+
+    if (options->asm_stats) {
+        struct timespec end;
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        const double elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) * 1e-9;
+        fprintf(stderr, "asm: %zu bytes, %zu lines, %.3f ms, %.1f MB/s\n",
+                emit_bytes(), emit_lines(), elapsed * 1e3,
+                emit_bytes() / elapsed / (1024 * 1024));
+    }
+
+    if (options->arena_stats) {
+        print_arena_stats(ctx->parse_arena);
+        print_arena_stats(ctx->codegen_arena);
+        fprintf(stderr, "ast nodes=%u (%zu bytes) list-items=%u (%zu bytes) types=%d\n",
+                ctx->ast.count, ctx->ast.count * sizeof(Node),
+                ctx->ast.lists_len, ctx->ast.lists_len * sizeof(NodeId), type_count());
+    }
+
+    if (ctx->cache_dir) {
+        CacheStats *stats = &ctx->cache_stats;
+        if (stats->stores > 0) {
+            cache_evict(ctx->cache_dir, options->cache_max_size, stats);
+        }
+        if (options->cache_stats) {
+            fprintf(stderr, "cache: hits=%ld misses=%ld stores=%ld evictions=%ld\n",
+                    stats->hits, stats->misses, stats->stores, stats->evictions);
+        }
+    }
+
+    if (options->peephole_stats) {
+        const PeepholeStats *stats = &ctx->peephole_stats;
+        for (int i = 0; i < PEEPHOLE_RULE_COUNT; i++) {
+            fprintf(stderr, "peephole: %-12s removed=%ld rewritten=%ld\n",
+                    peephole_rule_name(i), stats->removed[i], stats->rewritten[i]);
+        }
+    }
+
+    if (reporting) {
+        report.nodes = ctx->ast.count;
+        report.list_items = ctx->ast.lists_len;
+        report.types = type_count();
+        report.symbols = symbol_count();
+        report.locals = ctx->local_count;
+        report.lookups = ctx->lookup_count;
+        report.instructions = emit_instructions();
+        report.lines = emit_lines();
+        report.bytes = emit_bytes();
+
+        size_t used, reserved;
+        report_memory(&report, "parse", arena_bytes_used(ctx->parse_arena),
+                      arena_bytes_reserved(ctx->parse_arena));
+        report_memory(&report, "ast",
+                      ctx->ast.count * sizeof(Node) + ctx->ast.lists_len * sizeof(NodeId),
+                      ctx->ast.capacity * sizeof(Node) + ctx->ast.lists_capacity * sizeof(NodeId));
+        report_memory(&report, "codegen", arena_bytes_used(ctx->codegen_arena),
+                      arena_bytes_reserved(ctx->codegen_arena));
+        symbol_memory(&used, &reserved);
+        report_memory(&report, "symbols", used, reserved);
+        type_memory(&used, &reserved);
+        report_memory(&report, "types", used, reserved);
+        report_memory(&report, "emit", emit_buffer_bytes(), emit_buffer_bytes());
+    }
+
+    emit_close();
+    if (output) {
+        close(out_fd);
+    }
+    compiler_leave();
+    trace_dump(stderr, show_input_name ? input : NULL);
+
+    if (reporting) {
+        report.total_time = report_clock() - begin;
+        print_report(&report, options->time_report, options->mem_report, options->report_json);
+    }
 
-    // アセンブリの前半部分を出力
-    printf(".intel_syntax noprefix\n");
-    printf(".global _main\n");
+    if (options->run) {
+        // コンパイラの資源を解放してから実行する
+        const int status = jit.main();
+        jit_unload(&jit);
+        return status;
+    }
+    return 0;
+}
 
-    // 先頭の式から順にコード生成
-    for (int i = 0; code[i]; i++) {
-        D("%s", node_description(code[i]));
-        GenResult result = gen(code[i]);
-        // 式の評価結果としてスタックに一つの値が残っているはずなので、スタック
-        // が溢れないようにポップしておく
-        if (result == GEN_PUSHED_RESULT) {
-            printf("  pop rax\n");
+// 入力ファイル名の拡張子".c"をextに変えた出力ファイル名を返す(なければextを足す)
+static char *output_path(const char *input, const char *ext) {
+    size_t n = strlen(input);
+    if (n > 2 && strcmp(input + n - 2, ".c") == 0) {
+        n -= 2;
+    }
+    char *path = malloc(n + strlen(ext) + 1);
+    memcpy(path, input, n);
+    strcpy(path + n, ext);
+    return path;
+}
+
+// 並列コンパイルの作業キュー
+// ワーカーは次の入力の番号を取り合い、取った入力をコンパイルする
+typedef struct {
+    const Options *options;
+    char **inputs;
+    int count;
+    atomic_int next;        // 次にコンパイルする入力の番号
+    atomic_int failures;    // エラーになった入力の数
+} WorkQueue;
+
+static void *worker(void *arg) {
+    WorkQueue *queue = arg;
+    for (;;) {
+        const int i = atomic_fetch_add(&queue->next, 1);
+        if (i >= queue->count) {
+            return NULL;
+        }
+        char *output = output_path(queue->inputs[i], queue->options->object ? ".o" : ".s");
+        if (compile(queue->options, queue->inputs[i], output) != 0) {
+            atomic_fetch_add(&queue->failures, 1);
         }
+        free(output);
     }
-    //D("~~~EXIT~~~");
+}
+
+// 入力をjobs個のスレッドでコンパイルし、それぞれの".s"(-cなら".o")に書く
+static int compile_all(const Options *options, char **inputs, int count, int jobs) {
+    WorkQueue queue = {options, inputs, count};
+    atomic_init(&queue.next, 0);
+    atomic_init(&queue.failures, 0);
 
+    if (jobs > count) {
+        jobs = count;
+    }
+    pthread_t *threads = malloc(sizeof(pthread_t) * jobs);
+    for (int i = 0; i < jobs; i++) {
+        if (pthread_create(&threads[i], NULL, worker, &queue) != 0) {
+            error_exit("スレッドを作成できません");
+        }
+    }
+    for (int i = 0; i < jobs; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    free(threads);
+
+    const int failures = atomic_load(&queue.failures);
+    if (failures > 0) {
+        fprintf(stderr, "%d/%d個の入力のコンパイルに失敗しました\n", failures, count);
+        return 1;
+    }
     return 0;
 }
 
+int main(int argc, char **argv) {
+    // 使い方: 9cc [-o 出力ファイル] [--compact-asm] [--asm-stats] [--arena-stats]
+    //            <ファイル | - | ソース>
+    //         9cc -j N [--compact-asm] [--asm-stats] [--arena-stats] ファイル...
+    //            (ファイルごとに拡張子を".s"にしたファイルへ出力する)
+    // -c: アセンブリの代わりにELF64の再配置可能オブジェクトを出力する(-jなら".o")
+    // --run [--load ライブラリ]...: 出力せずに_mainを実行し、その戻り値で終了する
+    //          (外部の関数はこのプロセスと--loadで読み込んだライブラリから探す)
+    // 覗き穴最適化: --no-peephole(しない) --peephole-stats(規則ごとに取り除いた命令の数)
+    // 中間表現: --ir(SSA形式の中間表現を経由してコード生成する)
+    //          --dump-ir(アセンブリの代わりに関数ごとの中間表現を出力する)
+    // 関数キャッシュ: --cache-dir ディレクトリ [--cache-max-size バイト] [--cache-stats]
+    // レポート: --time-report(フェーズごとの時間) --mem-report(メモリ使用量)
+    //          [--report-json](1入力1行のJSONで書く)
+    // トレース: --trace カテゴリ=レベル,...(環境変数NINECC_TRACEより優先する)
+    // バッチ: --batch マニフェスト [-o 出力ファイル] [-c | --run] [--ir] [--no-peephole]
+    //          (マニフェストの全プログラムを1つの出力にまとめるか、それぞれ実行する)
+    Options options = {.cache_max_size = 256 * 1024 * 1024};
+    trace_configure(getenv("NINECC_TRACE"));
+    char *output = NULL;
+    const char *manifest = NULL;
+    int jobs = 0;
+    char **inputs = malloc(sizeof(char *) * argc);
+    int count = 0;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--arena-stats") == 0) {
+            options.arena_stats = true;
+        } else if (strcmp(argv[i], "--asm-stats") == 0) {
+            options.asm_stats = true;
+        } else if (strcmp(argv[i], "--compact-asm") == 0) {
+            options.compact_asm = true;
+        } else if (strcmp(argv[i], "-c") == 0) {
+            options.object = true;
+        } else if (strcmp(argv[i], "--run") == 0) {
+            options.run = true;
+        } else if (strcmp(argv[i], "--load") == 0 && i + 1 < argc) {
+            jit_load_library(argv[++i]);
+        } else if (strcmp(argv[i], "--batch") == 0 && i + 1 < argc) {
+            manifest = argv[++i];
+        } else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+            output = argv[++i];
+        } else if (strcmp(argv[i], "--cache-dir") == 0 && i + 1 < argc) {
+            options.cache_dir = argv[++i];
+        } else if (strcmp(argv[i], "--cache-max-size") == 0 && i + 1 < argc) {
+            options.cache_max_size = strtoull(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--cache-stats") == 0) {
+            options.cache_stats = true;
+        } else if (strcmp(argv[i], "--no-peephole") == 0) {
+            options.no_peephole = true;
+        } else if (strcmp(argv[i], "--peephole-stats") == 0) {
+            options.peephole_stats = true;
+        } else if (strcmp(argv[i], "--ir") == 0) {
+            options.ir = true;
+        } else if (strcmp(argv[i], "--dump-ir") == 0) {
+            options.dump_ir = true;
+        } else if (strcmp(argv[i], "--time-report") == 0) {
+            options.time_report = true;
+        } else if (strcmp(argv[i], "--mem-report") == 0) {
+            options.mem_report = true;
+        } else if (strcmp(argv[i], "--report-json") == 0) {
+            options.report_json = true;
+        } else if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc) {
+            trace_configure(argv[++i]);
+        } else if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+            jobs = atoi(argv[++i]);
+            if (jobs <= 0) {
+                error_exit("-jの値が正しくありません: %s", argv[i]);
+            }
+        } else {
+            inputs[count++] = argv[i];
+        }
+    }
+    if (options.dump_ir && (options.object || options.run)) {
+        error_exit("--dump-irは-cや--runと同時に指定できません");
+    }
+    if (manifest) {
+        if (count > 0 || jobs > 0 || options.cache_dir || options.dump_ir) {
+            error_exit("--batchは入力や-j、--cache-dir、--dump-irと同時に指定できません");
+        }
+        if (options.run && output) {
+            error_exit("--runは-oと同時に指定できません");
+        }
+        scan_select(NULL);
+        BatchOptions batch = {
+            .manifest = manifest,
+            .output = output,
+            .object = options.object,
+            .run = options.run,
+            .compact = options.compact_asm || options.object || options.run,
+            .ir = options.ir,
+            .no_peephole = options.no_peephole,
+        };
+        return run_batch(&batch);
+    }
+    if (count == 0 || (count > 1 && jobs == 0)) {
+        error_exit("引数の個数が正しくありません");
+        return 1;
+    }
+
+    if (options.cache_dir && mkdir(options.cache_dir, 0755) != 0 && errno != EEXIST) {
+        error_exit("キャッシュのディレクトリを作れません: %s", options.cache_dir);
+    }
+
+    // CPUに合わせて字句解析の走査の実装を選ぶ
+    scan_select(NULL);
+
+    if (options.run) {
+        if (jobs > 0 || output) {
+            error_exit("--runは-jや-oと同時に指定できません");
+        }
+        // 組み込みのアセンブラで機械語にしたものを実行する
+        options.object = true;
+    }
+
+    if (jobs > 0) {
+        if (output) {
+            error_exit("-jと-oは同時に指定できません");
+        }
+        show_input_name = true;
+        return compile_all(&options, inputs, count, jobs);
+    }
+    return compile(&options, inputs[0], output);
+}
+
 // エラーを報告するための関数
+// コンパイル中ならそのコンパイルを中断してcompile()に戻り、そうでなければ終了する
 void error_exit(char *fmt, ...) {
     va_list ap;
     va_start(ap, fmt);
+    if (ctx && show_input_name) {
+        fprintf(stderr, "%s: ", ctx->input);
+    }
     vfprintf(stderr, fmt, ap);
     fprintf(stderr, "\n");
+    va_end(ap);
+    if (ctx && ctx->on_error) {
+        longjmp(*ctx->on_error, 1);
+    }
+    trace_dump(stderr, NULL);
     exit(1);
 }
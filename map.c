@@ -1,4 +1,5 @@
-#include "9cc.h"
+#include "map.h"
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 
@@ -7,38 +8,132 @@ struct KeyValue {
     void *value;
 };
 
+// ハッシュテーブルのスロット。keyがNULLなら空き
+typedef struct {
+    KeyValue kv;
+    uint32_t hash;  // キーのハッシュ値(再計算しないように保持する)
+} Slot;
+
 struct Map {
-    Vector *data;
+    Slot *slots;
+    int capacity;   // スロット数(2の冪)
+    int len;        // 格納済の要素数
 };
 
+static const int MAP_INITIAL_CAPACITY = 16;
+
+// FNV-1a
+static uint32_t hash_string(const char *s) {
+    uint32_t h = 2166136261u;
+    for (; *s; s++) {
+        h ^= (unsigned char)*s;
+        h *= 16777619u;
+    }
+    return h;
+}
+
 Map *new_map()
 {
     Map *map = malloc(sizeof(Map));
-    map->data = new_vec();
+    map->capacity = MAP_INITIAL_CAPACITY;
+    map->slots = calloc(map->capacity, sizeof(Slot));
+    map->len = 0;
     return map;
 }
 
-int map_size(Map *map) { return vec_size(map->data); }
+// マップを解放する。キーと値は解放しない
+void map_free(Map *map)
+{
+    if (map) {
+        free(map->slots);
+        free(map);
+    }
+}
+
+int map_size(Map *map) { return map->len; }
+
+// keyが入っているスロット、またはkeyを入れるべき空きスロットを返す
+static Slot *find_slot(Slot *slots, int capacity, const char *key, uint32_t hash)
+{
+    const int mask = capacity - 1;
+    for (int i = hash & mask;; i = (i + 1) & mask) {
+        Slot *slot = &slots[i];
+        if (!slot->kv.key) return slot;
+        if (slot->hash == hash && strcmp(slot->kv.key, key) == 0) return slot;
+    }
+}
 
+// 負荷率が3/4を超えないように容量を倍にして詰め直す
+static void grow(Map *map)
+{
+    const int capacity = map->capacity * 2;
+    Slot *slots = calloc(capacity, sizeof(Slot));
+    for (int i = 0; i < map->capacity; i++) {
+        Slot *old = &map->slots[i];
+        if (old->kv.key) {
+            *find_slot(slots, capacity, old->kv.key, old->hash) = *old;
+        }
+    }
+    free(map->slots);
+    map->slots = slots;
+    map->capacity = capacity;
+}
+
+// 同じキーがあれば値を置き換える
 KeyValue *map_insert(Map *map, const char *key, void *item)
 {
-    KeyValue *kv = malloc(sizeof(KeyValue));
-    kv->key = key;
-    kv->value = item;
-    vec_push(map->data, kv);
-    return kv;
+    if ((map->len + 1) * 4 > map->capacity * 3) {
+        grow(map);
+    }
+    const uint32_t hash = hash_string(key);
+    Slot *slot = find_slot(map->slots, map->capacity, key, hash);
+    if (!slot->kv.key) {
+        slot->kv.key = key;
+        slot->hash = hash;
+        map->len++;
+    }
+    slot->kv.value = item;
+    return &slot->kv;
 }
 
 KeyValue *map_lookup(Map *map, const char *key)
 {
-    int i;
+    Slot *slot = find_slot(map->slots, map->capacity, key, hash_string(key));
+    return slot->kv.key ? &slot->kv : NULL;
+}
+
+// 削除したスロット以降の要素を前に詰める(墓標を使わない線形探査の削除)
+bool map_remove(Map *map, const char *key)
+{
+    const int mask = map->capacity - 1;
+    Slot *slot = find_slot(map->slots, map->capacity, key, hash_string(key));
+    if (!slot->kv.key) return false;
 
-    D("n:%d, key:%s", map->data->len, key);
-    for (i = 0; i < vec_size(map->data); i++) {
-        KeyValue *kv = (KeyValue *)vec_get(map->data, i);
-        if (strcmp(kv->key, key) == 0) return kv;
+    int hole = slot - map->slots;
+    for (int i = (hole + 1) & mask; map->slots[i].kv.key; i = (i + 1) & mask) {
+        // 本来の位置からholeまでの距離がiまでの距離以下なら、holeに動かしても
+        // 探索で見つけられる
+        const int home = map->slots[i].hash & mask;
+        if (((i - home) & mask) >= ((i - hole) & mask)) {
+            map->slots[hole] = map->slots[i];
+            hole = i;
+        }
     }
+    memset(&map->slots[hole], 0, sizeof(Slot));
+    map->len--;
+    return true;
+}
 
+/**
+ * 要素を順に返す。*cursorを0にしてから呼び出し、NULLが返るまで繰り返す
+ * 順序は不定。イテレーション中にマップを変更してはならない
+ */
+KeyValue *map_iterate(Map *map, int *cursor)
+{
+    while (*cursor < map->capacity) {
+        Slot *slot = &map->slots[(*cursor)++];
+        if (slot->kv.key) return &slot->kv;
+    }
     return NULL;
 }
 
@@ -1,11 +1,19 @@
 #pragma once
 
+#include <stdbool.h>
+
 typedef struct KeyValue KeyValue;
 typedef struct Map Map;
 
+// 文字列をキーとするオープンアドレス法のハッシュテーブル
+// map_lookup()などが返すKeyValueは次にマップを変更するまで有効
+
 extern Map *new_map();
+extern void map_free(Map *map);
 extern int map_size(Map *map);
 extern KeyValue *map_insert(Map *map, const char *key, void *item);
 extern KeyValue *map_lookup(Map *map, const char *key);
+extern bool map_remove(Map *map, const char *key);
+extern KeyValue *map_iterate(Map *map, int *cursor);
 extern const char *kv_key(KeyValue *kv);
 extern void *kv_value(KeyValue *kv);
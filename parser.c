@@ -1,65 +1,199 @@
 #include "9cc.h"
-#include <ctype.h>
+#include "scan.h"
 #include <string.h>
 #include <stdio.h>
 
-// 現在のパース位置がトップレベルかどうか
-static int nest_level = 0;
-
 // ローカル変数の型
 typedef struct LVar LVar;
 struct LVar {
-    LVar *next; // 次の変数かNULL
-    char *name; // 変数の名前
-    int len;    // 名前の長さ
+    Symbol sym; // 変数の名前
     int offset; // RBPからのオフセット
     Type *type;  // 型情報
 };
 
-LVar *locals;   // ローカル変数のリストの先頭
+/*
+ * ブロックスコープ
+ * `{`でスコープを積み`}`で降ろす。スコープごとにシンボルをキーにしたハッシュ
+ * 表を持ち、変数は内側のスコープから順に探す。
+ * スコープを抜けるとその変数が使っていたスタック領域は後続の変数が再利用する。
+ */
+typedef struct Scope Scope;
+struct Scope {
+    Scope *parent;      // 外側のスコープかNULL
+    LVar **vars;        // オープンアドレス法のハッシュ表(NULLは空き)
+    int capacity;       // varsの大きさ(2の冪)
+    int len;            // 定義済の変数の数
+    int frame_offset;   // スコープ開始時のRBPからのオフセット
+};
+
+static LVar **scope_slot(LVar **vars, int capacity, Symbol sym) {
+    const int mask = capacity - 1;
+    int i = (sym * 2654435761u) & mask;
+    while (vars[i] && vars[i]->sym != sym) {
+        i = (i + 1) & mask;
+    }
+    return &vars[i];
+}
+
+// スコープを積む。関数の先頭ならスタック領域の計算もやり直す
+static void enter_scope(bool is_function) {
+    Scope *sc = arena_alloc(ctx->parse_arena, sizeof(Scope));
+    sc->parent = ctx->scope;
+    sc->capacity = 8;
+    sc->vars = arena_alloc(ctx->parse_arena, sizeof(LVar *) * sc->capacity);
+    if (is_function) {
+        ctx->frame_offset = ctx->frame_size = 0;
+    }
+    sc->frame_offset = ctx->frame_offset;
+    ctx->scope = sc;
+}
+
+static void leave_scope() {
+    ctx->frame_offset = ctx->scope->frame_offset;
+    ctx->scope = ctx->scope->parent;
+}
+
+static LVar *find_lvar_in_scope(Scope *sc, Symbol sym) {
+    return *scope_slot(sc->vars, sc->capacity, sym);
+}
+
+static void scope_add(Scope *sc, LVar *var) {
+    if ((sc->len + 1) * 4 > sc->capacity * 3) {
+        // 古い表はアリーナごと解放されるのでそのままにしておく
+        const int capacity = sc->capacity * 2;
+        LVar **vars = arena_alloc(ctx->parse_arena, sizeof(LVar *) * capacity);
+        for (int i = 0; i < sc->capacity; i++) {
+            if (sc->vars[i]) {
+                *scope_slot(vars, capacity, sc->vars[i]->sym) = sc->vars[i];
+            }
+        }
+        sc->vars = vars;
+        sc->capacity = capacity;
+    }
+    *scope_slot(sc->vars, sc->capacity, var->sym) = var;
+    sc->len++;
+}
 
 // 変数を名前で検索する。見つからなかった場合はNULLを返す。
-LVar *find_lvar(Token *token) {
-    for (LVar *var = locals; var; var = var->next)
-        if (var->len == token->len && memcmp(token->str, var->name, var->len) == 0)
+LVar *find_lvar(int t) {
+    ctx->lookup_count++;
+    for (Scope *sc = ctx->scope; sc; sc = sc->parent) {
+        LVar *var = find_lvar_in_scope(sc, token_sym(t));
+        if (var)
             return var;
+    }
     return NULL;
 }
 
 // グローバル変数の情報
 struct GlobalVar {
-    char *name;	        // 変数の名前(NULL終端)
+    Symbol sym;         // 変数の名前
     Type *type_info;    // 型情報
 };
 typedef struct GlobalVar GlobalVar;
 
-// グローバル変数のマップ
-Map *global_variable_map;
+static GlobalVar *find_global_variable(Symbol sym) {
+    ctx->lookup_count++;
+    return sym < ctx->global_variables_capacity ? ctx->global_variables[sym] : NULL;
+}
 
-// 現在着目しているトークン
-Token *token;
+static void add_global_variable(GlobalVar *var) {
+    if (var->sym >= ctx->global_variables_capacity) {
+        int capacity = ctx->global_variables_capacity ? ctx->global_variables_capacity : 256;
+        while (capacity <= var->sym) {
+            capacity *= 2;
+        }
+        ctx->global_variables = realloc(ctx->global_variables, sizeof(GlobalVar *) * capacity);
+        memset(ctx->global_variables + ctx->global_variables_capacity, 0,
+               sizeof(GlobalVar *) * (capacity - ctx->global_variables_capacity));
+        ctx->global_variables_capacity = capacity;
+    }
+    ctx->global_variables[var->sym] = var;
+}
 
-Node *new_node(NodeKind kind, Node *lhs, Node *rhs) {
-    Node *node = calloc(1, sizeof(Node));
-    node->kind = kind;
+// 配列を倍に広げる
+// 抽象構文木の配列は大きくなるので、アリーナに古い配列を残さないようreallocで伸ばす
+static void *grow_array(void *data, size_t size, uint32_t *capacity, uint32_t initial) {
+    *capacity = *capacity ? *capacity * 2 : initial;
+    void *p = realloc(data, size * *capacity);
+    if (!p) {
+        error_exit("抽象構文木のメモリを確保できません");
+    }
+    return p;
+}
+
+// 新しいノードを末尾に追加してその番号を返す
+// ノードの配列は伸長で移動するので、呼び出し側はNode *を持ち越さないこと
+NodeId new_node(NodeKind kind, NodeId lhs, NodeId rhs) {
+    if (ctx->ast.count == ctx->ast.capacity) {
+        ctx->ast.nodes = grow_array(ctx->ast.nodes, sizeof(Node), &ctx->ast.capacity, 4096);
+    }
+    const NodeId id = ctx->ast.count++;
+    Node *node = node_at(id);
+    *node = (Node){.kind = kind};
     node->lhs = lhs;
     node->rhs = rhs;
-    return node;
+    return id;
 }
 
-Node *new_node_num(int val) {
-    Node *node = calloc(1, sizeof(Node));
-    node->kind = ND_NUM;
-    node->val = val;
-    return node;
+NodeId new_node_num(int val) {
+    const NodeId id = new_node(ND_NUM, 0, 0);
+    node_at(id)->val = val;
+    return id;
+}
+
+// 子ノードの並びの組み立て
+// 並びは入れ子になるので、組み立て中の要素を作業領域(list_stack)に積んでおき、
+// 並びが閉じたところでast.listsへ詰めて写す
+
+// 並びの組み立てを始める。戻り値はlist_end()に渡す
+static int list_begin() {
+    return ctx->list_stack_len;
+}
+
+static void list_push(NodeId id) {
+    if (ctx->list_stack_len == ctx->list_stack_capacity) {
+        uint32_t capacity = ctx->list_stack_capacity;
+        ctx->list_stack = grow_array(ctx->list_stack, sizeof(NodeId), &capacity, 256);
+        ctx->list_stack_capacity = capacity;
+    }
+    ctx->list_stack[ctx->list_stack_len++] = id;
+}
+
+// list_begin()以降に積んだ要素で並びを作りその番号を返す
+static ListId list_end(int mark) {
+    const uint32_t n = ctx->list_stack_len - mark;
+    while (ctx->ast.lists_len + n + 1 > ctx->ast.lists_capacity) {
+        ctx->ast.lists = grow_array(ctx->ast.lists, sizeof(NodeId), &ctx->ast.lists_capacity, 4096);
+    }
+    const ListId list = ctx->ast.lists_len;
+    ctx->ast.lists[list] = n;
+    memcpy(&ctx->ast.lists[list + 1], &ctx->list_stack[mark], sizeof(NodeId) * n);
+    ctx->ast.lists_len += n + 1;
+    ctx->list_stack_len = mark;
+    return list;
+}
+
+// k個先のトークンを返す(0なら現在のトークン)。末尾より先はTK_EOFを返す
+int peek(int k) {
+    const int t = ctx->token + k;
+    return t < ctx->tokens.count ? t : ctx->tokens.count - 1;
+}
+
+// トークンtが種別kindで文字列strと一致すればtを、そうでなければ0を返す
+int equal(int t, TokenKind kind, const char *str) {
+    if (token_kind(t) == kind &&
+        strlen(str) == token_len(t) &&
+        memcmp(token_str(t), str, token_len(t)) == 0) {
+        return t;
+    }
+    return 0;
 }
 
 bool consume_and_next(char* op, bool must_to_next) {
-    if (token->kind == TK_RESERVED &&
-        strlen(op) == token->len &&
-        memcmp(token->str, op, token->len) == 0) {
+    if (equal(ctx->token, TK_RESERVED, op)) {
         if (must_to_next) {
-            token = token->next;
+            ctx->token++;
         }
         return true;
     }
@@ -71,63 +205,71 @@ bool consume(char* op) {
     return consume_and_next(op, true);
 }
 
-Token* consume_by_kind(TokenKind kind) {
-    if (token->kind == kind) {
-        Token* t = token;
-        token = token->next;
-        return t;
+int consume_by_kind(TokenKind kind) {
+    if (token_kind(ctx->token) == kind) {
+        return ctx->token++;
     }
-    return NULL;
+    return 0;
 }
 
-Token* consume_ident() {
+int consume_ident() {
     return consume_by_kind(TK_IDENT);
 }
 
-Token* consume_reserved(char *c) {
-    if (token->kind == TK_RESERVED &&
-        strlen(c) == token->len &&
-        memcmp(c, token->str, token->len) == 0) {
-        Token* result = token;
-        token = token->next;
-        return result;
+int consume_reserved(char *c) {
+    if (equal(ctx->token, TK_RESERVED, c)) {
+        return ctx->token++;
     }
-    return NULL;
+    return 0;
 }
 
-Node *expr();
+NodeId expr();
 
-Node *reference_local_var(Token* t) {
+// ローカル変数を参照するノードを作る
+static NodeId new_lvar_node(LVar *var) {
+    const NodeId id = new_node(ND_LVAR, 0, 0);
+    Node *node = node_at(id);
+    node->offset = var->offset;
+    node->ident = var->sym;
+    node->type = var->type;
+    return id;
+}
+
+NodeId reference_local_var(int t) {
     LVar *local = find_lvar(t);
     if (!local) {
-        return NULL;
+        return 0;
     }
+    return new_lvar_node(local);
+}
 
-    Node *node = new_node(ND_LVAR, NULL, NULL);
-    node->offset = local->offset;
-    node->ident = local->name;
-    node->identLength = local->len;
-    node->type = local->type;
-    return node;
+// キャッシュのキーに混ぜるため、型の構造をハッシュ値にする
+static uint64_t hash_type_shape(uint64_t h, Type *type) {
+    for (; type; type = type->ptr_to) {
+        const int shape[2] = {type->type, type->num_elements};
+        h = cache_hash(h, shape, sizeof(shape));
+    }
+    return h;
 }
 
-Node *reference_global_variable(Token* t) {
-    Node *node = NULL;
-    char *name = token_name_copy(t);
-    KeyValue *kv = map_lookup(global_variable_map, name);
-    if (kv) {
-        GlobalVar* var = (GlobalVar *)kv_value(kv);
-        node = new_node(ND_GLOBAL_VAR, NULL, NULL);
-        node->ident = var->name;
-        node->identLength = strlen(var->name);
-        node->type = var->type_info;
+NodeId reference_global_variable(int t) {
+    NodeId node = 0;
+    GlobalVar *var = find_global_variable(token_sym(t));
+    if (var) {
+        if (ctx->cache_dir && ctx->scope) {
+            // 関数の出力はトークン列の外で決まるグローバル変数の型にも依存する
+            ctx->function_deps = hash_type_shape(ctx->function_deps, var->type_info);
+        }
+        node = new_node(ND_GLOBAL_VAR, 0, 0);
+        node_at(node)->ident = var->sym;
+        node_at(node)->type = var->type_info;
     }
     return node;
 }
 
-Node *reference_variable(Token *t) {
-    Node *node = reference_local_var(t);
-    D_NODE(node);
+NodeId reference_variable(int t) {
+    NodeId node = reference_local_var(t);
+    TRACE(TRACE_PARSE, 2, "%s", node_description(node));
     if (!node) {
         node = reference_global_variable(t);
     }
@@ -140,24 +282,22 @@ Node *reference_variable(Token *t) {
 /**
  * 型の宣言部分をパースしてType構造体を返す
  */
-Type *declaration_type(Token **out_token) {
+Type *declaration_type(int *out_token) {
     assert(out_token);
 
-    // まずINT型の型情報を作る
-    Type* type_original = new_type(INT);
+    // まずINT型の型情報を得る
+    Type *type_current = type_int();
 
     // （連続する）ポインタ修飾をパースする
-    Type *type_current = type_original;
     while (consume("*")) {
-        Type *ptr_type = new_ptr_type(type_current);
-        type_current = ptr_type;
+        type_current = pointer_to(type_current);
     }
 
     // 識別子
-    if (*out_token == NULL) {
-        Token *ident_token = consume_ident();
+    if (!*out_token) {
+        int ident_token = consume_ident();
         if (!ident_token) {
-            error_exit("識別子がありません: %s\n", token_description(token));
+            error_exit("識別子がありません: %s\n", token_description(ctx->token));
         }
         *out_token = ident_token;
     }
@@ -165,15 +305,15 @@ Type *declaration_type(Token **out_token) {
     // 配列かどうか
     if (consume("[")) {
         int n = 0;
-        Token *number_token = consume_by_kind(TK_NUM);
+        int number_token = consume_by_kind(TK_NUM);
         if (number_token) {
-            n = number_token->val; 
+            n = token_val(number_token); 
             number_token = consume_reserved("]");
         }
         if (!number_token) {
-            error_exit("配列の定義が間違っています: %s\n", token->str);
+            error_exit("配列の定義が間違っています: %s\n", token_str(ctx->token));
         }
-        type_current = new_array_type(n, type_current);
+        type_current = array_of(type_current, n);
     }
 
     return type_current;
@@ -182,126 +322,136 @@ Type *declaration_type(Token **out_token) {
 /**
  * ローカル変数の定義
  */
-Node *define_local_var() {
+NodeId define_local_var() {
     // 型をパースする
-    Token *identifier_token = NULL;
+    int identifier_token = 0;
     Type *type_info = declaration_type(&identifier_token);
 
-    // ローカル変数の重複定義のチェック
-    if (find_lvar(identifier_token)) {
-        error_exit("同名の変数が定義されています: %s\n", identifier_token->str);
+    if (!ctx->scope) {
+        error_exit("関数の外でローカル変数は定義できません: %s\n", token_str(identifier_token));
+    }
+
+    // ローカル変数の重複定義のチェック(外側のスコープの変数は隠してよい)
+    if (find_lvar_in_scope(ctx->scope, token_sym(identifier_token))) {
+        error_exit("同名の変数が定義されています: %s\n", token_str(identifier_token));
     }
 
     // LVarの生成
-    LVar *var = calloc(1, sizeof(LVar));
-    var->next = locals;
-    var->name = identifier_token->str;
-    var->len = identifier_token->len;
+    LVar *var = arena_alloc(ctx->parse_arena, sizeof(LVar));
+    var->sym = token_sym(identifier_token);
     var->type = type_info;
-    if (locals) { // オフセット計算
-        var->offset = locals->offset;
-        if (var->type->type == ARRAY) {
-            int type_size = 4; // 現状INTだけだから
-            var->offset += type_size * var->type->num_elements;
-        }
+    var->offset = ctx->frame_offset; // オフセット計算
+    if (var->type->type == ARRAY) {
+        var->offset += var->type->size;
     }
     var->offset += 8;
 
-    locals = var;
+    ctx->frame_offset = var->offset;
+    if (ctx->frame_size < ctx->frame_offset) {
+        ctx->frame_size = ctx->frame_offset;
+    }
+    scope_add(ctx->scope, var);
+    ctx->local_count++;
 
     // Nodeの生成
-    Node *node = new_node(ND_LVAR, NULL, NULL);
-    node->offset = var->offset;
-    node->ident = var->name;
-    node->identLength = var->len;
-    node->type = type_info;
-
-    return node;
+    return new_lvar_node(var);
 }
 
 /**
  * グローバル変数の定義
  */
-Node *define_global_variable(Token *identifier) {
+NodeId define_global_variable(int identifier) {
     // 型をパースする
     Type *type_info = declaration_type(&identifier);
 
-    // 変数名を確保する
-    char *name = token_name_copy(identifier);
-
-    // マップに格納済か？
-    GlobalVar *var = NULL;
-    KeyValue *kv = map_lookup(global_variable_map, name);
-    if (kv) {
-        var = (GlobalVar *)kv_value(kv);
+    // 表に格納済か？
+    GlobalVar *var = find_global_variable(token_sym(identifier));
+    if (var) {
         // 型が違った場合はコンパイルエラーに倒す
         if (!type_equal(var->type_info, type_info)) {
-            error_exit("型が衝突しています: %s", identifier);
+            error_exit("型が衝突しています: %s", symbol_name(token_sym(identifier)));
         }
     } else {
-        // なければマップにいれる
-        var = calloc(1, sizeof(GlobalVar));
-        var->name = name;
+        // なければ表にいれる
+        var = arena_alloc(ctx->parse_arena, sizeof(GlobalVar));
+        var->sym = token_sym(identifier);
         var->type_info = type_info;
-        map_insert(global_variable_map, name, var);
+        add_global_variable(var);
     }
 
     // Nodeの生成
-    Node *node = new_node(ND_GLOBAL_VAR, NULL, NULL);
-    node->ident = name;
-    node->identLength = identifier->len;
-    node->type = type_info;
+    NodeId node = new_node(ND_GLOBAL_VAR, 0, 0);
+    node_at(node)->ident = var->sym;
+    node_at(node)->type = type_info;
 
     if (!consume(";")) {
-        error_exit("';'ではないトークンです: %s", token_description(token));
+        error_exit("';'ではないトークンです: %s", token_description(ctx->token));
     }
     return node;
 }
 
-bool is_reserved_with(Token *token, char c) {
-    return token->kind == TK_RESERVED && token->str[0] == c;
+bool is_reserved_with(int t, char c) {
+    return token_kind(t) == TK_RESERVED && token_str(t)[0] == c;
 }
 
 // 次のトークンが期待している記号のときには、トークンを1つ読み進める。
 // それ以外の場合にはエラーを報告する。
 void expect(char op) {
-    if (!is_reserved_with(token, op))
+    if (!is_reserved_with(ctx->token, op))
         error_exit("'%c'ではありません", op);
-    token = token->next;
+    ctx->token++;
 }
 
 // 次のトークンが数値の場合、トークンを1つ読み進めてその数値を返す。
 // それ以外の場合にはエラーを報告する。
 int expect_number() {
-    if (token->kind != TK_NUM)
-        error_exit("数ではありません: %s", token_description(token));
-    int val = token->val;
-    token = token->next;
-    return val;
+    if (token_kind(ctx->token) != TK_NUM)
+        error_exit("数ではありません: %s", token_description(ctx->token));
+    return token_val(ctx->token++);
 }
 
 bool at_eof() {
-    if (!token) {
+    if (!ctx->token) {
         return false;
     }
-    return token->kind == TK_EOF;
+    return token_kind(ctx->token) == TK_EOF;
+}
+
+// トークン列の配列を倍に広げる
+// 古い配列はトークンのアリーナごと解放されるのでそのままにしておく
+static void grow_tokens() {
+    const int capacity = ctx->tokens.capacity ? ctx->tokens.capacity * 2 : 4096;
+#define GROW(field) do { \
+        void *p = arena_alloc(ctx->token_arena, sizeof(*ctx->tokens.field) * capacity); \
+        memcpy(p, ctx->tokens.field, sizeof(*ctx->tokens.field) * ctx->tokens.count); \
+        ctx->tokens.field = p; \
+    } while (0)
+    GROW(kind);
+    GROW(offset);
+    GROW(len);
+    GROW(val);
+#undef GROW
+    ctx->tokens.capacity = capacity;
 }
 
-// 新しいトークンを作成してcurに繋げる
-Token *new_token(TokenKind kind, Token *cur, char *str, int len) {
-    Token *tok = calloc(1, sizeof(Token));
-    tok->kind = kind;
-    tok->str = str;
-    tok->len = len;
-    cur->next = tok;
-    return tok;
+// 新しいトークンを末尾に追加してその番号を返す
+static int new_token(TokenKind kind, char *str, int len) {
+    if (ctx->tokens.count == ctx->tokens.capacity) {
+        grow_tokens();
+    }
+    const int t = ctx->tokens.count++;
+    ctx->tokens.kind[t] = kind;
+    ctx->tokens.offset[t] = str - ctx->tokens.source;
+    ctx->tokens.len[t] = len;
+    ctx->tokens.val[t] = 0;
+    return t;
 }
 
 // 前方宣言
-Node *indexing();
+NodeId indexing();
 
-Node *add() {
-    Node *node = indexing();
+NodeId add() {
+    NodeId node = indexing();
 
     for (;;) {
         if (consume("+"))
@@ -313,8 +463,8 @@ Node *add() {
     }
 }
 
-Node *relational() {
-    Node * node = add();
+NodeId relational() {
+    NodeId node = add();
 
     for (;;) {
         if (consume("<"))
@@ -322,24 +472,20 @@ Node *relational() {
         else if (consume("<="))
             node = new_node(ND_GREATER_EQUAL, node, add());
         else if (consume(">")) {
-            node = new_node(ND_GREATER, node, add());
-            Node *tmp = node->lhs;
-            node->lhs = node->rhs;
-            node->rhs = tmp;
+            NodeId rhs = add();
+            node = new_node(ND_GREATER, rhs, node); // 左右を入れ替えて'<'にする
         }
         else if (consume(">=")) {
-            node = new_node(ND_GREATER_EQUAL, node, add());
-            Node *tmp = node->lhs;
-            node->lhs = node->rhs;
-            node->rhs = tmp;
+            NodeId rhs = add();
+            node = new_node(ND_GREATER_EQUAL, rhs, node);
         }
         else
             return node;
     }
 }
 
-Node *equality() {
-    Node * node = relational();
+NodeId equality() {
+    NodeId node = relational();
 
     for (;;) {
         if (consume("=="))
@@ -351,184 +497,174 @@ Node *equality() {
     }
 }
 
-Node *assign() {
-    Node * node = equality();
+NodeId assign() {
+    NodeId node = equality();
     if (consume("="))
         node = new_node(ND_ASSIGN, node, equality());
     return node;
 }
 
-Node *expr() {
+NodeId expr() {
     return assign();
 }
 
-Token* peek(TokenKind kind) {
-    for (Token* t = token; t && t->kind != TK_EOF; t = t->next) {
-        if (t->kind == kind) {
-            return t;
-        }
-    }
-    return NULL;
-}
-
-Token* equal(Token* t, TokenKind kind, const char *str) {
-    if (t->kind == kind && memcmp(t->str, str, strlen(str)) == 0) {
-        return t;
-    }
-    return NULL;
-}
-
-Node *term();
-
-Node *calling_function(Token *indentifier) {
+NodeId calling_function(int indentifier) {
     if (indentifier) {
-        assert(token == indentifier->next);
-        // `()`を先読みしてあれば関数ノードを作成する
-        Token* open_paren = equal(indentifier->next, TK_RESERVED, "(");
-        if (open_paren) {
-            Token *close_paren = NULL;
-            Vector *args = new_vec();
-            for (Token* at = open_paren->next; at; at = at->next) {
-                if (token != at) {
-                    token = at;
-                }
-                close_paren = equal(at, TK_RESERVED, ")"); // peek
-                if (close_paren) {
-                    break;
-                }
-                if (equal(at, TK_RESERVED, ",")) { // peek
-                    continue;
-                }
-                Node* node = term();
-                vec_push(args, node);
-                at = token;
-                // termでtokenが進んでしまうのでここでもう一度")"をチェックしないと...
-                close_paren = equal(at, TK_RESERVED, ")"); // peek
-                if (close_paren) {
-                    break;
+        assert(ctx->token == indentifier + 1);
+        // `(`を先読みしてあれば関数ノードを作成する
+        if (consume("(")) {
+            const int args = list_begin();
+            if (!consume(")")) {
+                do {
+                    list_push(expr());
+                } while (consume(","));
+                if (!consume(")")) {
+                    error_exit("')'ではないトークンです: %s", token_description(ctx->token));
                 }
             }
-            token = close_paren->next;
-            Node *node = new_node(ND_FUN, NULL, NULL);
-            node->ident = indentifier->str;
-            node->identLength = indentifier->len;
-            node->block = args;
+            const ListId block = list_end(args);
+            NodeId node = new_node(ND_FUN, 0, 0);
+            node_at(node)->block = block;
+            node_at(node)->ident = token_sym(indentifier);
             return node;
         }
     }
-    return NULL;
+    return 0;
 }
 
-Node *stmt();
+NodeId stmt();
+
+/**
+ * 関数定義nodeのキャッシュのキーを記録する
+ * キーは関数のトークン列[start, end)と、関数が参照したグローバル変数の型から作る
+ */
+static void record_function_key(NodeId node, int start, int end) {
+    uint64_t h = cache_hash(ctx->cache_salt, &ctx->function_deps, sizeof(ctx->function_deps));
+    for (int t = start; t < end; t++) {
+        const unsigned char kind = token_kind(t);
+        const unsigned int len = token_len(t);
+        h = cache_hash(h, &kind, sizeof(kind));
+        h = cache_hash(h, &len, sizeof(len));
+        h = cache_hash(h, token_str(t), len);
+    }
 
-Node *define_function(Token *indentifier) {
+    if (ctx->function_keys_len == ctx->function_keys_capacity) {
+        ctx->function_keys_capacity = ctx->function_keys_capacity ? ctx->function_keys_capacity * 2 : 256;
+        ctx->function_keys = realloc(ctx->function_keys, sizeof(FunctionKey) * ctx->function_keys_capacity);
+    }
+    ctx->function_keys[ctx->function_keys_len++] = (FunctionKey){node, h};
+}
+
+NodeId define_function(int indentifier) {
     if (!indentifier) {
-        return NULL;
+        return 0;
     }
     // `(`を先読みして、なければグローバル変数とみなす
-    Token* open_paren = equal(indentifier->next, TK_RESERVED, "(");
-    if (!open_paren) {
+    if (!equal(peek(0), TK_RESERVED, "(")) {
         // グローバル変数の定義
         return define_global_variable(indentifier);
     }
 
     // あれば関数定義ノードを作成する
-    // 引数のパース
-    Token *close_paren = NULL;
-    Vector *args = new_vec();
-    int type_declared = 0;
-    for (Token* at = open_paren->next; at; at = at->next) {
-        if (at->kind == TK_INT) {
+    // 引数は関数のスコープに、本体の変数はその内側のブロックのスコープに入る
+    enter_scope(true);
+    ctx->function_deps = 0;
+
+    // 引数のパース: `(` [int 宣言 {`,` int 宣言}] `)`
+    consume("(");
+    const int args = list_begin();
+    if (!consume(")")) {
+        do {
             // 引数の型は単なる読み捨て
-            type_declared = 1;
-        } else if (is_reserved_with(at, '*') || at->kind == TK_IDENT) {
-            if (!type_declared)
-                error_exit("関数定義シンタックスエラー: %s\n", at->str);
-            type_declared = 0;
-            token = at; // Ad-Hoc!!
-            vec_push(args, define_local_var()); // 引数も実体はローカル変数なのです
-        } else {
-            type_declared = 0;
-            close_paren = equal(at, TK_RESERVED, ")");
-            if (close_paren) {
-                token = close_paren->next; // Ad-Hoc!!
-                break;
-            } else if (!equal(at, TK_RESERVED, ",")) {
-                error_exit("関数定義シンタックスエラー: %s\n", at->str);
-            }
-        }
+            if (!consume_by_kind(TK_INT))
+                error_exit("関数定義シンタックスエラー: %s\n", token_str(ctx->token));
+            list_push(define_local_var()); // 引数も実体はローカル変数なのです
+        } while (consume(","));
+        if (!consume(")"))
+            error_exit("関数定義シンタックスエラー: %s\n", token_str(ctx->token));
     }
-    Node *node = new_node(ND_FUN_IMPL, NULL, NULL);
-    node->ident = indentifier->str;
-    node->identLength = indentifier->len;
-    node->block = args;
+    const ListId block = list_end(args);
 
     // 次がブロックかどうか
     if (!consume_and_next("{", false)) {
-        error_exit("関数定義シンタックスエラー: %s\n", token->str);
+        error_exit("関数定義シンタックスエラー: %s\n", token_str(ctx->token));
     }
 
-    node->lhs = stmt();
+    const NodeId body = stmt();
+    leave_scope();
+
+    NodeId node = new_node(ND_FUN_IMPL, 0, 0);
+    node_at(node)->block = block;
+    node_at(node)->ident = token_sym(indentifier);
+    node_at(node)->frame_size = ctx->frame_size;
+    node_at(node)->body = body;
+    TRACE(TRACE_PARSE, 1, "function %.*s frame_size=%d", symbol_length(node_at(node)->ident),
+          symbol_name(node_at(node)->ident), ctx->frame_size);
+    if (ctx->cache_dir) {
+        // 戻り値の型の`int`から本体の`}`まで
+        record_function_key(node, indentifier - 1, ctx->token);
+    }
     return node;
 }
 
-Node *stmt() {
-    nest_level++;
+NodeId stmt() {
+    ctx->nest_level++;
 
-    Node *node;
+    NodeId node = 0;
     if (consume_by_kind(TK_IF)) { // if
-        node = new_node(ND_IF, NULL, NULL);
-        node->condition = expr();
-        node->lhs = stmt();
-        Token* maybe_else = peek(TK_ELSE);
-        if (maybe_else) { // else
-            token = maybe_else->next; // elseトークンをスキップ: consume関数がやってること
-            node->rhs = stmt();
+        NodeId condition = expr();
+        NodeId then = stmt();
+        NodeId otherwise = 0;
+        if (consume_by_kind(TK_ELSE)) { // else: 直後のトークンだけを見る
+            otherwise = stmt();
         }
+        node = new_node(ND_IF, then, otherwise);
+        node_at(node)->condition = condition;
         return node;
     } else if (consume_by_kind(TK_WHILE)) { // while
-        node = new_node(ND_WHILE, NULL, NULL);
-        node->condition = expr();
-        node->lhs = stmt();
+        NodeId condition = expr();
+        node = new_node(ND_WHILE, stmt(), 0);
+        node_at(node)->condition = condition;
         return node;
     } else if (consume_by_kind(TK_FOR)) { // for
         if (consume("(")) {
-            Vector *v = new_vec();
-            Node * e = NULL;
+            const int clauses = list_begin();
 
-            e = expr();
-            vec_push(v, e);
+            list_push(expr());
             if (!consume(";")) {
-                error_exit("';'ではないトークンです: %d %s", token->kind, token->str);
+                error_exit("';'ではないトークンです: %d %s", token_kind(ctx->token), token_str(ctx->token));
             }
-            e = expr();
-            vec_push(v, e);
+            list_push(expr());
             if (!consume(";")) {
-                error_exit("';'ではないトークンです: %d %s", token->kind, token->str);
+                error_exit("';'ではないトークンです: %d %s", token_kind(ctx->token), token_str(ctx->token));
             }
-            e = expr();
-            vec_push(v, e);
+            list_push(expr());
             if (!consume(")")) {
-                error_exit("')'ではないトークンです: %d %s", token->kind, token->str);
+                error_exit("')'ではないトークンです: %d %s", token_kind(ctx->token), token_str(ctx->token));
             }
+            const ListId block = list_end(clauses);
 
-            node = new_node(ND_FOR, NULL, NULL);
-            node->block = v;
-            node->lhs = stmt();
+            NodeId body = stmt();
+            node = new_node(ND_FOR, 0, 0);
+            node_at(node)->block = block;
+            node_at(node)->body = body;
         }
         return node;
     } else if (consume("{")) { // ブロック
-        Vector *vec = new_vec();
+        const int stmts = list_begin();
+        enter_scope(false);
         do {
-            vec_push(vec, stmt());
+            list_push(stmt());
         } while (!consume("}"));
-        node = new_node(ND_BLOCK, NULL, NULL);
-        node->block = vec;
+        leave_scope();
+        const ListId block = list_end(stmts);
+        node = new_node(ND_BLOCK, 0, 0);
+        node_at(node)->block = block;
         return node; // ここでreturnするので文末の';'は不要
     } else if (consume_by_kind(TK_RETURN)) {
-        node = new_node(ND_RETURN, expr(), NULL);
+        node = new_node(ND_RETURN, expr(), 0);
     } else if (consume_by_kind(TK_INT)) {
-        if (nest_level == 1) {
+        if (ctx->nest_level == 1) {
             // 戻り値としてのintなので関数定義としてパースする
             return define_function(consume_ident());
         }
@@ -541,48 +677,59 @@ Node *stmt() {
     }
 
     if (!consume(";")) {
-        error_exit("';'ではないトークンです: %d %s", token->kind, token->str);
+        error_exit("';'ではないトークンです: %d %s", token_kind(ctx->token), token_str(ctx->token));
     }
 
     return node;
 }
 
-// 文を格納する配列
-Node *code[100];
-static int statement_index = 0;
-
 void program() {
-    statement_index = 0;
+    release_ast();
+    new_node(ND_NUM, 0, 0);     // 0番は使わない
+    list_end(list_begin());     // 0番は空の並び
+
+    const int stmts = list_begin();
     while (!at_eof()) {
-        nest_level = 0;
-        Node *node = stmt();
-        code[statement_index] = node;
-        statement_index++;
+        ctx->nest_level = 0;
+        list_push(stmt());
     }
-    code[statement_index] = NULL;
+    ctx->code = list_end(stmts);
+
+    // コード生成の前に定数を畳み込む
+    fold_program();
+}
+
+// 抽象構文木を解放する
+void release_ast() {
+    free(ctx->ast.nodes);
+    free(ctx->ast.lists);
+    free(ctx->list_stack);
+    ctx->ast = (Ast){0};
+    ctx->list_stack = NULL;
+    ctx->list_stack_len = ctx->list_stack_capacity = 0;
 }
 
 // 前方宣言
-Node *unary();
-Node *pointer();
-Node *mul();
+NodeId unary();
+NodeId pointer();
+NodeId mul();
 
-Node *indexing() {
-    Node *node = mul(); // 1
+NodeId indexing() {
+    NodeId node = mul(); // 1
 
     for (;;) {
         // '[]' で囲まれたものがあるなら配列添え字とみなす
         // `x[y]`は`*(x+y)`と等価であるものとして定義する
         if (consume("[")) {
-            Node *index_node = expr();
+            NodeId index_node = expr();
             if (!index_node) {
-                error_exit("配列の添え字指定がありません: %s\n", token->str);
+                error_exit("配列の添え字指定がありません: %s\n", token_str(ctx->token));
             }
             if (consume("]")) {
-                Node *add_node = new_node(ND_ADD, node, index_node);
-                return new_node(ND_DEREF, NULL, add_node);
+                NodeId add_node = new_node(ND_ADD, node, index_node);
+                return new_node(ND_DEREF, 0, add_node);
             } else {
-                error_exit("配列の添え字指定が間違っています: %s\n", token->str);
+                error_exit("配列の添え字指定が間違っています: %s\n", token_str(ctx->token));
             }
         }
         else
@@ -590,8 +737,8 @@ Node *indexing() {
     }
 }
 
-Node *mul() {
-    Node *node = unary();
+NodeId mul() {
+    NodeId node = unary();
 
     for (;;) {
         if (consume("*"))
@@ -603,19 +750,19 @@ Node *mul() {
     }
 }
 
-Node *term() {
+NodeId term() {
     // 次のトークンが'('なら、"(" expr ")"のはず
     if (consume("(")) {
-        Node *node = expr();
+        NodeId node = expr();
         expect(')');
         return node;
     }
 
     // 識別子
-    Token *t = consume_ident();
+    int t = consume_ident();
     if (t) {
         // 関数呼び出しノード
-        Node *node = calling_function(t);
+        NodeId node = calling_function(t);
         if (!node) {
             // ローカル変数 or 配列添え字演算
             node = reference_variable(t);
@@ -624,7 +771,7 @@ Node *term() {
     }
 
     // ポインタ
-    Node *node = pointer();
+    NodeId node = pointer();
     if (node) {
         return node;
     }
@@ -634,12 +781,13 @@ Node *term() {
 }
 
 // 構文木に紐づいている型がintならば4、ポインタならば8を返す
-int sizeof_ast(Node *node) {
-    if (!node) {
+int sizeof_ast(NodeId id) {
+    if (!id) {
         return 0;
     }
+    Node *node = node_at(id);
     if (node->kind == ND_LVAR) {
-        return node_num_pointers(node) > 0 ? 8 : 4;
+        return node_num_pointers(id) > 0 ? 8 : 4;
     }
     if (node->kind == ND_DEREF || node->kind == ND_NUM) {
         return 4;
@@ -648,15 +796,19 @@ int sizeof_ast(Node *node) {
         return 8;
     }
 
+    if (!node_is_binary(node->kind)) {
+        return 0;
+    }
+
     // 左手、右手それぞれに対して再帰する
     int l = sizeof_ast(node->lhs);
     int r = sizeof_ast(node->rhs);
     return l > r ? l : r;
 }
 
-Node *unary() {
+NodeId unary() {
     if (consume_by_kind(TK_SIZEOF)) {
-        Node *node = term();
+        NodeId node = term();
         int s = sizeof_ast(node);
         assert(s == 4 || s == 8);
         return new_node_num(s);
@@ -668,141 +820,151 @@ Node *unary() {
     return term();
 }
 
-Node *pointer() {
+NodeId pointer() {
     if (consume("&")) {
         // オペランドについてruiさんの文書ではlhsだが他の演算子との整合性を考慮
         // してrhsにする
-        return new_node(ND_ADDR, NULL, unary());
+        return new_node(ND_ADDR, 0, unary());
     } else if (consume("*")) {
-        Node *node = unary();
-        return new_node(ND_DEREF, NULL, node);
+        NodeId node = unary();
+        return new_node(ND_DEREF, 0, node);
     }
-    return NULL;
-}
-
-int is_alnum(char c) {
-    return ('a' <= c && c <= 'z') ||
-        ('A' <= c && c <= 'Z') ||
-        ('0' <= c && c <= '9') ||
-        (c == '_');
+    return 0;
 }
 
-// 入力文字列pをトークナイズしてそれを返す
-Token* tokenize(char *p) {
-    global_variable_map = new_map();
-    Token head;
-    head.next = NULL;
-    Token *cur = &head;
-
-    while (*p) {
-        // 空白文字をスキップ
-        if (isspace(*p)) {
-            p++;
-            continue;
-        }
-
-        // return文
-        if (strncmp(p, "return", 6) == 0 && !is_alnum(p[6])) {
-            cur = new_token(TK_RETURN, cur, p, 6);
-            p += 6;
-            continue;
-        }
-
-        // if文
-        if (strncmp(p, "if", 2) == 0 && !is_alnum(p[2])) {
-            cur = new_token(TK_IF, cur, p, 2);
-            p += 2;
-            continue;
-        }
+// 文字の種別(ビットの組み合わせで表す)
+enum {
+    CC_SPACE    = 1 << 0,   // 空白文字
+    CC_DIGIT    = 1 << 1,   // 数字
+    CC_ALPHA    = 1 << 2,   // 識別子の先頭になれる文字(英字と'_')
+    CC_PUNCT    = 1 << 3,   // 1文字の記号
+    CC_PUNCT_EQ = 1 << 4,   // 後ろに'='が続くと2文字の記号になる文字
+};
 
-        // else文
-        if (strncmp(p, "else", 4) == 0 && !is_alnum(p[4])) {
-            cur = new_token(TK_ELSE, cur, p, 4);
-            p += 4;
-            continue;
-        }
+// 文字の種別表
+static const unsigned char char_class[256] = {
+    [' '] = CC_SPACE, ['\t'] = CC_SPACE, ['\n'] = CC_SPACE,
+    ['\v'] = CC_SPACE, ['\f'] = CC_SPACE, ['\r'] = CC_SPACE,
+
+    ['0'] = CC_DIGIT, ['1'] = CC_DIGIT, ['2'] = CC_DIGIT, ['3'] = CC_DIGIT,
+    ['4'] = CC_DIGIT, ['5'] = CC_DIGIT, ['6'] = CC_DIGIT, ['7'] = CC_DIGIT,
+    ['8'] = CC_DIGIT, ['9'] = CC_DIGIT,
+
+    ['a'] = CC_ALPHA, ['b'] = CC_ALPHA, ['c'] = CC_ALPHA, ['d'] = CC_ALPHA,
+    ['e'] = CC_ALPHA, ['f'] = CC_ALPHA, ['g'] = CC_ALPHA, ['h'] = CC_ALPHA,
+    ['i'] = CC_ALPHA, ['j'] = CC_ALPHA, ['k'] = CC_ALPHA, ['l'] = CC_ALPHA,
+    ['m'] = CC_ALPHA, ['n'] = CC_ALPHA, ['o'] = CC_ALPHA, ['p'] = CC_ALPHA,
+    ['q'] = CC_ALPHA, ['r'] = CC_ALPHA, ['s'] = CC_ALPHA, ['t'] = CC_ALPHA,
+    ['u'] = CC_ALPHA, ['v'] = CC_ALPHA, ['w'] = CC_ALPHA, ['x'] = CC_ALPHA,
+    ['y'] = CC_ALPHA, ['z'] = CC_ALPHA,
+    ['A'] = CC_ALPHA, ['B'] = CC_ALPHA, ['C'] = CC_ALPHA, ['D'] = CC_ALPHA,
+    ['E'] = CC_ALPHA, ['F'] = CC_ALPHA, ['G'] = CC_ALPHA, ['H'] = CC_ALPHA,
+    ['I'] = CC_ALPHA, ['J'] = CC_ALPHA, ['K'] = CC_ALPHA, ['L'] = CC_ALPHA,
+    ['M'] = CC_ALPHA, ['N'] = CC_ALPHA, ['O'] = CC_ALPHA, ['P'] = CC_ALPHA,
+    ['Q'] = CC_ALPHA, ['R'] = CC_ALPHA, ['S'] = CC_ALPHA, ['T'] = CC_ALPHA,
+    ['U'] = CC_ALPHA, ['V'] = CC_ALPHA, ['W'] = CC_ALPHA, ['X'] = CC_ALPHA,
+    ['Y'] = CC_ALPHA, ['Z'] = CC_ALPHA,
+    ['_'] = CC_ALPHA,
+
+    ['+'] = CC_PUNCT, ['-'] = CC_PUNCT, ['*'] = CC_PUNCT, ['/'] = CC_PUNCT,
+    ['&'] = CC_PUNCT, ['('] = CC_PUNCT, [')'] = CC_PUNCT, ['{'] = CC_PUNCT,
+    ['}'] = CC_PUNCT, ['['] = CC_PUNCT, [']'] = CC_PUNCT, [';'] = CC_PUNCT,
+    [','] = CC_PUNCT,
+    ['='] = CC_PUNCT | CC_PUNCT_EQ,
+    ['<'] = CC_PUNCT | CC_PUNCT_EQ,
+    ['>'] = CC_PUNCT | CC_PUNCT_EQ,
+    ['!'] = CC_PUNCT_EQ, // '!'単独は未サポート
+};
 
-        // while文
-        if (strncmp(p, "while", 5) == 0 && !is_alnum(p[5])) {
-            cur = new_token(TK_WHILE, cur, p, 5);
-            p += 5;
-            continue;
-        }
+static inline bool char_is(char c, int cls) {
+    return (char_class[(unsigned char)c] & cls) != 0;
+}
 
-        // for文
-        if (strncmp(p, "for", 3) == 0 && !is_alnum(p[3])) {
-            cur = new_token(TK_FOR, cur, p, 3);
-            p += 3;
-            continue;
-        }
+int is_alnum(char c) {
+    return char_is(c, CC_ALPHA | CC_DIGIT);
+}
+
+// 識別子がキーワードならそのトークン種別を、そうでなければTK_IDENTを返す
+// 長さと先頭文字で候補を1つに絞ってから比較するので、キーワードが増えても
+// 識別子1つあたりの比較回数は増えない
+static TokenKind keyword_kind(const char *p, int len) {
+    switch (len) {
+    case 2:
+        if (p[0] == 'i' && p[1] == 'f') return TK_IF;
+        break;
+    case 3:
+        if (p[0] == 'f' && memcmp(p, "for", 3) == 0) return TK_FOR;
+        if (p[0] == 'i' && memcmp(p, "int", 3) == 0) return TK_INT;
+        break;
+    case 4:
+        if (p[0] == 'e' && memcmp(p, "else", 4) == 0) return TK_ELSE;
+        break;
+    case 5:
+        if (p[0] == 'w' && memcmp(p, "while", 5) == 0) return TK_WHILE;
+        break;
+    case 6:
+        if (p[0] == 'r' && memcmp(p, "return", 6) == 0) return TK_RETURN;
+        if (p[0] == 's' && memcmp(p, "sizeof", 6) == 0) return TK_SIZEOF;
+        break;
+    }
+    return TK_IDENT;
+}
+
+// 入力文字列pをトークナイズしてトークン列を作り、先頭のトークンを返す
+int tokenize(char *p) {
+    ctx->tokens = (Tokens){0};
+    ctx->tokens.source = p;
+    new_token(TK_EOF, p, 0); // 0番は使わない
 
-        // int型
-        if (strncmp(p, "int", 3) == 0 && !is_alnum(p[3])) {
-            cur = new_token(TK_INT, cur, p, 3);
-            p += 3;
-            continue;
-        }
+    while (*p) {
+        const int cls = char_class[(unsigned char)*p];
 
-        // sizeof演算子
-        if (strncmp(p, "sizeof", 6) == 0 && !is_alnum(p[6])) {
-            cur = new_token(TK_SIZEOF, cur, p, 6);
-            p += 6;
+        // 空白文字をスキップ
+        if (cls & CC_SPACE) {
+            p = scan_skip_space(p + 1);
             continue;
         }
 
-        // 関係演算子
-        char *q = p + 1;
-        if (*q) {
-            if (*p == '>' || *p == '<') {
-                if (*q == '=') {
-                    cur = new_token(TK_RESERVED, cur, p++, 2);
-                } else {
-                    cur = new_token(TK_RESERVED, cur, p, 1);
-                }
-                p++;
-                continue;
-            }
-            if (strncmp(p, "==", 2) == 0 || strncmp(p, "!=", 2) == 0) {
-                cur = new_token(TK_RESERVED, cur, p, 2);
-                p += 2;
-                continue;
+        // 識別子またはキーワード
+        if (cls & CC_ALPHA) {
+            char *s = scan_ident_end(p + 1);
+            const int length = s - p;
+            const TokenKind kind = keyword_kind(p, length);
+            const int t = new_token(kind, p, length);
+            if (kind == TK_IDENT) {
+                ctx->tokens.val[t] = intern(p, length);
             }
-        }
-
-        if (*p == '+' || *p == '-' || *p == '*' || *p == '/' || *p == '=' || *p == '&' ||
-            *p == '(' || *p == ')' || *p == '{' || *p == '}' || *p == '[' || *p == ']' ||
-            *p == ';' || *p == ',') {
-            cur = new_token(TK_RESERVED, cur, p++, 1);
+            p = s;
             continue;
         }
 
         // 数値
-        if (isdigit(*p)) {
-            cur = new_token(TK_NUM, cur, p, 1);
+        if (cls & CC_DIGIT) {
             char *q = p;
-            cur->val = strtol(p, &q, 10);
-            cur->len = q - p;
+            const int val = scan_decimal(p, &q);
+            const int t = new_token(TK_NUM, p, q - p);
+            ctx->tokens.val[t] = val;
             p = q;
             continue;
         }
 
-        // ローカル変数
-        char *s = p;
-        while (('a' <= *s && *s <= 'z') ||
-               ('0' <= *s && *s <= '9') ||
-               ('_' == *s)) {
-            s++;
+        // 関係演算子などの2文字の記号
+        if ((cls & CC_PUNCT_EQ) && p[1] == '=') {
+            new_token(TK_RESERVED, p, 2);
+            p += 2;
+            continue;
         }
-        if (s != p) {
-            const int length = s - p;
-            cur = new_token(TK_IDENT, cur, p, length);
-            p = s;
+
+        // 1文字の記号
+        if (cls & CC_PUNCT) {
+            new_token(TK_RESERVED, p++, 1);
             continue;
         }
 
         error_exit("トークナイズできません");
     }
 
-    new_token(TK_EOF, cur, p, 1);
-    return head.next;
+    new_token(TK_EOF, p, 1);
+    TRACE(TRACE_LEX, 1, "%d tokens", ctx->tokens.count);
+    return 1;
 }
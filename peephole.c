@@ -0,0 +1,962 @@
+#include "9cc.h"
+#include "peephole.h"
+
+/*
+ * 覗き穴最適化
+ * コード生成が関数の出力に通すフィルタ(emit_filter_begin())として働く。
+ * 規則には2種類ある。
+ * - 窓の規則: 命令から数命令先までの並びだけを見て書き換える
+ * - 後ろ向きの規則: 関数全体の生存解析で求めた「命令の直後に生きているレジスタ」
+ *   を使う。命令を後ろから順にたどり、生きているレジスタを更新しながら当てはめる
+ * 窓の規則を全ての命令に当てはめてから後ろ向きの規則を当てはめ、変化がなくなる
+ * まで(最大PEEPHOLE_ROUNDS回)繰り返す。
+ * 長い関数はPEEPHOLE_SLICE_LINES行までの断片に分けて最適化する(作業領域の大きさ
+ * を抑える)。
+ * コード生成はフラグをcmpの直後(setcc, jcc)でしか使わないので、フラグを変える命
+ * 令を取り除いたり別の命令に畳んだりしても構わない。
+ */
+
+// 規則を当てはめ直す最大の回数
+#define PEEPHOLE_ROUNDS 4
+
+// 一度に最適化する最大の行数。半分を超えたらラベルの前で区切る
+#define PEEPHOLE_SLICE_LINES 2048
+
+// 読んだ結果を控えておく行の数(2の冪)と、控える行の最大の長さ
+#define PARSE_CACHE_SIZE 512
+#define PARSE_CACHE_LINE 32
+
+// メモリに書いた値を読み出す命令を探す範囲(命令数)
+#define STORE_LOAD_WINDOW 16
+
+// 一時レジスタに値を入れた命令を遡って探す範囲(命令数)
+#define COPY_FORWARD_WINDOW 8
+
+#define BIT(reg) (1u << (reg))
+#define ALL_REGISTERS 0xffffu
+// 常に生きているとみなすレジスタ
+#define FRAME_REGISTERS (BIT(REG_RSP) | BIT(REG_RBP))
+#define ARGUMENT_REGISTERS (BIT(REG_RDI) | BIT(REG_RSI) | BIT(REG_RDX) | BIT(REG_RCX) | \
+                            BIT(REG_R8) | BIT(REG_R9))
+#define CALLER_SAVED (ARGUMENT_REGISTERS | BIT(REG_RAX) | BIT(REG_R10) | BIT(REG_R11))
+#define CALLEE_SAVED (BIT(REG_RBX) | FRAME_REGISTERS | BIT(REG_R12) | BIT(REG_R13) | \
+                      BIT(REG_R14) | BIT(REG_R15))
+
+// アセンブリの1行
+typedef struct {
+    const char *text;   // 元の行(改行を含まない)
+    int len;
+    int target;         // ジャンプ命令の飛び先の行(断片の中になければ-1)
+    uint32_t use;       // 命令が読むレジスタ(effect()の結果)
+    uint32_t def;       // 命令が書くレジスタ
+    AsmLine line;       // 読んだ結果。命令を書き換えたらline.instを書き換えてrewrite_line()を呼ぶ
+    bool removed;
+    bool rewritten;     // 真ならtextではなくline.instを書き出す
+    bool loop_head;     // 後ろ向きのジャンプの飛び先か
+} Line;
+
+// 読んだ行の控え(コード生成は同じ行を何度も出すので、読んだ結果を使い回す)
+typedef struct {
+    char text[PARSE_CACHE_LINE];
+    int len;            // 0なら空き
+    AsmLine line;
+    uint32_t use;
+    uint32_t def;
+} ParsedLine;
+
+// ラベルの定義(名前順に並べて引く)
+typedef struct {
+    const char *name;
+    int name_len;
+    int line;
+} Label;
+
+// 作業領域はスレッドごとに持ち、関数をまたいで使い回す
+static _Thread_local Line *lines;
+static _Thread_local int lines_len;
+static _Thread_local int lines_capacity;
+static _Thread_local uint32_t *live_in;     // 行の直前に生きているレジスタ
+static _Thread_local Label *labels;
+static _Thread_local int labels_len;
+static _Thread_local int labels_capacity;
+static _Thread_local bool has_back_edge;    // 前のラベルへのジャンプ(ループ)があるか
+static _Thread_local char *out;             // 最適化した結果
+static _Thread_local size_t out_len;
+static _Thread_local size_t out_capacity;
+static _Thread_local PeepholeStats *stats;
+// 命令の種類ごとに当てはめる窓の規則・後ろ向きの規則(規則の番号のビットの集合)
+static _Thread_local uint32_t window_rules[OP_COUNT];
+static _Thread_local uint32_t backward_rules[OP_COUNT];
+static _Thread_local bool rules_ready;
+static _Thread_local ParsedLine *parse_cache; // PARSE_CACHE_SIZE個。同じハッシュ値の行は上書きする
+
+static void remove_line(int i, PeepholeRule rule) {
+    lines[i].removed = true;
+    stats->removed[rule]++;
+}
+
+// iより後で取り除いていない最初の行(コメントだけの行は飛ばす)。なければlines_len
+static int next_line(int i) {
+    for (i++; i < lines_len; i++) {
+        if (!lines[i].removed && lines[i].line.kind != ASM_EMPTY) {
+            break;
+        }
+    }
+    return i;
+}
+
+// iより前で取り除いていない最後の行(コメントだけの行は飛ばす)。なければ-1
+static int prev_line(int i) {
+    for (i--; i >= 0; i--) {
+        if (!lines[i].removed && lines[i].line.kind != ASM_EMPTY) {
+            break;
+        }
+    }
+    return i;
+}
+
+static bool is_instruction(int i, Opcode op) {
+    return i >= 0 && i < lines_len && lines[i].line.kind == ASM_INST && lines[i].line.inst.op == op;
+}
+
+static bool is_register64(const Operand *opr) {
+    return opr->kind == OPR_REG && opr->size == 8;
+}
+
+static bool is_jump(Opcode op) {
+    return OP_JMP <= op && op <= OP_JGE;
+}
+
+static bool same_memory(const Operand *a, const Operand *b) {
+    return a->kind == OPR_MEM && b->kind == OPR_MEM &&
+           (a->size == 0 || a->size == 8) && (b->size == 0 || b->size == 8) &&
+           a->reg == b->reg && a->index == b->index && a->imm == b->imm &&
+           (a->index < 0 || a->scale == b->scale);
+}
+
+// メモリのオペランドのアドレスの計算に使うレジスタ
+static uint32_t address_registers(const Operand *opr) {
+    if (opr->kind != OPR_MEM) {
+        return 0;
+    }
+    return BIT(opr->reg) | (opr->index >= 0 ? BIT(opr->index) : 0);
+}
+
+// オペランドを読むときに使うレジスタ
+static uint32_t operand_registers(const Operand *opr) {
+    return opr->kind == OPR_REG ? BIT(opr->reg) : address_registers(opr);
+}
+
+/**
+ * 命令が読むレジスタ(*use)と書くレジスタ(*def)を求める
+ * 8ビットのレジスタへの書き込みは残りのビットを読むものとして扱う
+ */
+static void effect(const Inst *inst, uint32_t *use, uint32_t *def) {
+    const Operand *a = &inst->operands[0];
+    const Operand *b = &inst->operands[1];
+    *use = 0;
+    *def = 0;
+    switch (inst->op) {
+    case OP_MOV:
+    case OP_LEA:
+    case OP_MOVZX:
+        *use = (inst->op == OP_LEA ? address_registers(b) : operand_registers(b)) | address_registers(a);
+        if (a->kind == OPR_REG) {
+            *def = BIT(a->reg);
+            if (a->size == 1) {
+                *use |= BIT(a->reg);
+            }
+        }
+        break;
+    case OP_IMUL:
+        if (inst->count == 1) {
+            *use = BIT(REG_RAX) | operand_registers(a);
+            *def = BIT(REG_RAX) | BIT(REG_RDX);
+            break;
+        }
+        // fallthrough
+    case OP_ADD:
+    case OP_SUB:
+    case OP_AND:
+    case OP_OR:
+    case OP_XOR:
+    case OP_SHL:
+    case OP_SAR:
+    case OP_SHR:
+    case OP_NEG:
+        *use = operand_registers(a) | (inst->count == 2 ? operand_registers(b) : 0);
+        *def = a->kind == OPR_REG ? BIT(a->reg) : 0;
+        break;
+    case OP_CMP:
+    case OP_TEST:
+        *use = operand_registers(a) | operand_registers(b);
+        break;
+    case OP_IDIV:
+        *use = BIT(REG_RAX) | BIT(REG_RDX) | operand_registers(a);
+        *def = BIT(REG_RAX) | BIT(REG_RDX);
+        break;
+    case OP_CQO:
+        *use = BIT(REG_RAX);
+        *def = BIT(REG_RDX);
+        break;
+    case OP_PUSH:
+        *use = operand_registers(a) | BIT(REG_RSP);
+        *def = BIT(REG_RSP);
+        break;
+    case OP_POP:
+        *use = address_registers(a) | BIT(REG_RSP);
+        *def = (a->kind == OPR_REG ? BIT(a->reg) : 0) | BIT(REG_RSP);
+        break;
+    case OP_SETE:
+    case OP_SETNE:
+    case OP_SETL:
+    case OP_SETLE:
+    case OP_SETG:
+    case OP_SETGE:
+        *use = operand_registers(a);
+        *def = a->kind == OPR_REG ? BIT(a->reg) : 0;
+        break;
+    case OP_CALL:
+        *use = ARGUMENT_REGISTERS;
+        *def = CALLER_SAVED;
+        break;
+    case OP_RET:
+        *use = BIT(REG_RAX) | CALLEE_SAVED;
+        break;
+    default: // ジャンプ
+        break;
+    }
+}
+
+static void rewrite_line(int i, PeepholeRule rule) {
+    lines[i].rewritten = true;
+    effect(&lines[i].line.inst, &lines[i].use, &lines[i].def);
+    stats->rewritten[rule]++;
+}
+
+// メモリに書く、または制御を移す命令か(メモリの値を覚えておけなくなる命令)
+static bool is_barrier(const Inst *inst) {
+    switch (inst->op) {
+    case OP_CMP:
+    case OP_TEST:
+    case OP_IDIV:
+        return false;
+    case OP_IMUL:
+        return inst->count == 2 && inst->operands[0].kind == OPR_MEM;
+    case OP_PUSH:
+    case OP_POP:
+    case OP_CALL:
+    case OP_RET:
+        return true;
+    default:
+        return is_jump(inst->op) || (inst->count > 0 && inst->operands[0].kind == OPR_MEM);
+    }
+}
+
+/*
+ * 命令がmemoryと重なるかもしれないメモリに書くか、制御を移すか
+ * 同じベースレジスタからの8バイトずつの書き込みで、8バイト以上離れていれば重ならない
+ */
+static bool may_clobber(const Inst *inst, const Operand *memory) {
+    if (!is_barrier(inst)) {
+        return false;
+    }
+    if (inst->op != OP_MOV) {
+        return true;
+    }
+    const Operand *dest = &inst->operands[0];
+    return dest->reg != memory->reg || dest->index >= 0 || memory->index >= 0 ||
+           (dest->size != 0 && dest->size != 8) ||
+           (dest->imm - memory->imm < 8 && memory->imm - dest->imm < 8);
+}
+
+static int compare_label(const char *name, int name_len, const Label *label) {
+    if (name_len != label->name_len) {
+        return name_len < label->name_len ? -1 : 1;
+    }
+    return memcmp(name, label->name, name_len);
+}
+
+static int compare_labels(const void *a, const void *b) {
+    const Label *x = a;
+    return compare_label(x->name, x->name_len, b);
+}
+
+// ラベルを定義した行を探す。この関数の中になければ-1
+static int find_label(const Operand *target) {
+    int lo = 0, hi = labels_len;
+    while (lo < hi) {
+        const int mid = (lo + hi) / 2;
+        const int c = compare_label(target->name, target->name_len, &labels[mid]);
+        if (c == 0) {
+            return labels[mid].line;
+        }
+        if (c < 0) {
+            hi = mid;
+        } else {
+            lo = mid + 1;
+        }
+    }
+    return -1;
+}
+
+// 行iの直前に生きているレジスタ(関数の外へ出る場合は全て)
+static uint32_t live_before(int i) {
+    return i < lines_len ? live_in[i] : ALL_REGISTERS;
+}
+
+// 行iの直後に生きているレジスタ
+static uint32_t live_out(int i) {
+    const AsmLine *line = &lines[i].line;
+    if (line->kind == ASM_DIRECTIVE) {
+        return ALL_REGISTERS;
+    }
+    if (line->kind != ASM_INST || lines[i].removed) {
+        return live_before(i + 1);
+    }
+    const Inst *inst = &line->inst;
+    if (inst->op == OP_RET) {
+        return 0;
+    }
+    if (!is_jump(inst->op)) {
+        return live_before(i + 1);
+    }
+    const int target = lines[i].target;
+    const uint32_t taken = target >= 0 ? live_in[target] : ALL_REGISTERS;
+    return inst->op == OP_JMP ? taken : taken | live_before(i + 1);
+}
+
+static uint32_t live_through(int i, uint32_t live) {
+    if (lines[i].removed || lines[i].line.kind != ASM_INST) {
+        return live;
+    }
+    return lines[i].use | (live & ~lines[i].def) | FRAME_REGISTERS;
+}
+
+/*
+ * 生存解析: 全ての行のlive_inを求める(後ろから繰り返したどる)
+ * 1回たどる間に古いlive_inを読むのは後ろ向きのジャンプだけなので、その飛び先の
+ * live_inが変わらなくなったら終える
+ */
+static void compute_liveness(void) {
+    memset(live_in, 0, sizeof(uint32_t) * lines_len);
+    for (bool changed = true; changed;) {
+        changed = false;
+        for (int i = lines_len - 1; i >= 0; i--) {
+            const uint32_t live = live_through(i, live_out(i));
+            if (live != live_in[i]) {
+                live_in[i] = live;
+                changed |= lines[i].loop_head;
+            }
+        }
+    }
+}
+
+// 規則
+
+// jmp, retの後、次のラベルまでの命令は実行されない
+static bool rule_unreachable(int i, uint32_t live) {
+    (void)live;
+    if (!is_instruction(i, OP_JMP) && !is_instruction(i, OP_RET)) {
+        return false;
+    }
+    bool changed = false;
+    for (int j = next_line(i); j < lines_len && lines[j].line.kind == ASM_INST; j = next_line(j)) {
+        remove_line(j, PEEPHOLE_UNREACHABLE);
+        changed = true;
+    }
+    return changed;
+}
+
+// 直後のラベルへのジャンプは要らない
+static bool rule_jump_next(int i, uint32_t live) {
+    (void)live;
+    const Inst *inst = &lines[i].line.inst;
+    if (!is_jump(inst->op) || inst->operands[0].kind != OPR_LABEL) {
+        return false;
+    }
+    for (int j = next_line(i); j < lines_len && lines[j].line.kind == ASM_LABEL; j = next_line(j)) {
+        const AsmLine *label = &lines[j].line;
+        if (label->name_len == inst->operands[0].name_len &&
+            memcmp(label->name, inst->operands[0].name, label->name_len) == 0) {
+            remove_line(i, PEEPHOLE_JUMP_NEXT);
+            return true;
+        }
+    }
+    return false;
+}
+
+// push X; pop Y は mov Y, X にする(XとYが同じレジスタなら両方要らない)
+static bool rule_push_pop(int i, uint32_t live) {
+    (void)live;
+    const int j = next_line(i);
+    if (!is_instruction(i, OP_PUSH) || !is_instruction(j, OP_POP) ||
+        !is_register64(&lines[j].line.inst.operands[0])) {
+        return false;
+    }
+    Inst *push = &lines[i].line.inst;
+    const Operand to = lines[j].line.inst.operands[0];
+    if (push->operands[0].kind == OPR_REG && push->operands[0].reg == to.reg) {
+        remove_line(i, PEEPHOLE_PUSH_POP);
+    } else {
+        *push = (Inst){.op = OP_MOV, .count = 2, .operands = {to, push->operands[0]}};
+        rewrite_line(i, PEEPHOLE_PUSH_POP);
+    }
+    remove_line(j, PEEPHOLE_PUSH_POP);
+    return true;
+}
+
+// 0の加減算・論理和・排他的論理和・シフトと1の乗算は何もしない
+static bool rule_identity(int i, uint32_t live) {
+    (void)live;
+    const Inst *inst = &lines[i].line.inst;
+    if (inst->count != 2 || !is_register64(&inst->operands[0]) || inst->operands[1].kind != OPR_IMM) {
+        return false;
+    }
+    const long imm = inst->operands[1].imm;
+    switch (inst->op) {
+    case OP_ADD:
+    case OP_SUB:
+    case OP_OR:
+    case OP_XOR:
+    case OP_SHL:
+    case OP_SAR:
+    case OP_SHR:
+        if (imm != 0) return false;
+        break;
+    case OP_IMUL:
+        if (imm != 1) return false;
+        break;
+    default:
+        return false;
+    }
+    remove_line(i, PEEPHOLE_IDENTITY);
+    return true;
+}
+
+// mov r, r は何もしない(32ビットのmovは上位を0にするので残す)
+static bool rule_self_move(int i, uint32_t live) {
+    (void)live;
+    const Inst *inst = &lines[i].line.inst;
+    if (inst->op != OP_MOV || !is_register64(&inst->operands[0]) || !is_register64(&inst->operands[1]) ||
+        inst->operands[0].reg != inst->operands[1].reg) {
+        return false;
+    }
+    remove_line(i, PEEPHOLE_SELF_MOVE);
+    return true;
+}
+
+/*
+ * mov [M], rA の後で同じメモリを読む mov rB, [M] は mov rB, rA にする
+ * 間にメモリへの書き込み・ジャンプ・ラベルがなく、rAとMのアドレスのレジスタが
+ * 変わっていない範囲で探す
+ * 間でrAを書くmovが1つあっても、rAを読まずに mov rA, [M] に着けばそのmovは要ら
+ * ないので、両方取り除く(dead-moveの後にもう一回り当てはめずに済む)
+ */
+static bool rule_store_load(int i, uint32_t live) {
+    (void)live;
+    const Inst *store = &lines[i].line.inst;
+    if (store->op != OP_MOV || store->operands[0].kind != OPR_MEM || !is_register64(&store->operands[1])) {
+        return false;
+    }
+    const Operand memory = store->operands[0];
+    const Operand value = store->operands[1];
+    const uint32_t clobber = BIT(value.reg) | address_registers(&memory);
+    bool changed = false;
+    int dead = -1;  // rAを書いたmov(rAはもうvalueではない)
+    int window = 0;
+    for (int k = next_line(i); k < lines_len && window < STORE_LOAD_WINDOW; k = next_line(k), window++) {
+        if (lines[k].line.kind != ASM_INST || (dead >= 0 && (lines[k].use & BIT(value.reg)))) {
+            break;
+        }
+        Inst *load = &lines[k].line.inst;
+        if (load->op == OP_MOV && is_register64(&load->operands[0]) && same_memory(&load->operands[1], &memory)) {
+            if (load->operands[0].reg == value.reg) {
+                if (dead >= 0) {
+                    remove_line(dead, PEEPHOLE_DEAD_MOVE);
+                    dead = -1;
+                }
+                remove_line(k, PEEPHOLE_STORE_LOAD);
+                changed = true;
+                continue;
+            }
+            if (dead >= 0) {
+                break;
+            }
+            load->operands[1] = value;
+            rewrite_line(k, PEEPHOLE_STORE_LOAD);
+            changed = true;
+        }
+        if ((lines[k].def & clobber) || may_clobber(load, &memory)) {
+            if (dead < 0 && load->op == OP_MOV && lines[k].def == BIT(value.reg) &&
+                !((lines[k].use | address_registers(&memory)) & BIT(value.reg))) {
+                dead = k;
+                continue;
+            }
+            break;
+        }
+    }
+    return changed;
+}
+
+// 命令useの第2オペランドの代わりにvalueを使えるか
+static bool can_fold_operand(const Inst *use, const Operand *value) {
+    const bool to_register = use->operands[0].kind == OPR_REG;
+    switch (use->op) {
+    case OP_MOV:
+    case OP_ADD:
+    case OP_SUB:
+    case OP_CMP:
+    case OP_AND:
+    case OP_OR:
+    case OP_XOR:
+        break;
+    case OP_IMUL:
+        if (!to_register) return false;
+        break;
+    default:
+        return false;
+    }
+    switch (value->kind) {
+    case OPR_REG:
+        return value->size == 8;
+    case OPR_IMM:
+        return (use->op == OP_MOV && to_register) || (INT32_MIN <= value->imm && value->imm <= INT32_MAX);
+    case OPR_MEM:
+        return to_register && (value->size == 0 || value->size == 8);
+    default:
+        return false;
+    }
+}
+
+/*
+ * mov rA, X の後の命令 op Y, rA でrAがその後使われなければ op Y, X にする
+ * (一時レジスタを経由した即値・変数・戻り値の受け渡しを畳む)
+ * 間の命令はrAを読み書きせず、Xの値を変えないものに限る
+ */
+static bool rule_copy_forward(int j, uint32_t live) {
+    Inst *use = &lines[j].line.inst;
+    if (use->count != 2 || !is_register64(&use->operands[1])) {
+        return false;
+    }
+    const int temp = use->operands[1].reg;
+    if ((live & BIT(temp)) || (operand_registers(&use->operands[0]) & BIT(temp))) {
+        return false;
+    }
+
+    // rAを書いた命令を探す。間の命令が書いたレジスタとメモリを書いたかを覚えておく
+    uint32_t written = 0;
+    bool memory_written = false;
+    int i = prev_line(j);
+    for (int window = 0; i >= 0 && lines[i].line.kind == ASM_INST; i = prev_line(i), window++) {
+        const Inst *inst = &lines[i].line.inst;
+        if (lines[i].def & BIT(temp)) {
+            break;
+        }
+        if (window == COPY_FORWARD_WINDOW || (lines[i].use & BIT(temp)) || is_jump(inst->op) ||
+            inst->op == OP_CALL || inst->op == OP_RET) {
+            return false;
+        }
+        written |= lines[i].def;
+        memory_written |= is_barrier(inst);
+    }
+    if (!is_instruction(i, OP_MOV)) {
+        return false;
+    }
+    const Inst *def = &lines[i].line.inst;
+    const Operand *value = &def->operands[1];
+    if (!is_register64(&def->operands[0]) || (operand_registers(value) & written) ||
+        (value->kind == OPR_MEM && memory_written) || !can_fold_operand(use, value)) {
+        return false;
+    }
+    use->operands[1] = *value;
+    rewrite_line(j, PEEPHOLE_COPY_FORWARD);
+    remove_line(i, PEEPHOLE_COPY_FORWARD);
+    // mov rA, rB; ...; mov rB, rA は mov rB, rB になるので、ここで取り除く(もう一回り当てはめずに済む)
+    rule_self_move(j, live);
+    return true;
+}
+
+// オペランドの中のレジスタfromをtoに付け替える
+static void rename_operand(Operand *opr, int from, int to) {
+    if (opr->kind == OPR_REG || opr->kind == OPR_MEM) {
+        if (opr->reg == from) {
+            opr->reg = to;
+        }
+    }
+    if (opr->kind == OPR_MEM && opr->index == from) {
+        opr->index = to;
+    }
+}
+
+// オペランドに書かれたレジスタだけを読み書きする命令か
+static bool has_explicit_registers(const Inst *inst) {
+    switch (inst->op) {
+    case OP_IDIV:
+    case OP_CQO:
+    case OP_PUSH:
+    case OP_POP:
+    case OP_CALL:
+    case OP_RET:
+        return false;
+    case OP_IMUL:
+        return inst->count == 2;
+    default:
+        return !is_jump(inst->op);
+    }
+}
+
+/*
+ * rAに値を作る命令の並びの後の mov rB, rA で、rAがその後使われなければ、並びの
+ * rAをrBに付け替えてmovを取り除く(式の結果を戻り値や引数のレジスタで直接作る)
+ * 並びはrAを読まずに書く命令から始まり、rBを読み書きしないものに限る
+ */
+static bool rule_coalesce(int j, uint32_t live) {
+    const Inst *copy = &lines[j].line.inst;
+    if (copy->op != OP_MOV || !is_register64(&copy->operands[0]) || !is_register64(&copy->operands[1])) {
+        return false;
+    }
+    const int to = copy->operands[0].reg;
+    const int from = copy->operands[1].reg;
+    if (to == from || (live & BIT(from)) || (BIT(to) & FRAME_REGISTERS)) {
+        return false;
+    }
+
+    // rAを読まずに書く命令まで遡る
+    int i = prev_line(j);
+    for (int window = 0;; i = prev_line(i), window++) {
+        if (window == COPY_FORWARD_WINDOW || i < 0 || lines[i].line.kind != ASM_INST ||
+            !has_explicit_registers(&lines[i].line.inst)) {
+            return false;
+        }
+        const uint32_t use = lines[i].use;
+        const uint32_t def = lines[i].def;
+        if ((use | def) & BIT(to)) {
+            return false;
+        }
+        if ((def & BIT(from)) && !(use & BIT(from))) {
+            break;
+        }
+    }
+
+    for (int k = i; k < j; k = next_line(k)) {
+        Inst *inst = &lines[k].line.inst;
+        for (int n = 0; n < inst->count; n++) {
+            rename_operand(&inst->operands[n], from, to);
+        }
+        rewrite_line(k, PEEPHOLE_COALESCE);
+    }
+    remove_line(j, PEEPHOLE_COALESCE);
+    return true;
+}
+
+// 書いたレジスタがその後使われない mov, lea, movzx は要らない
+static bool rule_dead_move(int i, uint32_t live) {
+    const Inst *inst = &lines[i].line.inst;
+    if ((inst->op != OP_MOV && inst->op != OP_LEA && inst->op != OP_MOVZX) ||
+        inst->operands[0].kind != OPR_REG || ((live | FRAME_REGISTERS) & BIT(inst->operands[0].reg))) {
+        return false;
+    }
+    remove_line(i, PEEPHOLE_DEAD_MOVE);
+    return true;
+}
+
+// 規則の表
+typedef struct {
+    const char *name;
+    bool (*apply)(int i, uint32_t live);    // 行iの命令に当てはめる。liveは直後に生きているレジスタ
+    uint64_t ops;                           // 当てはめる命令の種類(OPのビットの集合)
+    bool backward;                          // 後ろ向きの規則か(偽なら窓の規則)
+} Rule;
+
+#define OPS(op) (1ull << (op))
+#define JUMP_OPS (OPS(OP_JMP) | OPS(OP_JE) | OPS(OP_JNE) | OPS(OP_JL) | OPS(OP_JLE) | OPS(OP_JG) | OPS(OP_JGE))
+
+static const Rule RULES[PEEPHOLE_RULE_COUNT] = {
+    [PEEPHOLE_UNREACHABLE] = {"unreachable", rule_unreachable, OPS(OP_JMP) | OPS(OP_RET), false},
+    [PEEPHOLE_JUMP_NEXT] = {"jump-next", rule_jump_next, JUMP_OPS, false},
+    [PEEPHOLE_PUSH_POP] = {"push-pop", rule_push_pop, OPS(OP_PUSH), false},
+    [PEEPHOLE_IDENTITY] = {"identity", rule_identity,
+                           OPS(OP_ADD) | OPS(OP_SUB) | OPS(OP_OR) | OPS(OP_XOR) | OPS(OP_SHL) |
+                           OPS(OP_SAR) | OPS(OP_SHR) | OPS(OP_IMUL), false},
+    [PEEPHOLE_SELF_MOVE] = {"self-move", rule_self_move, OPS(OP_MOV), false},
+    [PEEPHOLE_STORE_LOAD] = {"store-load", rule_store_load, OPS(OP_MOV), false},
+    [PEEPHOLE_COPY_FORWARD] = {"copy-forward", rule_copy_forward,
+                               OPS(OP_MOV) | OPS(OP_ADD) | OPS(OP_SUB) | OPS(OP_CMP) | OPS(OP_AND) |
+                               OPS(OP_OR) | OPS(OP_XOR) | OPS(OP_IMUL), true},
+    [PEEPHOLE_COALESCE] = {"coalesce", rule_coalesce, OPS(OP_MOV), true},
+    [PEEPHOLE_DEAD_MOVE] = {"dead-move", rule_dead_move, OPS(OP_MOV) | OPS(OP_LEA) | OPS(OP_MOVZX), true},
+};
+
+const char *peephole_rule_name(PeepholeRule rule) {
+    return RULES[rule].name;
+}
+
+// 命令の種類ごとに当てはめる規則の表を作る(スレッドごとに最初の1回だけ)
+static void init_rules(void) {
+    if (rules_ready) {
+        return;
+    }
+    rules_ready = true;
+    for (int op = 0; op < OP_COUNT; op++) {
+        for (int r = 0; r < PEEPHOLE_RULE_COUNT; r++) {
+            if (RULES[r].ops & OPS(op)) {
+                *(RULES[r].backward ? &backward_rules[op] : &window_rules[op]) |= 1u << r;
+            }
+        }
+    }
+}
+
+/*
+ * 行iの命令に、rules(window_rulesかbackward_rules)のうちその種類の命令の規則を
+ * 表の順に当てはめる。規則が命令の種類を変えたら、残りは新しい種類の規則にする
+ */
+static bool apply_rules(int i, uint32_t live, const uint32_t *rules) {
+    bool changed = false;
+    uint32_t pending = rules[lines[i].line.inst.op];
+    while (pending && !lines[i].removed) {
+        const int r = __builtin_ctz(pending);
+        pending &= pending - 1;
+        if (RULES[r].apply(i, live)) {
+            changed = true;
+            pending = rules[lines[i].line.inst.op] & ~((2u << r) - 1);
+        }
+    }
+    return changed;
+}
+
+// 窓の規則を前から全ての命令に当てはめる
+static bool apply_window_rules(void) {
+    bool changed = false;
+    for (int i = 0; i < lines_len; i++) {
+        const Line *line = &lines[i];
+        if (!line->removed && line->line.kind == ASM_INST && window_rules[line->line.inst.op]) {
+            changed |= apply_rules(i, 0, window_rules);
+        }
+    }
+    return changed;
+}
+
+/*
+ * 後ろ向きの規則を後ろから全ての命令に当てはめる
+ * 書き換えで生きているレジスタは減るだけなので、まだたどっていない行(後ろ向き
+ * のジャンプの先)のlive_inは古いままでも安全側になる。後ろ向きのジャンプがなけ
+ * れば、後ろからたどりながら求めるlive_inだけで正確になる。同じ理由で、
+ * compute_liveness()は最初の1回だけでよく、その後は前回たどったときのlive_inを使う
+ */
+static bool apply_backward_rules(void) {
+    bool changed = false;
+    for (int i = lines_len - 1; i >= 0; i--) {
+        // 規則は行iより前の行を書き換えるか行iを取り除くだけなので、live_out(i)は変わらない
+        const uint32_t live = live_out(i);
+        const Line *line = &lines[i];
+        if (!line->removed && line->line.kind == ASM_INST && backward_rules[line->line.inst.op]) {
+            changed |= apply_rules(i, live, backward_rules);
+        }
+        live_in[i] = live_through(i, live);
+    }
+    return changed;
+}
+
+static void put_out(const char *s, size_t n) {
+    if (out_len + n > out_capacity) {
+        out_capacity = (out_len + n) * 2;
+        out = realloc(out, out_capacity);
+        if (!out) {
+            error_exit("覗き穴最適化のメモリを確保できません");
+        }
+    }
+    memcpy(out + out_len, s, n);
+    out_len += n;
+}
+
+// 行の控えを引くハッシュ値。8バイトずつ混ぜ、端数は最後の8バイトを重ねて読む
+static uint32_t hash_line(const char *s, int len) {
+    uint64_t h = 14695981039346656037ull ^ (uint64_t)len;
+    if (len < 8) {
+        for (int i = 0; i < len; i++) {
+            h = (h ^ (unsigned char)s[i]) * 1099511628211ull;
+        }
+        return (uint32_t)(h ^ h >> 32);
+    }
+    const char *last = s + len - 8;
+    uint64_t word;
+    for (; s < last; s += 8) {
+        memcpy(&word, s, 8);
+        h = (h ^ word) * 1099511628211ull;
+    }
+    memcpy(&word, last, 8);
+    h = (h ^ word) * 1099511628211ull;
+    return (uint32_t)(h ^ h >> 32);
+}
+
+/*
+ * 1行を読み、命令ならeffect()も求める。控えにあればそれを写す
+ * コメントは読んだ結果を変えないので、控えはコメントより前の部分で引く
+ * 名前(ラベル・シンボル)を含む行は結果が行の中を指すので控えない
+ */
+static void parse_line(const char *s, int len, Line *line) {
+    const char *comment = memchr(s, '#', len);
+    const int key_len = comment ? comment - s : len;
+    if (key_len == 0 || key_len > PARSE_CACHE_LINE) {
+        asm_parse_line(s, len, &line->line);
+        if (line->line.kind == ASM_INST) {
+            effect(&line->line.inst, &line->use, &line->def);
+        }
+        return;
+    }
+    if (!parse_cache) {
+        parse_cache = calloc(PARSE_CACHE_SIZE, sizeof(ParsedLine));
+        if (!parse_cache) {
+            error_exit("覗き穴最適化のメモリを確保できません");
+        }
+    }
+    ParsedLine *cached = &parse_cache[hash_line(s, key_len) & (PARSE_CACHE_SIZE - 1)];
+    if (cached->len == key_len && memcmp(cached->text, s, key_len) == 0) {
+        line->line = cached->line;
+        line->use = cached->use;
+        line->def = cached->def;
+        return;
+    }
+    asm_parse_line(s, len, &line->line);
+    const AsmLine *parsed = &line->line;
+    if (parsed->kind == ASM_INST) {
+        effect(&parsed->inst, &line->use, &line->def);
+    } else if (parsed->kind != ASM_EMPTY) {
+        return;
+    }
+    if ((parsed->inst.count > 0 && parsed->inst.operands[0].kind == OPR_LABEL) ||
+        (parsed->inst.count > 1 && parsed->inst.operands[1].kind == OPR_LABEL)) {
+        return;
+    }
+    memcpy(cached->text, s, key_len);
+    cached->len = key_len;
+    cached->line = *parsed;
+    cached->use = line->use;
+    cached->def = line->def;
+}
+
+/*
+ * textから最大PEEPHOLE_SLICE_LINES行を読み、読んだ長さを返す
+ * 半分を超えたらラベルの前で区切る(ラベルは窓の規則が越えないので区切っても失うものが少ない)
+ */
+static size_t read_lines(const char *text, size_t len) {
+    lines_len = labels_len = 0;
+    const char *end = text + len;
+    const char *p = text;
+    while (p < end && lines_len < PEEPHOLE_SLICE_LINES) {
+        const char *eol = memchr(p, '\n', end - p);
+        if (!eol) {
+            eol = end;
+        }
+        if (lines_len == lines_capacity) {
+            lines_capacity = lines_capacity ? lines_capacity * 2 : 1024;
+            lines = realloc(lines, sizeof(Line) * lines_capacity);
+            live_in = realloc(live_in, sizeof(uint32_t) * lines_capacity);
+        }
+        Line *line = &lines[lines_len];
+        line->text = p;
+        line->len = eol - p;
+        line->target = -1;
+        line->removed = line->rewritten = line->loop_head = false;
+        parse_line(p, eol - p, line);
+        if (line->line.kind == ASM_LABEL) {
+            if (lines_len >= PEEPHOLE_SLICE_LINES / 2) {
+                break;
+            }
+            if (labels_len == labels_capacity) {
+                labels_capacity = labels_capacity ? labels_capacity * 2 : 64;
+                labels = realloc(labels, sizeof(Label) * labels_capacity);
+            }
+            labels[labels_len++] = (Label){line->line.name, line->line.name_len, lines_len};
+        }
+        lines_len++;
+        p = eol + 1;
+    }
+    qsort(labels, labels_len, sizeof(Label), compare_labels);
+
+    // ジャンプの飛び先を引いておく
+    has_back_edge = false;
+    for (int i = 0; i < lines_len; i++) {
+        const AsmLine *line = &lines[i].line;
+        if (line->kind == ASM_INST && is_jump(line->inst.op)) {
+            const int target = find_label(&line->inst.operands[0]);
+            lines[i].target = target;
+            if (0 <= target && target < i) {
+                lines[target].loop_head = has_back_edge = true;
+            }
+        }
+    }
+    return MIN(p, end) - text;
+}
+
+// 読んだ行を最適化した結果をoutに足す。続けて残っている行は元のテキストのまま写す
+static void write_lines(void) {
+    for (int i = 0; i < lines_len;) {
+        if (lines[i].removed) {
+            i++;
+            continue;
+        }
+        if (lines[i].rewritten) {
+            char buf[256];
+            put_out(buf, asm_format_inst(&lines[i].line.inst, buf, sizeof(buf)));
+            put_out("\n", 1);
+            i++;
+            continue;
+        }
+        int j = i + 1;
+        while (j < lines_len && !lines[j].removed && !lines[j].rewritten) {
+            j++;
+        }
+        put_out(lines[i].text, lines[j - 1].text + lines[j - 1].len - lines[i].text);
+        put_out("\n", 1);
+        i = j;
+    }
+}
+
+/**
+ * 関数のアセンブリtext(長さ*len)を最適化して返し、*lenを結果の長さにする
+ * 長い関数は何回かに分けて渡されることがある。その場合、断片の外へのジャンプと
+ * 断片の末尾では全てのレジスタが生きているとみなす(PEEPHOLE_SLICE_LINESで区切っ
+ * た断片も同じ)
+ * 結果は次の呼び出しまで有効。規則ごとの件数をstatsに足す
+ */
+const char *peephole(const char *text, size_t *len, PeepholeStats *peephole_stats) {
+    stats = peephole_stats;
+    init_rules();
+    out_len = 0;
+    for (size_t done = 0; done < *len;) {
+        done += read_lines(text + done, *len - done);
+        if (has_back_edge) {
+            compute_liveness();
+        }
+        for (int round = 0; round < PEEPHOLE_ROUNDS; round++) {
+            // 後ろ向きの規則は1回で落ち着くので、窓の規則が何も変えなければ終える
+            if (!apply_window_rules() && round > 0) {
+                break;
+            }
+            if (!apply_backward_rules()) {
+                break;
+            }
+        }
+        write_lines();
+    }
+    *len = out_len;
+    return out;
+}
+
+// 作業領域を解放する
+void release_peephole(void) {
+    free(lines);
+    free(live_in);
+    free(labels);
+    free(out);
+    free(parse_cache);
+    lines = NULL;
+    live_in = NULL;
+    labels = NULL;
+    out = NULL;
+    parse_cache = NULL;
+    lines_len = lines_capacity = labels_len = labels_capacity = 0;
+    out_len = out_capacity = 0;
+}
@@ -0,0 +1,33 @@
+#pragma once
+
+#include <stddef.h>
+
+/*
+ * 覗き穴最適化
+ * コード生成が出力した関数1つ分のアセンブリを組み込みのアセンブラで命令の並び
+ * に読み、規則の表を順に当てはめて書き換えてから出力し直す。
+ */
+
+// 規則(規則の表の順)
+typedef enum {
+    PEEPHOLE_UNREACHABLE,   // jmp, retの後の到達しない命令
+    PEEPHOLE_JUMP_NEXT,     // 直後のラベルへのジャンプ
+    PEEPHOLE_PUSH_POP,      // 隣り合うpushとpop
+    PEEPHOLE_IDENTITY,      // 0の加減算・シフト、1の乗算
+    PEEPHOLE_SELF_MOVE,     // 同じレジスタへのmov
+    PEEPHOLE_STORE_LOAD,    // 書いた直後のメモリの読み出し
+    PEEPHOLE_COPY_FORWARD,  // 一度だけ使う値のmovを使う命令に畳む
+    PEEPHOLE_COALESCE,      // 値を作ってから別のレジスタへ移すmovを、移し先で作るようにする
+    PEEPHOLE_DEAD_MOVE,     // 使われない値を作るmov, lea, movzx
+    PEEPHOLE_RULE_COUNT,
+} PeepholeRule;
+
+// 規則ごとの統計(--peephole-stats)
+typedef struct {
+    long removed[PEEPHOLE_RULE_COUNT];      // 取り除いた命令の数
+    long rewritten[PEEPHOLE_RULE_COUNT];    // 書き換えた命令の数
+} PeepholeStats;
+
+extern const char *peephole_rule_name(PeepholeRule rule);
+extern const char *peephole(const char *text, size_t *len, PeepholeStats *stats);
+extern void release_peephole(void);
@@ -0,0 +1,125 @@
+#define _POSIX_C_SOURCE 200809L // clock_gettime, open_memstream
+#include "report.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <sys/resource.h>
+
+// 単調増加する時計の現在時刻(秒)
+double report_clock(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec * 1e-9;
+}
+
+void report_memory(Report *report, const char *name, size_t used, size_t reserved) {
+    if (report->memory_count < REPORT_MEMORY_MAX) {
+        report->memory[report->memory_count++] = (MemoryUsage){name, used, reserved};
+    }
+}
+
+// プロセスの最大常駐サイズ(KB)
+static long peak_rss(void) {
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0) {
+        return 0;
+    }
+#ifdef __APPLE__
+    return usage.ru_maxrss / 1024; // macOSはバイト単位
+#else
+    return usage.ru_maxrss;
+#endif
+}
+
+// JSONの文字列として書く
+static void put_json_string(FILE *out, const char *s) {
+    fputc('"', out);
+    for (; *s; s++) {
+        const unsigned char c = *s;
+        if (c == '"' || c == '\\') {
+            fprintf(out, "\\%c", c);
+        } else if (c == '\n') {
+            fputs("\\n", out);
+        } else if (c < 0x20) {
+            fprintf(out, "\\u%04x", c);
+        } else {
+            fputc(c, out);
+        }
+    }
+    fputc('"', out);
+}
+
+static void print_json(FILE *out, const Report *r, bool time, bool mem) {
+    fputs("{\"input\":", out);
+    put_json_string(out, r->input);
+    if (time) {
+        fprintf(out, ",\"time\":{\"tokenize\":%.6f,\"parse\":%.6f,\"codegen\":%.6f,\"total\":%.6f}",
+                r->tokenize_time, r->parse_time, r->codegen_time, r->total_time);
+    }
+    fprintf(out, ",\"counts\":{\"tokens\":%ld,\"nodes\":%ld,\"list_items\":%ld,\"types\":%ld,"
+            "\"symbols\":%ld,\"locals\":%ld,\"lookups\":%ld,\"instructions\":%ld,"
+            "\"lines\":%ld,\"bytes\":%ld}",
+            r->tokens, r->nodes, r->list_items, r->types, r->symbols, r->locals,
+            r->lookups, r->instructions, r->lines, r->bytes);
+    if (mem) {
+        fputs(",\"memory\":{", out);
+        for (int i = 0; i < r->memory_count; i++) {
+            fprintf(out, "%s\"%s\":{\"used\":%zu,\"reserved\":%zu}",
+                    i ? "," : "", r->memory[i].name, r->memory[i].used, r->memory[i].reserved);
+        }
+        fprintf(out, "},\"peak_rss_kb\":%ld", r->peak_rss);
+    }
+    fputs("}\n", out);
+}
+
+static void print_table(FILE *out, const Report *r, bool time, bool mem) {
+    fprintf(out, "report: %.60s\n", r->input);
+    if (time) {
+        const double phases[] = {r->tokenize_time, r->parse_time, r->codegen_time};
+        const char *names[] = {"tokenize", "parse", "codegen"};
+        for (int i = 0; i < 3; i++) {
+            fprintf(out, "  time %-10s %10.3f ms %5.1f%%\n", names[i], phases[i] * 1e3,
+                    r->total_time > 0 ? phases[i] / r->total_time * 100 : 0.0);
+        }
+        fprintf(out, "  time %-10s %10.3f ms\n", "total", r->total_time * 1e3);
+    }
+    fprintf(out, "  tokens=%ld nodes=%ld list-items=%ld types=%ld symbols=%ld\n",
+            r->tokens, r->nodes, r->list_items, r->types, r->symbols);
+    fprintf(out, "  locals=%ld lookups=%ld instructions=%ld lines=%ld bytes=%ld\n",
+            r->locals, r->lookups, r->instructions, r->lines, r->bytes);
+    if (mem) {
+        size_t used = 0, reserved = 0;
+        for (int i = 0; i < r->memory_count; i++) {
+            fprintf(out, "  mem  %-10s used=%-12zu reserved=%zu\n",
+                    r->memory[i].name, r->memory[i].used, r->memory[i].reserved);
+            used += r->memory[i].used;
+            reserved += r->memory[i].reserved;
+        }
+        fprintf(out, "  mem  %-10s used=%-12zu reserved=%zu peak-rss=%ldKB\n",
+                "total", used, reserved, r->peak_rss);
+    }
+}
+
+/**
+ * レポートを標準エラー出力に書く
+ * jsonなら1入力1行のJSON(JSON Lines)で書く。並列コンパイルで行が混ざらないよう、
+ * 一度文字列に組み立ててからまとめて書く。
+ */
+void print_report(Report *report, bool time, bool mem, bool json) {
+    report->peak_rss = peak_rss();
+
+    char *text = NULL;
+    size_t len = 0;
+    FILE *out = open_memstream(&text, &len);
+    if (!out) {
+        return;
+    }
+    if (json) {
+        print_json(out, report, time, mem);
+    } else {
+        print_table(out, report, time, mem);
+    }
+    fclose(out);
+    fwrite(text, 1, len, stderr);
+    free(text);
+}
@@ -0,0 +1,50 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * コンパイル1回分の時間とメモリのレポート(--time-report, --mem-report)
+ * compile()がフェーズの区切りで値を埋め、最後にprint_report()で標準エラー出力
+ * へ書く。どちらのオプションも指定されていなければ時刻の取得もしない。
+ */
+
+// サブシステムごとのメモリ使用量
+typedef struct {
+    const char *name;
+    size_t used;        // 使用中のバイト数
+    size_t reserved;    // 確保済のバイト数
+} MemoryUsage;
+
+#define REPORT_MEMORY_MAX 8
+
+typedef struct {
+    const char *input;
+
+    // フェーズごとの時間(秒)
+    double tokenize_time;
+    double parse_time;
+    double codegen_time;
+    double total_time;
+
+    // 件数
+    long tokens;
+    long nodes;
+    long list_items;
+    long types;
+    long symbols;
+    long locals;
+    long lookups;
+    long instructions;
+    long lines;
+    long bytes;
+
+    // メモリ
+    MemoryUsage memory[REPORT_MEMORY_MAX];
+    int memory_count;
+    long peak_rss;      // プロセスの最大常駐サイズ(KB)
+} Report;
+
+extern double report_clock(void);
+extern void report_memory(Report *report, const char *name, size_t used, size_t reserved);
+extern void print_report(Report *report, bool time, bool mem, bool json);
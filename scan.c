@@ -0,0 +1,126 @@
+#include "scan.h"
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+// SSE2はx86-64なら常に使えるので、CPUを調べずにコンパイル時に決める
+// (SSE4.2・AVX2版も試したが、トークン1つあたりの処理が支配的でSSE2より速く
+// ならなかった)
+#ifdef __SSE2__
+#define SCAN_SSE2 1
+#include <emmintrin.h>
+#endif
+
+// ページ境界をまたぐ読み込みは入力の終端より先の未マップ領域に触れる可能性が
+// あるので、ベクトル幅分がページ内に収まるときだけまとめて読む
+#define SCAN_PAGE_SIZE 4096
+#define SCAN_FITS_IN_PAGE(p, width) \
+    (((uintptr_t)(p) & (SCAN_PAGE_SIZE - 1)) <= SCAN_PAGE_SIZE - (width))
+
+static inline bool is_space_char(char c) {
+    return c == ' ' || ('\t' <= c && c <= '\r');
+}
+
+static inline bool is_digit_char(char c) {
+    return '0' <= c && c <= '9';
+}
+
+static inline bool is_ident_char(char c) {
+    return ('a' <= c && c <= 'z') ||
+        ('A' <= c && c <= 'Z') ||
+        ('0' <= c && c <= '9') ||
+        (c == '_');
+}
+
+/*
+ * スカラ実装
+ */
+static char *skip_space_scalar(char *p) {
+    while (is_space_char(*p)) p++;
+    return p;
+}
+
+static char *ident_end_scalar(char *p) {
+    while (is_ident_char(*p)) p++;
+    return p;
+}
+
+static char *digits_end_scalar(char *p) {
+    while (is_digit_char(*p)) p++;
+    return p;
+}
+
+#ifdef SCAN_SSE2
+/*
+ * SSE2実装: 16バイトずつ比較し、条件を満たさない最初のバイトを探す
+ */
+
+// lo <= v <= hi (符号なし)のバイトを0xffにする
+static inline __m128i in_range_sse2(__m128i v, char lo, char hi) {
+    __m128i ge = _mm_cmpeq_epi8(_mm_max_epu8(v, _mm_set1_epi8(lo)), v);
+    __m128i le = _mm_cmpeq_epi8(_mm_min_epu8(v, _mm_set1_epi8(hi)), v);
+    return _mm_and_si128(ge, le);
+}
+
+static inline __m128i space_mask_sse2(__m128i v) {
+    return _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(' ')),
+                        in_range_sse2(v, '\t', '\r'));
+}
+
+static inline __m128i digit_mask_sse2(__m128i v) {
+    return in_range_sse2(v, '0', '9');
+}
+
+static inline __m128i ident_mask_sse2(__m128i v) {
+    __m128i lower = _mm_or_si128(v, _mm_set1_epi8(0x20));
+    __m128i m = in_range_sse2(lower, 'a', 'z');
+    m = _mm_or_si128(m, in_range_sse2(v, '0', '9'));
+    return _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('_')));
+}
+
+#define DEFINE_SCAN_SSE2(name, mask_fn, char_fn) \
+    static char *name(char *p) { \
+        for (;;) { \
+            if (!SCAN_FITS_IN_PAGE(p, 16)) { \
+                if (!char_fn(*p)) return p; \
+                p++; \
+                continue; \
+            } \
+            __m128i v = _mm_loadu_si128((const __m128i *)p); \
+            unsigned miss = ~(unsigned)_mm_movemask_epi8(mask_fn(v)) & 0xffff; \
+            if (miss) return p + __builtin_ctz(miss); \
+            p += 16; \
+        } \
+    }
+
+DEFINE_SCAN_SSE2(skip_space_sse2, space_mask_sse2, is_space_char)
+DEFINE_SCAN_SSE2(ident_end_sse2, ident_mask_sse2, is_ident_char)
+DEFINE_SCAN_SSE2(digits_end_sse2, digit_mask_sse2, is_digit_char)
+#endif
+
+// 利用できる実装(優先度の低い順)
+static const Scanner scanners[] = {
+    {"scalar", skip_space_scalar, ident_end_scalar, digits_end_scalar},
+#ifdef SCAN_SSE2
+    {"sse2", skip_space_sse2, ident_end_sse2, digits_end_sse2},
+#endif
+};
+
+// 使用中の実装。最初に選択されるまではスカラ実装を使う
+Scanner scanner = {"scalar", skip_space_scalar, ident_end_scalar, digits_end_scalar};
+
+/**
+ * 走査の実装を選択する
+ * nameがNULLなら最も速い実装(SSE2が使えればSSE2)を選ぶ
+ * 指定の実装がない場合はfalseを返す
+ */
+bool scan_select(const char *name) {
+    const int n = sizeof(scanners) / sizeof(scanners[0]);
+    for (int i = n - 1; i >= 0; i--) {
+        if (!name || strcmp(scanners[i].name, name) == 0) {
+            scanner = scanners[i];
+            return true;
+        }
+    }
+    return false;
+}
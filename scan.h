@@ -0,0 +1,41 @@
+#pragma once
+
+#include <stdbool.h>
+
+// トークナイザ用の文字列走査
+// 入力はNULL終端されていること。NULL文字はどの文字種にも含まれない
+
+// 走査の実装
+typedef struct {
+    const char *name;
+    char *(*skip_space)(char *p);   // 空白文字以外が現れる位置を返す
+    char *(*ident_end)(char *p);    // 識別子を構成しない文字が現れる位置を返す
+    char *(*digits_end)(char *p);   // 数字以外が現れる位置を返す
+} Scanner;
+
+extern Scanner scanner;
+
+extern bool scan_select(const char *name);
+
+static inline char *scan_skip_space(char *p) {
+    return scanner.skip_space(p);
+}
+
+static inline char *scan_ident_end(char *p) {
+    return scanner.ident_end(p);
+}
+
+static inline char *scan_digits_end(char *p) {
+    return scanner.digits_end(p);
+}
+
+// 10進数を読んで値を返す。*endには数字の直後の位置を設定する
+static inline int scan_decimal(char *p, char **end) {
+    char *q = scan_digits_end(p);
+    unsigned long val = 0;
+    for (char *s = p; s < q; s++) {
+        val = val * 10 + (unsigned long)(*s - '0');
+    }
+    *end = q;
+    return (int)val;
+}
@@ -0,0 +1,111 @@
+#define _DEFAULT_SOURCE // MAP_ANONYMOUS
+#include "9cc.h"
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/*
+ * ファイルを読み取り専用でメモリマップする
+ * トークンは入力を直接指すのでコピーはしない。トークナイザはNULL文字を入力の
+ * 終端とみなすので、ファイルの直後に必ずゼロのバイトがくるようにマップする。
+ * - ファイルサイズ+1バイトを覆う匿名ページを予約する
+ * - その先頭にファイルを重ねてマップする
+ * ファイルの最終ページの余りはカーネルがゼロで埋め、サイズがページ境界ちょうど
+ * の場合は予約した匿名ページがゼロ終端になる。
+ */
+static char *map_file(int fd, size_t size, size_t *out_length) {
+    const size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    const size_t length = (size + 1 + page - 1) / page * page;
+    *out_length = length;
+
+    char *p = mmap(NULL, length, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) {
+        return NULL;
+    }
+    if (size > 0 &&
+        mmap(p, size, PROT_READ, MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED) {
+        munmap(p, length);
+        return NULL;
+    }
+    return p;
+}
+
+// 標準入力を終端まで読んでNULL終端したバッファを返す
+static char *read_stream(int fd) {
+    size_t capacity = 64 * 1024;
+    size_t len = 0;
+    char *buffer = malloc(capacity);
+    for (;;) {
+        if (capacity - len < 2) {
+            capacity *= 2;
+            buffer = realloc(buffer, capacity);
+        }
+        ssize_t n = read(fd, buffer + len, capacity - len - 1);
+        if (n < 0) {
+            error_exit("標準入力を読めません");
+        }
+        if (n == 0) {
+            break;
+        }
+        len += n;
+    }
+    buffer[len] = '\0';
+    return buffer;
+}
+
+// ファイルがない引数をパスではなくソースそのものとみなすか
+static bool is_inline_source(const char *arg) {
+    return strpbrk(arg, " \t\n\r(){};") != NULL;
+}
+
+/**
+ * 現在のコンテキストの入力を読み込んでctx->sourceにする
+ * - "-"なら標準入力から読む
+ * - その名前のファイルがあれば、通常のファイルとしてメモリマップする
+ * - ファイルがなく、空白か括弧・波括弧・セミコロンを含むなら引数そのものをソースとみなす
+ *   ("my file.c"や"f(1).c"のようなパスもファイルがあればファイルとして読む)
+ */
+void load_source(void) {
+    char *arg = ctx->input;
+    if (strcmp(arg, "-") == 0) {
+        ctx->source = read_stream(STDIN_FILENO);
+        return;
+    }
+
+    struct stat st;
+    if (stat(arg, &st) != 0) {
+        if (is_inline_source(arg)) {
+            ctx->source = arg;
+            return;
+        }
+        error_exit("ファイルがありません: %s", arg);
+    }
+    if (!S_ISREG(st.st_mode)) {
+        error_exit("通常のファイルではありません: %s", arg);
+    }
+
+    int fd = open(arg, O_RDONLY);
+    if (fd < 0) {
+        error_exit("ファイルを開けません: %s", arg);
+    }
+    size_t length;
+    char *p = map_file(fd, (size_t)st.st_size, &length);
+    close(fd); // マップはfdを閉じても残る
+    if (!p) {
+        error_exit("ファイルをマップできません: %s", arg);
+    }
+    ctx->source = p;
+    ctx->source_mapped = length;
+}
+
+// load_source()で読み込んだ入力を解放する
+void release_source(void) {
+    if (ctx->source_mapped) {
+        munmap(ctx->source, ctx->source_mapped);
+    } else if (ctx->source && ctx->source != ctx->input) {
+        free(ctx->source); // 標準入力から読んだバッファ
+    }
+    ctx->source = NULL;
+    ctx->source_mapped = 0;
+}
@@ -0,0 +1,533 @@
+#include "9cc.h"
+#include "ir.h"
+
+/*
+ * SSA形式の構築と解体
+ * 構築: アドレスを取らない配列でないスロットを値にする(mem2reg)
+ *   1. 支配木を求める(Cooper, Harvey, Kennedyの反復法)
+ *   2. スロットに書くブロックの支配辺境にphiを置く
+ *   3. 支配木をたどりながら、load_slotをその時点のスロットの値に置き換え、
+ *      store_slotを取り除く。一度も書いていないスロットの値は0とする
+ *   4. 引数が1つの値と自分だけのphiと、使われないphiを取り除く
+ * 解体: phiを前のブロックの末尾のコピーにする。複数の後続を持つブロックから複数
+ *   の前のブロックを持つブロックへの辺(critical edge)は間にブロックを挟んで分け、
+ *   同じ辺のコピーは並列コピーとして(循環していれば一時的な値を使って)並べる。
+ */
+
+// 逆後順の番号の小さい方へ支配木をたどって2つのブロックの共通の支配ブロックを求める
+static int intersect(IrFunction *fn, const int *rpo, int a, int b) {
+    while (a != b) {
+        while (rpo[a] > rpo[b]) {
+            a = fn->blocks[a].idom;
+        }
+        while (rpo[b] > rpo[a]) {
+            b = fn->blocks[b].idom;
+        }
+    }
+    return a;
+}
+
+static void compute_dominators(IrFunction *fn, int *rpo) {
+    for (int b = 0; b < fn->block_count; b++) {
+        fn->blocks[b].idom = -1;
+    }
+    for (int i = 0; i < fn->order_len; i++) {
+        rpo[fn->order[i]] = i;
+    }
+    fn->blocks[0].idom = 0;
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (int i = 1; i < fn->order_len; i++) {
+            IrBlock *block = &fn->blocks[fn->order[i]];
+            int idom = -1;
+            for (int k = 0; k < block->pred_count; k++) {
+                const int p = block->preds[k];
+                if (fn->blocks[p].idom < 0) {
+                    continue;
+                }
+                idom = idom < 0 ? p : intersect(fn, rpo, p, idom);
+            }
+            if (block->idom != idom) {
+                block->idom = idom;
+                changed = true;
+            }
+        }
+    }
+}
+
+// ブロックの並び(支配辺境, 支配木の子)
+typedef struct {
+    int *items;
+    int len;
+    int capacity;
+} BlockList;
+
+static void push_block(BlockList *list, int b) {
+    if (list->len == list->capacity) {
+        const int n = list->capacity ? list->capacity * 2 : 4;
+        int *items = arena_alloc(ctx->ir_arena, sizeof(int) * n);
+        if (list->len) {
+            memcpy(items, list->items, sizeof(int) * list->len);
+        }
+        list->items = items;
+        list->capacity = n;
+    }
+    list->items[list->len++] = b;
+}
+
+// 各ブロックの支配辺境を求める
+static BlockList *dominance_frontiers(IrFunction *fn) {
+    BlockList *df = arena_alloc(ctx->ir_arena, sizeof(BlockList) * fn->block_count);
+    int *last_added = arena_alloc(ctx->ir_arena, sizeof(int) * fn->block_count);
+    for (int b = 0; b < fn->block_count; b++) {
+        last_added[b] = -1;
+    }
+    for (int i = 0; i < fn->order_len; i++) {
+        const int b = fn->order[i];
+        const IrBlock *block = &fn->blocks[b];
+        if (block->pred_count < 2) {
+            continue;
+        }
+        for (int k = 0; k < block->pred_count; k++) {
+            for (int runner = block->preds[k]; runner != block->idom; runner = fn->blocks[runner].idom) {
+                if (last_added[runner] == b) {
+                    break;
+                }
+                push_block(&df[runner], b);
+                last_added[runner] = b;
+            }
+        }
+    }
+    return df;
+}
+
+static bool is_promotable(const IrSlot *slot) {
+    return !slot->array && !slot->address_taken;
+}
+
+// スロットに書くブロックの反復支配辺境にphiを置く
+static void insert_phis(IrFunction *fn, const BlockList *df) {
+    BlockList *defs = arena_alloc(ctx->ir_arena, sizeof(BlockList) * fn->slot_count);
+    for (int i = 0; i < fn->order_len; i++) {
+        const int b = fn->order[i];
+        for (int inst = fn->blocks[b].first; inst; inst = ir_inst(fn, inst)->next) {
+            const IrInst *in = ir_inst(fn, inst);
+            if (in->op == IR_STORE_SLOT && is_promotable(&fn->slots[in->slot])) {
+                BlockList *list = &defs[in->slot];
+                if (list->len == 0 || list->items[list->len - 1] != b) {
+                    push_block(list, b);
+                }
+            }
+        }
+    }
+
+    // 印はスロットの番号+1で付けるのでスロットごとに消さなくてよい
+    int *has_phi = arena_alloc(ctx->ir_arena, sizeof(int) * fn->block_count);
+    int *queued = arena_alloc(ctx->ir_arena, sizeof(int) * fn->block_count);
+    int *worklist = arena_alloc(ctx->ir_arena, sizeof(int) * fn->block_count);
+    for (int s = 0; s < fn->slot_count; s++) {
+        if (!is_promotable(&fn->slots[s])) {
+            continue;
+        }
+        fn->slots[s].promoted = true;
+        int len = 0;
+        for (int k = 0; k < defs[s].len; k++) {
+            worklist[len++] = defs[s].items[k];
+            queued[defs[s].items[k]] = s + 1;
+        }
+        while (len > 0) {
+            const int b = worklist[--len];
+            for (int k = 0; k < df[b].len; k++) {
+                const int y = df[b].items[k];
+                if (has_phi[y] == s + 1) {
+                    continue;
+                }
+                has_phi[y] = s + 1;
+                const int operands = ir_new_operands(fn, fn->blocks[y].pred_count);
+                const int inst = ir_new_inst(fn, IR_PHI);
+                IrInst *phi = ir_inst(fn, inst);
+                phi->dst = ir_new_value(fn);
+                phi->slot = s;
+                phi->operands = operands;
+                phi->operand_count = fn->blocks[y].pred_count;
+                ir_prepend(fn, y, inst);
+                if (queued[y] != s + 1) {
+                    queued[y] = s + 1;
+                    worklist[len++] = y;
+                }
+            }
+        }
+    }
+}
+
+// 名前の付け替えの作業領域
+typedef struct {
+    IrValue **stacks;       // スロットごとの値のスタック
+    int *stack_len;
+    int *stack_capacity;
+    int *log;               // 値を積んだスロットの記録(ブロックを出るときに戻す)
+    int log_len;
+    int log_capacity;
+    IrValue *alias;         // 取り除いたload_slotの値 -> 代わりの値
+    IrValue *undef;         // スロットごとの一度も書いていないときの値(0なら未作成)
+} Renaming;
+
+static void push_value(Renaming *r, int slot, IrValue v) {
+    if (r->stack_len[slot] == r->stack_capacity[slot]) {
+        r->stack_capacity[slot] = r->stack_capacity[slot] ? r->stack_capacity[slot] * 2 : 4;
+        IrValue *items = arena_alloc(ctx->ir_arena, sizeof(IrValue) * r->stack_capacity[slot]);
+        if (r->stack_len[slot]) {
+            memcpy(items, r->stacks[slot], sizeof(IrValue) * r->stack_len[slot]);
+        }
+        r->stacks[slot] = items;
+    }
+    r->stacks[slot][r->stack_len[slot]++] = v;
+    if (r->log_len == r->log_capacity) {
+        r->log_capacity = r->log_capacity ? r->log_capacity * 2 : 64;
+        int *log = arena_alloc(ctx->ir_arena, sizeof(int) * r->log_capacity);
+        if (r->log_len) {
+            memcpy(log, r->log, sizeof(int) * r->log_len);
+        }
+        r->log = log;
+    }
+    r->log[r->log_len++] = slot;
+}
+
+// スロットの現在の値。一度も書いていなければ入口で作った0
+static IrValue current_value(IrFunction *fn, Renaming *r, int slot) {
+    if (r->stack_len[slot] > 0) {
+        return r->stacks[slot][r->stack_len[slot] - 1];
+    }
+    if (!r->undef[slot]) {
+        const int inst = ir_new_inst(fn, IR_CONST);
+        ir_inst(fn, inst)->dst = r->undef[slot] = ir_new_value(fn);
+        ir_prepend(fn, 0, inst);
+    }
+    return r->undef[slot];
+}
+
+static IrValue resolve(const Renaming *r, IrValue v) {
+    return r->alias[v] ? r->alias[v] : v;
+}
+
+// 命令が読む値(phiの引数は除く)のそれぞれについて、useをその値へのポインタにしてbodyを実行する
+#define FOR_EACH_USE(fn, in, use, body) do {                                  \
+        IrValue *use;                                                       \
+        if ((in)->a) { use = &(in)->a; body; }                              \
+        if ((in)->b) { use = &(in)->b; body; }                              \
+        if ((in)->op == IR_CALL) {                                          \
+            for (int use_i = 0; use_i < (in)->operand_count; use_i++) {     \
+                use = &(fn)->operands[(in)->operands + use_i];              \
+                body;                                                       \
+            }                                                               \
+        }                                                                   \
+    } while (0)
+
+static void rename_block(IrFunction *fn, Renaming *r, int b) {
+    for (int inst = fn->blocks[b].first; inst;) {
+        IrInst *in = ir_inst(fn, inst);
+        const int next = in->next;
+        if (in->op == IR_PHI) {
+            push_value(r, in->slot, in->dst);
+        } else if (in->op == IR_LOAD_SLOT && fn->slots[in->slot].promoted) {
+            r->alias[in->dst] = current_value(fn, r, in->slot);
+            ir_remove(fn, inst);
+        } else if (in->op == IR_STORE_SLOT && fn->slots[in->slot].promoted) {
+            push_value(r, in->slot, resolve(r, in->a));
+            ir_remove(fn, inst);
+        } else {
+            FOR_EACH_USE(fn, in, use, *use = resolve(r, *use));
+        }
+        inst = next;
+    }
+
+    int succ[2];
+    const int count = ir_successors(fn, b, succ);
+    for (int k = 0; k < count; k++) {
+        const IrBlock *s = &fn->blocks[succ[k]];
+        int j = 0;
+        while (s->preds[j] != b) {
+            j++;
+        }
+        for (int inst = s->first; inst && ir_inst(fn, inst)->op == IR_PHI; inst = ir_inst(fn, inst)->next) {
+            IrInst *phi = ir_inst(fn, inst);
+            fn->operands[phi->operands + j] = current_value(fn, r, phi->slot);
+        }
+    }
+}
+
+// 支配木を深さ優先でたどって名前を付け替える(支配木は深くなりうるので再帰しない)
+static void rename_values(IrFunction *fn) {
+    BlockList *children = arena_alloc(ctx->ir_arena, sizeof(BlockList) * fn->block_count);
+    for (int i = 1; i < fn->order_len; i++) {
+        const int b = fn->order[i];
+        push_block(&children[fn->blocks[b].idom], b);
+    }
+
+    Renaming r = {
+        .stacks = arena_alloc(ctx->ir_arena, sizeof(IrValue *) * fn->slot_count),
+        .stack_len = arena_alloc(ctx->ir_arena, sizeof(int) * fn->slot_count),
+        .stack_capacity = arena_alloc(ctx->ir_arena, sizeof(int) * fn->slot_count),
+        .undef = arena_alloc(ctx->ir_arena, sizeof(IrValue) * fn->slot_count),
+        // 名前の付け替え中に作る値はスロットごとの0だけ
+        .alias = arena_alloc(ctx->ir_arena, sizeof(IrValue) * (fn->value_count + fn->slot_count)),
+    };
+
+    // スタックの要素: ブロックと、次にたどる子の番号と、入ったときのlogの長さ
+    int *block_stack = arena_alloc(ctx->ir_arena, sizeof(int) * fn->order_len);
+    int *child_stack = arena_alloc(ctx->ir_arena, sizeof(int) * fn->order_len);
+    int *log_stack = arena_alloc(ctx->ir_arena, sizeof(int) * fn->order_len);
+    int depth = 0;
+    block_stack[depth] = 0;
+    child_stack[depth] = 0;
+    log_stack[depth] = 0;
+    depth++;
+    rename_block(fn, &r, 0);
+    while (depth > 0) {
+        const int b = block_stack[depth - 1];
+        if (child_stack[depth - 1] < children[b].len) {
+            const int c = children[b].items[child_stack[depth - 1]++];
+            block_stack[depth] = c;
+            child_stack[depth] = 0;
+            log_stack[depth] = r.log_len;
+            depth++;
+            rename_block(fn, &r, c);
+        } else {
+            depth--;
+            while (r.log_len > log_stack[depth]) {
+                r.stack_len[r.log[--r.log_len]]--;
+            }
+        }
+    }
+}
+
+/*
+ * 引数が自分以外に1つの値だけのphiをその値に置き換え、使われないphiを取り除く
+ * 置き換えで別のphiが同じ形になることがあるので、変化がなくなるまで繰り返す
+ */
+static void simplify_phis(IrFunction *fn) {
+    IrValue *alias = arena_alloc(ctx->ir_arena, sizeof(IrValue) * fn->value_count);
+    int *uses = arena_alloc(ctx->ir_arena, sizeof(int) * fn->value_count);
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (int i = 0; i < fn->order_len; i++) {
+            for (int inst = fn->blocks[fn->order[i]].first; inst; inst = ir_inst(fn, inst)->next) {
+                IrInst *in = ir_inst(fn, inst);
+                if (in->op != IR_PHI) {
+                    break;
+                }
+                IrValue same = 0;
+                bool trivial = true;
+                for (int k = 0; k < in->operand_count; k++) {
+                    IrValue v = fn->operands[in->operands + k];
+                    while (alias[v]) {
+                        v = alias[v];
+                    }
+                    fn->operands[in->operands + k] = v;
+                    if (v == in->dst || v == same) {
+                        continue;
+                    }
+                    if (same) {
+                        trivial = false;
+                    }
+                    same = v;
+                }
+                if (trivial && same) {
+                    alias[in->dst] = same;
+                    ir_remove(fn, inst);
+                    changed = true;
+                    break; // 外したので次のブロックへ(残りのphiは次の周回で見る)
+                }
+            }
+        }
+    }
+
+    // 置き換えた値を使う命令を書き換えながら使用回数を数える
+    for (int i = 0; i < fn->order_len; i++) {
+        for (int inst = fn->blocks[fn->order[i]].first; inst; inst = ir_inst(fn, inst)->next) {
+            IrInst *in = ir_inst(fn, inst);
+            if (in->op == IR_PHI) {
+                for (int k = 0; k < in->operand_count; k++) {
+                    IrValue *use = &fn->operands[in->operands + k];
+                    while (alias[*use]) {
+                        *use = alias[*use];
+                    }
+                    uses[*use]++;
+                }
+                continue;
+            }
+            FOR_EACH_USE(fn, in, use, {
+                while (alias[*use]) {
+                    *use = alias[*use];
+                }
+                uses[*use]++;
+            });
+        }
+    }
+
+    // 使われない(自分の引数としてだけ使われる)phiを取り除く
+    changed = true;
+    while (changed) {
+        changed = false;
+        for (int i = 0; i < fn->order_len; i++) {
+            for (int inst = fn->blocks[fn->order[i]].first; inst;) {
+                IrInst *in = ir_inst(fn, inst);
+                const int next = in->next;
+                if (in->op != IR_PHI) {
+                    break;
+                }
+                int self = 0;
+                for (int k = 0; k < in->operand_count; k++) {
+                    self += fn->operands[in->operands + k] == in->dst;
+                }
+                if (uses[in->dst] == self) {
+                    for (int k = 0; k < in->operand_count; k++) {
+                        uses[fn->operands[in->operands + k]]--;
+                    }
+                    ir_remove(fn, inst);
+                    changed = true;
+                }
+                inst = next;
+            }
+        }
+    }
+}
+
+/**
+ * SSA形式にする
+ * 昇格したスロットのload_slot, store_slotはなくなり、合流するブロックにphiが入る
+ */
+void ir_construct_ssa(IrFunction *fn) {
+    ir_compute_cfg(fn);
+    int *rpo = arena_alloc(ctx->ir_arena, sizeof(int) * fn->block_count);
+    compute_dominators(fn, rpo);
+    insert_phis(fn, dominance_frontiers(fn));
+    rename_values(fn);
+    simplify_phis(fn);
+}
+
+// predからsへの辺の間に、sへ飛ぶだけのブロックを挟む
+static int split_edge(IrFunction *fn, int pred, int s) {
+    const int mid = ir_new_block(fn);
+    const int jump = ir_new_inst(fn, IR_JMP);
+    ir_inst(fn, jump)->target[0] = s;
+    ir_append(fn, mid, jump);
+    fn->blocks[mid].reachable = true;
+    fn->blocks[mid].idom = pred;
+    fn->blocks[mid].preds = arena_alloc(ctx->ir_arena, sizeof(int));
+    fn->blocks[mid].preds[0] = pred;
+    fn->blocks[mid].pred_count = 1;
+
+    IrInst *term = ir_inst(fn, fn->blocks[pred].last);
+    for (int k = 0; k < 2; k++) {
+        if (term->target[k] == s) {
+            term->target[k] = mid;
+        }
+    }
+    IrBlock *block = &fn->blocks[s];
+    for (int k = 0; k < block->pred_count; k++) {
+        if (block->preds[k] == pred) {
+            block->preds[k] = mid;
+        }
+    }
+    return mid;
+}
+
+/*
+ * 並列コピー dst[i] = src[i] (i < n) を順に実行できるコピーの並びにして、
+ * blockの終端命令の前に置く
+ * 他のコピーが読む値に書くコピーは後回しにし、全てがそうなら(循環していれば)
+ * 1つの書き込み先の値を一時的な値に退避して循環を切る
+ */
+static void sequentialize_copies(IrFunction *fn, int block, IrValue *dst, IrValue *src, int n) {
+    const int term = fn->blocks[block].last;
+    while (n > 0) {
+        int ready = -1;
+        for (int i = 0; i < n && ready < 0; i++) {
+            bool blocked = false;
+            for (int j = 0; j < n && !blocked; j++) {
+                blocked = j != i && src[j] == dst[i];
+            }
+            if (!blocked) {
+                ready = i;
+            }
+        }
+
+        const int inst = ir_new_inst(fn, IR_COPY);
+        IrInst *copy = ir_inst(fn, inst);
+        if (ready >= 0) {
+            copy->dst = dst[ready];
+            copy->a = src[ready];
+            dst[ready] = dst[n - 1];
+            src[ready] = src[n - 1];
+            n--;
+        } else {
+            const IrValue saved = dst[0];
+            copy->dst = ir_new_value(fn);
+            copy->a = saved;
+            for (int j = 0; j < n; j++) {
+                if (src[j] == saved) {
+                    src[j] = copy->dst;
+                }
+            }
+        }
+        ir_insert_before(fn, term, inst);
+    }
+}
+
+/**
+ * SSA形式を解体する(phiを前のブロックの末尾のコピーにする)
+ * ir_construct_ssa()の後に呼ぶ。分けた辺のブロックはfn->orderの末尾に足す
+ */
+void ir_deconstruct_ssa(IrFunction *fn) {
+    const int original_len = fn->order_len;
+    int *order = arena_alloc(ctx->ir_arena, sizeof(int) * (fn->order_len + fn->operand_count + 1));
+    memcpy(order, fn->order, sizeof(int) * fn->order_len);
+    fn->order = order;
+
+    IrValue *dst = NULL, *src = NULL;
+    int capacity = 0;
+    for (int i = 0; i < original_len; i++) {
+        const int b = fn->order[i];
+        const int first = fn->blocks[b].first;
+        if (!first || ir_inst(fn, first)->op != IR_PHI) {
+            continue;
+        }
+
+        for (int k = 0; k < fn->blocks[b].pred_count; k++) {
+            int pred = fn->blocks[b].preds[k];
+            int succ[2];
+            if (fn->blocks[b].pred_count > 1 && ir_successors(fn, pred, succ) > 1) {
+                pred = split_edge(fn, pred, b);
+                fn->order[fn->order_len++] = pred;
+            }
+
+            int n = 0;
+            for (int inst = first; inst && ir_inst(fn, inst)->op == IR_PHI; inst = ir_inst(fn, inst)->next) {
+                n++;
+            }
+            if (n > capacity) {
+                capacity = n * 2;
+                dst = arena_alloc(ctx->ir_arena, sizeof(IrValue) * capacity);
+                src = arena_alloc(ctx->ir_arena, sizeof(IrValue) * capacity);
+            }
+            n = 0;
+            for (int inst = first; inst && ir_inst(fn, inst)->op == IR_PHI; inst = ir_inst(fn, inst)->next) {
+                const IrInst *phi = ir_inst(fn, inst);
+                const IrValue v = fn->operands[phi->operands + k];
+                if (v != phi->dst) {
+                    dst[n] = phi->dst;
+                    src[n] = v;
+                    n++;
+                }
+            }
+            sequentialize_copies(fn, pred, dst, src, n);
+        }
+
+        while (fn->blocks[b].first && ir_inst(fn, fn->blocks[b].first)->op == IR_PHI) {
+            ir_remove(fn, fn->blocks[b].first);
+        }
+    }
+}
@@ -1,5 +1,9 @@
 #!/bin/bash
 
+# テストのソースは一時ディレクトリに書く(直下の*.cは次のmakeで9ccにリンクされてしまう)
+tmpdir=$(mktemp -d)
+trap 'rm -rf "$tmpdir"' EXIT
+
 try() {
   expected="$1"
   input="$2"
@@ -17,6 +21,234 @@ try() {
   fi
 }
 
+# ファイルまたは標準入力からソースを読む
+try_file() {
+  expected="$1"
+  input="$2"
+
+  echo "$input" > "$tmpdir/tmp.c"
+  ./9cc "$tmpdir/tmp.c" -o tmp.s
+  gcc -o tmp tmp.s extern/foo.o extern/alloc4.o extern/alloc_ptr3.o
+  ./tmp
+  actual_file="$?"
+
+  echo "$input" | ./9cc - -o tmp.s
+  gcc -o tmp tmp.s extern/foo.o extern/alloc4.o extern/alloc_ptr3.o
+  ./tmp
+  actual_stdin="$?"
+
+  if [ "$actual_file" = "$expected" ] && [ "$actual_stdin" = "$expected" ]; then
+    echo "(file) $input => $actual_file"
+  else
+    echo "❎ $expected expected, but got $actual_file(file) $actual_stdin(stdin)"
+    exit 1
+  fi
+}
+
+# 関数キャッシュを使わない場合・空のキャッシュの場合・キャッシュが効く場合で
+# 出力が同じになることを確かめる
+try_cache() {
+  expected="$1"
+  input="$2"
+
+  rm -rf tmp_cache
+  echo "$input" > "$tmpdir/tmp.c"
+  ./9cc "$tmpdir/tmp.c" -o tmp_nocache.s
+  ./9cc --cache-dir tmp_cache "$tmpdir/tmp.c" -o tmp_cold.s
+  ./9cc --cache-dir tmp_cache --cache-stats "$tmpdir/tmp.c" -o tmp.s 2> tmp_stats.txt
+  rm -rf tmp_cache
+  if ! cmp -s tmp_nocache.s tmp_cold.s || ! cmp -s tmp_nocache.s tmp.s; then
+    echo "❎ キャッシュの有無で出力が異なります: $input"
+    exit 1
+  fi
+  if ! grep -q "misses=0" tmp_stats.txt; then
+    echo "❎ キャッシュが使われていません: $input"
+    exit 1
+  fi
+
+  gcc -o tmp tmp.s extern/foo.o extern/alloc4.o extern/alloc_ptr3.o
+  ./tmp
+  actual="$?"
+
+  if [ "$actual" = "$expected" ]; then
+    echo "(cache) $input => $actual"
+  else
+    echo "❎ $expected expected, but got $actual"
+    exit 1
+  fi
+}
+
+# レポートを付けてもアセンブリが変わらず、JSONに件数が出ることを確かめる
+try_report() {
+  expected="$1"
+  input="$2"
+
+  echo "$input" > "$tmpdir/tmp.c"
+  ./9cc "$tmpdir/tmp.c" -o tmp_noreport.s
+  ./9cc --time-report --mem-report --report-json "$tmpdir/tmp.c" -o tmp.s 2> tmp_report.txt
+  if ! cmp -s tmp_noreport.s tmp.s; then
+    echo "❎ レポートの有無で出力が異なります: $input"
+    exit 1
+  fi
+  if ! grep -q '"instructions":[1-9]' tmp_report.txt; then
+    echo "❎ レポートが出力されていません: $input"
+    exit 1
+  fi
+
+  gcc -o tmp tmp.s extern/foo.o extern/alloc4.o extern/alloc_ptr3.o
+  ./tmp
+  actual="$?"
+
+  if [ "$actual" = "$expected" ]; then
+    echo "(report) $input => $actual"
+  else
+    echo "❎ $expected expected, but got $actual"
+    exit 1
+  fi
+}
+
+# -cで組み込みのアセンブラが出力したオブジェクトファイルをリンクして確かめる
+# ELFを出力するのでLinuxだけで行う(_mainをエントリのmainとしてリンクする)
+try_object() {
+  expected="$1"
+  input="$2"
+
+  if [ "$(uname)" != "Linux" ]; then
+    return
+  fi
+  echo "$input" > "$tmpdir/tmp.c"
+  ./9cc -c "$tmpdir/tmp.c" -o tmp.o
+  gcc -o tmp tmp.o extern/foo.o extern/alloc4.o extern/alloc_ptr3.o -Wl,--defsym=main=_main
+  ./tmp
+  actual="$?"
+
+  if [ "$actual" = "$expected" ]; then
+    echo "(object) $input => $actual"
+  else
+    echo "❎ $expected expected, but got $actual"
+    exit 1
+  fi
+}
+
+# --runでJIT実行した結果を確かめる(アセンブルとリンクをしない)
+# 外部の関数は共有ライブラリにして--loadで読み込ませる
+try_run() {
+  expected="$1"
+  input="$2"
+
+  if [ ! -f tmp_extern.so ]; then
+    gcc -shared -fPIC -o tmp_extern.so extern/foo.c extern/alloc4.c extern/alloc_ptr3.c
+  fi
+  ./9cc --run --load ./tmp_extern.so "$input"
+  actual="$?"
+
+  if [ "$actual" = "$expected" ]; then
+    echo "(run) $input => $actual"
+  else
+    echo "❎ $expected expected, but got $actual"
+    exit 1
+  fi
+}
+
+# マニフェストの全プログラムを--batchでまとめて確かめる
+# 1つの.sにまとめてリンクした実行ファイルは、期待値と違ったプログラムの数で終了する
+# 中間表現を経由した場合と覗き穴最適化をしない場合も同じ結果になることを確かめる
+try_batch() {
+  expected="$1"
+  manifest="$2"
+
+  printf '%s\n' "$manifest" > tmp_batch.txt
+  for flag in "" --ir --no-peephole; do
+    ./9cc --batch tmp_batch.txt $flag -o tmp.s 2> /dev/null
+    gcc -o tmp tmp.s extern/foo.o extern/alloc4.o extern/alloc_ptr3.o
+    ./tmp
+    actual="$?"
+    if [ "$actual" != "$expected" ]; then
+      echo "❎ $expected failures expected, but got $actual ($flag)"
+      exit 1
+    fi
+  done
+  echo "(batch) $(grep -c . tmp_batch.txt) programs => $actual failed"
+}
+
+# コンパイルがエラーになることを確かめる
+try_error() {
+  input="$1"
+
+  if ./9cc "$input" > tmp.s 2> /dev/null; then
+    echo "❎ error expected, but compiled: $input"
+    exit 1
+  fi
+  echo "(error) $input"
+}
+
+# 覗き穴最適化の有無で結果が同じで、最適化すると命令が減ることを確かめる
+try_peephole() {
+  expected="$1"
+  input="$2"
+
+  ./9cc --no-peephole --compact-asm "$input" > tmp_noopt.s
+  ./9cc --peephole-stats --compact-asm "$input" > tmp.s 2> tmp_peephole.txt
+  if [ "$(wc -l < tmp.s)" -ge "$(wc -l < tmp_noopt.s)" ]; then
+    echo "❎ 覗き穴最適化で命令が減っていません: $input"
+    exit 1
+  fi
+  if ! grep -q 'removed=[1-9]' tmp_peephole.txt; then
+    echo "❎ 規則ごとの件数が出力されていません: $input"
+    exit 1
+  fi
+  for asm in tmp_noopt.s tmp.s; do
+    gcc -o tmp $asm extern/foo.o extern/alloc4.o extern/alloc_ptr3.o
+    ./tmp
+    actual="$?"
+    if [ "$actual" != "$expected" ]; then
+      echo "❎ $expected expected, but got $actual ($asm)"
+      exit 1
+    fi
+  done
+  echo "(peephole) $input => $actual"
+}
+
+try_ir() {
+  expected="$1"
+  input="$2"
+
+  ./9cc --dump-ir "$input" > tmp_ir.txt
+  if ! grep -q ' = phi ' tmp_ir.txt; then
+    echo "❎ 中間表現にphiがありません: $input"
+    exit 1
+  fi
+  ./9cc --ir "$input" > tmp.s
+  gcc -o tmp tmp.s extern/foo.o extern/alloc4.o extern/alloc_ptr3.o
+  ./tmp
+  actual="$?"
+  if [ "$actual" != "$expected" ]; then
+    echo "❎ $expected expected, but got $actual (ir)"
+    exit 1
+  fi
+  echo "(ir) $input => $actual"
+}
+
+# 2つの入力を-jで並列にコンパイルし、それぞれの結果を確かめる
+try_jobs() {
+  echo "$2" > "$tmpdir/tmp_job1.c"
+  echo "$4" > "$tmpdir/tmp_job2.c"
+  ./9cc -j 2 "$tmpdir/tmp_job1.c" "$tmpdir/tmp_job2.c"
+  gcc -o tmp "$tmpdir/tmp_job1.s" extern/foo.o extern/alloc4.o extern/alloc_ptr3.o
+  ./tmp
+  actual1="$?"
+  gcc -o tmp "$tmpdir/tmp_job2.s" extern/foo.o extern/alloc4.o extern/alloc_ptr3.o
+  ./tmp
+  actual2="$?"
+
+  if [ "$actual1" = "$1" ] && [ "$actual2" = "$3" ]; then
+    echo "(jobs) $2 => $actual1, $4 => $actual2"
+  else
+    echo "❎ $1, $3 expected, but got $actual1, $actual2"
+    exit 1
+  fi
+}
+
 #try 0 '0;'
 #try 42 '42;'
 #try 21 '5+20-4;'
@@ -246,6 +478,189 @@ try() {
 #	return 1[a];
 #}
 #'
+try 1 '
+int main() {
+	int x;
+	x = 1;
+	{
+		int x;
+		x = 2;
+	}
+	return x;
+}
+'
+try 12 '
+int main() {
+	int a;
+	a = 3;
+	{
+		int b;
+		b = 4;
+		a = a + b;
+	}
+	{
+		int c;
+		c = 5;
+		a = a + c;
+	}
+	return a;
+}
+'
+try 21 '
+int sum(int a, int b) {
+	int c;
+	c = a + b;
+	return c;
+}
+int main() {
+	int x;
+	int y;
+	x = 10;
+	y = 11;
+	return sum(x, y);
+}
+'
+try 7 '
+int main() {
+	int x;
+	x = 0;
+	if (x == 1) x = 5;
+	x = x + 1;
+	if (x == 1) {
+		x = 7;
+	} else {
+		x = 9;
+	}
+	return x;
+}
+'
+try 15 '
+int add(int a, int b) {
+	return a + b;
+}
+int main() {
+	return add(1 + 2, 3 * 4);
+}
+'
+try 19 '
+int add3(int a, int b, int c) {
+	return a + b + c;
+}
+int sub(int a, int b) {
+	return a - b;
+}
+int main() {
+	int x;
+	x = 2;
+	return sub(add3(x, add3(1, x * 3, 4), (x + 1) * (x + 2) - add3(x, x, x)), sub(x, add3(x, x, 0)) + 2);
+}
+'
+# 評価に必要なレジスタが足りず、途中の値をスタックに退避する式
+balanced() {
+  if [ "$1" = 0 ]; then
+    echo a
+  else
+    e=$(balanced $(($1 - 1)))
+    echo "($e * 2 - $e)"
+  fi
+}
+try 5 "int main() { int a; a = 5; return $(balanced 8); }"
+try 7 'int main() { int x; x = 7; return x * 1 + 0 - (x - x) + x * 0 + (-1 + 1) * 5; }'
+try 4 'int main() { if (0) return 1 / 0; while (0) return 2; return 2 * (3 + 4) / 7 + 2; }'
+try 9 '
+int main() {
+	int i;
+	i = 0;
+	while (1) {
+		i = i + 1;
+		if (i == 9) return i;
+	}
+}
+'
+try_error 'int main() { return 1 / (2 - 2); }'
+try_file 42 '
+int main() {
+	return 42;
+}
+'
+try_jobs 3 'int main() { int a; a = 3; return a; }' 7 'int main() { int b; int c; b = 2; c = 5; return b + c; }'
+try_cache 7 '
+int sum(int n) {
+	int s;
+	int i;
+	s = 0;
+	for (i = 1; i <= n; i = i + 1) s = s + i;
+	return s;
+}
+int twice(int x) {
+	if (x > 5) return x; else return x * 2;
+}
+int main() {
+	int a;
+	a = 0;
+	while (a < 3) a = a + 1;
+	return sum(a) + twice(7) - a - 3;
+}
+'
+try_report 5 'int main() { int a; int b; a = 2; b = 3; if (a < b) return a + b; return 0; }'
+try_object 11 '
+int f(int a, int b) { return a * b - 1; }
+int main() {
+	int x;
+	int *p;
+	int i;
+	p = &x;
+	*p = 0;
+	for (i = 0; i < 6; i = i + 1) x = x + 1;
+	while (x != 6) x = x - 1;
+	if (x >= 6) return f(x, 4) / 2; else return 0;
+}
+'
+try_run 34 'int main() { int *p; int *q; alloc4(&p, 1, 2, 4, 8); q = p + 2; return *q + foo(30); }'
+try_batch 1 "$(printf '%s\t%s\n' \
+  0 'int main() { return 0; }' \
+  42 'int f() { return 40; }\nint main() { return f() + 2; }' \
+  7 'int f() { return 9; }\nint main() { return f() - 2; }' \
+  5 'int main() { return 1 +; }' \
+  3 'int main() { return 4; }')"
+try_peephole 26 '
+int f(int a, int b) { return a * b - 1; }
+int main() {
+	int x;
+	int *p;
+	p = &x;
+	x = 1;
+	*p = 5;
+	f(1, 2);
+	return f(x, 4) + x + x * 1 + 0 - 3;
+}
+'
+try 7 'int main() { int a; int b; a = 0 - 17; b = 100; return a / (0 - 3) + a / 8 * (0 - 1) + b / 7 - b / 16 + a / 2; }'
+try 20 'int main() { int a; a = 0 - 3; return a * 6 + a * (0 - 9) + a * 16 + a * 7 + 80; }'
+try 11 'int main() { int *p; int *q; int i; int c; alloc4(&p, 1, 2, 4, 8); i = 3; c = 1; q = p + i; return *q + *(p + c) + *(q - i); }'
+try_ir 11 '
+int f(int a, int b) { return a * 3 - b; }
+int main() {
+	int a;
+	int b;
+	int t;
+	int i;
+	int *p;
+	a = 1;
+	b = 2;
+	for (i = 0; i < 5; i = i + 1) {
+		t = a;
+		a = b;
+		b = t + f(i, a);
+	}
+	p = &t;
+	*p = *p + 1;
+	while (a > 40) a = a / 2;
+	return a + b + t;
+}
+'
+# グローバル変数の参照はコード生成が未対応(codegen.cのND_GLOBAL_VAR)なので失敗する
+# tryは最初の失敗で終了するので、ほかのテストを止めないよう最後に置く
 try 0 '
 int global;
 int main() {
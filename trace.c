@@ -0,0 +1,94 @@
+#define _POSIX_C_SOURCE 200809L // flockfile
+#include "trace.h"
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+
+// リングバッファの1件。書式化した文字列を固定長で持つ
+typedef struct {
+    unsigned char category;
+    char text[247];
+} TraceRecord;
+
+#define TRACE_RING_SIZE 4096    // リングバッファの件数(2の冪)
+
+int trace_levels[TRACE_CATEGORY_COUNT];
+
+static const char *CATEGORY_NAMES[] = {"lex", "parse", "codegen", "cache"};
+
+// このスレッドのリングバッファ(最初のイベントで確保する)
+static _Thread_local TraceRecord *ring;
+static _Thread_local unsigned long ring_count;   // これまでに記録した件数
+
+/**
+ * 「カテゴリ=レベル,...」の形の指定でレベルを設定する
+ * レベルを省いたら1、カテゴリがallなら全カテゴリ。知らないカテゴリは無視する
+ */
+void trace_configure(const char *spec) {
+    if (!spec) {
+        return;
+    }
+    while (*spec) {
+        const size_t n = strcspn(spec, "=,");
+        int level = 1;
+        if (spec[n] == '=') {
+            level = atoi(spec + n + 1);
+        }
+        for (int i = 0; i < TRACE_CATEGORY_COUNT; i++) {
+            if ((n == 3 && strncmp(spec, "all", 3) == 0) ||
+                (strlen(CATEGORY_NAMES[i]) == n && strncmp(spec, CATEGORY_NAMES[i], n) == 0)) {
+                trace_levels[i] = level;
+            }
+        }
+        spec += strcspn(spec, ",");
+        if (*spec == ',') {
+            spec++;
+        }
+    }
+}
+
+// イベントを1件リングバッファに記録する(TRACE()から呼ばれる)
+void trace_event(TraceCategory category, const char *func, int line, const char *fmt, ...) {
+    if (!ring) {
+        ring = malloc(sizeof(TraceRecord) * TRACE_RING_SIZE);
+        if (!ring) {
+            return;
+        }
+    }
+    TraceRecord *record = &ring[ring_count++ & (TRACE_RING_SIZE - 1)];
+    record->category = category;
+    const int n = snprintf(record->text, sizeof(record->text), "%s:%d ", func, line);
+    if (n >= 0 && (size_t)n < sizeof(record->text)) {
+        va_list ap;
+        va_start(ap, fmt);
+        vsnprintf(record->text + n, sizeof(record->text) - n, fmt, ap);
+        va_end(ap);
+    }
+}
+
+/**
+ * このスレッドで記録したイベントを古い順に書き出して空にする
+ * inputがNULLでなければ各行の先頭に付ける。並列コンパイルで他のスレッドの出力と
+ * 混ざらないよう、書き出す間はoutをロックする
+ */
+void trace_dump(FILE *out, const char *input) {
+    if (!ring || ring_count == 0) {
+        return;
+    }
+    const unsigned long first = ring_count > TRACE_RING_SIZE ? ring_count - TRACE_RING_SIZE : 0;
+    flockfile(out);
+    if (first > 0) {
+        fprintf(out, "trace: %lu older events dropped\n", first);
+    }
+    for (unsigned long i = first; i < ring_count; i++) {
+        const TraceRecord *record = &ring[i & (TRACE_RING_SIZE - 1)];
+        if (input) {
+            fprintf(out, "%s: ", input);
+        }
+        fprintf(out, "[%s] %s\n", CATEGORY_NAMES[record->category], record->text);
+    }
+    funlockfile(out);
+    free(ring);
+    ring = NULL;
+    ring_count = 0;
+}
@@ -0,0 +1,41 @@
+#pragma once
+
+#include <stdio.h>
+
+/*
+ * トレース
+ * カテゴリごとにレベルを決めておき、そのレベル以下のイベントだけを記録する。
+ * 記録したイベントはスレッドごとのリングバッファに溜めておき、コンパイルの終わり
+ * かエラーのときにtrace_dump()で書き出す(溢れたら古いものから捨てる)。
+ * レベルは環境変数NINECC_TRACEか--traceで「カテゴリ=レベル,...」の形で指定す
+ * る(例: "parse=2,codegen"。レベルを省くと1、カテゴリallは全部)。
+ * NDEBUGを定義したリリースビルドではTRACE()は何もしない式になり、引数も評価し
+ * ない。
+ */
+
+typedef enum {
+    TRACE_LEX,
+    TRACE_PARSE,
+    TRACE_CODEGEN,
+    TRACE_CACHE,
+    TRACE_CATEGORY_COUNT,
+} TraceCategory;
+
+// カテゴリごとのレベル(0なら記録しない)。スレッドを作る前に設定し、以後は読むだけ
+extern int trace_levels[TRACE_CATEGORY_COUNT];
+
+extern void trace_configure(const char *spec);
+extern void trace_event(TraceCategory category, const char *func, int line, const char *fmt, ...)
+    __attribute__((format(printf, 4, 5)));
+extern void trace_dump(FILE *out, const char *input);
+
+#ifndef NDEBUG
+#define TRACE(category, level, fmt, ...) \
+    do { \
+        if (trace_levels[category] >= (level)) { \
+            trace_event(category, __func__, __LINE__, fmt, ##__VA_ARGS__); \
+        } \
+    } while (0)
+#else
+#define TRACE(category, level, fmt, ...) ((void)0)
+#endif
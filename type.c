@@ -0,0 +1,123 @@
+#include "type.h"
+#include "arena.h"
+#include <stdint.h>
+#include <stdlib.h>
+
+// 型の表はスレッドごとに持つ(オープンアドレス法、NULLは空き)
+static _Thread_local Type **table;
+static _Thread_local int table_capacity;
+static _Thread_local int table_len;
+
+// 型の格納先。型はrelease_types()まで有効
+static _Thread_local Arena *types;
+
+static uint32_t hash_type(enum TypeKind kind, Type *base, int n) {
+    uint64_t h = (uintptr_t)base;
+    h = (h ^ ((uint64_t)kind << 32 | (uint32_t)n)) * 0x9e3779b97f4a7c15u;
+    return h >> 32;
+}
+
+static Type **type_slot(Type **slots, int capacity, enum TypeKind kind, Type *base, int n) {
+    const int mask = capacity - 1;
+    int i = hash_type(kind, base, n) & mask;
+    for (; slots[i]; i = (i + 1) & mask) {
+        Type *t = slots[i];
+        if (t->type == kind && t->ptr_to == base && t->num_elements == n) {
+            break;
+        }
+    }
+    return &slots[i];
+}
+
+static void rehash(int capacity) {
+    Type **slots = calloc(capacity, sizeof(Type *));
+    for (int i = 0; i < table_capacity; i++) {
+        Type *t = table[i];
+        if (t) {
+            *type_slot(slots, capacity, t->type, t->ptr_to, t->num_elements) = t;
+        }
+    }
+    free(table);
+    table = slots;
+    table_capacity = capacity;
+}
+
+/**
+ * 種別kind、元の型base、要素数nの型を返す。初めての組み合わせなら新しく作る
+ */
+static Type *intern_type(enum TypeKind kind, Type *base, int n) {
+    if (!table) {
+        types = new_arena("type");
+        rehash(64);
+    }
+
+    Type **slot = type_slot(table, table_capacity, kind, base, n);
+    if (*slot) {
+        return *slot;
+    }
+
+    Type *type = arena_alloc(types, sizeof(Type));
+    type->type = kind;
+    type->ptr_to = base;
+    type->num_elements = n;
+    switch (kind) {
+    case INT:
+        type->size = type->align = 4;
+        break;
+    case PTR:
+        type->size = type->align = 8;
+        type->depth = base->depth + 1;
+        break;
+    case ARRAY:
+        type->size = base->size * n;
+        type->align = base->align;
+        type->depth = base->depth;
+        break;
+    }
+    *slot = type;
+
+    if (++table_len * 4 > table_capacity * 3) {
+        rehash(table_capacity * 2);
+    }
+    return type;
+}
+
+Type *type_int(void) {
+    return intern_type(INT, NULL, 0);
+}
+
+Type *pointer_to(Type *base) {
+    return intern_type(PTR, base, 0);
+}
+
+Type *array_of(Type *base, int n) {
+    return intern_type(ARRAY, base, n);
+}
+
+// 作成済の型の数
+int type_count(void) {
+    return table_len;
+}
+
+// このスレッドの型をすべて解放する
+void release_types(void) {
+    if (!table) {
+        return;
+    }
+    arena_release(types);
+    free(types);
+    free(table);
+    types = NULL;
+    table = NULL;
+    table_capacity = table_len = 0;
+}
+
+// このスレッドの型の表が使っているメモリ
+void type_memory(size_t *used, size_t *reserved) {
+    *used = *reserved = 0;
+    if (!table) {
+        return;
+    }
+    *used = arena_bytes_used(types) + sizeof(Type *) * table_capacity;
+    *reserved = arena_bytes_reserved(types) + sizeof(Type *) * table_capacity;
+}
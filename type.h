@@ -0,0 +1,49 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+
+/*
+ * 型
+ * 型は構造ごとに1つだけ作られる(ハッシュコンシング)ので、同じ構造の型は常に同じ
+ * ポインタになる。型の表はスレッドごとにあり、型はrelease_types()まで有効で、
+ * 書き換えてはならない。
+ */
+typedef struct Type {
+    enum TypeKind { INT, PTR, ARRAY } type; // 型の種別
+    struct Type *ptr_to;    // typeがPTR, ARRAYの時だけ有効
+    int num_elements;       // 配列の要素数
+    int size;               // 大きさ(バイト数)
+    int align;              // アラインメント(バイト数)
+    int depth;              // ポインタの段数(int**なら2)
+} Type;
+
+extern Type *type_int(void);
+extern Type *pointer_to(Type *base);
+extern Type *array_of(Type *base, int n);
+extern int type_count(void);
+extern void release_types(void);
+extern void type_memory(size_t *used, size_t *reserved);
+
+static inline const char* type_description(Type *type) {
+    static const char* description[] = {
+        "INT", "PTR", "ARRAY"
+    };
+    static _Thread_local char buffer[1024];
+
+    if (!type) {
+        return "null.";
+    }
+
+    sprintf(buffer, "%-5s %-14p %d",
+            description[type->type],
+            type->ptr_to,
+            type->num_elements);
+    return buffer;
+}
+
+// 型は一意なので同じ型かどうかはポインタの比較で済む
+static inline bool type_equal(Type *lhs, Type *rhs) {
+    return lhs == rhs;
+}
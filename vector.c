@@ -1,6 +1,7 @@
 #include "vector.h"
 #include <stdlib.h>
 #include <assert.h>
+#include <stdint.h>
 
 const int INITIAL_CAPACITY = 16;
 